@@ -35,6 +35,8 @@
 // using std::hash function
 #include <functional>
 #include <random>
+#include <algorithm>
+#include <numeric>
 
 // for log print
 #include <spdlog/spdlog.h>
@@ -44,12 +46,23 @@
 #define GLM_ENABLE_EXPERIMENTAL
 // hash.hpp will provide some struct's hash functional
 #include <glm/gtx/hash.hpp>
+#include <glm/gtc/packing.hpp>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 #include "tiny_obj_loader.cc"
 
+#include "PipelineCache.h"
+#include "FrameTimeline.h"
+#include "Specialization.h"
+#include "FrameStats.h"
+#include "ParticleStreams.h"
+#include "RadixSort.h"
+#include "ComputePrimitives.h"
+#include "CpuParticleSimulator.h"
+#include "BarrierBatcher.h"
+
 struct Vertex {
     glm::vec3 mPos;
     glm::vec3 mColor;
@@ -119,13 +132,78 @@ namespace std {
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
 
-const uint32_t PARTICLE_COUNT = 8192;
+// 没有在命令行中指定粒子数量时使用的默认值, 实际数量还会受到设备限制 (见 selectParticleCount)
+const uint32_t DEFAULT_PARTICLE_COUNT = 8192;
+// 粒子数量 benchmark 依次测试的数量, 超过设备上限的会被跳过
+const std::array<uint32_t, 7> PARTICLE_BENCHMARK_COUNTS = {
+    10000, 30000, 100000, 300000, 1000000, 3000000, 10000000
+};
+// 每一种数量先跑几帧让 gpu 频率和缓存稳定下来, 然后再统计
+const uint32_t PARTICLE_BENCHMARK_WARMUP_FRAMES = 60;
+const uint32_t PARTICLE_BENCHMARK_FRAMES = 240;
+// radix sort benchmark 测试的 key 数量, 每一种数量排序几次取最快的一次
+const std::array<uint32_t, 4> RADIX_SORT_BENCHMARK_COUNTS = {1 << 16, 1 << 18, 1 << 20, 1 << 22};
+const uint32_t RADIX_SORT_BENCHMARK_ITERATIONS = 5;
+// scan / reduce / compaction benchmark 测试的元素数量, 包括 block 边界附近和需要三层的情况
+const std::array<uint32_t, 8> PRIMITIVES_BENCHMARK_COUNTS = {1, 1023, 1024, 1025, 65536, 1048577, 1 << 22, 1 << 24};
+const uint32_t PRIMITIVES_BENCHMARK_ITERATIONS = 5;
+// 空间哈希每个方向上的格子数量 (对应 grid_common.glsl 中的 constant_id = 3), 格子边长就是 boids 的相互作用半径
+const uint32_t GRID_SIZE = 64;
+// N-body 每一步是 O(n^2) 的, 超过这个数量一帧的时间就不可接受了
+const uint32_t NBODY_MAX_PARTICLES = 65536;
+// 相互作用 benchmark 测试的粒子数量, N-body 只测试不超过 NBODY_MAX_PARTICLES 的部分
+const std::array<uint32_t, 6> INTERACTION_BENCHMARK_COUNTS = {4096, 16384, 65536, 262144, 1048576, 4194304};
+// cpu 实现的 benchmark 中每一种数量连续模拟的步数, 取最快的一步
+const uint32_t CPU_BENCHMARK_STEPS = 20;
+// 和 cpu 实现比较之前先让 gpu 跑几帧, 让输入不再是初始数据
+const uint32_t CPU_VALIDATION_FRAMES = 10;
+// 没有在命令行中指定 workgroup 大小的时候, 每个 workgroup 默认包含这么多个 subgroup
+const uint32_t DEFAULT_SUBGROUPS_PER_WORKGROUP = 4;
+// workgroup benchmark 中每一种大小连续 dispatch 的次数
+const uint32_t WORKGROUP_BENCHMARK_DISPATCHES = 100;
 
 // https://skfb.ly/VAKF
 const std::string MODEL_PATH = "./models/viking_room.obj";
 const std::string TEXTURE_PATH = "./textures/viking_room.png";
 
+// pipeline cache 保存的位置, 第二次启动的时候驱动可以跳过 shader 的编译
+const std::string PIPELINE_CACHE_PATH = "./pipeline_cache.bin";
+
 const int MAX_FRAMES_IN_FLIGHT = 2;
+// 粒子 SSBO 的数量, compute 比 graphics 领先一帧:
+// 第 k 步 compute 读 (k - 1) 写 k, 同时 graphics 绘制 (k - 1), 第三个 buffer 留给还没有执行完的 k - 2 帧的绘制
+const uint32_t PARTICLE_BUFFER_COUNT = 3;
+// 每隔多少帧打印一次 compute 和 graphics 的重叠统计
+const uint32_t OVERLAP_LOG_INTERVAL = 600;
+
+// 每一步模拟的方式
+//   Integrate: 粒子之间没有相互作用, 只按速度积分
+//   Boids:     通过均匀网格空间哈希查询邻居, 只和相互作用半径内的粒子交互, O(n)
+//   NBody:     每个粒子受到所有粒子的引力, O(n^2), 用共享内存分块
+//   Emitter:   粒子在 gpu 上发射和死亡, 只模拟和绘制活着的粒子 (见 emitter_common.glsl)
+//   Cpu:       和 Integrate 相同的积分在 cpu 上多线程执行 (见 ops::CpuParticleSimulator), compute 队列只负责上传结果
+enum class SimulationMode : uint32_t {
+    Integrate,
+    Boids,
+    NBody,
+    Emitter,
+    Cpu,
+};
+
+const char* simulationModeName(SimulationMode mode) {
+    switch (mode) {
+    case SimulationMode::Boids:
+        return "boids";
+    case SimulationMode::NBody:
+        return "nbody";
+    case SimulationMode::Emitter:
+        return "emitter";
+    case SimulationMode::Cpu:
+        return "cpu";
+    default:
+        return "integrate";
+    }
+}
 
 const std::vector<const char *> validationLayers = {
     "VK_LAYER_KHRONOS_validation", // debug, logging and validate
@@ -143,6 +221,11 @@ const std::vector<const char*> deviceExtensions = {
 #endif /* BUG_FIXES */
 };
 
+// VK_KHR_synchronization2: 设备支持的时候纹理上传和 mipmap 生成用 vkCmdPipelineBarrier2KHR 录制 barrier, 否则退回 vkCmdPipelineBarrier
+const std::vector<const char*> synchronization2Extensions = {
+    VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME,
+};
+
 const std::vector<const char*> instanceExtensions = {
 #ifdef BUG_FIXES
     VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
@@ -189,6 +272,8 @@ struct QueueFamilyIndices
 {
     std::optional<uint32_t> mGraphicsAndComputeFamily;
     std::optional<uint32_t> mPresentFamily;
+    // 只支持 compute 不支持 graphics 的队列族, 可以和 graphics 队列并行执行, 没有的时候为空
+    std::optional<uint32_t> mAsyncComputeFamily;
 
     bool isComplete()
     {
@@ -205,37 +290,14 @@ struct SwapChainSupportDetails {
 
 struct UniformBufferObject {
     float mDeltaTime = 1.0f;
+    uint32_t mStep = 0;
 };
 
+// 只在 cpu 端生成初始数据的时候使用, 上传之前拆成 SoA 的流 (见 ops::ParticleStreams)
 struct Particle {
     glm::vec2 mPosition;    // 粒子的位置
     glm::vec2 mVelocity;    // 粒子的速度
     glm::vec4 mColor;       // 粒子的颜色
-
-    static VkVertexInputBindingDescription getBindingDescription() {
-        VkVertexInputBindingDescription bindingDescription;
-        bindingDescription.binding = 0;
-        bindingDescription.stride = sizeof(Particle);
-        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-
-        return bindingDescription;
-    }
-
-    static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions() {
-        std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions{};
-
-        attributeDescriptions[0].binding = 0;
-        attributeDescriptions[0].location = 0;
-        attributeDescriptions[0].format = VK_FORMAT_R32G32_SFLOAT;
-        attributeDescriptions[0].offset = offsetof(Particle, mPosition);
-
-        attributeDescriptions[1].binding = 0;
-        attributeDescriptions[1].location = 1;
-        attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-        attributeDescriptions[1].offset = offsetof(Particle, mColor);
-
-        return attributeDescriptions;
-    }
 };
 
 class ComputeShaderApplication
@@ -245,10 +307,99 @@ public:
     {
         initWindow();
         initVulkan();
-        mainLoop();
+        // 只有用到 cpu 模拟的时候才创建工作线程, 没有线程的时候 parallelFor 直接在调用线程上执行
+        if (mSimulationMode == SimulationMode::Cpu || mBenchmarkCpu || mValidateCpu) {
+            mCpuSimulator.create(mRequestedCpuThreads);
+        }
+        if (mBenchmarkWorkgroup) {
+            benchmarkWorkgroupSizes();
+        }
+        if (mBenchmarkRadixSort) {
+            benchmarkRadixSort();
+        }
+        if (mBenchmarkPrimitives) {
+            benchmarkComputePrimitives();
+        }
+        if (mBenchmarkCpu) {
+            benchmarkCpuSimulation();
+        }
+        bool running = true;
+        if (mValidateCpu) {
+            running = validateCpuReference();
+        }
+        if (running && mBenchmarkParticles) {
+            running = benchmarkParticleCounts();
+        }
+        if (running && mBenchmarkInteraction) {
+            running = benchmarkInteraction();
+        }
+        if (running) {
+            mainLoop();
+        } else {
+            vkDeviceWaitIdle(mDevice);
+        }
         cleanup();
     }
 
+    // --workgroup-size N: 指定 compute shader 的 workgroup 大小
+    // --benchmark-workgroup: 启动之后测量所有可用的 workgroup 大小, 然后使用最快的那一个
+    // --particle-count N: 指定粒子数量, 超过设备限制的时候会被截断
+    // --benchmark-particles: 启动之后依次测试 10^4 ~ 10^7 个粒子的模拟和绘制耗时, 然后恢复到指定的数量
+    // --half-precision: velocity 和 color 用 16 位浮点存储, 设备不支持 storageBuffer16BitAccess 的时候忽略
+    // --benchmark-radix-sort: 启动之后测试 gpu radix sort 的正确性和速度, 和 std::sort 比较
+    // --benchmark-primitives: 启动之后测试 gpu scan / reduce / compaction 的正确性和速度, 和 std 中的算法比较
+    // --simulation integrate|boids|nbody|emitter|cpu: 选择模拟方式, nbody 的粒子数量不超过 NBODY_MAX_PARTICLES,
+    //     emitter 的粒子数量是 slot 的数量, 活着的粒子大约占一半, cpu 不支持 --half-precision
+    // --benchmark-interaction: 启动之后在不同粒子数量下比较三种模拟方式每一步的 gpu 耗时
+    // --cpu-threads N: cpu 模拟使用的线程数量, 默认使用所有的核心
+    // --validate-cpu: 启动之后用 gpu 最近一步积分的输入和输出检查 cpu 实现, 两者应该逐位一致
+    // --benchmark-cpu: 启动之后测量 cpu 实现单线程和多线程每个核心每秒处理的粒子数量
+    void parseCommandLine(int argc, char *argv[]) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--workgroup-size" && i + 1 < argc) {
+                mRequestedWorkgroupSize = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            } else if (arg == "--benchmark-workgroup") {
+                mBenchmarkWorkgroup = true;
+            } else if (arg == "--particle-count" && i + 1 < argc) {
+                mRequestedParticleCount = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            } else if (arg == "--benchmark-particles") {
+                mBenchmarkParticles = true;
+            } else if (arg == "--half-precision") {
+                mRequestedHalfPrecision = true;
+            } else if (arg == "--benchmark-radix-sort") {
+                mBenchmarkRadixSort = true;
+            } else if (arg == "--benchmark-primitives") {
+                mBenchmarkPrimitives = true;
+            } else if (arg == "--simulation" && i + 1 < argc) {
+                std::string mode = argv[++i];
+                if (mode == "integrate") {
+                    mSimulationMode = SimulationMode::Integrate;
+                } else if (mode == "boids") {
+                    mSimulationMode = SimulationMode::Boids;
+                } else if (mode == "nbody") {
+                    mSimulationMode = SimulationMode::NBody;
+                } else if (mode == "emitter") {
+                    mSimulationMode = SimulationMode::Emitter;
+                } else if (mode == "cpu") {
+                    mSimulationMode = SimulationMode::Cpu;
+                } else {
+                    spdlog::warn("{} unknown simulation mode {}", __func__, mode);
+                }
+            } else if (arg == "--benchmark-interaction") {
+                mBenchmarkInteraction = true;
+            } else if (arg == "--cpu-threads" && i + 1 < argc) {
+                mRequestedCpuThreads = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            } else if (arg == "--validate-cpu") {
+                mValidateCpu = true;
+            } else if (arg == "--benchmark-cpu") {
+                mBenchmarkCpu = true;
+            } else {
+                spdlog::warn("{} unknown argument {}", __func__, arg);
+            }
+        }
+    }
+
 private:
 #ifndef USING_SDL2
     GLFWwindow *mWindow;
@@ -263,7 +414,11 @@ private:
     VkPhysicalDevice mPhysicalDevice = VK_NULL_HANDLE;
     VkDevice mDevice;
     VkQueue mGraphicsQueue;
+    bool mUseSynchronization2 = false;
+    PFN_vkCmdPipelineBarrier2KHR mCmdPipelineBarrier2 = nullptr;
+    // 独立的 compute 队列, 设备不支持的时候和 mGraphicsQueue 是同一个队列
     VkQueue mComputeQueue;
+    uint32_t mComputeFamily = 0;
     VkQueue mPresentQueue;
 
     // swap chain
@@ -290,9 +445,112 @@ private:
     VkDescriptorSetLayout mComputeDescriptorSetLayout;
     VkPipelineLayout mComputePipelineLayout;
     VkPipeline mComputePipeline;
+    // 保留下来, 修改 specialization constant 之后重新创建 compute pipeline 时使用
+    VkShaderModule mComputeShaderModule;
+
+    // compute shader 的 local_size_x, 通过 specialization constant 在创建 pipeline 的时候指定
+    uint32_t mWorkgroupSize = 256;
+    uint32_t mRequestedWorkgroupSize = 0;
+    uint32_t mSubgroupSize = 1;
+    uint32_t mMaxWorkgroupSize = 256;
+    bool mBenchmarkWorkgroup = false;
+
+    // 粒子数量在运行时决定, SSBO 的大小, dispatch 的数量和 shader 中的越界检查都跟着它走
+    uint32_t mParticleCount = DEFAULT_PARTICLE_COUNT;
+    uint32_t mRequestedParticleCount = 0;
+    uint32_t mMaxParticleCount = DEFAULT_PARTICLE_COUNT;
+    bool mBenchmarkParticles = false;
+
+    // 粒子数据按 SoA 存放, mShaderStorageBuffers 中每一个都包含 position 和 velocity 两个流
+    ops::ParticleStreams mParticleStreams;
+    // 静态的颜色只上传一次, 只有顶点着色器读取
+    VkBuffer mParticleColorBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory mParticleColorBufferMemory = VK_NULL_HANDLE;
+    bool mRequestedHalfPrecision = false;
+    bool mHalfPrecision = false;
+
+    bool mBenchmarkRadixSort = false;
+    bool mBenchmarkPrimitives = false;
+
+    SimulationMode mSimulationMode = SimulationMode::Integrate;
+    bool mBenchmarkInteraction = false;
+    // 除了积分以外的模拟方式用到的 kernel, 和 mComputePipeline 共用 pipeline layout 和 descriptor set
+    enum SimulationKernel : uint32_t {
+        GridCount,
+        GridScan,
+        GridScatter,
+        BoidsKernel,
+        NBodyKernel,
+        EmitterArgs,
+        EmitterSimulate,
+        EmitterEmitArgs,
+        EmitterEmit,
+        SimulationKernelCount,
+    };
+    std::array<VkShaderModule, SimulationKernelCount> mSimulationShaderModules{};
+    std::array<VkPipeline, SimulationKernelCount> mSimulationPipelines{};
+    // 空间哈希的 buffer, 只在 compute 队列上使用, 相邻两步模拟在 compute timeline 上是串行的, 所有 descriptor set 共用一份
+    //   0: 每个格子的计数 / 起始位置, 1: 每个粒子的格子, 2: 每个粒子在格子中的序号, 3 / 4: 按格子排序后的 position / velocity
+    static constexpr uint32_t GRID_BUFFER_COUNT = 5;
+    std::array<VkBuffer, GRID_BUFFER_COUNT> mGridBuffers{};
+    std::array<VkDeviceMemory, GRID_BUFFER_COUNT> mGridBuffersMemory{};
+    // 发射器的 buffer (见 emitter_common.glsl): alive list 和粒子 buffer 一起轮换, graphics 把它当作 index buffer 和 indirect 参数,
+    // dead list 和每个 slot 的寿命只在 compute 队列上使用. 对应 descriptor set 中的 binding 10 ~ 13
+    static constexpr uint32_t EMITTER_BINDING_COUNT = 4;
+    // alive list 的头部是一个 VkDrawIndexedIndirectCommand, 补齐到 32 字节, 后面是活着的 slot
+    static constexpr VkDeviceSize ALIVE_LIST_HEADER_SIZE = 32;
+    // dead list 的头部: deadCount, emitCount, emitBase, 然后是模拟和发射两个 VkDispatchIndirectCommand, 补齐到 48 字节
+    static constexpr VkDeviceSize DEAD_LIST_HEADER_SIZE = 48;
+    static constexpr VkDeviceSize DEAD_LIST_SIMULATE_DISPATCH_OFFSET = 3 * sizeof(uint32_t);
+    static constexpr VkDeviceSize DEAD_LIST_EMIT_DISPATCH_OFFSET = 6 * sizeof(uint32_t);
+    std::array<VkBuffer, PARTICLE_BUFFER_COUNT> mAliveListBuffers{};
+    std::array<VkDeviceMemory, PARTICLE_BUFFER_COUNT> mAliveListBuffersMemory{};
+    VkBuffer mDeadListBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory mDeadListBufferMemory = VK_NULL_HANDLE;
+    VkBuffer mParticleLifeBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory mParticleLifeBufferMemory = VK_NULL_HANDLE;
+
+    // cpu 模拟: 状态保存在内存中, 每一步的结果写到持久映射的 upload buffer, 再由 compute 队列拷贝到对应的粒子 buffer
+    ops::CpuParticleSimulator mCpuSimulator;
+    uint32_t mRequestedCpuThreads = 0;
+    bool mValidateCpu = false;
+    bool mBenchmarkCpu = false;
+    std::vector<float> mCpuPositions;
+    std::vector<float> mCpuVelocities;
+    std::vector<float> mCpuNextPositions;
+    std::vector<float> mCpuNextVelocities;
+    std::array<VkBuffer, PARTICLE_BUFFER_COUNT> mCpuUploadBuffers{};
+    std::array<VkDeviceMemory, PARTICLE_BUFFER_COUNT> mCpuUploadBuffersMemory{};
+    std::array<void*, PARTICLE_BUFFER_COUNT> mCpuUploadBuffersMapped{};
+    ops::RollingStat mCpuSimulationTime;
+
+    // 持久化到磁盘上的 pipeline cache, graphics 和 compute pipeline 共用
+    ops::PipelineCache mPipelineCache;
+
+    // 所有提交共用的 timeline semaphore, 以及每一个 frame 最后一次提交 signal 的值
+    ops::FrameTimeline mFrameTimeline;
+    std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> mFrameTimelineValues{};
+    // compute 队列使用自己的 timeline, 两个队列并行执行的时候同一个 timeline 上 signal 的值不能保证递增
+    ops::FrameTimeline mComputeTimeline;
+    std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> mComputeTimelineValues{};
+    // 每一步模拟对应一个粒子 buffer, 分别记录最后一次写它的 compute 值和最后一次读它的 graphics 值
+    uint64_t mSimulationStep = 0;
+    std::array<uint64_t, PARTICLE_BUFFER_COUNT> mParticleBufferWriteValues{};
+    std::array<uint64_t, PARTICLE_BUFFER_COUNT> mParticleBufferReadValues{};
+
+    // 每一帧 4 个 timestamp: compute 开始, 结束, graphics 开始, 结束
+    VkQueryPool mTimestampQueryPool = VK_NULL_HANDLE;
+    float mTimestampPeriod = 1.0f;
+    std::array<bool, MAX_FRAMES_IN_FLIGHT> mTimestampsWritten{};
+    ops::RollingStat mComputeGpuTime;
+    ops::RollingStat mGraphicsGpuTime;
+    ops::RollingStat mOverlapGpuTime;
+    uint64_t mFrameCount = 0;
 
     // command pools
     VkCommandPool mCommandPool;
+    // compute command buffer 需要从 compute 队列族的 pool 中分配
+    VkCommandPool mComputeCommandPool;
     // command buffer allocation
     std::vector<VkCommandBuffer> mCommandBuffers;
     std::vector<VkCommandBuffer> mComputeCommandBuffers;
@@ -323,12 +581,9 @@ private:
     std::vector<VkDescriptorSet> mComputeDescriptorSets;
 
     // synchronization object
-    // use semaphore for gpu sync, and use fence for sync between gpu and cpu
+    // 交换链只能使用 binary semaphore, 其他的同步 (compute -> graphics, gpu -> cpu) 都通过 mFrameTimeline 完成
     std::vector<VkSemaphore> mImageAvailableSemaphores;
     std::vector<VkSemaphore> mRenderFinishedSemaphores;
-    std::vector<VkSemaphore> mComputeFinishSemaphores;
-    std::vector<VkFence> mInFlightFences;
-    std::vector<VkFence> mComputeInFlightFences;
 
     // frames in flight
     uint32_t mCurrentFrame = 0;
@@ -401,6 +656,7 @@ private:
     static void frameBufferResizedCallback(GLFWwindow* window, int width, int height) {
         spdlog::debug("{}: window changed to [{}x{}]", __func__, width, height);
         auto app = reinterpret_cast<ComputeShaderApplication*>(glfwGetWindowUserPointer(window));
+        // 拖动窗口的时候一帧之内会收到多次回调, 这里只设置标记, drawFrame 每一帧最多重建一次交换链
         app->mFrameBufferResized = true;
     }
 
@@ -411,12 +667,17 @@ private:
         createSurface();
         pickPhysicalDevice();
         createLogicalDevice();
+        mPipelineCache.create(mPhysicalDevice, mDevice, PIPELINE_CACHE_PATH);
+        mFrameTimeline.create(mDevice);
+        mComputeTimeline.create(mDevice);
         createSwapChain();
         createImageViews();
         createRenderPass();
         // descriptor
         createComputeDescriptorSetLayout();
         createGraphicPipeline();
+        selectWorkgroupSize();
+        selectParticleCount();
         createComputePipeline();
         createFrameBuffers();
         createCommandPool();
@@ -428,6 +689,7 @@ private:
         createCommandBuffers();
         createComputeCommandBuffers();
         createSyncObjects();
+        createTimestampQueryPool();
     }
 
     void createSurface() {
@@ -477,8 +739,10 @@ private:
 
         cleanupSwapChain();
 
+        logOverlap();
+
         // 回收 uniform buffer 的内存
-        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        for (uint32_t i = 0; i < PARTICLE_BUFFER_COUNT; ++i) {
             vkDestroyBuffer(mDevice, mUniformBuffers[i], nullptr);
             vkFreeMemory(mDevice, mUniformBuffersMemory[i], nullptr);
         }
@@ -493,26 +757,36 @@ private:
         for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
             vkDestroySemaphore(mDevice, mRenderFinishedSemaphores[i], nullptr);
             vkDestroySemaphore(mDevice, mImageAvailableSemaphores[i], nullptr);
-            vkDestroySemaphore(mDevice, mComputeFinishSemaphores[i], nullptr);
-            vkDestroyFence(mDevice, mInFlightFences[i], nullptr);
-            vkDestroyFence(mDevice, mComputeInFlightFences[i], nullptr);
         }
+        // 执行剩下的延迟销毁, 其中包括 command buffer 的回收, 所以要在销毁 command pool 之前
+        mFrameTimeline.destroy();
+        mComputeTimeline.destroy();
 
-        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-            vkDestroyBuffer(mDevice, mShaderStorageBuffers[i], nullptr);
-            vkFreeMemory(mDevice, mShaderStorageBuffersMemory[i], nullptr);
-        }
+        destroyShaderStorageBuffers();
+        mCpuSimulator.destroy();
 
         vkDestroyCommandPool(mDevice, mCommandPool, nullptr);
+        vkDestroyCommandPool(mDevice, mComputeCommandPool, nullptr);
+        if (mTimestampQueryPool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(mDevice, mTimestampQueryPool, nullptr);
+        }
 
         vkDestroyPipeline(mDevice, mGraphicsPipeline, nullptr);
         vkDestroyPipelineLayout(mDevice, mPipelineLayout, nullptr);
 
         vkDestroyPipeline(mDevice, mComputePipeline, nullptr);
+        destroySimulationPipelines();
         vkDestroyPipelineLayout(mDevice, mComputePipelineLayout, nullptr);
+        vkDestroyShaderModule(mDevice, mComputeShaderModule, nullptr);
+        for (VkShaderModule shaderModule : mSimulationShaderModules) {
+            vkDestroyShaderModule(mDevice, shaderModule, nullptr);
+        }
 
         vkDestroyRenderPass(mDevice, mRenderPass, nullptr);
 
+        // 写回磁盘之后再销毁
+        mPipelineCache.destroy();
+
         vkDestroyDevice(mDevice, nullptr);
 
         if (enableValidationLayers)
@@ -533,32 +807,16 @@ private:
     }
 
     void drawFrame() {
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-
-        // compute submission
-        vkWaitForFences(mDevice, 1, &mComputeInFlightFences[mCurrentFrame], VK_TRUE, UINT64_MAX);
-
-        updateUniformBuffer(mCurrentFrame);
-
-        vkResetFences(mDevice, 1, &mComputeInFlightFences[mCurrentFrame]);
-
-        vkResetCommandBuffer(mComputeCommandBuffers[mCurrentFrame], 0);
-        recordComputeCommandBuffer(mComputeCommandBuffers[mCurrentFrame]);
-
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &mComputeCommandBuffers[mCurrentFrame];
-        submitInfo.signalSemaphoreCount = 1;
-        submitInfo.pSignalSemaphores = &mComputeFinishSemaphores[mCurrentFrame];
-
-        if (vkQueueSubmit(mComputeQueue, 1, &submitInfo, mComputeInFlightFences[mCurrentFrame]) != VK_SUCCESS) {
-            spdlog::error("{} failed to submit compute command buffer!", __func__);
-            throw std::runtime_error("failed to submit compute command buffer!");
+        // 等待这个 frame 上一次的 graphics 和 compute 提交执行完, 之后才能重新录制它们的 command buffer
+        mFrameTimeline.wait(mFrameTimelineValues[mCurrentFrame]);
+        mComputeTimeline.wait(mComputeTimelineValues[mCurrentFrame]);
+        mFrameTimeline.collect();
+        collectOverlap(mCurrentFrame);
+        if (mFrameBufferResized) {
+            recreateSwapChain();
         }
 
-        // Graphics submission
-        vkWaitForFences(mDevice, 1, &mInFlightFences[mCurrentFrame], VK_TRUE, UINT64_MAX);
-
+        // 先获取交换链图像, 交换链过期的时候这一帧什么都还没有提交, 可以直接返回
         uint32_t imageIndex;
         VkResult result = vkAcquireNextImageKHR(mDevice, mSwapChain,
             UINT64_MAX,
@@ -574,34 +832,103 @@ private:
             throw std::runtime_error("failed to acquire swap chain image!");
         }
 
-        vkResetFences(mDevice, 1, &mInFlightFences[mCurrentFrame]);
+        // 这一步模拟写 writeBuffer, graphics 同时绘制上一步的结果 readBuffer, 两者可以在不同的队列上重叠执行
+        uint32_t writeBuffer = static_cast<uint32_t>(mSimulationStep % PARTICLE_BUFFER_COUNT);
+        uint32_t readBuffer = (writeBuffer + PARTICLE_BUFFER_COUNT - 1) % PARTICLE_BUFFER_COUNT;
+        VkSemaphore timeline = mFrameTimeline.semaphore();
+        VkSemaphore computeTimeline = mComputeTimeline.semaphore();
+
+        // compute submission
+        updateUniformBuffer(writeBuffer);
+        if (mSimulationMode == SimulationMode::Cpu) {
+            stepCpuSimulation(writeBuffer);
+        }
+
+        vkResetCommandBuffer(mComputeCommandBuffers[mCurrentFrame], 0);
+        recordComputeCommandBuffer(mComputeCommandBuffers[mCurrentFrame], writeBuffer);
+
+        // 读上一步写的 buffer (RAW), 覆盖之前 graphics 还在绘制的 buffer (WAR)
+        // boids 只有一份格子 buffer, 这一步的 vkCmdFillBuffer 要等上一步的 kernel 读完, 所以也要挡住 transfer
+        // cpu 模式用 vkCmdCopyBuffer 覆盖 writeBuffer, 同样要等 graphics 读完
+        VkSemaphore computeWaitSemaphores[] = {computeTimeline, timeline};
+        uint64_t computeWaitValues[] = {mParticleBufferWriteValues[readBuffer], mParticleBufferReadValues[writeBuffer]};
+        VkPipelineStageFlags computeWaitStages[] = {
+            VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+        };
+        uint64_t computeValue = mComputeTimeline.nextValue();
+        VkTimelineSemaphoreSubmitInfo computeTimelineInfo{};
+        computeTimelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        computeTimelineInfo.waitSemaphoreValueCount = 2;
+        computeTimelineInfo.pWaitSemaphoreValues = computeWaitValues;
+        computeTimelineInfo.signalSemaphoreValueCount = 1;
+        computeTimelineInfo.pSignalSemaphoreValues = &computeValue;
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.pNext = &computeTimelineInfo;
+        submitInfo.waitSemaphoreCount = 2;
+        submitInfo.pWaitSemaphores = computeWaitSemaphores;
+        submitInfo.pWaitDstStageMask = computeWaitStages;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &mComputeCommandBuffers[mCurrentFrame];
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &computeTimeline;
+
+        if (vkQueueSubmit(mComputeQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+            spdlog::error("{} failed to submit compute command buffer!", __func__);
+            throw std::runtime_error("failed to submit compute command buffer!");
+        }
+        mComputeTimelineValues[mCurrentFrame] = computeValue;
+        mParticleBufferWriteValues[writeBuffer] = computeValue;
 
+        // Graphics submission, 只等待上一步模拟, 不等待刚刚提交的这一步
         vkResetCommandBuffer(mCommandBuffers[mCurrentFrame], 0);
-        recordCommandBuffer(mCommandBuffers[mCurrentFrame], imageIndex);
+        recordCommandBuffer(mCommandBuffers[mCurrentFrame], imageIndex, readBuffer);
 
         VkSemaphore waitSemaphores[] = {
-            mComputeFinishSemaphores[mCurrentFrame],
+            computeTimeline,
             mImageAvailableSemaphores[mCurrentFrame]
         };
+        // binary semaphore 对应的值会被忽略
+        uint64_t waitValues[] = {mParticleBufferWriteValues[readBuffer], 0};
         VkPipelineStageFlags waitStages[] = {
-            VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+            VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
         };
+        uint64_t graphicsValue = mFrameTimeline.nextValue();
+        VkSemaphore signalSemaphores[] = {
+            timeline,
+            mRenderFinishedSemaphores[mCurrentFrame]
+        };
+        uint64_t signalValues[] = {graphicsValue, 0};
+
+        VkTimelineSemaphoreSubmitInfo graphicsTimelineInfo{};
+        graphicsTimelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        graphicsTimelineInfo.waitSemaphoreValueCount = 2;
+        graphicsTimelineInfo.pWaitSemaphoreValues = waitValues;
+        graphicsTimelineInfo.signalSemaphoreValueCount = 2;
+        graphicsTimelineInfo.pSignalSemaphoreValues = signalValues;
+
         submitInfo = {};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-
+        submitInfo.pNext = &graphicsTimelineInfo;
         submitInfo.waitSemaphoreCount = 2;
         submitInfo.pWaitSemaphores = waitSemaphores;
         submitInfo.pWaitDstStageMask = waitStages;
         submitInfo.commandBufferCount = 1;
         submitInfo.pCommandBuffers = &mCommandBuffers[mCurrentFrame];
-        submitInfo.signalSemaphoreCount = 1;
-        submitInfo.pSignalSemaphores = &mRenderFinishedSemaphores[mCurrentFrame];
+        submitInfo.signalSemaphoreCount = 2;
+        submitInfo.pSignalSemaphores = signalSemaphores;
 
-        if (vkQueueSubmit(mGraphicsQueue, 1, &submitInfo, mInFlightFences[mCurrentFrame]) != VK_SUCCESS) {
+        if (vkQueueSubmit(mGraphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
             spdlog::error("{} failed to submit draw command buffer!", __func__);
             throw std::runtime_error("failed to submit draw command buffer!");
         }
+        mFrameTimelineValues[mCurrentFrame] = graphicsValue;
+        mParticleBufferReadValues[readBuffer] = graphicsValue;
+        mTimestampsWritten[mCurrentFrame] = mTimestampQueryPool != VK_NULL_HANDLE;
+        mSimulationStep++;
 
         VkPresentInfoKHR presentInfo{};
         presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -615,15 +942,84 @@ private:
 
         result = vkQueuePresentKHR(mPresentQueue, &presentInfo);
 
-        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || mFrameBufferResized) {
-            mFrameBufferResized = false;
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
             recreateSwapChain();
+        } else if (result == VK_SUBOPTIMAL_KHR) {
+            // 还可以继续 present, 和 resize 合并到下一帧开始的时候重建
+            mFrameBufferResized = true;
         } else if (result != VK_SUCCESS) {
             spdlog::error("{} failed to present swap chain image!", __func__);
             throw std::runtime_error("failed to present swap chain image!");
         }
 
         mCurrentFrame = (mCurrentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+        if (++mFrameCount % OVERLAP_LOG_INTERVAL == 0) {
+            logOverlap();
+        }
+    }
+
+    // 同一个 frame 中 compute (第 k 步) 和 graphics (绘制第 k - 1 步) 的 gpu 时间区间求交集
+    // 以前 graphics 必须等待同一帧的 compute, 交集一定为 0, 所以重叠的时间就是节省下来的时间
+    // 这里假设同一个设备上不同队列的 timestamp 使用同一个时钟
+    void collectOverlap(uint32_t frame) {
+        if (mTimestampQueryPool == VK_NULL_HANDLE || !mTimestampsWritten[frame]) {
+            return;
+        }
+        uint64_t timestamps[4] = {};
+        if (vkGetQueryPoolResults(mDevice, mTimestampQueryPool, frame * 4, 4, sizeof(timestamps), timestamps,
+                sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+            double toMs = mTimestampPeriod / 1e6;
+            uint64_t overlapBegin = std::max(timestamps[0], timestamps[2]);
+            uint64_t overlapEnd = std::min(timestamps[1], timestamps[3]);
+            mComputeGpuTime.add(static_cast<double>(timestamps[1] - timestamps[0]) * toMs);
+            mGraphicsGpuTime.add(static_cast<double>(timestamps[3] - timestamps[2]) * toMs);
+            mOverlapGpuTime.add(overlapEnd > overlapBegin ? static_cast<double>(overlapEnd - overlapBegin) * toMs : 0.0);
+        }
+        mTimestampsWritten[frame] = false;
+    }
+
+    void logOverlap() {
+        if (mTimestampQueryPool == VK_NULL_HANDLE || mComputeGpuTime.count() == 0) {
+            return;
+        }
+        double compute = mComputeGpuTime.mean();
+        double graphics = mGraphicsGpuTime.mean();
+        double overlap = mOverlapGpuTime.mean();
+        spdlog::info("{} compute {:.4f} ms, graphics {:.4f} ms, overlap {:.4f} ms per frame "
+            "({:.1f}% of compute hidden, serialized {:.4f} ms -> {:.4f} ms), {} compute queue",
+            __func__, compute, graphics, overlap, compute > 0.0 ? overlap / compute * 100.0 : 0.0,
+            compute + graphics, compute + graphics - overlap,
+            mComputeQueue == mGraphicsQueue ? "shared" : "dedicated");
+        if (mSimulationMode == SimulationMode::Cpu) {
+            spdlog::info("{} cpu simulation {:.4f} ms per step on {} threads ({})",
+                __func__, mCpuSimulationTime.mean(), mCpuSimulator.threadCount(), ops::CpuParticleSimulator::simdName());
+        }
+    }
+
+    void createTimestampQueryPool() {
+        QueueFamilyIndices indices = findQueueFamilies(mPhysicalDevice);
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, queueFamilies.data());
+        if (queueFamilies[indices.mGraphicsAndComputeFamily.value()].timestampValidBits == 0 ||
+            queueFamilies[mComputeFamily].timestampValidBits == 0) {
+            spdlog::warn("{} queue does not support timestamps, overlap is not measured", __func__);
+            return;
+        }
+
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+        mTimestampPeriod = properties.limits.timestampPeriod;
+
+        VkQueryPoolCreateInfo queryPoolInfo{};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = MAX_FRAMES_IN_FLIGHT * 4;
+        if (vkCreateQueryPool(mDevice, &queryPoolInfo, nullptr, &mTimestampQueryPool) != VK_SUCCESS) {
+            spdlog::error("{} failed to create timestamp query pool!", __func__);
+            throw std::runtime_error("failed to create timestamp query pool!");
+        }
     }
 
     void createInstance()
@@ -639,7 +1035,8 @@ private:
         appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
         appInfo.pEngineName = "No Engine";
         appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-        appInfo.apiVersion = VK_API_VERSION_1_0;
+        // vkGetPhysicalDeviceProperties2 和 subgroup 属性的查询需要 vulkan 1.1, timeline semaphore 需要 1.2
+        appInfo.apiVersion = VK_API_VERSION_1_2;
 
         VkInstanceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -674,26 +1071,69 @@ private:
 
     void createLogicalDevice() {
         QueueFamilyIndices indices = findQueueFamilies(mPhysicalDevice);
+        uint32_t graphicsFamily = indices.mGraphicsAndComputeFamily.value();
+
+        // compute 队列的选择: 优先使用只支持 compute 的队列族 (async compute), 其次是 graphics 队列族中的第二个队列,
+        // 都没有的时候和 graphics 共用一个队列, 这时 compute 依然领先一帧提交, 但是不会和 graphics 重叠执行
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, queueFamilies.data());
+        mComputeFamily = graphicsFamily;
+        uint32_t computeQueueIndex = 0;
+        if (indices.mAsyncComputeFamily.has_value()) {
+            mComputeFamily = indices.mAsyncComputeFamily.value();
+        } else if (queueFamilies[graphicsFamily].queueCount >= 2) {
+            computeQueueIndex = 1;
+        }
 
         std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 
         std::set<uint32_t> uniqueQueueFamilies = {
-            indices.mGraphicsAndComputeFamily.value(),
-            indices.mPresentFamily.value()
+            graphicsFamily,
+            indices.mPresentFamily.value(),
+            mComputeFamily
         };
-        float queuePriority = 1.0f;
+        float queuePriorities[] = {1.0f, 1.0f};
         for (uint32_t queueFamily : uniqueQueueFamilies) {
             VkDeviceQueueCreateInfo queueCreateInfo{};
             queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
             queueCreateInfo.queueFamilyIndex = queueFamily;
-            queueCreateInfo.queueCount = 1;
-            queueCreateInfo.pQueuePriorities = &queuePriority;
+            queueCreateInfo.queueCount = queueFamily == graphicsFamily ? computeQueueIndex + 1 : 1;
+            queueCreateInfo.pQueuePriorities = queuePriorities;
             queueCreateInfos.push_back(queueCreateInfo);
         }
 
         VkPhysicalDeviceFeatures deviceFeatures{};
         // we do not need any device features.
+        // 帧同步使用 vulkan 1.2 的 timeline semaphore
+        VkPhysicalDeviceTimelineSemaphoreFeatures timelineSemaphoreFeatures{};
+        timelineSemaphoreFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+        timelineSemaphoreFeatures.timelineSemaphore = VK_TRUE;
+        // 粒子的 velocity 用 16 位浮点存储需要 storageBuffer16BitAccess (vulkan 1.1 core)
+        VkPhysicalDevice16BitStorageFeatures storage16BitFeatures{};
+        storage16BitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES;
+        VkPhysicalDeviceFeatures2 supportedFeatures{};
+        supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        supportedFeatures.pNext = &storage16BitFeatures;
+        vkGetPhysicalDeviceFeatures2(mPhysicalDevice, &supportedFeatures);
+        mHalfPrecision = mRequestedHalfPrecision && storage16BitFeatures.storageBuffer16BitAccess;
+        if (mRequestedHalfPrecision && !mHalfPrecision) {
+            spdlog::warn("{} storageBuffer16BitAccess is not supported, use fp32 particle storage", __func__);
+        }
+        if (mHalfPrecision && mSimulationMode == SimulationMode::Cpu) {
+            spdlog::warn("{} cpu simulation only supports fp32 particle storage", __func__);
+            mHalfPrecision = false;
+        }
+        storage16BitFeatures = {};
+        storage16BitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_16BIT_STORAGE_FEATURES;
+        storage16BitFeatures.storageBuffer16BitAccess = VK_TRUE;
+        if (mHalfPrecision) {
+            timelineSemaphoreFeatures.pNext = &storage16BitFeatures;
+        }
+
         VkDeviceCreateInfo createInfo{};    // Logical Device Create Info
+        createInfo.pNext = &timelineSemaphoreFeatures;
 
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
         createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
@@ -703,8 +1143,18 @@ private:
 
         // extension
         // 使用交换链需要首先启用 VK_KHR_swapchain 扩展
-        createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-        createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+        std::vector<const char*> enabledExtensions(deviceExtensions.begin(), deviceExtensions.end());
+        VkPhysicalDeviceSynchronization2FeaturesKHR synchronization2Features{};
+        synchronization2Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR;
+        if (mUseSynchronization2) {
+            enabledExtensions.insert(enabledExtensions.end(),
+                synchronization2Extensions.begin(), synchronization2Extensions.end());
+            synchronization2Features.synchronization2 = VK_TRUE;
+            synchronization2Features.pNext = createInfo.pNext;
+            createInfo.pNext = &synchronization2Features;
+        }
+        createInfo.enabledExtensionCount = static_cast<uint32_t>(enabledExtensions.size());
+        createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
         if (enableValidationLayers) {
             createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
@@ -719,11 +1169,21 @@ private:
         }
 
         vkGetDeviceQueue(mDevice, indices.mGraphicsAndComputeFamily.value(), 0, &mGraphicsQueue);
-        vkGetDeviceQueue(mDevice, indices.mGraphicsAndComputeFamily.value(), 0, &mComputeQueue);
+        vkGetDeviceQueue(mDevice, mComputeFamily, computeQueueIndex, &mComputeQueue);
+        spdlog::info("{} compute queue: family {} index {} ({})", __func__, mComputeFamily, computeQueueIndex,
+            mComputeQueue == mGraphicsQueue ? "shared with graphics" : "async");
         vkGetDeviceQueue(mDevice, indices.mPresentFamily.value(), 0, &mPresentQueue);
+
+        if (mUseSynchronization2) {
+            mCmdPipelineBarrier2 = reinterpret_cast<PFN_vkCmdPipelineBarrier2KHR>(
+                vkGetDeviceProcAddr(mDevice, "vkCmdPipelineBarrier2KHR"));
+            if (mCmdPipelineBarrier2 == nullptr) {
+                spdlog::warn("{} failed to load vkCmdPipelineBarrier2KHR, using vkCmdPipelineBarrier", __func__);
+            }
+        }
     }
 
-    void createSwapChain() {
+    void createSwapChain(VkSwapchainKHR oldSwapChain = VK_NULL_HANDLE) {
         SwapChainSupportDetails swapChainSupport = querySwapChainSupport(mPhysicalDevice);
         VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.mFormats);
         // 呈现模式，它决定了如何将画面送往屏幕
@@ -785,7 +1245,8 @@ private:
         createInfo.presentMode = presentMode;
         createInfo.clipped = VK_TRUE;
 
-        createInfo.oldSwapchain = VK_NULL_HANDLE;
+        // 重建的时候传入旧的交换链, 驱动可以复用它的资源, 已经 acquire 的旧图像也可以继续 present
+        createInfo.oldSwapchain = oldSwapChain;
 
         if (vkCreateSwapchainKHR(mDevice, &createInfo, nullptr, &mSwapChain) != VK_SUCCESS) {
             spdlog::error("{} failed to create swap chain", __func__);
@@ -800,19 +1261,48 @@ private:
         mSwapChainExtent = extent;
     }
 
+    // 不再调用 vkDeviceWaitIdle, 已经提交的帧继续使用旧的资源, 新的资源创建好之后下一帧就可以开始使用
     void recreateSwapChain() {
-        //我们首先调用 vkDeviceWaitIdle，因为就像上一章一样，我们不应该触碰可能仍在使用的资源。
-        //显然，我们必须重新创建交换链本身。 图像视图需要重新创建，因为它们直接基于交换链图像。
-        //最后，帧缓冲区直接依赖于交换链图像，因此也必须重新创建。
-        vkDeviceWaitIdle(mDevice);
-
-        cleanupSwapChain();
+        mFrameBufferResized = false;
+        // 窗口最小化的时候 framebuffer 的大小为 0, 不能创建交换链, 等到窗口恢复
+        int width = 0, height = 0;
+        glfwGetFramebufferSize(mWindow, &width, &height);
+        while (width == 0 || height == 0) {
+            glfwWaitEvents();
+            glfwGetFramebufferSize(mWindow, &width, &height);
+        }
 
-        createSwapChain();
+        VkSwapchainKHR oldSwapChain = mSwapChain;
+        retireSwapChain();
+        createSwapChain(oldSwapChain);
         createImageViews();
         createFrameBuffers();
     }
 
+    // 把依赖交换链的资源交给 mFrameTimeline, 在最后一次提交执行完之后再销毁
+    void retireSwapChain() {
+        uint64_t retireValue = mFrameTimeline.lastValue();
+        std::vector<VkFramebuffer> framebuffers = std::move(mSwapChainFramebuffers);
+        std::vector<VkImageView> imageViews = std::move(mSwapChainImageViews);
+        mSwapChainFramebuffers.clear();
+        mSwapChainImageViews.clear();
+        mFrameTimeline.deferDestroy(retireValue, [this, framebuffers, imageViews]() {
+            for (VkFramebuffer framebuffer : framebuffers) {
+                vkDestroyFramebuffer(mDevice, framebuffer, nullptr);
+            }
+            for (VkImageView imageView : imageViews) {
+                vkDestroyImageView(mDevice, imageView, nullptr);
+            }
+        });
+
+        // present 不会 signal timeline, 没有办法直接知道旧图像的 present 什么时候结束,
+        // 所以交换链本身再多等 MAX_FRAMES_IN_FLIGHT 次提交, 那时旧图像的 present 肯定已经被处理了
+        VkSwapchainKHR swapChain = mSwapChain;
+        mFrameTimeline.deferDestroy(retireValue + MAX_FRAMES_IN_FLIGHT, [this, swapChain]() {
+            vkDestroySwapchainKHR(mDevice, swapChain, nullptr);
+        });
+    }
+
     void cleanupSwapChain() {
         spdlog::debug("{}", __func__);
 
@@ -886,6 +1376,9 @@ private:
             spdlog::error("{} can not find a gpu device can do graphic work", __func__);
             throw std::runtime_error("failed to find a suitable GPU!");
         }
+        mUseSynchronization2 = checkDeviceExtensionSupport(mPhysicalDevice, synchronization2Extensions);
+        spdlog::info("{} recording barriers with {}", __func__,
+            mUseSynchronization2 ? "vkCmdPipelineBarrier2KHR" : "vkCmdPipelineBarrier");
     }
 
     uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
@@ -916,10 +1409,26 @@ private:
                 !swapChainSupport.mPresentModes.empty();
         }
 
-        return indices.isComplete() && extensionsSupported && swapChainAdequate;
+        return indices.isComplete() && extensionsSupported && swapChainAdequate && supportsTimelineSemaphore(pDevice);
+    }
+
+    bool supportsTimelineSemaphore(VkPhysicalDevice pDevice) {
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(pDevice, &properties);
+        if (properties.apiVersion < VK_API_VERSION_1_2) {
+            return false;
+        }
+        VkPhysicalDeviceTimelineSemaphoreFeatures timelineSemaphoreFeatures{};
+        timelineSemaphoreFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+        VkPhysicalDeviceFeatures2 features2{};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &timelineSemaphoreFeatures;
+        vkGetPhysicalDeviceFeatures2(pDevice, &features2);
+        return timelineSemaphoreFeatures.timelineSemaphore == VK_TRUE;
     }
 
-    bool checkDeviceExtensionSupport(VkPhysicalDevice pDevice) {
+    bool checkDeviceExtensionSupport(VkPhysicalDevice pDevice,
+            const std::vector<const char*>& extensions = deviceExtensions) {
         uint32_t extensionCount;
         vkEnumerateDeviceExtensionProperties(pDevice, nullptr, &extensionCount, nullptr);
         
@@ -932,7 +1441,7 @@ private:
         }
 #endif
 
-        std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+        std::set<std::string> requiredExtensions(extensions.begin(), extensions.end());
 
         for (const auto& extension : availableExtensions) {
             spdlog::trace("{}: device support extension {}", __func__, extension.extensionName);
@@ -984,6 +1493,14 @@ private:
             }
             i++;
         }
+
+        for (uint32_t family = 0; family < queueFamilyCount; ++family) {
+            if ((queueFamilies[family].queueFlags & VK_QUEUE_COMPUTE_BIT) &&
+                !(queueFamilies[family].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+                indices.mAsyncComputeFamily = family;
+                break;
+            }
+        }
         return indices;
     }
 
@@ -1269,12 +1786,15 @@ private:
         VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
         vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 
-        VkVertexInputBindingDescription bindDescription = Particle::getBindingDescription();
-        std::array<VkVertexInputAttributeDescription, 2> attributeDescription = Particle::getAttributeDescriptions();
+        // position 和 color 来自两个不同的 buffer
+        std::array<VkVertexInputBindingDescription, 2> bindDescription =
+            ops::ParticleStreams::getBindingDescriptions(mHalfPrecision);
+        std::array<VkVertexInputAttributeDescription, 2> attributeDescription =
+            ops::ParticleStreams::getAttributeDescriptions(mHalfPrecision);
 
-        vertexInputInfo.vertexBindingDescriptionCount = 1;
+        vertexInputInfo.vertexBindingDescriptionCount = static_cast<unsigned int>(bindDescription.size());
         vertexInputInfo.vertexAttributeDescriptionCount = static_cast<unsigned int>(attributeDescription.size());
-        vertexInputInfo.pVertexBindingDescriptions = &bindDescription;
+        vertexInputInfo.pVertexBindingDescriptions = bindDescription.data();
         // 类似于 opengl 中的 glVertexAttribPointer() 函数的功能？
         vertexInputInfo.pVertexAttributeDescriptions = attributeDescription.data();
 
@@ -1386,134 +1906,940 @@ private:
         pipelineInfo.subpass = 0;
         pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 
-        if (vkCreateGraphicsPipelines(mDevice, VK_NULL_HANDLE, 1, &pipelineInfo,
+        auto pipelineStartTime = std::chrono::high_resolution_clock::now();
+        if (vkCreateGraphicsPipelines(mDevice, mPipelineCache.handle(), 1, &pipelineInfo,
             nullptr, &mGraphicsPipeline) != VK_SUCCESS) {
             spdlog::error("{} failed to create graphics pipeline", __func__);
             throw std::runtime_error("failed to create graphics pipeline");
         }
+        std::chrono::duration<double, std::milli> pipelineTime =
+            std::chrono::high_resolution_clock::now() - pipelineStartTime;
+        spdlog::info("{} graphics pipeline created in {:.3f} ms ({} pipeline cache)",
+            __func__, pipelineTime.count(), mPipelineCache.isWarm() ? "warm" : "cold");
 
         // destroy the shader module, we do not need to keep it
         vkDestroyShaderModule(mDevice, fragShaderModule, nullptr);
         vkDestroyShaderModule(mDevice, vertShaderModule, nullptr);
     }
 
-    void createComputePipeline() {
-        auto computeShaderCode = readFile("shader/comp.spv");
-        
-        VkShaderModule computeShaderModule = createShaderModule(computeShaderCode);
+    // 根据设备的 subgroup 大小和 workgroup 的限制选择 compute shader 的 workgroup 大小
+    void selectWorkgroupSize() {
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
 
-        VkPipelineShaderStageCreateInfo computeShaderStageInfo{};
-        computeShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-        computeShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-        computeShaderStageInfo.module = computeShaderModule;
-        computeShaderStageInfo.pName = "main";
+        mSubgroupSize = 1;
+        if (properties.apiVersion >= VK_API_VERSION_1_1) {
+            VkPhysicalDeviceSubgroupProperties subgroupProperties{};
+            subgroupProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+            VkPhysicalDeviceProperties2 properties2{};
+            properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+            properties2.pNext = &subgroupProperties;
+            vkGetPhysicalDeviceProperties2(mPhysicalDevice, &properties2);
+            mSubgroupSize = std::max(subgroupProperties.subgroupSize, 1u);
+        }
 
-        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-        pipelineLayoutInfo.setLayoutCount = 1;
-        pipelineLayoutInfo.pSetLayouts = &mComputeDescriptorSetLayout;
-        
-        if (vkCreatePipelineLayout(mDevice, &pipelineLayoutInfo, nullptr, &mComputePipelineLayout) != VK_SUCCESS) {
-            spdlog::error("{} failed to create compute pipeline layout!", __func__);
-            throw std::runtime_error("failed to create compute pipeline layout!");
+        const VkPhysicalDeviceLimits& limits = properties.limits;
+        mMaxWorkgroupSize = std::min(limits.maxComputeWorkGroupInvocations, limits.maxComputeWorkGroupSize[0]);
+
+        uint32_t workgroupSize = mRequestedWorkgroupSize != 0 ?
+            mRequestedWorkgroupSize : mSubgroupSize * DEFAULT_SUBGROUPS_PER_WORKGROUP;
+        workgroupSize = std::min(workgroupSize, mMaxWorkgroupSize);
+        // 保持为 subgroup 大小的整数倍, 避免最后一个 subgroup 只有一部分线程在工作
+        if (workgroupSize >= mSubgroupSize) {
+            workgroupSize = workgroupSize / mSubgroupSize * mSubgroupSize;
         }
+        mWorkgroupSize = std::max(workgroupSize, 1u);
 
-        VkComputePipelineCreateInfo pipelineInfo{};
-        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-        pipelineInfo.layout = mComputePipelineLayout;
-        pipelineInfo.stage = computeShaderStageInfo;
+        spdlog::info("{} subgroup size {}, max workgroup size {}, use workgroup size {}",
+            __func__, mSubgroupSize, mMaxWorkgroupSize, mWorkgroupSize);
+    }
 
-        if (vkCreateComputePipelines(
-                mDevice,
-                VK_NULL_HANDLE,
-                1,
-                &pipelineInfo,
-                nullptr,
-                &mComputePipeline ) != VK_SUCCESS) {
-            spdlog::error("{} failed to create compute pipeline!", __func__);
-            throw std::runtime_error("failed to create compute pipeline!");
+    // 粒子数量的上限取下面三者中最小的:
+    //   一个 storage buffer descriptor 能覆盖的范围 (maxStorageBufferRange, 有的设备只有 128 MB), 按最大的 position 流计算
+    //   一维 dispatch 的 workgroup 数量上限, 按照 benchmark 中最小的 workgroup 大小计算
+    //   最大的 device local heap 的一半分给所有的粒子 buffer 和 color buffer, 剩下的留给交换链和其他资源
+    void selectParticleCount() {
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+        const VkPhysicalDeviceLimits& limits = properties.limits;
+
+        VkPhysicalDeviceMemoryProperties memoryProperties{};
+        vkGetPhysicalDeviceMemoryProperties(mPhysicalDevice, &memoryProperties);
+        VkDeviceSize deviceLocalHeapSize = 0;
+        for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; ++i) {
+            if (memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+                deviceLocalHeapSize = std::max(deviceLocalHeapSize, memoryProperties.memoryHeaps[i].size);
+            }
         }
 
-        vkDestroyShaderModule(mDevice, computeShaderModule, nullptr);
+        uint64_t maxByRange = limits.maxStorageBufferRange / ops::ParticleStreams::positionStride();
+        uint64_t maxByDispatch = static_cast<uint64_t>(limits.maxComputeWorkGroupCount[0]) *
+            std::min(mWorkgroupSize, mSubgroupSize);
+        VkDeviceSize bytesPerParticle = PARTICLE_BUFFER_COUNT * (ops::ParticleStreams::positionStride() +
+            ops::ParticleStreams::velocityStride(mHalfPrecision)) + ops::ParticleStreams::colorStride(mHalfPrecision) +
+            gridBytesPerParticle() + emitterBytesPerParticle();
+        uint64_t maxByMemory = deviceLocalHeapSize / 2 / bytesPerParticle;
+        uint64_t maxCount = std::min({maxByRange, maxByDispatch, maxByMemory, static_cast<uint64_t>(UINT32_MAX)});
+        mMaxParticleCount = static_cast<uint32_t>(maxCount);
+
+        uint32_t requested = mRequestedParticleCount != 0 ? mRequestedParticleCount : DEFAULT_PARTICLE_COUNT;
+        mParticleCount = std::min(requested, mMaxParticleCount);
+        if (mSimulationMode == SimulationMode::NBody && mParticleCount > NBODY_MAX_PARTICLES) {
+            mParticleCount = NBODY_MAX_PARTICLES;
+        }
+        if (mParticleCount != requested) {
+            spdlog::warn("{} requested {} particles, clamped to {}", __func__, requested, mParticleCount);
+        }
+        spdlog::info("{} use {} particles, max {} (storage range {}, dispatch {}, memory {})",
+            __func__, mParticleCount, mMaxParticleCount, maxByRange, maxByDispatch, maxByMemory);
     }
 
-    void createFrameBuffers() {
-        mSwapChainFramebuffers.resize(mSwapChainImageViews.size());
-        for (unsigned int i = 0; i < mSwapChainImageViews.size(); ++i) {
-            std::array<VkImageView, 1> attachments = {
-                mSwapChainImageViews[i],
-            };
+    // 改变粒子数量: 重新创建粒子 buffer, 更新 descriptor set, 用新的 specialization constant 重新创建 compute pipeline
+    // 只在 benchmark 中使用, 直接等待设备空闲
+    void resizeParticles(uint32_t particleCount) {
+        vkDeviceWaitIdle(mDevice);
+        destroyShaderStorageBuffers();
+        mParticleCount = std::min(particleCount, mMaxParticleCount);
+        createShaderStorageBuffers();
+        updateComputeDescriptorSets();
 
-            VkFramebufferCreateInfo framebufferInfo{};
-            framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-            framebufferInfo.renderPass = mRenderPass;
-            framebufferInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
-            framebufferInfo.pAttachments  = attachments.data();
-            framebufferInfo.width = mSwapChainExtent.width;
-            framebufferInfo.height = mSwapChainExtent.height;
-            framebufferInfo.layers = 1;
+        vkDestroyPipeline(mDevice, mComputePipeline, nullptr);
+        mComputePipeline = createComputePipelineVariant(mWorkgroupSize);
+        destroySimulationPipelines();
+        createSimulationPipelines();
+    }
 
-            if (vkCreateFramebuffer(mDevice, &framebufferInfo, nullptr,
-                &mSwapChainFramebuffers[i]) != VK_SUCCESS) {
-                spdlog::error("{} failed to create framebuffer for imageView "
-                    "with index {}", __func__, i);
-                throw std::runtime_error("failed to create framebuffer");
+    // 正常地绘制 frameCount 帧, 窗口被关闭的时候返回 false
+    bool runFrames(uint32_t frameCount) {
+        for (uint32_t i = 0; i < frameCount; ++i) {
+#ifndef USING_SDL2
+            glfwPollEvents();
+            if (glfwWindowShouldClose(mWindow)) {
+                return false;
+            }
+            drawFrame();
+
+            double currentTime = glfwGetTime();
+            mLastFrameTime = (currentTime - mLastTime) * 1000.0f;
+            mLastTime = currentTime;
+#else
+            SDL_Event windowEvent;
+            while (SDL_PollEvent(&windowEvent)) {
+                if (windowEvent.type == SDL_QUIT) {
+                    return false;
+                }
             }
+            drawFrame();
+#endif /* USING_SDL2 */
         }
+        return true;
     }
 
-    void createSyncObjects() {
-        // resize the sync objects size
-        mImageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        mRenderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        mComputeFinishSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        mInFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
-        mComputeInFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
-
-        VkSemaphoreCreateInfo semaphoreInfo{};
-        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-
-        VkFenceCreateInfo fenceInfo{};
-        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    // 用每一帧的 timestamp (见 collectOverlap) 测量不同粒子数量下一步模拟和一次绘制的 gpu 耗时
+    // 结束之后恢复到原来的粒子数量, 窗口在测试中被关闭的时候返回 false
+    bool benchmarkParticleCounts() {
+        if (mTimestampQueryPool == VK_NULL_HANDLE) {
+            spdlog::warn("{} timestamps are not supported, skip benchmark", __func__);
+            return true;
+        }
 
-        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-            if (vkCreateSemaphore(mDevice, &semaphoreInfo, nullptr, &mImageAvailableSemaphores[i]) != VK_SUCCESS ||
-                vkCreateSemaphore(mDevice, &semaphoreInfo, nullptr, &mRenderFinishedSemaphores[i]) != VK_SUCCESS ||
-                vkCreateFence(mDevice, &fenceInfo, nullptr, &mInFlightFences[i]) != VK_SUCCESS
-            ) {
-                spdlog::error("{}:{} failed to create graphics synchronization objects!", __func__, i);
-                throw std::runtime_error("failed to create graphics synchronization objects!");
+        uint32_t originalCount = mParticleCount;
+        bool running = true;
+        for (uint32_t particleCount : PARTICLE_BENCHMARK_COUNTS) {
+            if (particleCount > mMaxParticleCount) {
+                spdlog::warn("{} skip {} particles, device limit is {}", __func__, particleCount, mMaxParticleCount);
+                continue;
             }
+            resizeParticles(particleCount);
 
-            if (vkCreateSemaphore(mDevice, &semaphoreInfo, nullptr, &mComputeFinishSemaphores[i]) != VK_SUCCESS ||
-                vkCreateFence(mDevice, &fenceInfo, nullptr, &mComputeInFlightFences[i]) != VK_SUCCESS
-            ) {
-                spdlog::error("{}:{} failed to create compute synchronization objects!", __func__, i);
-                throw std::runtime_error("failed to create compute synchronization objects!");
+            double compute = 0.0;
+            double graphics = 0.0;
+            running = measureFrames(compute, graphics);
+            if (!running) {
+                break;
             }
+
+            double bandwidth = compute > 0.0 ? mParticleStreams.simulationBytesPerStep() / (compute * 1e6) : 0.0;
+            spdlog::info("{} {:9} particles: simulate {:.4f} ms ({:.3f} ns/particle, {:.1f} GB/s), "
+                "draw {:.4f} ms ({:.3f} ns/particle)",
+                __func__, mParticleCount, compute, compute * 1e6 / mParticleCount, bandwidth,
+                graphics, graphics * 1e6 / mParticleCount);
+        }
+
+        if (running) {
+            resizeParticles(originalCount);
         }
+        return running;
     }
 
-    void createCommandPool() {
-        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(mPhysicalDevice);
-        VkCommandPoolCreateInfo poolInfo{};
-        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-        poolInfo.queueFamilyIndex = queueFamilyIndices.mGraphicsAndComputeFamily.value();
+    // 先跑几帧预热, 然后统计 PARTICLE_BENCHMARK_FRAMES 帧中 compute 和 graphics 的平均 gpu 耗时 (ms)
+    bool measureFrames(double& compute, double& graphics) {
+        bool running = runFrames(PARTICLE_BENCHMARK_WARMUP_FRAMES);
+        mComputeGpuTime.reset();
+        mGraphicsGpuTime.reset();
+        mOverlapGpuTime.reset();
+        running = running && runFrames(PARTICLE_BENCHMARK_FRAMES);
+        compute = mComputeGpuTime.mean();
+        graphics = mGraphicsGpuTime.mean();
+        return running;
+    }
 
-        if (vkCreateCommandPool(mDevice, &poolInfo, nullptr, &mCommandPool) != VK_SUCCESS) {
-            spdlog::error("{} failed to create command pool", __func__);
-            throw std::runtime_error("failed to create command pool");
+    // 在相同的粒子数量下比较三种模拟方式一步的 gpu 耗时:
+    // 没有相互作用的积分是下限, boids 的空间哈希 (建网格 + 邻居查询) 应该随粒子数量线性增长, N-body 是平方增长
+    // 结束之后恢复到原来的模拟方式和粒子数量, 窗口在测试中被关闭的时候返回 false
+    bool benchmarkInteraction() {
+        if (mTimestampQueryPool == VK_NULL_HANDLE) {
+            spdlog::warn("{} timestamps are not supported, skip benchmark", __func__);
+            return true;
         }
-    }
 
-    void createCommandBuffers() {
-        // resize the command buffers
-        mCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        SimulationMode originalMode = mSimulationMode;
+        uint32_t originalCount = mParticleCount;
+        bool running = true;
+        for (uint32_t particleCount : INTERACTION_BENCHMARK_COUNTS) {
+            if (particleCount > mMaxParticleCount) {
+                spdlog::warn("{} skip {} particles, device limit is {}", __func__, particleCount, mMaxParticleCount);
+                continue;
+            }
+            resizeParticles(particleCount);
 
-        VkCommandBufferAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            for (SimulationMode mode : {SimulationMode::Integrate, SimulationMode::Boids, SimulationMode::NBody}) {
+                if (mode == SimulationMode::NBody && particleCount > NBODY_MAX_PARTICLES) {
+                    continue;
+                }
+                mSimulationMode = mode;
+
+                double compute = 0.0;
+                double graphics = 0.0;
+                running = measureFrames(compute, graphics);
+                if (!running) {
+                    break;
+                }
+                spdlog::info("{} {:9} particles, {:9}: simulate {:.4f} ms ({:.3f} ns/particle)",
+                    __func__, particleCount, simulationModeName(mode), compute, compute * 1e6 / particleCount);
+            }
+            if (!running) {
+                break;
+            }
+        }
+
+        mSimulationMode = originalMode;
+        if (running) {
+            resizeParticles(originalCount);
+        }
+        return running;
+    }
+
+    // 把 device local 的粒子 buffer 读回 cpu, 只在验证的时候使用
+    std::vector<char> readBackSimulationBuffer(VkBuffer buffer) {
+        VkDeviceSize size = mParticleStreams.mSimulationBufferSize;
+        VkBuffer stagingBuffer;
+        VkDeviceMemory stagingBufferMemory;
+        createBuffer(size,
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            stagingBuffer,
+            stagingBufferMemory
+        );
+        mFrameTimeline.wait(copyBuffer(buffer, stagingBuffer, size));
+
+        std::vector<char> data(size);
+        void* mapped;
+        vkMapMemory(mDevice, stagingBufferMemory, 0, size, 0, &mapped);
+        memcpy(data.data(), mapped, size);
+        vkUnmapMemory(mDevice, stagingBufferMemory);
+        vkDestroyBuffer(mDevice, stagingBuffer, nullptr);
+        vkFreeMemory(mDevice, stagingBufferMemory, nullptr);
+        return data;
+    }
+
+    // 先跑几帧, 然后读回最近一步积分的输入和输出, 在 cpu 上用同样的输入和 deltaTime 再算一遍, 逐位比较
+    // 窗口在验证中被关闭的时候返回 false
+    bool validateCpuReference() {
+        if (mSimulationMode != SimulationMode::Integrate || mHalfPrecision) {
+            spdlog::warn("{} only the fp32 integrate kernel has a cpu reference, skip validation", __func__);
+            return true;
+        }
+        if (!runFrames(CPU_VALIDATION_FRAMES)) {
+            return false;
+        }
+        vkDeviceWaitIdle(mDevice);
+
+        uint32_t writeBuffer = static_cast<uint32_t>((mSimulationStep - 1) % PARTICLE_BUFFER_COUNT);
+        uint32_t readBuffer = (writeBuffer + PARTICLE_BUFFER_COUNT - 1) % PARTICLE_BUFFER_COUNT;
+        // 设备空闲之后这一步的 ubo 还没有被覆盖
+        float deltaTime = static_cast<UniformBufferObject*>(mUniformBuffersMapped[writeBuffer])->mDeltaTime;
+        std::vector<char> input = readBackSimulationBuffer(mShaderStorageBuffers[readBuffer]);
+        std::vector<char> gpuOutput = readBackSimulationBuffer(mShaderStorageBuffers[writeBuffer]);
+
+        size_t floatCount = 2 * static_cast<size_t>(mParticleCount);
+        std::vector<float> cpuPositions(floatCount);
+        std::vector<float> cpuVelocities(floatCount);
+        mCpuSimulator.step(
+            reinterpret_cast<const float*>(input.data() + mParticleStreams.mPositionOffset),
+            reinterpret_cast<const float*>(input.data() + mParticleStreams.mVelocityOffset),
+            cpuPositions.data(), cpuVelocities.data(), mParticleCount, deltaTime, true);
+
+        const auto* gpuPositions = reinterpret_cast<const float*>(gpuOutput.data() + mParticleStreams.mPositionOffset);
+        const auto* gpuVelocities = reinterpret_cast<const float*>(gpuOutput.data() + mParticleStreams.mVelocityOffset);
+        size_t mismatches = 0;
+        float maxError = 0.0f;
+        for (size_t i = 0; i < floatCount; ++i) {
+            if (memcmp(&cpuPositions[i], &gpuPositions[i], sizeof(float)) != 0 ||
+                    memcmp(&cpuVelocities[i], &gpuVelocities[i], sizeof(float)) != 0) {
+                mismatches++;
+                maxError = std::max({maxError, std::abs(cpuPositions[i] - gpuPositions[i]),
+                    std::abs(cpuVelocities[i] - gpuVelocities[i])});
+            }
+        }
+
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+        if (mismatches == 0) {
+            spdlog::info("{} {} particles, step {}: cpu ({}) and {} are bit-identical",
+                __func__, mParticleCount, mSimulationStep - 1, ops::CpuParticleSimulator::simdName(), properties.deviceName);
+        } else {
+            spdlog::warn("{} {} particles, step {}: {} of {} components differ between cpu ({}) and {}, max error {}",
+                __func__, mParticleCount, mSimulationStep - 1, mismatches, floatCount,
+                ops::CpuParticleSimulator::simdName(), properties.deviceName, maxError);
+        }
+        return true;
+    }
+
+    // 单线程和所有线程分别测量 cpu 积分一步的耗时, 报告每秒和每个核心每秒处理的粒子数量
+    void benchmarkCpuSimulation() {
+        ops::CpuParticleSimulator singleThread;
+        singleThread.create(1);
+        std::default_random_engine rndEngine(1);
+        std::uniform_real_distribution<float> positionDist(-1.0f, 1.0f);
+        std::uniform_real_distribution<float> velocityDist(-0.00025f, 0.00025f);
+
+        for (uint32_t particleCount : PARTICLE_BENCHMARK_COUNTS) {
+            size_t floatCount = 2 * static_cast<size_t>(particleCount);
+            std::array<std::vector<float>, 2> positions{std::vector<float>(floatCount), std::vector<float>(floatCount)};
+            std::array<std::vector<float>, 2> velocities{std::vector<float>(floatCount), std::vector<float>(floatCount)};
+            for (size_t i = 0; i < floatCount; ++i) {
+                positions[0][i] = positionDist(rndEngine);
+                velocities[0][i] = velocityDist(rndEngine);
+            }
+
+            for (ops::CpuParticleSimulator* simulator : {&singleThread, &mCpuSimulator}) {
+                double best = 0.0;
+                for (uint32_t step = 0; step < CPU_BENCHMARK_STEPS; ++step) {
+                    uint32_t in = step % 2;
+                    auto startTime = std::chrono::high_resolution_clock::now();
+                    simulator->step(positions[in].data(), velocities[in].data(),
+                        positions[1 - in].data(), velocities[1 - in].data(), particleCount, 16.0f, true);
+                    std::chrono::duration<double> stepTime = std::chrono::high_resolution_clock::now() - startTime;
+                    best = step == 0 ? stepTime.count() : std::min(best, stepTime.count());
+                }
+                double particlesPerSecond = particleCount / best;
+                spdlog::info("{} {:9} particles, {:2} threads ({}): {:.4f} ms per step, {:.1f} M particles/s, "
+                    "{:.1f} M particles/s per core",
+                    __func__, particleCount, simulator->threadCount(), ops::CpuParticleSimulator::simdName(),
+                    best * 1e3, particlesPerSecond * 1e-6, particlesPerSecond * 1e-6 / simulator->threadCount());
+                if (mCpuSimulator.threadCount() == 1) {
+                    break;
+                }
+            }
+        }
+        singleThread.destroy();
+    }
+
+    // gpu 基本操作的 benchmark 共用的资源: 时间戳 query pool (队列不支持时间戳的时候为空),
+    // device local 的工作 buffer, 上传和读回共用的 host visible staging buffer (一直映射着)
+    struct ComputeBenchmark {
+        VkQueryPool mQueryPool = VK_NULL_HANDLE;
+        float mTimestampPeriod = 1.0f;
+        std::vector<VkBuffer> mBuffers;
+        std::vector<VkDeviceMemory> mBuffersMemory;
+        VkBuffer mStagingBuffer = VK_NULL_HANDLE;
+        VkDeviceMemory mStagingBufferMemory = VK_NULL_HANDLE;
+        char* mStagingData = nullptr;
+    };
+
+    ComputeBenchmark createComputeBenchmark(const char* name, const std::vector<VkDeviceSize>& bufferSizes,
+            VkDeviceSize stagingSize) {
+        ComputeBenchmark benchmark;
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+        benchmark.mTimestampPeriod = properties.limits.timestampPeriod;
+
+        QueueFamilyIndices indices = findQueueFamilies(mPhysicalDevice);
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, queueFamilies.data());
+        if (queueFamilies[indices.mGraphicsAndComputeFamily.value()].timestampValidBits != 0) {
+            VkQueryPoolCreateInfo queryPoolInfo{};
+            queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+            queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+            queryPoolInfo.queryCount = 2;
+            if (vkCreateQueryPool(mDevice, &queryPoolInfo, nullptr, &benchmark.mQueryPool) != VK_SUCCESS) {
+                spdlog::error("{} failed to create query pool!", __func__);
+                throw std::runtime_error("failed to create query pool!");
+            }
+        } else {
+            spdlog::warn("{} queue does not support timestamps, only check the results", name);
+        }
+
+        benchmark.mBuffers.resize(bufferSizes.size());
+        benchmark.mBuffersMemory.resize(bufferSizes.size());
+        for (size_t i = 0; i < bufferSizes.size(); ++i) {
+            createBuffer(bufferSizes[i],
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                benchmark.mBuffers[i],
+                benchmark.mBuffersMemory[i]
+            );
+        }
+
+        createBuffer(stagingSize,
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            benchmark.mStagingBuffer,
+            benchmark.mStagingBufferMemory
+        );
+        void* stagingData;
+        vkMapMemory(mDevice, benchmark.mStagingBufferMemory, 0, stagingSize, 0, &stagingData);
+        benchmark.mStagingData = static_cast<char*>(stagingData);
+        return benchmark;
+    }
+
+    void destroyComputeBenchmark(ComputeBenchmark& benchmark) {
+        vkUnmapMemory(mDevice, benchmark.mStagingBufferMemory);
+        vkDestroyBuffer(mDevice, benchmark.mStagingBuffer, nullptr);
+        vkFreeMemory(mDevice, benchmark.mStagingBufferMemory, nullptr);
+        for (size_t i = 0; i < benchmark.mBuffers.size(); ++i) {
+            vkDestroyBuffer(mDevice, benchmark.mBuffers[i], nullptr);
+            vkFreeMemory(mDevice, benchmark.mBuffersMemory[i], nullptr);
+        }
+        if (benchmark.mQueryPool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(mDevice, benchmark.mQueryPool, nullptr);
+        }
+        benchmark = {};
+    }
+
+    // 在一个 command buffer 中录制 upload (可以为空), 计时的 work 和 readback, 之间加上 transfer 和 compute 的 barrier,
+    // 提交并等待完成. 返回 work 的 gpu 耗时 (ms), 没有时间戳的时候返回 0
+    double runComputeBenchmark(const ComputeBenchmark& benchmark,
+            const std::function<void(VkCommandBuffer)>& upload,
+            const std::function<void(VkCommandBuffer)>& work,
+            const std::function<void(VkCommandBuffer)>& readback) {
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        if (upload) {
+            upload(commandBuffer);
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            vkCmdPipelineBarrier(commandBuffer,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                0, 1, &barrier, 0, nullptr, 0, nullptr);
+        }
+
+        if (benchmark.mQueryPool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(commandBuffer, benchmark.mQueryPool, 0, 2);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, benchmark.mQueryPool, 0);
+        }
+        work(commandBuffer);
+        if (benchmark.mQueryPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, benchmark.mQueryPool, 1);
+        }
+
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            0, 1, &barrier, 0, nullptr, 0, nullptr);
+        readback(commandBuffer);
+
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+            0, 1, &barrier, 0, nullptr, 0, nullptr);
+        endSingleTimeCommands(commandBuffer);
+
+        uint64_t timestamps[2] = {};
+        if (benchmark.mQueryPool == VK_NULL_HANDLE ||
+                vkGetQueryPoolResults(mDevice, benchmark.mQueryPool, 0, 2, sizeof(timestamps), timestamps,
+                    sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+            return 0.0;
+        }
+        return static_cast<double>(timestamps[1] - timestamps[0]) * benchmark.mTimestampPeriod / 1e6;
+    }
+
+    // 在 gpu 上排序随机的 32 / 64 位 key (payload 是原来的下标), 检查结果是否和 std::sort 一致并且是稳定的,
+    // 报告两者每秒排序的 key 数量. 在 lavapipe 上测试时用 VK_ICD_FILENAMES 指定 lvp_icd.*.json
+    void benchmarkRadixSort() {
+        ops::RadixSort radixSort;
+        radixSort.create(mPhysicalDevice, mDevice, mPipelineCache.handle(), "shader");
+
+        // 按最大的数量和 64 位 key 分配, 所有测试共用
+        // 上传和读回共用 staging buffer: [keys | payloads]
+        uint32_t maxCount = *std::max_element(RADIX_SORT_BENCHMARK_COUNTS.begin(), RADIX_SORT_BENCHMARK_COUNTS.end());
+        VkDeviceSize keysSize = maxCount * ops::RadixSort::keySize(ops::RadixSort::KeyType::Uint64);
+        VkDeviceSize payloadsSize = maxCount * sizeof(uint32_t);
+        ComputeBenchmark benchmark = createComputeBenchmark(__func__, {
+            keysSize, payloadsSize, keysSize, payloadsSize,
+            ops::RadixSort::histogramSize(maxCount), ops::RadixSort::scanScratchSize(maxCount)
+        }, keysSize + payloadsSize);
+        ops::RadixSort::Buffers sortBuffers;
+        sortBuffers.mKeys = benchmark.mBuffers[0];
+        sortBuffers.mPayloads = benchmark.mBuffers[1];
+        sortBuffers.mTempKeys = benchmark.mBuffers[2];
+        sortBuffers.mTempPayloads = benchmark.mBuffers[3];
+        sortBuffers.mHistogram = benchmark.mBuffers[4];
+        sortBuffers.mScanScratch = benchmark.mBuffers[5];
+        radixSort.bindBuffers(sortBuffers);
+
+        char* stagingKeys = benchmark.mStagingData;
+        auto* stagingPayloads = reinterpret_cast<uint32_t*>(stagingKeys + keysSize);
+
+        std::mt19937_64 rndEngine(42);
+        for (ops::RadixSort::KeyType keyType : {ops::RadixSort::KeyType::Uint32, ops::RadixSort::KeyType::Uint64}) {
+            bool wide = keyType == ops::RadixSort::KeyType::Uint64;
+            VkDeviceSize keySize = ops::RadixSort::keySize(keyType);
+            for (uint32_t count : RADIX_SORT_BENCHMARK_COUNTS) {
+                // 64 位的 key 存成 uint64_t, 在小端的机器上正好是低 32 位在前
+                std::vector<uint64_t> keys(count);
+                for (uint64_t& key : keys) {
+                    key = wide ? rndEngine() : static_cast<uint32_t>(rndEngine());
+                }
+
+                double gpuTime = 0.0;
+                for (uint32_t iteration = 0; iteration < RADIX_SORT_BENCHMARK_ITERATIONS; ++iteration) {
+                    for (uint32_t i = 0; i < count; ++i) {
+                        memcpy(stagingKeys + i * keySize, &keys[i], keySize);
+                        stagingPayloads[i] = i;
+                    }
+
+                    double time = runComputeBenchmark(benchmark,
+                        [&](VkCommandBuffer commandBuffer) {
+                            VkBufferCopy keysRegion{0, 0, count * keySize};
+                            VkBufferCopy payloadsRegion{keysSize, 0, count * sizeof(uint32_t)};
+                            vkCmdCopyBuffer(commandBuffer, benchmark.mStagingBuffer, sortBuffers.mKeys, 1, &keysRegion);
+                            vkCmdCopyBuffer(commandBuffer, benchmark.mStagingBuffer, sortBuffers.mPayloads,
+                                1, &payloadsRegion);
+                        },
+                        [&](VkCommandBuffer commandBuffer) {
+                            radixSort.record(commandBuffer, count, keyType);
+                        },
+                        [&](VkCommandBuffer commandBuffer) {
+                            VkBufferCopy keysRegion{0, 0, count * keySize};
+                            VkBufferCopy payloadsRegion{0, keysSize, count * sizeof(uint32_t)};
+                            vkCmdCopyBuffer(commandBuffer, sortBuffers.mKeys, benchmark.mStagingBuffer, 1, &keysRegion);
+                            vkCmdCopyBuffer(commandBuffer, sortBuffers.mPayloads, benchmark.mStagingBuffer,
+                                1, &payloadsRegion);
+                        });
+                    gpuTime = iteration == 0 ? time : std::min(gpuTime, time);
+                }
+
+                std::vector<uint64_t> sortedKeys = keys;
+                auto cpuStartTime = std::chrono::high_resolution_clock::now();
+                std::sort(sortedKeys.begin(), sortedKeys.end());
+                std::chrono::duration<double, std::milli> cpuTime =
+                    std::chrono::high_resolution_clock::now() - cpuStartTime;
+
+                // key 要和 std::sort 的结果一致, payload 指回原来的 key, 相同的 key 保持原来的顺序
+                bool valid = true;
+                for (uint32_t i = 0; i < count && valid; ++i) {
+                    uint64_t key = 0;
+                    memcpy(&key, stagingKeys + i * keySize, keySize);
+                    uint32_t payload = stagingPayloads[i];
+                    valid = key == sortedKeys[i] && payload < count && keys[payload] == key &&
+                        (i == 0 || key != sortedKeys[i - 1] || payload > stagingPayloads[i - 1]);
+                }
+                if (!valid) {
+                    spdlog::error("{} {} {}-bit keys: gpu result does not match std::sort", __func__, count,
+                        wide ? 64 : 32);
+                }
+                spdlog::info("{} {:8} {}-bit keys: gpu {:.3f} ms ({:.1f} Mkeys/s), std::sort {:.3f} ms ({:.1f} Mkeys/s), {}",
+                    __func__, count, wide ? 64 : 32,
+                    gpuTime, gpuTime > 0.0 ? count / (gpuTime * 1e3) : 0.0,
+                    cpuTime.count(), cpuTime.count() > 0.0 ? count / (cpuTime.count() * 1e3) : 0.0,
+                    valid ? "ok" : "mismatch");
+            }
+        }
+
+        destroyComputeBenchmark(benchmark);
+        radixSort.destroy();
+    }
+
+    // 对随机数据做 exclusive / inclusive scan, reduce 和 compaction, 和 std::exclusive_scan / inclusive_scan /
+    // accumulate / copy_if 的结果逐个比较, 报告 gpu 耗时, 有效带宽和 cpu 耗时
+    // 数量包括 1, block 边界前后和需要三层 block 和的情况. 加法按 uint32 回绕, 两边的结果一样
+    void benchmarkComputePrimitives() {
+        using Operation = ops::ComputePrimitives::Operation;
+        ops::ComputePrimitives primitives;
+        primitives.create(mPhysicalDevice, mDevice, mPipelineCache.handle(), "shader");
+
+        // 按最大的数量分配, 所有测试共用: input, flags, output, scratch, counter
+        // 上传和读回共用 staging buffer: [input | flags | output | counter]
+        uint32_t maxCount = *std::max_element(PRIMITIVES_BENCHMARK_COUNTS.begin(), PRIMITIVES_BENCHMARK_COUNTS.end());
+        VkDeviceSize dataSize = maxCount * sizeof(uint32_t);
+        ComputeBenchmark benchmark = createComputeBenchmark(__func__, {
+            dataSize, dataSize, dataSize, ops::ComputePrimitives::scratchSize(maxCount), sizeof(uint32_t)
+        }, 3 * dataSize + sizeof(uint32_t));
+        ops::ComputePrimitives::Buffers primitiveBuffers;
+        primitiveBuffers.mInput = benchmark.mBuffers[0];
+        primitiveBuffers.mFlags = benchmark.mBuffers[1];
+        primitiveBuffers.mOutput = benchmark.mBuffers[2];
+        primitiveBuffers.mScratch = benchmark.mBuffers[3];
+        primitiveBuffers.mCounter = benchmark.mBuffers[4];
+        primitives.bindBuffers(primitiveBuffers);
+
+        auto* stagingInput = reinterpret_cast<uint32_t*>(benchmark.mStagingData);
+        uint32_t* stagingFlags = stagingInput + maxCount;
+        uint32_t* stagingOutput = stagingFlags + maxCount;
+        uint32_t* stagingCounter = stagingOutput + maxCount;
+
+        const std::array<std::pair<Operation, const char*>, 4> operations = {{
+            {Operation::ExclusiveScan, "exclusive scan"},
+            {Operation::InclusiveScan, "inclusive scan"},
+            {Operation::Reduce, "reduce"},
+            {Operation::Compact, "compact"},
+        }};
+
+        std::mt19937 rndEngine(42);
+        for (uint32_t count : PRIMITIVES_BENCHMARK_COUNTS) {
+            std::vector<uint32_t> input(count);
+            std::vector<uint32_t> flags(count);
+            for (uint32_t i = 0; i < count; ++i) {
+                input[i] = rndEngine() & 0xff;
+                flags[i] = rndEngine() & 1;
+            }
+            memcpy(stagingInput, input.data(), count * sizeof(uint32_t));
+            memcpy(stagingFlags, flags.data(), count * sizeof(uint32_t));
+
+            // 输入只在第一次提交的时候上传, 计时的命令不会修改它
+            bool uploaded = false;
+            auto upload = [&](VkCommandBuffer commandBuffer) {
+                VkBufferCopy inputRegion{0, 0, count * sizeof(uint32_t)};
+                VkBufferCopy flagsRegion{dataSize, 0, count * sizeof(uint32_t)};
+                vkCmdCopyBuffer(commandBuffer, benchmark.mStagingBuffer, primitiveBuffers.mInput, 1, &inputRegion);
+                vkCmdCopyBuffer(commandBuffer, benchmark.mStagingBuffer, primitiveBuffers.mFlags, 1, &flagsRegion);
+            };
+
+            for (const auto& [operation, name] : operations) {
+                bool reduce = operation == Operation::Reduce;
+                double gpuTime = 0.0;
+                for (uint32_t iteration = 0; iteration < PRIMITIVES_BENCHMARK_ITERATIONS; ++iteration) {
+                    double time = runComputeBenchmark(benchmark,
+                        uploaded ? nullptr : std::function<void(VkCommandBuffer)>(upload),
+                        [&](VkCommandBuffer commandBuffer) {
+                            primitives.record(commandBuffer, count, operation);
+                        },
+                        [&](VkCommandBuffer commandBuffer) {
+                            VkBufferCopy outputRegion{0, 2 * dataSize, (reduce ? 1 : count) * sizeof(uint32_t)};
+                            VkBufferCopy counterRegion{0, 3 * dataSize, sizeof(uint32_t)};
+                            vkCmdCopyBuffer(commandBuffer, primitiveBuffers.mOutput, benchmark.mStagingBuffer,
+                                1, &outputRegion);
+                            vkCmdCopyBuffer(commandBuffer, primitiveBuffers.mCounter, benchmark.mStagingBuffer,
+                                1, &counterRegion);
+                        });
+                    uploaded = true;
+                    gpuTime = iteration == 0 ? time : std::min(gpuTime, time);
+                }
+                std::vector<uint32_t> expected(count);
+                auto cpuStartTime = std::chrono::high_resolution_clock::now();
+                switch (operation) {
+                case Operation::ExclusiveScan:
+                    std::exclusive_scan(input.begin(), input.end(), expected.begin(), 0u);
+                    break;
+                case Operation::InclusiveScan:
+                    std::inclusive_scan(input.begin(), input.end(), expected.begin());
+                    break;
+                case Operation::Reduce:
+                    expected.resize(1);
+                    expected[0] = std::accumulate(input.begin(), input.end(), 0u);
+                    break;
+                case Operation::Compact: {
+                    expected.clear();
+                    for (uint32_t i = 0; i < count; ++i) {
+                        if (flags[i] != 0) {
+                            expected.push_back(input[i]);
+                        }
+                    }
+                    break;
+                }
+                }
+                std::chrono::duration<double, std::milli> cpuTime =
+                    std::chrono::high_resolution_clock::now() - cpuStartTime;
+
+                bool valid = operation != Operation::Compact || *stagingCounter == expected.size();
+                valid = valid && std::equal(expected.begin(), expected.end(), stagingOutput);
+                if (!valid) {
+                    spdlog::error("{} {} of {} elements: gpu result does not match the cpu", __func__, name, count);
+                }
+
+                // 有效带宽只算必需的读写: scan 读写一遍, reduce 只读, compact 读 flags 和 input, 写保留的元素
+                VkDeviceSize bytes = count * sizeof(uint32_t);
+                if (operation == Operation::Compact) {
+                    bytes = 2 * bytes + expected.size() * sizeof(uint32_t);
+                } else if (!reduce) {
+                    bytes *= 2;
+                }
+                spdlog::info("{} {:8} elements {:>14}: gpu {:.3f} ms ({:.1f} GB/s), cpu {:.3f} ms, {}",
+                    __func__, count, name,
+                    gpuTime, gpuTime > 0.0 ? bytes / (gpuTime * 1e6) : 0.0,
+                    cpuTime.count(), valid ? "ok" : "mismatch");
+            }
+        }
+
+        destroyComputeBenchmark(benchmark);
+        primitives.destroy();
+    }
+
+    void createComputePipeline() {
+        auto computeShaderCode = readFile(mHalfPrecision ? "shader/comp_f16.spv" : "shader/comp.spv");
+        
+        mComputeShaderModule = createShaderModule(computeShaderCode);
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &mComputeDescriptorSetLayout;
+        
+        if (vkCreatePipelineLayout(mDevice, &pipelineLayoutInfo, nullptr, &mComputePipelineLayout) != VK_SUCCESS) {
+            spdlog::error("{} failed to create compute pipeline layout!", __func__);
+            throw std::runtime_error("failed to create compute pipeline layout!");
+        }
+
+        // 读写 velocity 的 kernel 和积分 kernel 一样有 full / half 两个版本,
+        // grid_scan 和发射器的两个 args kernel 只处理计数, 只有一个版本
+        const std::array<const char*, SimulationKernelCount> simulationShaders = {
+            "grid_count", "grid_scan", "grid_scatter", "boids", "nbody",
+            "emitter_args", "emitter_simulate", "emitter_emit_args", "emitter_emit"
+        };
+        for (uint32_t kernel = 0; kernel < SimulationKernelCount; ++kernel) {
+            bool hasHalfVariant = kernel != GridScan && kernel != EmitterArgs && kernel != EmitterEmitArgs;
+            std::string path = std::string("shader/") + simulationShaders[kernel] +
+                (mHalfPrecision && hasHalfVariant ? "_f16.spv" : ".spv");
+            mSimulationShaderModules[kernel] = createShaderModule(readFile(path));
+        }
+
+        auto pipelineStartTime = std::chrono::high_resolution_clock::now();
+        mComputePipeline = createComputePipelineVariant(mWorkgroupSize);
+        createSimulationPipelines();
+        std::chrono::duration<double, std::milli> pipelineTime =
+            std::chrono::high_resolution_clock::now() - pipelineStartTime;
+        spdlog::info("{} compute pipeline created in {:.3f} ms ({} pipeline cache)",
+            __func__, pipelineTime.count(), mPipelineCache.isWarm() ? "warm" : "cold");
+    }
+
+    // 粒子数量和 workgroup 大小改变之后都要重新创建
+    void createSimulationPipelines() {
+        for (uint32_t kernel = 0; kernel < SimulationKernelCount; ++kernel) {
+            mSimulationPipelines[kernel] = createComputePipelineVariant(mWorkgroupSize, mSimulationShaderModules[kernel]);
+        }
+    }
+
+    void destroySimulationPipelines() {
+        for (VkPipeline& pipeline : mSimulationPipelines) {
+            vkDestroyPipeline(mDevice, pipeline, nullptr);
+            pipeline = VK_NULL_HANDLE;
+        }
+    }
+
+    // 同一份 SPIR-V, 只通过 specialization constant 改变 workgroup 大小
+    // 不指定 shaderModule 的时候使用积分的 kernel
+    VkPipeline createComputePipelineVariant(uint32_t workgroupSize, VkShaderModule shaderModule = VK_NULL_HANDLE) {
+        // 对应 particle_common.glsl 中的 local_size_x_id = 0 和 constant_id = 1, 2 以及 grid_common.glsl 中的 constant_id = 3
+        // shader 中没有声明的 constant 会被忽略
+        ops::SpecializationConstants constants;
+        constants.set<uint32_t>(0, workgroupSize);
+        constants.set<uint32_t>(1, mParticleCount);
+        constants.set<VkBool32>(2, VK_TRUE);
+        constants.set<uint32_t>(3, GRID_SIZE);
+
+        VkPipelineShaderStageCreateInfo computeShaderStageInfo{};
+        computeShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        computeShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        computeShaderStageInfo.module = shaderModule != VK_NULL_HANDLE ? shaderModule : mComputeShaderModule;
+        computeShaderStageInfo.pName = "main";
+        computeShaderStageInfo.pSpecializationInfo = constants.info();
+
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.layout = mComputePipelineLayout;
+        pipelineInfo.stage = computeShaderStageInfo;
+
+        VkPipeline pipeline;
+        if (vkCreateComputePipelines(
+                mDevice,
+                mPipelineCache.handle(),
+                1,
+                &pipelineInfo,
+                nullptr,
+                &pipeline ) != VK_SUCCESS) {
+            spdlog::error("{} failed to create compute pipeline!", __func__);
+            throw std::runtime_error("failed to create compute pipeline!");
+        }
+        return pipeline;
+    }
+
+    // 用 timestamp query 测量每一种 workgroup 大小下一次 dispatch 的 gpu 耗时, 然后切换到最快的那一个
+    void benchmarkWorkgroupSizes() {
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+
+        QueueFamilyIndices indices = findQueueFamilies(mPhysicalDevice);
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, queueFamilies.data());
+        if (queueFamilies[indices.mGraphicsAndComputeFamily.value()].timestampValidBits == 0) {
+            spdlog::warn("{} queue does not support timestamps, skip benchmark", __func__);
+            return;
+        }
+
+        VkQueryPoolCreateInfo queryPoolInfo{};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = 2;
+
+        VkQueryPool queryPool;
+        if (vkCreateQueryPool(mDevice, &queryPoolInfo, nullptr, &queryPool) != VK_SUCCESS) {
+            spdlog::error("{} failed to create query pool!", __func__);
+            throw std::runtime_error("failed to create query pool!");
+        }
+
+        uint32_t bestWorkgroupSize = mWorkgroupSize;
+        double bestTime = 0.0;
+        for (uint32_t workgroupSize = mSubgroupSize; workgroupSize <= mMaxWorkgroupSize; workgroupSize *= 2) {
+            VkPipeline pipeline = createComputePipelineVariant(workgroupSize);
+
+            VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+            vkCmdResetQueryPool(commandBuffer, queryPool, 0, 2);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+            vkCmdBindDescriptorSets(commandBuffer,
+                VK_PIPELINE_BIND_POINT_COMPUTE,
+                mComputePipelineLayout,
+                0, 1,
+                &mComputeDescriptorSets[0],
+                0,
+                nullptr
+            );
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, 0);
+            for (uint32_t i = 0; i < WORKGROUP_BENCHMARK_DISPATCHES; ++i) {
+                vkCmdDispatch(commandBuffer, (mParticleCount + workgroupSize - 1) / workgroupSize, 1, 1);
+
+                // 每次 dispatch 都写同一个 buffer, 需要和实际运行时一样串行执行
+                VkMemoryBarrier barrier{};
+                barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+                barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+                vkCmdPipelineBarrier(commandBuffer,
+                    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                    0,
+                    1, &barrier,
+                    0, nullptr,
+                    0, nullptr
+                );
+            }
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 1);
+            endSingleTimeCommands(commandBuffer);
+
+            uint64_t timestamps[2] = {};
+            if (vkGetQueryPoolResults(mDevice, queryPool, 0, 2, sizeof(timestamps), timestamps, sizeof(uint64_t),
+                    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+                spdlog::warn("{} failed to get timestamps for workgroup size {}", __func__, workgroupSize);
+                vkDestroyPipeline(mDevice, pipeline, nullptr);
+                continue;
+            }
+            double dispatchTime = static_cast<double>(timestamps[1] - timestamps[0]) *
+                properties.limits.timestampPeriod / 1e6 / WORKGROUP_BENCHMARK_DISPATCHES;
+            spdlog::info("{} workgroup size {:4}: {:.4f} ms per dispatch", __func__, workgroupSize, dispatchTime);
+
+            if (bestTime == 0.0 || dispatchTime < bestTime) {
+                bestTime = dispatchTime;
+                bestWorkgroupSize = workgroupSize;
+            }
+            vkDestroyPipeline(mDevice, pipeline, nullptr);
+        }
+        vkDestroyQueryPool(mDevice, queryPool, nullptr);
+
+        spdlog::info("{} best workgroup size {} ({:.4f} ms per dispatch)", __func__, bestWorkgroupSize, bestTime);
+        if (bestWorkgroupSize != mWorkgroupSize) {
+            vkDestroyPipeline(mDevice, mComputePipeline, nullptr);
+            mWorkgroupSize = bestWorkgroupSize;
+            mComputePipeline = createComputePipelineVariant(mWorkgroupSize);
+            destroySimulationPipelines();
+            createSimulationPipelines();
+        }
+    }
+
+    void createFrameBuffers() {
+        mSwapChainFramebuffers.resize(mSwapChainImageViews.size());
+        for (unsigned int i = 0; i < mSwapChainImageViews.size(); ++i) {
+            std::array<VkImageView, 1> attachments = {
+                mSwapChainImageViews[i],
+            };
+
+            VkFramebufferCreateInfo framebufferInfo{};
+            framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+            framebufferInfo.renderPass = mRenderPass;
+            framebufferInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+            framebufferInfo.pAttachments  = attachments.data();
+            framebufferInfo.width = mSwapChainExtent.width;
+            framebufferInfo.height = mSwapChainExtent.height;
+            framebufferInfo.layers = 1;
+
+            if (vkCreateFramebuffer(mDevice, &framebufferInfo, nullptr,
+                &mSwapChainFramebuffers[i]) != VK_SUCCESS) {
+                spdlog::error("{} failed to create framebuffer for imageView "
+                    "with index {}", __func__, i);
+                throw std::runtime_error("failed to create framebuffer");
+            }
+        }
+    }
+
+    void createSyncObjects() {
+        // resize the sync objects size
+        mImageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+        mRenderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+            if (vkCreateSemaphore(mDevice, &semaphoreInfo, nullptr, &mImageAvailableSemaphores[i]) != VK_SUCCESS ||
+                vkCreateSemaphore(mDevice, &semaphoreInfo, nullptr, &mRenderFinishedSemaphores[i]) != VK_SUCCESS
+            ) {
+                spdlog::error("{}:{} failed to create graphics synchronization objects!", __func__, i);
+                throw std::runtime_error("failed to create graphics synchronization objects!");
+            }
+        }
+    }
+
+    void createCommandPool() {
+        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(mPhysicalDevice);
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        poolInfo.queueFamilyIndex = queueFamilyIndices.mGraphicsAndComputeFamily.value();
+
+        if (vkCreateCommandPool(mDevice, &poolInfo, nullptr, &mCommandPool) != VK_SUCCESS) {
+            spdlog::error("{} failed to create command pool", __func__);
+            throw std::runtime_error("failed to create command pool");
+        }
+
+        poolInfo.queueFamilyIndex = mComputeFamily;
+        if (vkCreateCommandPool(mDevice, &poolInfo, nullptr, &mComputeCommandPool) != VK_SUCCESS) {
+            spdlog::error("{} failed to create compute command pool", __func__);
+            throw std::runtime_error("failed to create compute command pool");
+        }
+    }
+
+    void createCommandBuffers() {
+        // resize the command buffers
+        mCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
         allocInfo.commandPool = mCommandPool;
         allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
         allocInfo.commandBufferCount = static_cast<uint32_t>(mCommandBuffers.size());
@@ -1529,7 +2855,7 @@ private:
 
         VkCommandBufferAllocateInfo allocInfo{};
         allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.commandPool = mCommandPool;
+        allocInfo.commandPool = mComputeCommandPool;
         allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
         allocInfo.commandBufferCount = static_cast<uint32_t>(mComputeCommandBuffers.size());
 
@@ -1542,15 +2868,22 @@ private:
     void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
         VkMemoryPropertyFlags properities,
         VkBuffer& buffer,
-        VkDeviceMemory& bufferMemory) {
+        VkDeviceMemory& bufferMemory,
+        const std::vector<uint32_t>& sharedQueueFamilies = {}) {
         // VkBuffer 是一个逻辑上的概念，他表示一段连续的内存数据，但是他不实际包含数据，而是描述数据的大小，用途等信息
         VkBufferCreateInfo bufferInfo{};
         bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
         bufferInfo.size = size;
         bufferInfo.usage = usage;
         // 和 image chains 中的 image 相同，buffers 也可以被一个特定的 queue 占用，也可以在多个
-        // queues 之间进行共享。在这里这个 buffer 只在 graphics queue 中使用
+        // queues 之间进行共享。默认这个 buffer 只在 graphics queue 中使用,
+        // 同时在 graphics 和 async compute 队列族中使用的 buffer 用 CONCURRENT, 省去队列族所有权的转移
         bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (sharedQueueFamilies.size() > 1) {
+            bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+            bufferInfo.queueFamilyIndexCount = static_cast<uint32_t>(sharedQueueFamilies.size());
+            bufferInfo.pQueueFamilyIndices = sharedQueueFamilies.data();
+        }
 
         if (vkCreateBuffer(mDevice, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
             spdlog::error("{}: failed to create buffer!", __func__);
@@ -1580,7 +2913,8 @@ private:
         vkBindBufferMemory(mDevice, buffer, bufferMemory, 0);
     }
 
-    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+    // 不等待拷贝完成, 返回的 timeline 值被 signal 之后才能销毁 srcBuffer
+    uint64_t copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
         VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
         VkBufferCopy copyRegion{};
@@ -1589,7 +2923,31 @@ private:
         copyRegion.size = size;
         vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
 
-        endSingleTimeCommands(commandBuffer);
+        // cpu 不再等待拷贝完成, 由 barrier 保证之后提交的命令能看到拷贝的结果
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+            VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            0,
+            1, &barrier,
+            0, nullptr,
+            0, nullptr
+        );
+
+        return submitSingleTimeCommands(commandBuffer);
+    }
+
+    // 在 timeline 到达 value 之后销毁 staging buffer
+    void destroyStagingBufferAfter(uint64_t value, VkBuffer buffer, VkDeviceMemory memory) {
+        mFrameTimeline.deferDestroy(value, [this, buffer, memory]() {
+            vkDestroyBuffer(mDevice, buffer, nullptr);
+            vkFreeMemory(mDevice, memory, nullptr);
+        });
     }
 
     void createVertexBuffer() {
@@ -1615,9 +2973,8 @@ private:
             mVertexBufferMemory
         );
 
-        copyBuffer(stagingBuffer, mVertexBuffer, bufferSize);
-        vkDestroyBuffer(mDevice, stagingBuffer, nullptr);
-        vkFreeMemory(mDevice, stagingBufferMemory, nullptr);
+        uint64_t copyValue = copyBuffer(stagingBuffer, mVertexBuffer, bufferSize);
+        destroyStagingBufferAfter(copyValue, stagingBuffer, stagingBufferMemory);
     }
 
     void  createIndexBuffer() {
@@ -1640,19 +2997,19 @@ private:
         createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mIndexBuffer, mIndexBufferMemory);
 
-        copyBuffer(stagingBuffer, mIndexBuffer, bufferSize);
-        vkDestroyBuffer(mDevice, stagingBuffer, nullptr);
-        vkFreeMemory(mDevice, stagingBufferMemory, nullptr);
+        uint64_t copyValue = copyBuffer(stagingBuffer, mIndexBuffer, bufferSize);
+        destroyStagingBufferAfter(copyValue, stagingBuffer, stagingBufferMemory);
     }
 
     void createUniformBuffers() {
         VkDeviceSize bufferSize = sizeof(UniformBufferObject);
 
-        mUniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-        mUniformBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
-        mUniformBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+        // 和粒子 buffer 一一对应, 第 k 步模拟使用第 k % PARTICLE_BUFFER_COUNT 个
+        mUniformBuffers.resize(PARTICLE_BUFFER_COUNT);
+        mUniformBuffersMemory.resize(PARTICLE_BUFFER_COUNT);
+        mUniformBuffersMapped.resize(PARTICLE_BUFFER_COUNT);
 
-        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        for (uint32_t i = 0; i < PARTICLE_BUFFER_COUNT; i++) {
             createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                 mUniformBuffers[i], mUniformBuffersMemory[i]
@@ -1671,7 +3028,7 @@ private:
         std::uniform_real_distribution<float> rndDist(0.0f, 1.0f);
 
         // Initial particel positions on a cicle
-        std::vector<Particle> particels(PARTICLE_COUNT);
+        std::vector<Particle> particels(mParticleCount);
         for (auto& particle : particels) {
             float r = 0.25f * std::sqrt(rndDist(rndEngine));
             float theta = rndDist(rndEngine) * 2.0f * 3.14159265358979323846f;
@@ -1683,7 +3040,16 @@ private:
             particle.mColor = glm::vec4(rndDist(rndEngine), rndDist(rndEngine), rndDist(rndEngine), 1.0f);
         }
 
-        VkDeviceSize bufferSize = sizeof(Particle) * PARTICLE_COUNT;
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+        mParticleStreams = ops::ParticleStreams::create(mParticleCount, mHalfPrecision,
+            properties.limits.minStorageBufferOffsetAlignment);
+        VkDeviceSize bufferSize = mParticleStreams.mSimulationBufferSize;
+        spdlog::info("{} {} particles, {} precision: simulation {} bytes per step, draw {} bytes per frame "
+            "(std140 AoS was {} and {})", __func__, mParticleCount, mHalfPrecision ? "half" : "full",
+            mParticleStreams.simulationBytesPerStep(), mParticleStreams.drawBytesPerFrame(),
+            2 * sizeof(Particle) * static_cast<VkDeviceSize>(mParticleCount),
+            sizeof(Particle) * static_cast<VkDeviceSize>(mParticleCount));
 
         // Create a staging buffer used to upload data to the gpu
         VkBuffer stagingBuffer;
@@ -1695,43 +3061,293 @@ private:
             stagingBufferMemory
         );
 
+        // 拆成 position 和 velocity 两个流
         void* data;
         vkMapMemory(mDevice, stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, particels.data(), static_cast<size_t>(bufferSize));
+        auto* positions = reinterpret_cast<glm::vec2*>(static_cast<char*>(data) + mParticleStreams.mPositionOffset);
+        char* velocities = static_cast<char*>(data) + mParticleStreams.mVelocityOffset;
+        for (size_t i = 0; i < particels.size(); ++i) {
+            positions[i] = particels[i].mPosition;
+            if (mHalfPrecision) {
+                reinterpret_cast<uint32_t*>(velocities)[i] = glm::packHalf2x16(particels[i].mVelocity);
+            } else {
+                reinterpret_cast<glm::vec2*>(velocities)[i] = particels[i].mVelocity;
+            }
+        }
         vkUnmapMemory(mDevice, stagingBufferMemory);
 
-        mShaderStorageBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-        mShaderStorageBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        // 颜色不参与模拟, 只需要一份, 只在 graphics 队列上读取
+        VkBuffer colorStagingBuffer;
+        VkDeviceMemory colorStagingBufferMemory;
+        createBuffer(mParticleStreams.mColorBufferSize,
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            colorStagingBuffer,
+            colorStagingBufferMemory
+        );
+        vkMapMemory(mDevice, colorStagingBufferMemory, 0, mParticleStreams.mColorBufferSize, 0, &data);
+        for (size_t i = 0; i < particels.size(); ++i) {
+            if (mHalfPrecision) {
+                static_cast<uint64_t*>(data)[i] = glm::packHalf4x16(particels[i].mColor);
+            } else {
+                static_cast<glm::vec4*>(data)[i] = particels[i].mColor;
+            }
+        }
+        vkUnmapMemory(mDevice, colorStagingBufferMemory);
+
+        createBuffer(mParticleStreams.mColorBufferSize,
+            VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            mParticleColorBuffer,
+            mParticleColorBufferMemory
+        );
+        uint64_t colorCopyValue = copyBuffer(colorStagingBuffer, mParticleColorBuffer, mParticleStreams.mColorBufferSize);
+        destroyStagingBufferAfter(colorCopyValue, colorStagingBuffer, colorStagingBufferMemory);
+
+        mShaderStorageBuffers.resize(PARTICLE_BUFFER_COUNT);
+        mShaderStorageBuffersMemory.resize(PARTICLE_BUFFER_COUNT);
+
+        std::vector<uint32_t> sharedQueueFamilies;
+        uint32_t graphicsFamily = findQueueFamilies(mPhysicalDevice).mGraphicsAndComputeFamily.value();
+        if (mComputeFamily != graphicsFamily) {
+            sharedQueueFamilies = {graphicsFamily, mComputeFamily};
+        }
 
         // copy initial particle data to all storage buffers
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+        uint64_t copyValue = 0;
+        for (size_t i = 0; i < PARTICLE_BUFFER_COUNT; ++i) {
             createBuffer(
                 bufferSize,
-                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                    VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
                 mShaderStorageBuffers[i],
-                mShaderStorageBuffersMemory[i]
+                mShaderStorageBuffersMemory[i],
+                sharedQueueFamilies
             );
-            copyBuffer(stagingBuffer, mShaderStorageBuffers[i], bufferSize);
+            copyValue = copyBuffer(stagingBuffer, mShaderStorageBuffers[i], bufferSize);
         }
 
-        vkDestroyBuffer(mDevice, stagingBuffer, nullptr);
-        vkFreeMemory(mDevice, stagingBufferMemory, nullptr);
+        // 拷贝按顺序提交, 等待最后一次就够了
+        destroyStagingBufferAfter(copyValue, stagingBuffer, stagingBufferMemory);
+        copyValue = createEmitterBuffers(sharedQueueFamilies);
+        if (mSimulationMode == SimulationMode::Cpu) {
+            createCpuSimulationBuffers(particels);
+        }
+        // 拷贝在 graphics 队列上执行, compute 队列第一次写这些 buffer 之前要等它们完成
+        mParticleBufferReadValues.fill(copyValue);
+
+        createGridBuffers();
+    }
+
+    // 空间哈希每个粒子需要的字节数: 格子, 序号, 排序后的 position 和 velocity (始终是 fp32)
+    static VkDeviceSize gridBytesPerParticle() {
+        return 2 * sizeof(uint32_t) + 2 * 2 * sizeof(float);
+    }
+
+    // cpu 模拟的状态按 ParticleStreams 中 position / velocity 流的布局保存, 每一步整个拷贝到 upload buffer
+    void createCpuSimulationBuffers(const std::vector<Particle>& particles) {
+        mCpuPositions.resize(2 * particles.size());
+        mCpuVelocities.resize(2 * particles.size());
+        mCpuNextPositions.resize(2 * particles.size());
+        mCpuNextVelocities.resize(2 * particles.size());
+        for (size_t i = 0; i < particles.size(); ++i) {
+            mCpuPositions[2 * i] = particles[i].mPosition.x;
+            mCpuPositions[2 * i + 1] = particles[i].mPosition.y;
+            mCpuVelocities[2 * i] = particles[i].mVelocity.x;
+            mCpuVelocities[2 * i + 1] = particles[i].mVelocity.y;
+        }
+
+        for (size_t i = 0; i < PARTICLE_BUFFER_COUNT; ++i) {
+            createBuffer(mParticleStreams.mSimulationBufferSize,
+                VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                mCpuUploadBuffers[i],
+                mCpuUploadBuffersMemory[i]
+            );
+            vkMapMemory(mDevice, mCpuUploadBuffersMemory[i], 0, mParticleStreams.mSimulationBufferSize, 0,
+                &mCpuUploadBuffersMapped[i]);
+        }
+    }
+
+    // 在 cpu 上模拟第 particleBuffer 步, 这个 upload buffer 上一次被拷贝是 PARTICLE_BUFFER_COUNT 步之前, 已经执行完了
+    void stepCpuSimulation(uint32_t particleBuffer) {
+        auto startTime = std::chrono::high_resolution_clock::now();
+        mCpuSimulator.step(mCpuPositions.data(), mCpuVelocities.data(),
+            mCpuNextPositions.data(), mCpuNextVelocities.data(),
+            mParticleCount, mLastFrameTime * 2.0f, true);
+        mCpuPositions.swap(mCpuNextPositions);
+        mCpuVelocities.swap(mCpuNextVelocities);
+
+        // upload buffer 通常是 write-combined 的, 只顺序写, 不读
+        char* mapped = static_cast<char*>(mCpuUploadBuffersMapped[particleBuffer]);
+        memcpy(mapped + mParticleStreams.mPositionOffset, mCpuPositions.data(), mParticleStreams.mPositionSize);
+        memcpy(mapped + mParticleStreams.mVelocityOffset, mCpuVelocities.data(), mParticleStreams.mVelocitySize);
+
+        std::chrono::duration<double, std::milli> stepTime = std::chrono::high_resolution_clock::now() - startTime;
+        mCpuSimulationTime.add(stepTime.count());
+    }
+
+    // 发射器每个粒子需要的字节数: 每一个 alive list 中的 index, dead list 中的 index, 寿命
+    static VkDeviceSize emitterBytesPerParticle() {
+        return (PARTICLE_BUFFER_COUNT + 1) * sizeof(uint32_t) + sizeof(float);
+    }
+
+    // 一开始所有的 slot 都在 dead list 中, alive list 都是空的, 返回最后一次初始化拷贝的 timeline 值
+    uint64_t createEmitterBuffers(const std::vector<uint32_t>& sharedQueueFamilies) {
+        VkDeviceSize count = mParticleCount;
+        VkDeviceSize aliveListSize = ALIVE_LIST_HEADER_SIZE + count * sizeof(uint32_t);
+        VkDeviceSize deadListSize = DEAD_LIST_HEADER_SIZE + count * sizeof(uint32_t);
+
+        // 空的 alive list 只需要头部: indexCount = 0, instanceCount = 1
+        VkBuffer headerStagingBuffer;
+        VkDeviceMemory headerStagingBufferMemory;
+        createBuffer(ALIVE_LIST_HEADER_SIZE,
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            headerStagingBuffer,
+            headerStagingBufferMemory
+        );
+        void* data;
+        vkMapMemory(mDevice, headerStagingBufferMemory, 0, ALIVE_LIST_HEADER_SIZE, 0, &data);
+        memset(data, 0, static_cast<size_t>(ALIVE_LIST_HEADER_SIZE));
+        static_cast<uint32_t*>(data)[1] = 1;
+        vkUnmapMemory(mDevice, headerStagingBufferMemory);
+
+        uint64_t copyValue = 0;
+        for (size_t i = 0; i < PARTICLE_BUFFER_COUNT; ++i) {
+            createBuffer(aliveListSize,
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                    VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                mAliveListBuffers[i],
+                mAliveListBuffersMemory[i],
+                sharedQueueFamilies
+            );
+            copyValue = copyBuffer(headerStagingBuffer, mAliveListBuffers[i], ALIVE_LIST_HEADER_SIZE);
+        }
+        destroyStagingBufferAfter(copyValue, headerStagingBuffer, headerStagingBufferMemory);
+
+        // dead list 的头部只有 deadCount 是 count, 栈中是所有的 slot
+        VkBuffer deadListStagingBuffer;
+        VkDeviceMemory deadListStagingBufferMemory;
+        createBuffer(deadListSize,
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            deadListStagingBuffer,
+            deadListStagingBufferMemory
+        );
+        vkMapMemory(mDevice, deadListStagingBufferMemory, 0, deadListSize, 0, &data);
+        memset(data, 0, static_cast<size_t>(DEAD_LIST_HEADER_SIZE));
+        static_cast<uint32_t*>(data)[0] = mParticleCount;
+        auto* slots = reinterpret_cast<uint32_t*>(static_cast<char*>(data) + DEAD_LIST_HEADER_SIZE);
+        for (uint32_t i = 0; i < mParticleCount; ++i) {
+            slots[i] = mParticleCount - 1 - i;
+        }
+        vkUnmapMemory(mDevice, deadListStagingBufferMemory);
+
+        // dead list 和寿命只在 compute 队列上使用, 初始化的拷贝在 graphics 队列上, 所以和粒子 buffer 一样共享
+        createBuffer(deadListSize,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            mDeadListBuffer,
+            mDeadListBufferMemory,
+            sharedQueueFamilies
+        );
+        copyValue = copyBuffer(deadListStagingBuffer, mDeadListBuffer, deadListSize);
+        destroyStagingBufferAfter(copyValue, deadListStagingBuffer, deadListStagingBufferMemory);
+
+        // 死掉的 slot 的寿命不会被读取, 发射的时候才写入, 不需要初始化
+        createBuffer(count * sizeof(float),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            mParticleLifeBuffer,
+            mParticleLifeBufferMemory
+        );
+        return copyValue;
+    }
+
+    void createGridBuffers() {
+        VkDeviceSize count = mParticleCount;
+        const std::array<VkDeviceSize, GRID_BUFFER_COUNT> sizes = {
+            GRID_SIZE * GRID_SIZE * sizeof(uint32_t),
+            count * sizeof(uint32_t),
+            count * sizeof(uint32_t),
+            count * 2 * sizeof(float),
+            count * 2 * sizeof(float),
+        };
+        for (uint32_t i = 0; i < GRID_BUFFER_COUNT; ++i) {
+            // 格子的计数每一步用 vkCmdFillBuffer 清零
+            createBuffer(sizes[i],
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                mGridBuffers[i],
+                mGridBuffersMemory[i]
+            );
+        }
+    }
+
+    void destroyShaderStorageBuffers() {
+        for (size_t i = 0; i < mShaderStorageBuffers.size(); ++i) {
+            vkDestroyBuffer(mDevice, mShaderStorageBuffers[i], nullptr);
+            vkFreeMemory(mDevice, mShaderStorageBuffersMemory[i], nullptr);
+        }
+        mShaderStorageBuffers.clear();
+        mShaderStorageBuffersMemory.clear();
+
+        vkDestroyBuffer(mDevice, mParticleColorBuffer, nullptr);
+        vkFreeMemory(mDevice, mParticleColorBufferMemory, nullptr);
+        mParticleColorBuffer = VK_NULL_HANDLE;
+        mParticleColorBufferMemory = VK_NULL_HANDLE;
+
+        for (uint32_t i = 0; i < GRID_BUFFER_COUNT; ++i) {
+            vkDestroyBuffer(mDevice, mGridBuffers[i], nullptr);
+            vkFreeMemory(mDevice, mGridBuffersMemory[i], nullptr);
+            mGridBuffers[i] = VK_NULL_HANDLE;
+            mGridBuffersMemory[i] = VK_NULL_HANDLE;
+        }
+
+        for (size_t i = 0; i < PARTICLE_BUFFER_COUNT; ++i) {
+            vkDestroyBuffer(mDevice, mAliveListBuffers[i], nullptr);
+            vkFreeMemory(mDevice, mAliveListBuffersMemory[i], nullptr);
+            mAliveListBuffers[i] = VK_NULL_HANDLE;
+            mAliveListBuffersMemory[i] = VK_NULL_HANDLE;
+        }
+        vkDestroyBuffer(mDevice, mDeadListBuffer, nullptr);
+        vkFreeMemory(mDevice, mDeadListBufferMemory, nullptr);
+        vkDestroyBuffer(mDevice, mParticleLifeBuffer, nullptr);
+        vkFreeMemory(mDevice, mParticleLifeBufferMemory, nullptr);
+        mDeadListBuffer = VK_NULL_HANDLE;
+        mDeadListBufferMemory = VK_NULL_HANDLE;
+        mParticleLifeBuffer = VK_NULL_HANDLE;
+        mParticleLifeBufferMemory = VK_NULL_HANDLE;
+
+        for (size_t i = 0; i < PARTICLE_BUFFER_COUNT; ++i) {
+            if (mCpuUploadBuffers[i] == VK_NULL_HANDLE) {
+                continue;
+            }
+            vkUnmapMemory(mDevice, mCpuUploadBuffersMemory[i]);
+            vkDestroyBuffer(mDevice, mCpuUploadBuffers[i], nullptr);
+            vkFreeMemory(mDevice, mCpuUploadBuffersMemory[i], nullptr);
+            mCpuUploadBuffers[i] = VK_NULL_HANDLE;
+            mCpuUploadBuffersMemory[i] = VK_NULL_HANDLE;
+            mCpuUploadBuffersMapped[i] = nullptr;
+        }
     }
 
     void createDescriptorPool() {
         std::array<VkDescriptorPoolSize, 2> poolSizes{};
         poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+        poolSizes[0].descriptorCount = PARTICLE_BUFFER_COUNT;
 
         poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        poolSizes[1].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT) * 2;
+        poolSizes[1].descriptorCount = PARTICLE_BUFFER_COUNT * (4 + GRID_BUFFER_COUNT + EMITTER_BINDING_COUNT);
 
         VkDescriptorPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
         poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
         poolInfo.pPoolSizes = poolSizes.data();
-        poolInfo.maxSets = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+        poolInfo.maxSets = PARTICLE_BUFFER_COUNT;
 
         if (vkCreateDescriptorPool(mDevice, &poolInfo, nullptr, &mDescriptorPool) != VK_SUCCESS) {
             spdlog::error("{}: failed to create descriptor pool!", __func__);
@@ -1792,69 +3408,72 @@ private:
     }
 
     void createComputeDescriptorSets() {
-        std::vector<VkDescriptorSetLayout> layouts{MAX_FRAMES_IN_FLIGHT, mComputeDescriptorSetLayout};
+        // 每一个粒子 buffer 一个 descriptor set: 读前一个 buffer, 写这一个 buffer
+        std::vector<VkDescriptorSetLayout> layouts(PARTICLE_BUFFER_COUNT, mComputeDescriptorSetLayout);
         VkDescriptorSetAllocateInfo allocInfo{};
         allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
         allocInfo.descriptorPool = mDescriptorPool;
-        allocInfo.descriptorSetCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+        allocInfo.descriptorSetCount = PARTICLE_BUFFER_COUNT;
         allocInfo.pSetLayouts = layouts.data();
 
-        mComputeDescriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+        mComputeDescriptorSets.resize(PARTICLE_BUFFER_COUNT);
         if (vkAllocateDescriptorSets(mDevice, &allocInfo, mComputeDescriptorSets.data()) != VK_SUCCESS) {
             spdlog::error("{} failed to allocate descriptor sets!", __func__);
             throw std::runtime_error("failed to allocate descriptor sets!");
         }
 
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-            VkDescriptorBufferInfo uniformBufferInfo{};
-            uniformBufferInfo.buffer = mUniformBuffers[i];
-            uniformBufferInfo.offset = 0;
-            uniformBufferInfo.range = sizeof(UniformBufferObject);
-
-            std::array<VkWriteDescriptorSet, 3> descriptorWrites{};
-            descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            descriptorWrites[0].dstSet = mComputeDescriptorSets[i];
-            descriptorWrites[0].dstBinding = 0;
-            descriptorWrites[0].dstArrayElement = 0;
-            descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-            descriptorWrites[0].descriptorCount = 1;
-            descriptorWrites[0].pBufferInfo = &uniformBufferInfo;
-
-            VkDescriptorBufferInfo storageBufferInfoLastFrame{};
-            storageBufferInfoLastFrame.buffer = mShaderStorageBuffers[(i - 1) % MAX_FRAMES_IN_FLIGHT];
-            storageBufferInfoLastFrame.offset = 0;
-            storageBufferInfoLastFrame.range = sizeof(Particle) * PARTICLE_COUNT;
-
-            descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            descriptorWrites[1].dstSet = mComputeDescriptorSets[i];
-            descriptorWrites[1].dstBinding = 1;
-            descriptorWrites[1].dstArrayElement = 0;
-            descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-            descriptorWrites[1].descriptorCount = 1;
-            descriptorWrites[1].pBufferInfo = &storageBufferInfoLastFrame;
-
-            VkDescriptorBufferInfo storageBufferInfoCurrentFrame{};
-            storageBufferInfoCurrentFrame.buffer = mShaderStorageBuffers[i];
-            storageBufferInfoCurrentFrame.offset = 0;
-            storageBufferInfoCurrentFrame.range = sizeof(Particle) * PARTICLE_COUNT;
+        updateComputeDescriptorSets();
+    }
 
-            descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            descriptorWrites[2].dstSet = mComputeDescriptorSets[i];
-            descriptorWrites[2].dstBinding = 2;
-            descriptorWrites[2].dstArrayElement = 0;
-            descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-            descriptorWrites[2].descriptorCount = 1;
-            descriptorWrites[2].pBufferInfo = &storageBufferInfoCurrentFrame;
+    // 粒子 buffer 重新创建之后也要调用, 调用时这些 descriptor set 不能被正在执行的命令使用
+    void updateComputeDescriptorSets() {
+        for (size_t i = 0; i < PARTICLE_BUFFER_COUNT; ++i) {
+            VkBuffer lastBuffer = mShaderStorageBuffers[(i + PARTICLE_BUFFER_COUNT - 1) % PARTICLE_BUFFER_COUNT];
+            VkBuffer currentBuffer = mShaderStorageBuffers[i];
+
+            std::array<VkDescriptorBufferInfo, 5 + GRID_BUFFER_COUNT + EMITTER_BINDING_COUNT> bufferInfos{};
+            bufferInfos[0] = {mUniformBuffers[i], 0, sizeof(UniformBufferObject)};
+            // 上一步的 position 和 velocity
+            bufferInfos[1] = {lastBuffer, mParticleStreams.mPositionOffset, mParticleStreams.mPositionSize};
+            bufferInfos[2] = {lastBuffer, mParticleStreams.mVelocityOffset, mParticleStreams.mVelocitySize};
+            // 这一步的 position 和 velocity
+            bufferInfos[3] = {currentBuffer, mParticleStreams.mPositionOffset, mParticleStreams.mPositionSize};
+            bufferInfos[4] = {currentBuffer, mParticleStreams.mVelocityOffset, mParticleStreams.mVelocitySize};
+            // 空间哈希
+            for (uint32_t grid = 0; grid < GRID_BUFFER_COUNT; ++grid) {
+                bufferInfos[5 + grid] = {mGridBuffers[grid], 0, VK_WHOLE_SIZE};
+            }
+            // 发射器: 上一步和这一步的 alive list, dead list, 寿命
+            uint32_t emitterBinding = 5 + GRID_BUFFER_COUNT;
+            bufferInfos[emitterBinding] = {
+                mAliveListBuffers[(i + PARTICLE_BUFFER_COUNT - 1) % PARTICLE_BUFFER_COUNT], 0, VK_WHOLE_SIZE};
+            bufferInfos[emitterBinding + 1] = {mAliveListBuffers[i], 0, VK_WHOLE_SIZE};
+            bufferInfos[emitterBinding + 2] = {mDeadListBuffer, 0, VK_WHOLE_SIZE};
+            bufferInfos[emitterBinding + 3] = {mParticleLifeBuffer, 0, VK_WHOLE_SIZE};
+
+            std::array<VkWriteDescriptorSet, 5 + GRID_BUFFER_COUNT + EMITTER_BINDING_COUNT> descriptorWrites{};
+            for (uint32_t binding = 0; binding < descriptorWrites.size(); ++binding) {
+                descriptorWrites[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                descriptorWrites[binding].dstSet = mComputeDescriptorSets[i];
+                descriptorWrites[binding].dstBinding = binding;
+                descriptorWrites[binding].dstArrayElement = 0;
+                descriptorWrites[binding].descriptorType = binding == 0 ?
+                    VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                descriptorWrites[binding].descriptorCount = 1;
+                descriptorWrites[binding].pBufferInfo = &bufferInfos[binding];
+            }
 
-            vkUpdateDescriptorSets(mDevice, 3, descriptorWrites.data(), 0, nullptr);
+            vkUpdateDescriptorSets(mDevice, static_cast<uint32_t>(descriptorWrites.size()),
+                descriptorWrites.data(), 0, nullptr);
         }
     }
 
-    void updateUniformBuffer(uint32_t currentImage) {
+    void updateUniformBuffer(uint32_t particleBuffer) {
         UniformBufferObject ubo{};
         ubo.mDeltaTime = mLastFrameTime * 2.0f;
+        ubo.mStep = static_cast<uint32_t>(mSimulationStep);
 
-        memcpy(mUniformBuffersMapped[mCurrentFrame], &ubo, sizeof(ubo));
+        memcpy(mUniformBuffersMapped[particleBuffer], &ubo, sizeof(ubo));
     }
 
     void createDescriptorSetLayout() {
@@ -1889,7 +3508,9 @@ private:
     }
 
     void createComputeDescriptorSetLayout() {
-        std::array<VkDescriptorSetLayoutBinding, 3> layoutBinding{};
+        // binding 0: ubo, 1 / 2: 上一步的 position / velocity, 3 / 4: 这一步的 position / velocity
+        // 5 ~ 9: 空间哈希 (见 grid_common.glsl), 10 ~ 13: 发射器 (见 emitter_common.glsl)
+        std::array<VkDescriptorSetLayoutBinding, 5 + GRID_BUFFER_COUNT + EMITTER_BINDING_COUNT> layoutBinding{};
 
         layoutBinding[0].binding = 0;
         layoutBinding[0].descriptorCount = 1;
@@ -1897,17 +3518,13 @@ private:
         layoutBinding[0].pImmutableSamplers = nullptr;
         layoutBinding[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 
-        layoutBinding[1].binding = 1;
-        layoutBinding[1].descriptorCount = 1;
-        layoutBinding[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        layoutBinding[1].pImmutableSamplers = nullptr;
-        layoutBinding[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-
-        layoutBinding[2].binding = 2;
-        layoutBinding[2].descriptorCount = 1;
-        layoutBinding[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        layoutBinding[2].pImmutableSamplers = nullptr;
-        layoutBinding[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        for (uint32_t binding = 1; binding < layoutBinding.size(); ++binding) {
+            layoutBinding[binding].binding = binding;
+            layoutBinding[binding].descriptorCount = 1;
+            layoutBinding[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            layoutBinding[binding].pImmutableSamplers = nullptr;
+            layoutBinding[binding].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        }
 
         VkDescriptorSetLayoutCreateInfo layoutInfo{};
         layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -1920,7 +3537,7 @@ private:
         }
     }
 
-    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t particleBuffer) {
         VkCommandBufferBeginInfo beginInfo{};
         beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 
@@ -1929,6 +3546,11 @@ private:
             throw std::runtime_error("failed to begin recording command buffer");
         }
 
+        if (mTimestampQueryPool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(commandBuffer, mTimestampQueryPool, mCurrentFrame * 4 + 2, 2);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, mTimestampQueryPool, mCurrentFrame * 4 + 2);
+        }
+
         VkRenderPassBeginInfo renderPassInfo{};
         renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
         renderPassInfo.renderPass = mRenderPass;
@@ -1964,19 +3586,32 @@ private:
         scissor.extent = {mSwapChainExtent.width, mSwapChainExtent.height};
         vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
 
-        VkDeviceSize offsets[] = {0};
-        vkCmdBindVertexBuffers(commandBuffer, 0, 1, &mShaderStorageBuffers[mCurrentFrame], offsets);
-        vkCmdDraw(commandBuffer, PARTICLE_COUNT, 1, 0, 0);
+        VkBuffer vertexBuffers[] = {mShaderStorageBuffers[particleBuffer], mParticleColorBuffer};
+        VkDeviceSize offsets[] = {mParticleStreams.mPositionOffset, 0};
+        vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers, offsets);
+        if (mSimulationMode == SimulationMode::Emitter) {
+            // alive list 中的 slot 作为 index, 数量来自 compute 写的 indirect 参数
+            vkCmdBindIndexBuffer(commandBuffer, mAliveListBuffers[particleBuffer], ALIVE_LIST_HEADER_SIZE,
+                VK_INDEX_TYPE_UINT32);
+            vkCmdDrawIndexedIndirect(commandBuffer, mAliveListBuffers[particleBuffer], 0, 1,
+                sizeof(VkDrawIndexedIndirectCommand));
+        } else {
+            vkCmdDraw(commandBuffer, mParticleCount, 1, 0, 0);
+        }
 
         vkCmdEndRenderPass(commandBuffer);
 
+        if (mTimestampQueryPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, mTimestampQueryPool, mCurrentFrame * 4 + 3);
+        }
+
         if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
             spdlog::error("{} failed to record command buffer", __func__);
             throw std::runtime_error("failed to record command buffer");
         }
     }
 
-    void recordComputeCommandBuffer(VkCommandBuffer commandBuffer) {
+    void recordComputeCommandBuffer(VkCommandBuffer commandBuffer, uint32_t particleBuffer) {
         VkCommandBufferBeginInfo beginInfo{};
         beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 
@@ -1985,18 +3620,75 @@ private:
             throw std::runtime_error("failed to begin recording compute command buffer!");
         }
 
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mComputePipeline);
+        if (mTimestampQueryPool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(commandBuffer, mTimestampQueryPool, mCurrentFrame * 4, 2);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, mTimestampQueryPool, mCurrentFrame * 4);
+        }
 
+        // 所有 kernel 共用同一个 pipeline layout, descriptor set 只需要绑定一次
         vkCmdBindDescriptorSets(commandBuffer,
             VK_PIPELINE_BIND_POINT_COMPUTE,
             mComputePipelineLayout,
             0, 1,
-            &mComputeDescriptorSets[mCurrentFrame],
+            &mComputeDescriptorSets[particleBuffer],
             0,
             nullptr
         );
 
-        vkCmdDispatch(commandBuffer, PARTICLE_COUNT / 256, 1, 1);
+        // 粒子数量不一定是 workgroup 大小的整数倍, shader 中会丢弃越界的线程
+        uint32_t groupCount = (mParticleCount + mWorkgroupSize - 1) / mWorkgroupSize;
+        switch (mSimulationMode) {
+        case SimulationMode::Boids:
+            // counting sort 建立空间哈希, 每一个 kernel 都要看到前一个 kernel 的写入
+            vkCmdFillBuffer(commandBuffer, mGridBuffers[0], 0, VK_WHOLE_SIZE, 0);
+            recordComputeBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mSimulationPipelines[GridCount]);
+            vkCmdDispatch(commandBuffer, groupCount, 1, 1);
+            recordComputeBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mSimulationPipelines[GridScan]);
+            vkCmdDispatch(commandBuffer, 1, 1, 1);
+            recordComputeBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mSimulationPipelines[GridScatter]);
+            vkCmdDispatch(commandBuffer, groupCount, 1, 1);
+            recordComputeBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mSimulationPipelines[BoidsKernel]);
+            vkCmdDispatch(commandBuffer, groupCount, 1, 1);
+            break;
+        case SimulationMode::NBody:
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mSimulationPipelines[NBodyKernel]);
+            vkCmdDispatch(commandBuffer, groupCount, 1, 1);
+            break;
+        case SimulationMode::Emitter:
+            // 活着和要发射的数量只有 gpu 知道, 由 args kernel 写 indirect 参数, 不处理任何死掉的 slot
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mSimulationPipelines[EmitterArgs]);
+            vkCmdDispatch(commandBuffer, 1, 1, 1);
+            recordComputeBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mSimulationPipelines[EmitterSimulate]);
+            vkCmdDispatchIndirect(commandBuffer, mDeadListBuffer, DEAD_LIST_SIMULATE_DISPATCH_OFFSET);
+            recordComputeBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mSimulationPipelines[EmitterEmitArgs]);
+            vkCmdDispatch(commandBuffer, 1, 1, 1);
+            recordComputeBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mSimulationPipelines[EmitterEmit]);
+            vkCmdDispatchIndirect(commandBuffer, mDeadListBuffer, DEAD_LIST_EMIT_DISPATCH_OFFSET);
+            break;
+        case SimulationMode::Cpu: {
+            // 结果已经在 stepCpuSimulation 中写好, compute 队列只做拷贝, 和 graphics 之间的同步保持不变
+            VkBufferCopy copyRegion{};
+            copyRegion.size = mParticleStreams.mSimulationBufferSize;
+            vkCmdCopyBuffer(commandBuffer, mCpuUploadBuffers[particleBuffer], mShaderStorageBuffers[particleBuffer],
+                1, &copyRegion);
+            break;
+        }
+        default:
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mComputePipeline);
+            vkCmdDispatch(commandBuffer, groupCount, 1, 1);
+            break;
+        }
+
+        if (mTimestampQueryPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, mTimestampQueryPool, mCurrentFrame * 4 + 1);
+        }
 
         if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
             spdlog::error("{} failed to record compute command buffer!", __func__);
@@ -2004,6 +3696,17 @@ private:
         }
     }
 
+    // 同一个 command buffer 中前后两个 compute dispatch 之间的 buffer 依赖, 后一个 dispatch 可能是 indirect 的
+    void recordComputeBarrier(VkCommandBuffer commandBuffer, VkPipelineStageFlags srcStage, VkAccessFlags srcAccess) {
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = srcAccess;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, srcStage,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0,
+            1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
     // 二进制的 SPIR-V 代码需要转化为 VkShaderModule 对象
     VkShaderModule createShaderModule(const std::vector<char>& code) {
         VkShaderModuleCreateInfo createInfo{};
@@ -2064,30 +3767,37 @@ private:
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mTextureImage, mTextureImageMemory
         );
 #endif /* BUG_FIXES */
+        // 拷贝和生成 mipmap 录制在同一个 command buffer 中, 只提交和等待一次
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        ops::BarrierBatcher barriers(mCmdPipelineBarrier2);
+        barriers.addImage(mTextureImage, VK_IMAGE_ASPECT_COLOR_BIT, mMipLevels, 1);
         // 该图像是使用VK_IMAGE_LAYOUT_UNDEFINED布局创建的，因此在转换textureImage时应将其指定为旧布局。
         // 请记住，我们可以这样做，因为在执行复制操作之前我们不关心其内容
-        // 未定义 → 传输目的地
-        transitionImageLayout(mTextureImage,
-            VK_FORMAT_R8G8B8A8_SRGB,
-            VK_IMAGE_LAYOUT_UNDEFINED,
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            mMipLevels
-        );
+        // 未定义 → 传输目的地, 其它的 mip level 在生成的时候再转换
+        barriers.transition(mTextureImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, 1);
+        barriers.flush(commandBuffer);
         // 从临时的 buffer 拷贝到 VkImage 中
-        copyBufferToImage(stagingBuffer,
+        recordCopyBufferToImage(commandBuffer,
+            stagingBuffer,
             mTextureImage,
             static_cast<uint32_t>(texWidth),
             static_cast<uint32_t>(texHeight)
         );
         // transitioned to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL while generating mipmaps
+        recordMipmaps(commandBuffer, barriers, mTextureImage, VK_FORMAT_R8G8B8A8_SRGB, texWidth, texHeight, mMipLevels);
+        endSingleTimeCommands(commandBuffer);
+        spdlog::info("{} {} mip levels with {} barriers in {} pipeline barrier calls", __func__,
+            mMipLevels, barriers.barrierCount(), barriers.flushCount());
+
         // 销毁临时的 buffer
         vkDestroyBuffer(mDevice, stagingBuffer, nullptr);
         vkFreeMemory(mDevice, stagingBufferMemory, nullptr);
-
-        generateMipmaps(mTextureImage, VK_FORMAT_R8G8B8A8_SRGB, texWidth, texHeight, mMipLevels);
     }
 
-    void generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels) {
+    // 每一级 mip 从上一级 blit 得到: 上一级转换到 TRANSFER_SRC 和这一级转换到 TRANSFER_DST 在同一次 barrier 中完成,
+    // 最后所有的 mip level 一起转换到 SHADER_READ_ONLY. mip level 0 需要已经处于 TRANSFER_DST 并且写入了数据
+    void recordMipmaps(VkCommandBuffer commandBuffer, ops::BarrierBatcher& barriers, VkImage image,
+            VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels) {
         // check if image format supports linear blitting
         VkFormatProperties formatProperties;
         vkGetPhysicalDeviceFormatProperties(mPhysicalDevice, imageFormat, &formatProperties);
@@ -2096,35 +3806,12 @@ private:
             throw std::runtime_error("texture image format does not support linear blitting!");
         }
 
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-        VkImageMemoryBarrier barrier{};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.image = image;
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = 1;
-        barrier.subresourceRange.levelCount = 1;
-
         int32_t mipWidth = texWidth;
         int32_t mipHeight = texHeight;
-        for (int32_t i = 1; i < mipLevels; ++i) {
-            barrier.subresourceRange.baseMipLevel = i - 1;
-            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-
-            vkCmdPipelineBarrier(commandBuffer,
-                VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-                0,
-                0, nullptr,
-                0, nullptr, 
-                1,
-                &barrier
-            );
+        for (uint32_t i = 1; i < mipLevels; ++i) {
+            barriers.transition(image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, i - 1, 1);
+            barriers.transition(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, i, 1);
+            barriers.flush(commandBuffer);
 
             VkImageBlit blit{};
             blit.srcOffsets[0] = {0, 0, 0};
@@ -2147,41 +3834,13 @@ private:
                 VK_FILTER_LINEAR
             );
 
-            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-            barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-            vkCmdPipelineBarrier(commandBuffer,
-                VK_PIPELINE_STAGE_TRANSFER_BIT,
-                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                0,
-                0, nullptr,
-                0, nullptr,
-                1,
-                &barrier
-            );
-
             if (mipWidth > 1) mipWidth /= 2;
             if (mipHeight > 1) mipHeight /= 2;
         }
 
-        barrier.subresourceRange.baseMipLevel = mipLevels - 1;
-        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-        vkCmdPipelineBarrier(commandBuffer, 
-            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-            0,
-            0, nullptr,
-            0, nullptr,
-            1,
-            &barrier
-        );
-
-        endSingleTimeCommands(commandBuffer);
+        // 由片段着色器去做读取操作
+        barriers.transition(image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 0, mipLevels);
+        barriers.flush(commandBuffer);
     }
 
     void createTextureImageView() {
@@ -2299,90 +3958,8 @@ private:
         vkBindImageMemory(mDevice, image, imageMemory, 0);
     }
 
-    void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout,
-            uint32_t mipLevels) {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-        // 同步对图像资源的访问
-        // 在图像的不同的操作之间插入内存屏障
-        VkImageMemoryBarrier barrier{};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.oldLayout = oldLayout;
-        barrier.newLayout = newLayout;
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.image = image;
-#ifndef EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-#else
-        if(newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
-            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-            if (hasStencilComponent(format)) {
-                barrier.subresourceRange.aspectMask | VK_IMAGE_ASPECT_STENCIL_BIT;
-            }
-        } else {
-            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        }
-#endif /* EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE */
-        barrier.subresourceRange.baseMipLevel = 0;
-        barrier.subresourceRange.levelCount = mipLevels;
-        barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = 1;
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = 0;
-
-        VkPipelineStageFlags sourceStage;
-        VkPipelineStageFlags dstinationStage;
-
-        if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED &&
-                newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-            // 未定义 → 传输目的地：传输不需要等待任何内容的写入
-            barrier.srcAccessMask = 0;
-            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-            sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-            dstinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        } else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL &&
-                newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-            // 传输目的地 → 着色器读取：着色器读取应该等待传输写入，特别是着色器在片段着色器中读取，因为这是我们要使用纹理的地方
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-            sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-            // 由片段着色器去做读取操作
-            dstinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-#ifdef EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE
-        } else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED &&
-                newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
-            barrier.srcAccessMask = 0;
-            barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
-                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-
-            sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-            dstinationStage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-#endif /* EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE */
-        } else {
-            spdlog::error("{} unsupported layout transition!", __func__);
-            throw std::runtime_error("unsupported layout transition!");
-        }
-
-        vkCmdPipelineBarrier(
-            commandBuffer,
-            sourceStage, dstinationStage,
-            0,
-            0,
-            nullptr,
-            0,
-            nullptr,
-            1,
-            &barrier
-        );
-
-        endSingleTimeCommands(commandBuffer);
-    }
-
-    void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
+    void recordCopyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImage image,
+            uint32_t width, uint32_t height) {
         VkBufferImageCopy region{};
         region.bufferOffset = 0;
         region.bufferRowLength = 0;
@@ -2408,8 +3985,6 @@ private:
             1,
             &region
         );
-
-        endSingleTimeCommands(commandBuffer);
     }
 
     // recording and executing a command buffer
@@ -2431,17 +4006,40 @@ private:
         return commandBuffer;
     }
     // end a command buffer
+    // 提交之后只等待这一次提交 signal 的 timeline 值, 而不是 vkQueueWaitIdle 等待整个队列
     void endSingleTimeCommands(VkCommandBuffer commandBuffer) {
+        mFrameTimeline.wait(submitSingleTimeCommands(commandBuffer));
+        mFrameTimeline.collect();
+    }
+
+    // 提交之后不等待, command buffer 在 timeline 到达返回的值之后回收
+    uint64_t submitSingleTimeCommands(VkCommandBuffer commandBuffer) {
         vkEndCommandBuffer(commandBuffer);
+
+        VkSemaphore timeline = mFrameTimeline.semaphore();
+        uint64_t signalValue = mFrameTimeline.nextValue();
+        VkTimelineSemaphoreSubmitInfo timelineInfo{};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &signalValue;
+
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.pNext = &timelineInfo;
         submitInfo.commandBufferCount = 1;
         submitInfo.pCommandBuffers = &commandBuffer;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &timeline;
 
-        vkQueueSubmit(mGraphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-        vkQueueWaitIdle(mGraphicsQueue);
+        if (vkQueueSubmit(mGraphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+            spdlog::error("{} failed to submit single time commands", __func__);
+            throw std::runtime_error("failed to submit single time commands");
+        }
 
-        vkFreeCommandBuffers(mDevice, mCommandPool, 1, &commandBuffer);
+        mFrameTimeline.deferDestroy(signalValue, [this, commandBuffer]() {
+            vkFreeCommandBuffers(mDevice, mCommandPool, 1, &commandBuffer);
+        });
+        return signalValue;
     }
 
     static std::vector<char> readFile(const std::string& fileName) {
@@ -2476,9 +4074,16 @@ private:
 
 #ifdef EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE
         spdlog::info("{} explicitly transitioning depth image", __func__);
-        transitionImageLayout(mDepthImage, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED,
-            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, 1
-        );
+        VkImageAspectFlags aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+        if (hasStencilComponent(depthFormat)) {
+            aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+        }
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        ops::BarrierBatcher barriers(mCmdPipelineBarrier2);
+        barriers.addImage(mDepthImage, aspect, 1, 1);
+        barriers.transition(mDepthImage, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+        barriers.flush(commandBuffer);
+        endSingleTimeCommands(commandBuffer);
 #endif /* EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE */
     }
 
@@ -2645,6 +4250,7 @@ int main(int argc, char *argv[])
     spdlog::set_level(spdlog::level::info);
 #endif
     ComputeShaderApplication app;
+    app.parseCommandLine(argc, argv);
     try
     {
         app.run();
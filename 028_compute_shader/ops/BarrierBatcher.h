@@ -0,0 +1,479 @@
+#ifndef _BARRIER_BATCHER_DEMO_H_
+#define _BARRIER_BATCHER_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace ops {
+
+// 一次访问的 stage 和 access, 使用 synchronization2 的定义
+// 只能使用和 vulkan 1.0 数值相同的位 (NONE 除外), 设备不支持 VK_KHR_synchronization2 时直接截断成 vkCmdPipelineBarrier 的参数
+struct BarrierAccess {
+    VkPipelineStageFlags2KHR mStages = VK_PIPELINE_STAGE_2_NONE_KHR;
+    VkAccessFlags2KHR mAccess = VK_ACCESS_2_NONE_KHR;
+};
+
+// 处于这个 layout 的 image 最常见的访问方式, 其它的用法 (例如在 compute shader 中采样) 通过 imageAccess 指定
+inline BarrierAccess layoutAccess(VkImageLayout layout) {
+    switch (layout) {
+    case VK_IMAGE_LAYOUT_UNDEFINED:
+        return {};
+    case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
+        return {VK_PIPELINE_STAGE_2_TRANSFER_BIT_KHR, VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR};
+    case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL:
+        return {VK_PIPELINE_STAGE_2_TRANSFER_BIT_KHR, VK_ACCESS_2_TRANSFER_READ_BIT_KHR};
+    case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
+        return {VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_READ_BIT_KHR};
+    case VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL:
+        return {VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR,
+            VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT_KHR | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR};
+    case VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL:
+        return {VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT_KHR | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT_KHR,
+            VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT_KHR | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT_KHR};
+    case VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL:
+        return {VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT_KHR | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT_KHR |
+                VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR,
+            VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT_KHR | VK_ACCESS_2_SHADER_READ_BIT_KHR};
+    case VK_IMAGE_LAYOUT_PRESENT_SRC_KHR:
+        // present 通过 semaphore 等待, barrier 只需要完成 layout 转换
+        return {};
+    default:
+        return {VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT_KHR, VK_ACCESS_2_MEMORY_READ_BIT_KHR | VK_ACCESS_2_MEMORY_WRITE_BIT_KHR};
+    }
+}
+
+// 一次 barrier 的 src / dst, 对 image 还包括 layout 转换 (没有转换时 old 和 new 相同)
+struct BarrierDependency {
+    VkPipelineStageFlags2KHR mSrcStages = VK_PIPELINE_STAGE_2_NONE_KHR;
+    VkAccessFlags2KHR mSrcAccess = VK_ACCESS_2_NONE_KHR;
+    VkPipelineStageFlags2KHR mDstStages = VK_PIPELINE_STAGE_2_NONE_KHR;
+    VkAccessFlags2KHR mDstAccess = VK_ACCESS_2_NONE_KHR;
+    VkImageLayout mOldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkImageLayout mNewLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    bool operator==(const BarrierDependency& other) const {
+        return mSrcStages == other.mSrcStages && mSrcAccess == other.mSrcAccess &&
+            mDstStages == other.mDstStages && mDstAccess == other.mDstAccess &&
+            mOldLayout == other.mOldLayout && mNewLayout == other.mNewLayout;
+    }
+};
+
+// 一个资源 (或者 image 的一个 subresource) 的访问历史: 当前的 layout, 最后一次写, 之后的读,
+// 以及写的结果已经对哪些 stage / access 可见. BarrierBatcher 和 RenderGraph 都用它从之前的访问推导 barrier:
+//   - layout 变化或者写: 等待之前所有的读写, 让之前的写可用
+//   - 读: 只在之前的写还没有对这些 stage 和 access 可见的时候才需要 barrier, 连续的读之间没有 barrier
+struct BarrierState {
+    // 会写内存的 access, 读之后的写只需要执行依赖, 写之后的访问还需要让写的结果可用和可见
+    static constexpr VkAccessFlags2KHR WRITE_ACCESS = VK_ACCESS_2_SHADER_WRITE_BIT_KHR |
+        VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT_KHR |
+        VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR | VK_ACCESS_2_HOST_WRITE_BIT_KHR | VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
+
+    VkImageLayout mLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags2KHR mWriteStages = VK_PIPELINE_STAGE_2_NONE_KHR;
+    VkAccessFlags2KHR mWriteAccess = VK_ACCESS_2_NONE_KHR;
+    VkPipelineStageFlags2KHR mReadStages = VK_PIPELINE_STAGE_2_NONE_KHR;
+    VkPipelineStageFlags2KHR mVisibleStages = VK_PIPELINE_STAGE_2_NONE_KHR;
+    VkAccessFlags2KHR mVisibleAccess = VK_ACCESS_2_NONE_KHR;
+
+    static bool isWrite(const BarrierAccess& access) { return (access.mAccess & WRITE_ACCESS) != 0; }
+
+    // 处于 layout, 之前最后一次访问是 last 的资源
+    static BarrierState initial(VkImageLayout layout, const BarrierAccess& last) {
+        BarrierState state{};
+        state.mLayout = layout;
+        if (isWrite(last)) {
+            state.mWriteStages = last.mStages;
+            state.mWriteAccess = last.mAccess & WRITE_ACCESS;
+        } else {
+            state.mReadStages = last.mStages;
+        }
+        return state;
+    }
+
+    // 接下来的命令以 access 的方式访问处于 layout 的资源, 计算需要的依赖并更新状态, 返回是否需要 barrier
+    // discard 为 true 时不需要之前的内容, layout 转换的 oldLayout 使用 UNDEFINED
+    bool resolve(VkImageLayout layout, const BarrierAccess& access, bool write, bool discard,
+            BarrierDependency& dependency) {
+        bool transition = layout != mLayout;
+        bool needed = false;
+        dependency.mDstStages = access.mStages;
+        dependency.mDstAccess = access.mAccess;
+        dependency.mOldLayout = transition && discard ? VK_IMAGE_LAYOUT_UNDEFINED : mLayout;
+        dependency.mNewLayout = layout;
+        if (transition || write) {
+            dependency.mSrcStages = mWriteStages | mReadStages;
+            dependency.mSrcAccess = mWriteAccess;
+            needed = transition || dependency.mSrcStages != VK_PIPELINE_STAGE_2_NONE_KHR;
+            if (write) {
+                mWriteStages = access.mStages;
+                mWriteAccess = access.mAccess & WRITE_ACCESS;
+                mReadStages = VK_PIPELINE_STAGE_2_NONE_KHR;
+                mVisibleStages = VK_PIPELINE_STAGE_2_NONE_KHR;
+                mVisibleAccess = VK_ACCESS_2_NONE_KHR;
+            } else {
+                // layout 转换相当于在 dst stage 上的一次写, 之后其它 stage 的读也要等它完成
+                mWriteStages = access.mStages;
+                mWriteAccess = VK_ACCESS_2_NONE_KHR;
+                mReadStages = access.mStages;
+                mVisibleStages = access.mStages;
+                mVisibleAccess = access.mAccess;
+            }
+        } else {
+            bool visible = (access.mStages & ~mVisibleStages) == 0 && (access.mAccess & ~mVisibleAccess) == 0;
+            dependency.mSrcStages = mWriteStages;
+            dependency.mSrcAccess = mWriteAccess;
+            needed = mWriteStages != VK_PIPELINE_STAGE_2_NONE_KHR && !visible;
+            if (needed) {
+                mVisibleStages |= access.mStages;
+                mVisibleAccess |= access.mAccess;
+            }
+            mReadStages |= access.mStages;
+        }
+        mLayout = layout;
+        return needed;
+    }
+
+    // 同步已经由别的方式完成 (例如 VkRenderPass 的 subpass dependency), 只记录这次访问
+    void synchronized(const BarrierAccess& access, bool write) {
+        if (write) {
+            mWriteStages = access.mStages;
+            mWriteAccess = access.mAccess & WRITE_ACCESS;
+            mReadStages = VK_PIPELINE_STAGE_2_NONE_KHR;
+            mVisibleStages = VK_PIPELINE_STAGE_2_NONE_KHR;
+            mVisibleAccess = VK_ACCESS_2_NONE_KHR;
+        } else {
+            mReadStages |= access.mStages;
+            mVisibleStages |= access.mStages;
+            mVisibleAccess |= access.mAccess;
+        }
+    }
+};
+
+struct ImageDependency {
+    VkImage mImage;
+    VkImageSubresourceRange mRange;
+    BarrierDependency mDependency;
+};
+
+struct BufferDependency {
+    VkBuffer mBuffer;
+    BarrierDependency mDependency;
+};
+
+// 把一组依赖录制成一次 vkCmdPipelineBarrier2KHR; memory 的 src stage 为 NONE 时没有全局的 memory barrier
+// barrier2 为 nullptr 时使用 vkCmdPipelineBarrier, 它的 stage 是整个命令共用的, 合并之后可能比 synchronization2 等待得更多
+inline void recordBarriers(VkCommandBuffer commandBuffer, PFN_vkCmdPipelineBarrier2KHR barrier2,
+        const BarrierDependency& memory, const std::vector<ImageDependency>& images,
+        const std::vector<BufferDependency>& buffers) {
+    bool hasMemoryBarrier = memory.mSrcStages != VK_PIPELINE_STAGE_2_NONE_KHR;
+    if (barrier2 != nullptr) {
+        VkMemoryBarrier2KHR memoryBarrier{};
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2_KHR;
+        memoryBarrier.srcStageMask = memory.mSrcStages;
+        memoryBarrier.srcAccessMask = memory.mSrcAccess;
+        memoryBarrier.dstStageMask = memory.mDstStages;
+        memoryBarrier.dstAccessMask = memory.mDstAccess;
+
+        std::vector<VkImageMemoryBarrier2KHR> imageBarriers(images.size());
+        for (size_t i = 0; i < images.size(); ++i) {
+            const BarrierDependency& d = images[i].mDependency;
+            VkImageMemoryBarrier2KHR& barrier = imageBarriers[i];
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2_KHR;
+            barrier.srcStageMask = d.mSrcStages;
+            barrier.srcAccessMask = d.mSrcAccess;
+            barrier.dstStageMask = d.mDstStages;
+            barrier.dstAccessMask = d.mDstAccess;
+            barrier.oldLayout = d.mOldLayout;
+            barrier.newLayout = d.mNewLayout;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.image = images[i].mImage;
+            barrier.subresourceRange = images[i].mRange;
+        }
+        std::vector<VkBufferMemoryBarrier2KHR> bufferBarriers(buffers.size());
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            const BarrierDependency& d = buffers[i].mDependency;
+            VkBufferMemoryBarrier2KHR& barrier = bufferBarriers[i];
+            barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2_KHR;
+            barrier.srcStageMask = d.mSrcStages;
+            barrier.srcAccessMask = d.mSrcAccess;
+            barrier.dstStageMask = d.mDstStages;
+            barrier.dstAccessMask = d.mDstAccess;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.buffer = buffers[i].mBuffer;
+            barrier.offset = 0;
+            barrier.size = VK_WHOLE_SIZE;
+        }
+
+        VkDependencyInfoKHR dependencyInfo{};
+        dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+        dependencyInfo.memoryBarrierCount = hasMemoryBarrier ? 1 : 0;
+        dependencyInfo.pMemoryBarriers = &memoryBarrier;
+        dependencyInfo.bufferMemoryBarrierCount = static_cast<uint32_t>(bufferBarriers.size());
+        dependencyInfo.pBufferMemoryBarriers = bufferBarriers.data();
+        dependencyInfo.imageMemoryBarrierCount = static_cast<uint32_t>(imageBarriers.size());
+        dependencyInfo.pImageMemoryBarriers = imageBarriers.data();
+        barrier2(commandBuffer, &dependencyInfo);
+        return;
+    }
+
+    VkPipelineStageFlags2KHR srcStages = memory.mSrcStages;
+    VkPipelineStageFlags2KHR dstStages = memory.mDstStages;
+    std::vector<VkImageMemoryBarrier> imageBarriers(images.size());
+    for (size_t i = 0; i < images.size(); ++i) {
+        const BarrierDependency& d = images[i].mDependency;
+        srcStages |= d.mSrcStages;
+        dstStages |= d.mDstStages;
+        VkImageMemoryBarrier& barrier = imageBarriers[i];
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcAccessMask = static_cast<VkAccessFlags>(d.mSrcAccess);
+        barrier.dstAccessMask = static_cast<VkAccessFlags>(d.mDstAccess);
+        barrier.oldLayout = d.mOldLayout;
+        barrier.newLayout = d.mNewLayout;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = images[i].mImage;
+        barrier.subresourceRange = images[i].mRange;
+    }
+    std::vector<VkBufferMemoryBarrier> bufferBarriers(buffers.size());
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        const BarrierDependency& d = buffers[i].mDependency;
+        srcStages |= d.mSrcStages;
+        dstStages |= d.mDstStages;
+        VkBufferMemoryBarrier& barrier = bufferBarriers[i];
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = static_cast<VkAccessFlags>(d.mSrcAccess);
+        barrier.dstAccessMask = static_cast<VkAccessFlags>(d.mDstAccess);
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.buffer = buffers[i].mBuffer;
+        barrier.offset = 0;
+        barrier.size = VK_WHOLE_SIZE;
+    }
+    VkMemoryBarrier memoryBarrier{};
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.srcAccessMask = static_cast<VkAccessFlags>(memory.mSrcAccess);
+    memoryBarrier.dstAccessMask = static_cast<VkAccessFlags>(memory.mDstAccess);
+    vkCmdPipelineBarrier(commandBuffer,
+        srcStages == VK_PIPELINE_STAGE_2_NONE_KHR ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT :
+            static_cast<VkPipelineStageFlags>(srcStages),
+        dstStages == VK_PIPELINE_STAGE_2_NONE_KHR ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT :
+            static_cast<VkPipelineStageFlags>(dstStages),
+        0,
+        hasMemoryBarrier ? 1 : 0, &memoryBarrier,
+        static_cast<uint32_t>(bufferBarriers.size()), bufferBarriers.data(),
+        static_cast<uint32_t>(imageBarriers.size()), imageBarriers.data()
+    );
+}
+
+// 用 BarrierState 记录每个 image subresource (mip level, array layer) 和每个 buffer 的访问历史,
+// 调用者按命令的顺序声明接下来的访问, 推导出的 barrier 在 flush 中一次录制
+// 参数相同并且 mip / layer 相邻的 subresource 合并成一个 barrier
+// 同一个 subresource 在两次 flush 之间的多次声明合并成一次转换, 所以声明的访问必须在 flush 之后才录制
+class BarrierBatcher {
+public:
+    // barrier2 为 nullptr 时使用 vkCmdPipelineBarrier, 所有 barrier 的 stage 合并在一起
+    explicit BarrierBatcher(PFN_vkCmdPipelineBarrier2KHR barrier2 = nullptr) : mCmdPipelineBarrier2(barrier2) {}
+
+    // 开始跟踪一个 image, 所有 subresource 的初始状态相同, 新创建的 image 处于 UNDEFINED 并且没有之前的访问
+    void addImage(VkImage image, VkImageAspectFlags aspect, uint32_t mipLevels, uint32_t arrayLayers,
+            VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED, const BarrierAccess& last = {}) {
+        TrackedImage tracked{};
+        tracked.mAspect = aspect;
+        tracked.mMipLevels = mipLevels;
+        tracked.mArrayLayers = arrayLayers;
+        tracked.mStates.assign(size_t(mipLevels) * arrayLayers, BarrierState::initial(layout, last));
+        tracked.mPending.assign(tracked.mStates.size(), -1);
+        mImages[image] = std::move(tracked);
+    }
+
+    void addBuffer(VkBuffer buffer, const BarrierAccess& last = {}) {
+        TrackedBuffer tracked{};
+        tracked.mState = BarrierState::initial(VK_IMAGE_LAYOUT_UNDEFINED, last);
+        mBuffers[buffer] = tracked;
+    }
+
+    VkImageLayout layout(VkImage image, uint32_t mipLevel, uint32_t arrayLayer = 0) const {
+        const TrackedImage& tracked = mImages.at(image);
+        return tracked.mStates[size_t(arrayLayer) * tracked.mMipLevels + mipLevel].mLayout;
+    }
+
+    // 转换到 layout, 之后的访问方式由 layoutAccess 推导
+    void transition(VkImage image, VkImageLayout layout, uint32_t baseMipLevel = 0,
+            uint32_t levelCount = VK_REMAINING_MIP_LEVELS, uint32_t baseArrayLayer = 0,
+            uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS) {
+        imageAccess(image, layout, layoutAccess(layout), baseMipLevel, levelCount, baseArrayLayer, layerCount);
+    }
+
+    // 接下来的命令以 access 的方式访问处于 layout 的这些 subresource
+    void imageAccess(VkImage image, VkImageLayout layout, const BarrierAccess& access, uint32_t baseMipLevel = 0,
+            uint32_t levelCount = VK_REMAINING_MIP_LEVELS, uint32_t baseArrayLayer = 0,
+            uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS) {
+        auto it = mImages.find(image);
+        if (it == mImages.end()) {
+            spdlog::error("{} image is not tracked, call addImage first", __func__);
+            throw std::runtime_error("barrier batcher: image is not tracked");
+        }
+        TrackedImage& tracked = it->second;
+        uint32_t mipEnd = levelCount == VK_REMAINING_MIP_LEVELS ? tracked.mMipLevels : baseMipLevel + levelCount;
+        uint32_t layerEnd = layerCount == VK_REMAINING_ARRAY_LAYERS ? tracked.mArrayLayers : baseArrayLayer + layerCount;
+        for (uint32_t layer = baseArrayLayer; layer < layerEnd; ++layer) {
+            for (uint32_t mip = baseMipLevel; mip < mipEnd; ++mip) {
+                size_t index = size_t(layer) * tracked.mMipLevels + mip;
+                BarrierDependency dependency{};
+                bool write = BarrierState::isWrite(access);
+                if (!tracked.mStates[index].resolve(layout, access, write, false, dependency)) {
+                    continue;
+                }
+                if (tracked.mPending[index] >= 0) {
+                    merge(mPendingImages[tracked.mPending[index]].mDependency, dependency);
+                    continue;
+                }
+                tracked.mPending[index] = static_cast<int32_t>(mPendingImages.size());
+                mPendingImages.push_back({image, mip, layer, dependency});
+            }
+        }
+    }
+
+    // buffer 没有 layout, 没有跟踪过的 buffer 视为没有之前的访问
+    void bufferAccess(VkBuffer buffer, const BarrierAccess& access) {
+        TrackedBuffer& tracked = mBuffers[buffer];
+        BarrierDependency dependency{};
+        bool write = BarrierState::isWrite(access);
+        if (!tracked.mState.resolve(VK_IMAGE_LAYOUT_UNDEFINED, access, write, false, dependency)) {
+            return;
+        }
+        if (tracked.mPending >= 0) {
+            merge(mPendingBuffers[tracked.mPending].mDependency, dependency);
+            return;
+        }
+        tracked.mPending = static_cast<int32_t>(mPendingBuffers.size());
+        mPendingBuffers.push_back({buffer, dependency});
+    }
+
+    bool pending() const { return !mPendingImages.empty() || !mPendingBuffers.empty(); }
+
+    // 把积累的 barrier 录制成一次 vkCmdPipelineBarrier2KHR (或者 vkCmdPipelineBarrier)
+    void flush(VkCommandBuffer commandBuffer) {
+        if (!pending()) {
+            return;
+        }
+        std::vector<ImageDependency> ranges = mergeImageBarriers();
+        recordBarriers(commandBuffer, mCmdPipelineBarrier2, {}, ranges, mPendingBuffers);
+        mFlushCount++;
+        mBarrierCount += static_cast<uint32_t>(ranges.size() + mPendingBuffers.size());
+
+        for (const PendingImage& pending : mPendingImages) {
+            TrackedImage& tracked = mImages[pending.mImage];
+            tracked.mPending[size_t(pending.mArrayLayer) * tracked.mMipLevels + pending.mMipLevel] = -1;
+        }
+        for (const BufferDependency& pending : mPendingBuffers) {
+            mBuffers[pending.mBuffer].mPending = -1;
+        }
+        mPendingImages.clear();
+        mPendingBuffers.clear();
+    }
+
+    // 录制的 pipeline barrier 命令数和其中的 barrier 数
+    uint32_t flushCount() const { return mFlushCount; }
+    uint32_t barrierCount() const { return mBarrierCount; }
+
+private:
+    struct TrackedImage {
+        VkImageAspectFlags mAspect = 0;
+        uint32_t mMipLevels = 0;
+        uint32_t mArrayLayers = 0;
+        // 按 layer * mMipLevels + mip 排列
+        std::vector<BarrierState> mStates;
+        // 这个 subresource 在 mPendingImages 中的下标, -1 表示没有
+        std::vector<int32_t> mPending;
+    };
+
+    struct TrackedBuffer {
+        BarrierState mState;
+        int32_t mPending = -1;
+    };
+
+    struct PendingImage {
+        VkImage mImage;
+        uint32_t mMipLevel;
+        uint32_t mArrayLayer;
+        BarrierDependency mDependency;
+    };
+
+    // 两次 flush 之间对同一个资源的第二次声明: 中间没有命令, 合并成从第一次的 src 直接到两次的 dst
+    static void merge(BarrierDependency& pending, const BarrierDependency& next) {
+        pending.mDstStages |= next.mDstStages;
+        pending.mDstAccess |= next.mDstAccess;
+        pending.mNewLayout = next.mNewLayout;
+    }
+
+    // 先把同一个 layer 中相邻的 mip 合并, 再把 mip 范围相同的相邻 layer 合并
+    std::vector<ImageDependency> mergeImageBarriers() {
+        std::vector<PendingImage> pendings = mPendingImages;
+        std::sort(pendings.begin(), pendings.end(), [](const PendingImage& a, const PendingImage& b) {
+            if (a.mImage != b.mImage) {
+                return std::less<VkImage>()(a.mImage, b.mImage);
+            }
+            return a.mArrayLayer != b.mArrayLayer ? a.mArrayLayer < b.mArrayLayer : a.mMipLevel < b.mMipLevel;
+        });
+        std::vector<ImageDependency> mipRanges;
+        for (const PendingImage& pending : pendings) {
+            if (!mipRanges.empty()) {
+                ImageDependency& last = mipRanges.back();
+                if (last.mImage == pending.mImage && last.mRange.baseArrayLayer == pending.mArrayLayer &&
+                    last.mRange.baseMipLevel + last.mRange.levelCount == pending.mMipLevel &&
+                    last.mDependency == pending.mDependency) {
+                    last.mRange.levelCount++;
+                    continue;
+                }
+            }
+            VkImageSubresourceRange range = {mImages[pending.mImage].mAspect, pending.mMipLevel, 1, pending.mArrayLayer, 1};
+            mipRanges.push_back({pending.mImage, range, pending.mDependency});
+        }
+
+        std::stable_sort(mipRanges.begin(), mipRanges.end(), [](const ImageDependency& a, const ImageDependency& b) {
+            if (a.mImage != b.mImage) {
+                return std::less<VkImage>()(a.mImage, b.mImage);
+            }
+            if (a.mRange.baseMipLevel != b.mRange.baseMipLevel) {
+                return a.mRange.baseMipLevel < b.mRange.baseMipLevel;
+            }
+            return a.mRange.baseArrayLayer < b.mRange.baseArrayLayer;
+        });
+        std::vector<ImageDependency> ranges;
+        for (const ImageDependency& range : mipRanges) {
+            if (!ranges.empty()) {
+                ImageDependency& last = ranges.back();
+                if (last.mImage == range.mImage && last.mRange.baseMipLevel == range.mRange.baseMipLevel &&
+                    last.mRange.levelCount == range.mRange.levelCount &&
+                    last.mRange.baseArrayLayer + last.mRange.layerCount == range.mRange.baseArrayLayer &&
+                    last.mDependency == range.mDependency) {
+                    last.mRange.layerCount++;
+                    continue;
+                }
+            }
+            ranges.push_back(range);
+        }
+        return ranges;
+    }
+
+    PFN_vkCmdPipelineBarrier2KHR mCmdPipelineBarrier2 = nullptr;
+    std::unordered_map<VkImage, TrackedImage> mImages;
+    std::unordered_map<VkBuffer, TrackedBuffer> mBuffers;
+    std::vector<PendingImage> mPendingImages;
+    std::vector<BufferDependency> mPendingBuffers;
+    uint32_t mFlushCount = 0;
+    uint32_t mBarrierCount = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef _COMPUTE_KERNELS_DEMO_H_
+#define _COMPUTE_KERNELS_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include <spdlog/spdlog.h>
+#include "Specialization.h"
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ops {
+
+// 一组共用 pipeline layout 的 compute kernel: descriptor set 中是 bindingCount 个 storage buffer, 加上一段 push constant
+// RadixSort 和 ComputePrimitives 都建立在它上面, 每个 descriptor set 绑定一组 buffer, pipeline 用 specialization constant 区分
+class ComputeKernels {
+public:
+    // name 只用于日志, workgroupSize 是 kernel 中 local_size_x 的最大值
+    void create(VkPhysicalDevice physicalDevice, VkDevice device, const char* name, uint32_t workgroupSize,
+            uint32_t bindingCount, uint32_t pushConstantSize, uint32_t setCount) {
+        mDevice = device;
+        mName = name;
+        mBindingCount = bindingCount;
+
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        if (properties.limits.maxComputeWorkGroupInvocations < workgroupSize) {
+            spdlog::error("{} {} needs {} invocations per workgroup", __func__, mName, workgroupSize);
+            throw std::runtime_error("compute kernel workgroup size is not supported!");
+        }
+        mMaxGroupCount = properties.limits.maxComputeWorkGroupCount[0];
+
+        std::vector<VkDescriptorSetLayoutBinding> bindings(bindingCount);
+        for (uint32_t i = 0; i < bindingCount; ++i) {
+            bindings[i].binding = i;
+            bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            bindings[i].descriptorCount = 1;
+            bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        }
+        VkDescriptorSetLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = bindingCount;
+        layoutInfo.pBindings = bindings.data();
+        if (vkCreateDescriptorSetLayout(mDevice, &layoutInfo, nullptr, &mDescriptorSetLayout) != VK_SUCCESS) {
+            spdlog::error("{} failed to create {} descriptor set layout!", __func__, mName);
+            throw std::runtime_error("failed to create compute kernel descriptor set layout!");
+        }
+
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = pushConstantSize;
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &mDescriptorSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+        if (vkCreatePipelineLayout(mDevice, &pipelineLayoutInfo, nullptr, &mPipelineLayout) != VK_SUCCESS) {
+            spdlog::error("{} failed to create {} pipeline layout!", __func__, mName);
+            throw std::runtime_error("failed to create compute kernel pipeline layout!");
+        }
+
+        VkDescriptorPoolSize poolSize{};
+        poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        poolSize.descriptorCount = setCount * bindingCount;
+        VkDescriptorPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.poolSizeCount = 1;
+        poolInfo.pPoolSizes = &poolSize;
+        poolInfo.maxSets = setCount;
+        if (vkCreateDescriptorPool(mDevice, &poolInfo, nullptr, &mDescriptorPool) != VK_SUCCESS) {
+            spdlog::error("{} failed to create {} descriptor pool!", __func__, mName);
+            throw std::runtime_error("failed to create compute kernel descriptor pool!");
+        }
+        std::vector<VkDescriptorSetLayout> layouts(setCount, mDescriptorSetLayout);
+        mDescriptorSets.resize(setCount);
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = mDescriptorPool;
+        allocInfo.descriptorSetCount = setCount;
+        allocInfo.pSetLayouts = layouts.data();
+        if (vkAllocateDescriptorSets(mDevice, &allocInfo, mDescriptorSets.data()) != VK_SUCCESS) {
+            spdlog::error("{} failed to allocate {} descriptor sets!", __func__, mName);
+            throw std::runtime_error("failed to allocate compute kernel descriptor sets!");
+        }
+    }
+
+    void destroy() {
+        if (mDevice == VK_NULL_HANDLE) {
+            return;
+        }
+        for (VkPipeline pipeline : mPipelines) {
+            vkDestroyPipeline(mDevice, pipeline, nullptr);
+        }
+        mPipelines.clear();
+        vkDestroyPipelineLayout(mDevice, mPipelineLayout, nullptr);
+        vkDestroyDescriptorPool(mDevice, mDescriptorPool, nullptr);
+        vkDestroyDescriptorSetLayout(mDevice, mDescriptorSetLayout, nullptr);
+        mDescriptorSets.clear();
+        mDevice = VK_NULL_HANDLE;
+    }
+
+    uint32_t maxGroupCount() const { return mMaxGroupCount; }
+
+    // 调用者在创建完 pipeline 之后用 vkDestroyShaderModule 销毁
+    VkShaderModule createShaderModule(const std::string& path) {
+        std::ifstream file(path, std::ios::ate | std::ios::binary);
+        if (!file.is_open()) {
+            spdlog::error("{} failed to open {}", __func__, path);
+            throw std::runtime_error("failed to open compute kernel shader!");
+        }
+        std::vector<char> code(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(code.data(), code.size());
+
+        VkShaderModuleCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        createInfo.codeSize = code.size();
+        createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+        VkShaderModule module;
+        if (vkCreateShaderModule(mDevice, &createInfo, nullptr, &module) != VK_SUCCESS) {
+            spdlog::error("{} failed to create shader module {}", __func__, path);
+            throw std::runtime_error("failed to create compute kernel shader module!");
+        }
+        return module;
+    }
+
+    // 返回的 pipeline 在 destroy 中销毁
+    VkPipeline createPipeline(VkPipelineCache pipelineCache, VkShaderModule module, SpecializationConstants& constants) {
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.layout = mPipelineLayout;
+        pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineInfo.stage.module = module;
+        pipelineInfo.stage.pName = "main";
+        pipelineInfo.stage.pSpecializationInfo = constants.info();
+
+        VkPipeline pipeline;
+        if (vkCreateComputePipelines(mDevice, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+            spdlog::error("{} failed to create {} pipeline!", __func__, mName);
+            throw std::runtime_error("failed to create compute kernel pipeline!");
+        }
+        mPipelines.push_back(pipeline);
+        return pipeline;
+    }
+
+    // buffers[i] 绑定到 binding i, 调用时之前录制的命令不能还在执行
+    void bindBuffers(uint32_t set, const std::vector<VkBuffer>& buffers) {
+        if (buffers.size() != mBindingCount) {
+            spdlog::error("{} {} needs {} buffers, got {}", __func__, mName, mBindingCount, buffers.size());
+            throw std::runtime_error("wrong number of compute kernel buffers!");
+        }
+        std::vector<VkDescriptorBufferInfo> bufferInfos(buffers.size());
+        std::vector<VkWriteDescriptorSet> writes(buffers.size());
+        for (uint32_t binding = 0; binding < buffers.size(); ++binding) {
+            bufferInfos[binding] = {buffers[binding], 0, VK_WHOLE_SIZE};
+            writes[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writes[binding].dstSet = mDescriptorSets[set];
+            writes[binding].dstBinding = binding;
+            writes[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writes[binding].descriptorCount = 1;
+            writes[binding].pBufferInfo = &bufferInfos[binding];
+        }
+        vkUpdateDescriptorSets(mDevice, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+    }
+
+    // 绑定 descriptor set 和 push constant; 中间录制了其它 pipeline layout 的命令之后需要重新绑定
+    template <typename T>
+    void bind(VkCommandBuffer commandBuffer, uint32_t set, const T& constants) const {
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mPipelineLayout,
+            0, 1, &mDescriptorSets[set], 0, nullptr);
+        vkCmdPushConstants(commandBuffer, mPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(T), &constants);
+    }
+
+    // dispatch 之后加上 barrier, 下一个 kernel 可以读写这一个写的结果
+    void dispatch(VkCommandBuffer commandBuffer, VkPipeline pipeline, uint32_t groupCount) const {
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+        vkCmdDispatch(commandBuffer, groupCount, 1, 1);
+        computeBarrier(commandBuffer);
+    }
+
+    static VkPhysicalDeviceSubgroupProperties subgroupProperties(VkPhysicalDevice physicalDevice) {
+        VkPhysicalDeviceSubgroupProperties subgroupProperties{};
+        subgroupProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+        VkPhysicalDeviceProperties2 properties2{};
+        properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        properties2.pNext = &subgroupProperties;
+        vkGetPhysicalDeviceProperties2(physicalDevice, &properties2);
+        subgroupProperties.pNext = nullptr;
+        return subgroupProperties;
+    }
+
+    static void computeBarrier(VkCommandBuffer commandBuffer) {
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            0,
+            1, &barrier,
+            0, nullptr,
+            0, nullptr
+        );
+    }
+
+private:
+    VkDevice mDevice = VK_NULL_HANDLE;
+    const char* mName = "";
+    uint32_t mBindingCount = 0;
+    uint32_t mMaxGroupCount = 65535;
+    VkDescriptorSetLayout mDescriptorSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout mPipelineLayout = VK_NULL_HANDLE;
+    VkDescriptorPool mDescriptorPool = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> mDescriptorSets;
+    std::vector<VkPipeline> mPipelines;
+};
+
+}
+
+#endif
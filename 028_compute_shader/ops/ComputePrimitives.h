@@ -0,0 +1,192 @@
+#ifndef _COMPUTE_PRIMITIVES_DEMO_H_
+#define _COMPUTE_PRIMITIVES_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include <spdlog/spdlog.h>
+#include "ComputeKernels.h"
+#include "Specialization.h"
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ops {
+
+// gpu 上 uint32 的并行基本操作: exclusive / inclusive scan, reduce (求和), stream compaction
+// 长度任意, 用多趟的 reduce-then-scan:
+//   向上: scan_reduce 把每一层每 1024 个元素的和写到 scratch 中, 直到某一层只剩一个 block
+//   向下: scan_blocks 从最上层开始, 每个 block 内部 scan 之后加上上一层对应的值
+// 每一层的数量是下一层的 1 / 1024, 三层就可以覆盖 2^30 个元素, 额外的读写只有第 0 层多读一遍
+// 没有使用 decoupled look-back: 它要求先启动的 workgroup 一定能继续执行 (forward progress),
+// vulkan 不保证这一点, 在 lavapipe 这样按顺序执行 workgroup 的实现上自旋等待前一个 block 可能永远等不到
+class ComputePrimitives {
+public:
+    static constexpr uint32_t WORKGROUP_SIZE = 256;
+    static constexpr uint32_t ITEMS_PER_THREAD = 4;
+    static constexpr uint32_t BLOCK_SIZE = WORKGROUP_SIZE * ITEMS_PER_THREAD;
+
+    enum class Operation : uint32_t {
+        ExclusiveScan = 0,
+        InclusiveScan = 1,
+        Reduce = 2,
+        Compact = 3,    // 保留 flags 非 0 的元素, 保持原来的顺序, 数量写到 counter
+    };
+
+    // 都需要 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+    //   input: count 个 uint32
+    //   flags: compact 的条件, count 个 uint32, 其他操作不读取但也需要一个有效的 buffer
+    //   output: scan 和 compact 是 count 个 uint32, reduce 是 1 个
+    //   scratch: 至少 scratchSize(count) 字节
+    //   counter: 4 字节, compact 保留下来的数量
+    struct Buffers {
+        VkBuffer mInput = VK_NULL_HANDLE;
+        VkBuffer mFlags = VK_NULL_HANDLE;
+        VkBuffer mOutput = VK_NULL_HANDLE;
+        VkBuffer mScratch = VK_NULL_HANDLE;
+        VkBuffer mCounter = VK_NULL_HANDLE;
+    };
+
+    // shaderDir 中需要有 compile.sh 编译出来的 scan_*.spv
+    void create(VkPhysicalDevice physicalDevice, VkDevice device, VkPipelineCache pipelineCache,
+            const std::string& shaderDir) {
+        selectSubgroupPath(physicalDevice);
+        mKernels.create(physicalDevice, device, "compute primitives", WORKGROUP_SIZE, 5, sizeof(PushConstants), 1);
+
+        const char* suffix = mUseSubgroups ? "_subgroup.spv" : ".spv";
+        VkShaderModule reduceModule = mKernels.createShaderModule(shaderDir + "/scan_reduce" + suffix);
+        VkShaderModule blocksModule = mKernels.createShaderModule(shaderDir + "/scan_blocks" + suffix);
+        // reduce 只关心第 0 层读的是值还是 compact 的条件
+        mReducePipelines[0] = createPipeline(pipelineCache, reduceModule, Operation::Reduce);
+        mReducePipelines[1] = createPipeline(pipelineCache, reduceModule, Operation::Compact);
+        for (Operation operation : {Operation::ExclusiveScan, Operation::InclusiveScan, Operation::Compact}) {
+            mScanPipelines[static_cast<uint32_t>(operation)] = createPipeline(pipelineCache, blocksModule, operation);
+        }
+        vkDestroyShaderModule(device, reduceModule, nullptr);
+        vkDestroyShaderModule(device, blocksModule, nullptr);
+
+        spdlog::info("{} compute primitives use the {} path", __func__,
+            mUseSubgroups ? "subgroup" : "shared memory");
+    }
+
+    void destroy() {
+        mKernels.destroy();
+    }
+
+    bool usesSubgroups() const { return mUseSubgroups; }
+
+    static uint32_t blockCount(uint32_t count) {
+        return (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    static VkDeviceSize scratchSize(uint32_t count) {
+        std::vector<Level> levels = buildLevels(count);
+        uint32_t words = levels.back().mBlockOffset;
+        return static_cast<VkDeviceSize>(words == 0 ? 1 : words) * sizeof(uint32_t);
+    }
+
+    // 更新 descriptor set, 调用时之前录制的命令不能还在执行
+    void bindBuffers(const Buffers& buffers) {
+        mKernels.bindBuffers(0, {buffers.mInput, buffers.mFlags, buffers.mOutput, buffers.mScratch, buffers.mCounter});
+    }
+
+    // 录制一次操作, 调用者负责在前后加上和自己的读写之间的 barrier. count 为 0 的时候不录制任何命令
+    void record(VkCommandBuffer commandBuffer, uint32_t count, Operation operation) {
+        if (count == 0) {
+            return;
+        }
+        if (blockCount(count) > mKernels.maxGroupCount()) {
+            spdlog::error("{} {} elements need more than {} workgroups", __func__, count, mKernels.maxGroupCount());
+            throw std::runtime_error("too many elements for compute primitives!");
+        }
+        std::vector<Level> levels = buildLevels(count);
+        size_t top = levels.size() - 1;
+        bool compact = operation == Operation::Compact;
+
+        // 向上: 除了最上层, 每一层的 block 和写到 scratch
+        for (size_t level = 0; level < top; ++level) {
+            VkPipeline pipeline = level == 0 && compact ? mReducePipelines[1] : mReducePipelines[0];
+            dispatch(commandBuffer, pipeline, levels[level], static_cast<uint32_t>(level), 0);
+        }
+
+        if (operation == Operation::Reduce) {
+            // 最上层只有一个 block, 它的和就是结果
+            dispatch(commandBuffer, mReducePipelines[0], levels[top], static_cast<uint32_t>(top), WRITE_OUTPUT);
+            return;
+        }
+
+        // 向下: 最上层不需要 carry, 更高的层总是 exclusive scan
+        for (size_t level = top + 1; level-- > 0;) {
+            Operation levelOperation = level == 0 ? operation : Operation::ExclusiveScan;
+            dispatch(commandBuffer, mScanPipelines[static_cast<uint32_t>(levelOperation)], levels[level],
+                static_cast<uint32_t>(level), level < top ? CARRY_IN : 0);
+        }
+    }
+
+private:
+    // 对应 scan_common.glsl 中的 flags
+    static constexpr uint32_t CARRY_IN = 1;
+    static constexpr uint32_t WRITE_OUTPUT = 2;
+
+    struct PushConstants {
+        uint32_t mCount;
+        uint32_t mLevel;
+        uint32_t mSourceOffset;
+        uint32_t mBlockOffset;
+        uint32_t mFlags;
+    };
+
+    // 一层的元素数量, 元素在 scratch 中的位置 (第 0 层不使用), 每个 block 的和在 scratch 中的位置
+    struct Level {
+        uint32_t mCount;
+        uint32_t mSourceOffset;
+        uint32_t mBlockOffset;
+    };
+
+    ComputeKernels mKernels;
+    // 0: 读 input, 1: 读 compact 的条件
+    std::array<VkPipeline, 2> mReducePipelines{};
+    // 按 Operation 的值索引, Reduce 对应的位置不使用
+    std::array<VkPipeline, 4> mScanPipelines{};
+    bool mUseSubgroups = false;
+
+    // 最后一层的数量不超过 BLOCK_SIZE, 它的 mBlockOffset 就是 scratch 需要的 uint32 数量
+    static std::vector<Level> buildLevels(uint32_t count) {
+        std::vector<Level> levels;
+        Level level{count, 0, 0};
+        for (;;) {
+            levels.push_back(level);
+            if (level.mCount <= BLOCK_SIZE) {
+                return levels;
+            }
+            level = {blockCount(level.mCount), level.mBlockOffset, level.mBlockOffset + blockCount(level.mCount)};
+        }
+    }
+
+    void dispatch(VkCommandBuffer commandBuffer, VkPipeline pipeline, const Level& level, uint32_t levelIndex,
+            uint32_t flags) {
+        PushConstants constants{level.mCount, levelIndex, level.mSourceOffset, level.mBlockOffset, flags};
+        mKernels.bind(commandBuffer, 0, constants);
+        mKernels.dispatch(commandBuffer, pipeline, blockCount(level.mCount));
+    }
+
+    // workgroup_scan.glsl 的 subgroup 版本只需要 arithmetic, 并且每个 subgroup 都是满的
+    void selectSubgroupPath(VkPhysicalDevice physicalDevice) {
+        VkPhysicalDeviceSubgroupProperties subgroupProperties = ComputeKernels::subgroupProperties(physicalDevice);
+        uint32_t subgroupSize = subgroupProperties.subgroupSize;
+        mUseSubgroups = (subgroupProperties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+            (subgroupProperties.supportedOperations & VK_SUBGROUP_FEATURE_ARITHMETIC_BIT) &&
+            subgroupSize > 0 && WORKGROUP_SIZE % subgroupSize == 0;
+    }
+
+    // 对应 scan_common.glsl 中的 constant_id = 0
+    VkPipeline createPipeline(VkPipelineCache pipelineCache, VkShaderModule module, Operation operation) {
+        SpecializationConstants constants;
+        constants.set<uint32_t>(0, static_cast<uint32_t>(operation));
+        return mKernels.createPipeline(pipelineCache, module, constants);
+    }
+};
+
+}
+
+#endif
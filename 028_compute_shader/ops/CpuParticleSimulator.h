@@ -0,0 +1,135 @@
+#ifndef _CPU_PARTICLE_SIMULATOR_DEMO_H_
+#define _CPU_PARTICLE_SIMULATOR_DEMO_H_
+
+#include "WorkerPool.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define OPS_PARTICLE_AVX2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define OPS_PARTICLE_NEON 1
+#endif
+
+namespace ops {
+
+// shader_compute.comp 的 cpu 实现, 数据布局和 ParticleStreams 中的 position / velocity 流相同 (fp32)
+// vec2 的两个分量的计算互不相关 (p' = p + v * dt, 越过边界的分量速度反向), 所以 2 * count 个 float 可以当作一个平坦的数组处理,
+// SIMD 不需要任何 shuffle. 乘法和加法分开执行 (shader 中用 precise 禁止合并成 fma, 编译时也要 -ffp-contract=off),
+// 结果和 gpu 逐位一致, 可以用来验证 lavapipe 等实现的结果, 也可以在没有 compute 的时候代替 gpu 做模拟
+class CpuParticleSimulator {
+public:
+    // 每个任务块包含的粒子数量, 太小的时候调度开销明显, 太大的时候线程之间不容易均衡
+    static constexpr size_t GRAIN = 16384;
+
+    void create(uint32_t threadCount) {
+        mWorkerPool.create(threadCount);
+    }
+
+    void destroy() {
+        mWorkerPool.destroy();
+    }
+
+    uint32_t threadCount() const { return mWorkerPool.threadCount(); }
+
+    static const char* simdName() {
+#if defined(OPS_PARTICLE_AVX2)
+        return hasAvx2() ? "avx2" : "scalar";
+#elif defined(OPS_PARTICLE_NEON)
+        return "neon";
+#else
+        return "scalar";
+#endif
+    }
+
+    // 积分 count 个粒子, 输入和输出不能重叠
+    void step(const float* positionsIn, const float* velocitiesIn, float* positionsOut, float* velocitiesOut,
+            size_t count, float deltaTime, bool bounceAtBorder) {
+        mWorkerPool.parallelFor(count, GRAIN, [&](size_t begin, size_t end) {
+            integrate(positionsIn + 2 * begin, velocitiesIn + 2 * begin,
+                positionsOut + 2 * begin, velocitiesOut + 2 * begin,
+                2 * (end - begin), deltaTime, bounceAtBorder);
+        });
+    }
+
+    // 单线程处理 floatCount 个分量
+    static void integrate(const float* positionsIn, const float* velocitiesIn, float* positionsOut, float* velocitiesOut,
+            size_t floatCount, float deltaTime, bool bounceAtBorder) {
+        size_t i = 0;
+#if defined(OPS_PARTICLE_AVX2)
+        if (hasAvx2()) {
+            i = integrateAvx2(positionsIn, velocitiesIn, positionsOut, velocitiesOut, floatCount, deltaTime, bounceAtBorder);
+        }
+#elif defined(OPS_PARTICLE_NEON)
+        i = integrateNeon(positionsIn, velocitiesIn, positionsOut, velocitiesOut, floatCount, deltaTime, bounceAtBorder);
+#endif
+        for (; i < floatCount; ++i) {
+            float velocity = velocitiesIn[i];
+            float position = positionsIn[i] + velocity * deltaTime;
+            if (bounceAtBorder && (position <= -1.0f || position >= 1.0f)) {
+                velocity = -velocity;
+            }
+            positionsOut[i] = position;
+            velocitiesOut[i] = velocity;
+        }
+    }
+
+private:
+    WorkerPool mWorkerPool;
+
+#if defined(OPS_PARTICLE_AVX2)
+    static bool hasAvx2() {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+
+    // 只给这一个函数打开 avx2, 程序在不支持的 cpu 上仍然可以运行. 不打开 fma, 编译器不会合并乘加
+    // 返回处理完的分量数量, 剩下不足 8 个的由标量代码处理
+    __attribute__((target("avx2")))
+    static size_t integrateAvx2(const float* positionsIn, const float* velocitiesIn, float* positionsOut,
+            float* velocitiesOut, size_t floatCount, float deltaTime, bool bounceAtBorder) {
+        const __m256 dt = _mm256_set1_ps(deltaTime);
+        const __m256 lower = _mm256_set1_ps(-1.0f);
+        const __m256 upper = _mm256_set1_ps(1.0f);
+        const __m256 signMask = _mm256_set1_ps(-0.0f);
+        size_t i = 0;
+        for (; i + 8 <= floatCount; i += 8) {
+            __m256 velocity = _mm256_loadu_ps(velocitiesIn + i);
+            __m256 position = _mm256_add_ps(_mm256_loadu_ps(positionsIn + i), _mm256_mul_ps(velocity, dt));
+            if (bounceAtBorder) {
+                __m256 outside = _mm256_or_ps(_mm256_cmp_ps(position, lower, _CMP_LE_OQ),
+                    _mm256_cmp_ps(position, upper, _CMP_GE_OQ));
+                velocity = _mm256_xor_ps(velocity, _mm256_and_ps(outside, signMask));
+            }
+            _mm256_storeu_ps(positionsOut + i, position);
+            _mm256_storeu_ps(velocitiesOut + i, velocity);
+        }
+        return i;
+    }
+#elif defined(OPS_PARTICLE_NEON)
+    static size_t integrateNeon(const float* positionsIn, const float* velocitiesIn, float* positionsOut,
+            float* velocitiesOut, size_t floatCount, float deltaTime, bool bounceAtBorder) {
+        const float32x4_t lower = vdupq_n_f32(-1.0f);
+        const float32x4_t upper = vdupq_n_f32(1.0f);
+        size_t i = 0;
+        for (; i + 4 <= floatCount; i += 4) {
+            float32x4_t velocity = vld1q_f32(velocitiesIn + i);
+            float32x4_t position = vaddq_f32(vld1q_f32(positionsIn + i), vmulq_n_f32(velocity, deltaTime));
+            if (bounceAtBorder) {
+                uint32x4_t outside = vorrq_u32(vcleq_f32(position, lower), vcgeq_f32(position, upper));
+                velocity = vbslq_f32(outside, vnegq_f32(velocity), velocity);
+            }
+            vst1q_f32(positionsOut + i, position);
+            vst1q_f32(velocitiesOut + i, velocity);
+        }
+        return i;
+    }
+#endif
+};
+
+}
+
+#endif
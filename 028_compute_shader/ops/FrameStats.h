@@ -0,0 +1,64 @@
+#ifndef _FRAME_STATS_DEMO_H_
+#define _FRAME_STATS_DEMO_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+namespace ops {
+
+// 固定窗口的滑动统计, 只保留最近的 capacity 个样本
+class RollingStat {
+public:
+    explicit RollingStat(size_t capacity = 240) : mCapacity(capacity) {
+        mSamples.reserve(capacity);
+    }
+
+    void add(double value) {
+        if (mSamples.size() < mCapacity) {
+            mSamples.push_back(value);
+        } else {
+            mSamples[mNext] = value;
+        }
+        mNext = (mNext + 1) % mCapacity;
+    }
+
+    void reset() {
+        mSamples.clear();
+        mNext = 0;
+    }
+
+    size_t count() const { return mSamples.size(); }
+    bool full() const { return mSamples.size() == mCapacity; }
+
+    double mean() const {
+        if (mSamples.empty()) {
+            return 0.0;
+        }
+        double sum = 0.0;
+        for (double sample : mSamples) {
+            sum += sample;
+        }
+        return sum / mSamples.size();
+    }
+
+    // percentile 取值 [0, 1]
+    double percentile(double p) const {
+        if (mSamples.empty()) {
+            return 0.0;
+        }
+        std::vector<double> sorted = mSamples;
+        size_t index = static_cast<size_t>(p * (sorted.size() - 1));
+        std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+        return sorted[index];
+    }
+
+private:
+    size_t mCapacity;
+    size_t mNext = 0;
+    std::vector<double> mSamples;
+};
+
+}
+
+#endif
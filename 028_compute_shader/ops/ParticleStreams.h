@@ -0,0 +1,91 @@
+#ifndef _PARTICLE_STREAMS_DEMO_H_
+#define _PARTICLE_STREAMS_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include <array>
+#include <cstdint>
+
+namespace ops {
+
+// SoA 的粒子数据布局:
+//   每一个模拟用的 buffer 中依次存放 position 和 velocity 两个流, compute shader 只读写这两个流
+//   color 不会改变, 单独放在一个只给顶点着色器读的 buffer 里, 只上传一次
+// half precision 时 velocity 用 f16vec2 (需要 storageBuffer16BitAccess), color 用 R16G16B16A16_SFLOAT
+// position 每一步都要累加一个很小的位移, half 在 1.0 附近的精度只有 1e-3, 所以始终是 fp32
+struct ParticleStreams {
+    uint32_t mCount = 0;
+    bool mHalfPrecision = false;
+    VkDeviceSize mPositionOffset = 0;
+    VkDeviceSize mPositionSize = 0;
+    VkDeviceSize mVelocityOffset = 0;
+    VkDeviceSize mVelocitySize = 0;
+    // 一个模拟 buffer 的大小 (position + velocity)
+    VkDeviceSize mSimulationBufferSize = 0;
+    VkDeviceSize mColorBufferSize = 0;
+
+    static VkDeviceSize positionStride() { return 2 * sizeof(float); }
+
+    static VkDeviceSize velocityStride(bool halfPrecision) {
+        return halfPrecision ? 2 * sizeof(uint16_t) : 2 * sizeof(float);
+    }
+
+    static VkDeviceSize colorStride(bool halfPrecision) {
+        return halfPrecision ? 4 * sizeof(uint16_t) : 4 * sizeof(float);
+    }
+
+    static VkFormat colorFormat(bool halfPrecision) {
+        return halfPrecision ? VK_FORMAT_R16G16B16A16_SFLOAT : VK_FORMAT_R32G32B32A32_SFLOAT;
+    }
+
+    // velocity 流的起始位置要满足 minStorageBufferOffsetAlignment
+    static ParticleStreams create(uint32_t count, bool halfPrecision, VkDeviceSize offsetAlignment) {
+        ParticleStreams streams;
+        streams.mCount = count;
+        streams.mHalfPrecision = halfPrecision;
+        streams.mPositionOffset = 0;
+        streams.mPositionSize = positionStride() * count;
+        VkDeviceSize alignment = offsetAlignment == 0 ? 1 : offsetAlignment;
+        streams.mVelocityOffset = (streams.mPositionSize + alignment - 1) / alignment * alignment;
+        streams.mVelocitySize = velocityStride(halfPrecision) * count;
+        streams.mSimulationBufferSize = streams.mVelocityOffset + streams.mVelocitySize;
+        streams.mColorBufferSize = colorStride(halfPrecision) * count;
+        return streams;
+    }
+
+    // 每一步模拟读写的字节数: 读上一步的 position 和 velocity, 写这一步的 position 和 velocity
+    VkDeviceSize simulationBytesPerStep() const { return 2 * (mPositionSize + mVelocitySize); }
+
+    // 一次绘制读取的字节数: position 和 color
+    VkDeviceSize drawBytesPerFrame() const { return mPositionSize + mColorBufferSize; }
+
+    // binding 0 是当前模拟 buffer 中的 position 流, binding 1 是静态的 color buffer
+    static std::array<VkVertexInputBindingDescription, 2> getBindingDescriptions(bool halfPrecision) {
+        std::array<VkVertexInputBindingDescription, 2> bindingDescriptions{};
+        bindingDescriptions[0].binding = 0;
+        bindingDescriptions[0].stride = static_cast<uint32_t>(positionStride());
+        bindingDescriptions[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+        bindingDescriptions[1].binding = 1;
+        bindingDescriptions[1].stride = static_cast<uint32_t>(colorStride(halfPrecision));
+        bindingDescriptions[1].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        return bindingDescriptions;
+    }
+
+    static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions(bool halfPrecision) {
+        std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions{};
+        attributeDescriptions[0].binding = 0;
+        attributeDescriptions[0].location = 0;
+        attributeDescriptions[0].format = VK_FORMAT_R32G32_SFLOAT;
+        attributeDescriptions[0].offset = 0;
+
+        attributeDescriptions[1].binding = 1;
+        attributeDescriptions[1].location = 1;
+        attributeDescriptions[1].format = colorFormat(halfPrecision);
+        attributeDescriptions[1].offset = 0;
+        return attributeDescriptions;
+    }
+};
+
+}
+
+#endif
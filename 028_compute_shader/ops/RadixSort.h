@@ -0,0 +1,184 @@
+#ifndef _RADIX_SORT_DEMO_H_
+#define _RADIX_SORT_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include <spdlog/spdlog.h>
+#include "ComputeKernels.h"
+#include "ComputePrimitives.h"
+#include "Specialization.h"
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ops {
+
+// gpu 上的 LSD radix sort, 每一趟处理 8 位 digit, 32 位 key 4 趟, 64 位 key 8 趟, 每个 key 带一个 32 位的 payload
+// 每一趟分三步: radix_count 统计每个 block 的直方图, ComputePrimitives 对直方图原地做 exclusive scan, radix_scatter 稳定地写出
+// 趟数总是偶数, keys 和 temp keys 之间来回写, 排序完成之后结果回到 keys / payloads 中
+// 设备支持 subgroup ballot 的时候 scatter 使用 subgroup 版本的 shader, 否则使用共享内存的版本
+class RadixSort {
+public:
+    static constexpr uint32_t WORKGROUP_SIZE = 256;
+    static constexpr uint32_t ROUNDS_PER_BLOCK = 16;
+    static constexpr uint32_t BLOCK_SIZE = WORKGROUP_SIZE * ROUNDS_PER_BLOCK;
+    static constexpr uint32_t RADIX_BITS = 8;
+    static constexpr uint32_t RADIX_SIZE = 1 << RADIX_BITS;
+
+    enum class KeyType {
+        Uint32,
+        Uint64,     // 每个 key 两个 uint32, 低 32 位在前
+    };
+
+    // 排序需要的 buffer, 都需要 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, 大小至少为 count 个元素
+    struct Buffers {
+        VkBuffer mKeys = VK_NULL_HANDLE;
+        VkBuffer mPayloads = VK_NULL_HANDLE;
+        VkBuffer mTempKeys = VK_NULL_HANDLE;
+        VkBuffer mTempPayloads = VK_NULL_HANDLE;
+        VkBuffer mHistogram = VK_NULL_HANDLE;     // 至少 histogramSize(count) 字节
+        VkBuffer mScanScratch = VK_NULL_HANDLE;   // 至少 scanScratchSize(count) 字节
+    };
+
+    // shaderDir 中需要有 compile.sh 编译出来的 radix_*.spv 和 scan_*.spv
+    void create(VkPhysicalDevice physicalDevice, VkDevice device, VkPipelineCache pipelineCache,
+            const std::string& shaderDir) {
+        selectSubgroupPath(physicalDevice);
+        // 两个 descriptor set: keys -> temp keys 和 temp keys -> keys
+        mKernels.create(physicalDevice, device, "radix sort", WORKGROUP_SIZE, 5, sizeof(PushConstants), 2);
+        mScan.create(physicalDevice, device, pipelineCache, shaderDir);
+
+        const char* scatterShader = mUseSubgroups ? "radix_scatter_subgroup.spv" : "radix_scatter.spv";
+        VkShaderModule countModule = mKernels.createShaderModule(shaderDir + "/radix_count.spv");
+        VkShaderModule scatterModule = mKernels.createShaderModule(shaderDir + "/" + scatterShader);
+        for (uint32_t keyWords = 1; keyWords <= 2; ++keyWords) {
+            mCountPipelines[keyWords - 1] = createPipeline(pipelineCache, countModule, keyWords);
+            mScatterPipelines[keyWords - 1] = createPipeline(pipelineCache, scatterModule, keyWords);
+        }
+        vkDestroyShaderModule(device, countModule, nullptr);
+        vkDestroyShaderModule(device, scatterModule, nullptr);
+
+        spdlog::info("{} radix sort uses the {} path", __func__,
+            mUseSubgroups ? "subgroup" : "shared memory");
+    }
+
+    void destroy() {
+        mScan.destroy();
+        mKernels.destroy();
+    }
+
+    bool usesSubgroups() const { return mUseSubgroups; }
+
+    static uint32_t blockCount(uint32_t count) {
+        return (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    static VkDeviceSize histogramSize(uint32_t count) {
+        return static_cast<VkDeviceSize>(RADIX_SIZE) * blockCount(count) * sizeof(uint32_t);
+    }
+
+    static VkDeviceSize scanScratchSize(uint32_t count) {
+        return ComputePrimitives::scratchSize(RADIX_SIZE * blockCount(count));
+    }
+
+    static VkDeviceSize keySize(KeyType keyType) {
+        return keyType == KeyType::Uint64 ? 2 * sizeof(uint32_t) : sizeof(uint32_t);
+    }
+
+    // 把 float 映射成按 uint32 比较时顺序不变的 key: 正数翻转符号位, 负数翻转所有位
+    // 用来按深度排序, 降序排序时再取反
+    static uint32_t floatKey(float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+    }
+
+    // 更新 descriptor set, 调用时之前录制的排序命令不能还在执行
+    void bindBuffers(const Buffers& buffers) {
+        mKernels.bindBuffers(0,
+            {buffers.mKeys, buffers.mPayloads, buffers.mTempKeys, buffers.mTempPayloads, buffers.mHistogram});
+        mKernels.bindBuffers(1,
+            {buffers.mTempKeys, buffers.mTempPayloads, buffers.mKeys, buffers.mPayloads, buffers.mHistogram});
+        // 原地 scan: exclusive scan 中每个元素由同一个线程先读后写; flags 和 counter 只有 compact 会用到, 绑定直方图占位
+        ComputePrimitives::Buffers scanBuffers;
+        scanBuffers.mInput = buffers.mHistogram;
+        scanBuffers.mFlags = buffers.mHistogram;
+        scanBuffers.mOutput = buffers.mHistogram;
+        scanBuffers.mScratch = buffers.mScanScratch;
+        scanBuffers.mCounter = buffers.mHistogram;
+        mScan.bindBuffers(scanBuffers);
+    }
+
+    // 录制排序命令, 调用者负责在前后加上和自己的读写之间的 barrier
+    void record(VkCommandBuffer commandBuffer, uint32_t count, KeyType keyType) {
+        if (count == 0) {
+            return;
+        }
+        uint32_t keyWords = keyType == KeyType::Uint64 ? 2 : 1;
+        uint32_t passCount = keyWords * 32 / RADIX_BITS;
+        PushConstants constants{count, 0, blockCount(count)};
+
+        for (uint32_t pass = 0; pass < passCount; ++pass) {
+            constants.mShift = pass * RADIX_BITS;
+            mKernels.bind(commandBuffer, pass % 2, constants);
+            mKernels.dispatch(commandBuffer, mCountPipelines[keyWords - 1], constants.mBlockCount);
+
+            mScan.record(commandBuffer, RADIX_SIZE * constants.mBlockCount, ComputePrimitives::Operation::ExclusiveScan);
+
+            // scan 使用自己的 pipeline layout, 之后要重新绑定 descriptor set 和 push constant
+            mKernels.bind(commandBuffer, pass % 2, constants);
+            mKernels.dispatch(commandBuffer, mScatterPipelines[keyWords - 1], constants.mBlockCount);
+        }
+    }
+
+private:
+    struct PushConstants {
+        uint32_t mCount;
+        uint32_t mShift;
+        uint32_t mBlockCount;
+    };
+
+    ComputeKernels mKernels;
+    ComputePrimitives mScan;
+    std::array<VkPipeline, 2> mCountPipelines{};
+    std::array<VkPipeline, 2> mScatterPipelines{};
+    bool mUseSubgroups = false;
+    uint32_t mSubgroupCount = 1;
+
+    // subgroup 版本的 scatter 需要 compute stage 支持 ballot (scan 由 ComputePrimitives 自己选择),
+    // 并且 scatter 中每个 subgroup 一份的 256 个计数要放得进共享内存 (subgroup 很小的时候放不下)
+    void selectSubgroupPath(VkPhysicalDevice physicalDevice) {
+        VkPhysicalDeviceSubgroupProperties subgroupProperties = ComputeKernels::subgroupProperties(physicalDevice);
+        uint32_t subgroupSize = subgroupProperties.subgroupSize;
+        mUseSubgroups = (subgroupProperties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+            (subgroupProperties.supportedOperations & VK_SUBGROUP_FEATURE_BALLOT_BIT) &&
+            subgroupSize > 0 && subgroupSize <= 128 && WORKGROUP_SIZE % subgroupSize == 0;
+        if (!mUseSubgroups) {
+            return;
+        }
+        mSubgroupCount = WORKGROUP_SIZE / subgroupSize;
+        VkDeviceSize sharedSize = (mSubgroupCount + 2) * RADIX_SIZE * sizeof(uint32_t);
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        if (sharedSize > properties.limits.maxComputeSharedMemorySize) {
+            spdlog::info("{} subgroup size {} needs {} bytes of shared memory, use the portable path",
+                __func__, subgroupSize, sharedSize);
+            mUseSubgroups = false;
+        }
+    }
+
+    // 对应 radix_*.comp 中的 constant_id = 0, 1, 2, shader 中没有用到的常量会被忽略
+    VkPipeline createPipeline(VkPipelineCache pipelineCache, VkShaderModule module, uint32_t keyWords) {
+        SpecializationConstants constants;
+        constants.set<uint32_t>(0, keyWords);
+        constants.set<uint32_t>(1, ROUNDS_PER_BLOCK);
+        constants.set<uint32_t>(2, mSubgroupCount);
+        return mKernels.createPipeline(pipelineCache, module, constants);
+    }
+};
+
+}
+
+#endif
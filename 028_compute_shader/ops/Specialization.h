@@ -0,0 +1,67 @@
+#ifndef _SPECIALIZATION_DEMO_H_
+#define _SPECIALIZATION_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include <spdlog/spdlog.h>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace ops {
+
+// 收集 shader 中 layout(constant_id = N) 的取值, 生成 VkSpecializationInfo
+// 同一份 SPIR-V 在创建 pipeline 的时候才确定这些常量, 不需要重新编译 shader
+// 注意 glsl 中的 bool 对应的是 4 字节的 VkBool32
+class SpecializationConstants {
+public:
+    template <typename T>
+    SpecializationConstants& set(uint32_t constantID, const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "specialization constant must be trivially copyable");
+        static_assert(sizeof(T) == 4 || sizeof(T) == 8, "specialization constant must be 32 or 64 bits");
+
+        // 同一个 constantID 只能有一个 map entry (VUID-VkSpecializationInfo-constantID-04911)
+        for (auto& entry : mEntries) {
+            if (entry.constantID != constantID) {
+                continue;
+            }
+            if (entry.size != sizeof(T)) {
+                spdlog::error("{} constant {} was set with {} bytes, can not change to {} bytes", __func__,
+                    constantID, entry.size, sizeof(T));
+                throw std::runtime_error("specialization constant size mismatch");
+            }
+            memcpy(mData.data() + entry.offset, &value, sizeof(T));
+            return *this;
+        }
+
+        VkSpecializationMapEntry entry{};
+        entry.constantID = constantID;
+        entry.offset = static_cast<uint32_t>(mData.size());
+        entry.size = sizeof(T);
+        mEntries.push_back(entry);
+        mData.resize(mData.size() + sizeof(T));
+        memcpy(mData.data() + entry.offset, &value, sizeof(T));
+        return *this;
+    }
+
+    // 返回的指针在本对象被修改或者析构之前有效, 需要在 vkCreate*Pipelines 调用之前保持存活
+    const VkSpecializationInfo* info() {
+        if (mEntries.empty()) {
+            return nullptr;
+        }
+        mInfo.mapEntryCount = static_cast<uint32_t>(mEntries.size());
+        mInfo.pMapEntries = mEntries.data();
+        mInfo.dataSize = mData.size();
+        mInfo.pData = mData.data();
+        return &mInfo;
+    }
+
+private:
+    std::vector<VkSpecializationMapEntry> mEntries;
+    std::vector<uint8_t> mData;
+    VkSpecializationInfo mInfo{};
+};
+
+}
+
+#endif
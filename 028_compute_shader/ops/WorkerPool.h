@@ -0,0 +1,134 @@
+#ifndef _WORKER_POOL_DEMO_H_
+#define _WORKER_POOL_DEMO_H_
+
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ops {
+
+// 常驻的工作线程, 每次 parallelFor 不需要创建线程
+// 任务被切成 grain 大小的小块, 调用线程和所有工作线程通过一个原子计数器抢着领取, 快的线程自然多做一些,
+// 不需要事先按线程数量平均切分, 某个核心被别的进程占用的时候也不会拖慢整体
+class WorkerPool {
+public:
+    using Task = std::function<void(size_t begin, size_t end)>;
+
+    // 初始化失败的时候 cleanup 不会执行, 析构时还没有 join 的线程会让 std::thread 调用 std::terminate
+    ~WorkerPool() {
+        destroy();
+    }
+
+    // threadCount 包括调用 parallelFor 的线程, 0 表示使用所有的核心
+    void create(uint32_t threadCount) {
+        if (threadCount == 0) {
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+        mStop = false;
+        for (uint32_t i = 1; i < threadCount; ++i) {
+            mWorkers.emplace_back([this]() { workerLoop(); });
+        }
+        spdlog::info("{} {} threads", __func__, threadCount);
+    }
+
+    // 可以重复调用
+    void destroy() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mStartCondition.notify_all();
+        for (std::thread& worker : mWorkers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+        mWorkers.clear();
+    }
+
+    uint32_t threadCount() const { return static_cast<uint32_t>(mWorkers.size()) + 1; }
+
+    // 对 [0, count) 执行 task, 返回的时候所有的块都已经处理完
+    // 只能从同一个线程调用, task 需要是线程安全的
+    void parallelFor(size_t count, size_t grain, const Task& task) {
+        grain = std::max<size_t>(grain, 1);
+        if (mWorkers.empty() || count <= grain) {
+            task(0, count);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTask = &task;
+            mCount = count;
+            mGrain = grain;
+            mNext.store(0, std::memory_order_relaxed);
+            mPending = mWorkers.size();
+            ++mGeneration;
+        }
+        mStartCondition.notify_all();
+
+        runChunks();
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mDoneCondition.wait(lock, [this]() { return mPending == 0; });
+        mTask = nullptr;
+    }
+
+private:
+    std::vector<std::thread> mWorkers;
+    std::mutex mMutex;
+    std::condition_variable mStartCondition;
+    std::condition_variable mDoneCondition;
+    bool mStop = false;
+    // 每一次 parallelFor 加一, 工作线程通过它判断是否有新的任务
+    uint64_t mGeneration = 0;
+    size_t mPending = 0;
+
+    const Task* mTask = nullptr;
+    size_t mCount = 0;
+    size_t mGrain = 1;
+    std::atomic<size_t> mNext{0};
+
+    void runChunks() {
+        for (;;) {
+            size_t begin = mNext.fetch_add(mGrain, std::memory_order_relaxed);
+            if (begin >= mCount) {
+                return;
+            }
+            (*mTask)(begin, std::min(begin + mGrain, mCount));
+        }
+    }
+
+    void workerLoop() {
+        uint64_t generation = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mStartCondition.wait(lock, [&]() { return mStop || mGeneration != generation; });
+                if (mStop) {
+                    return;
+                }
+                generation = mGeneration;
+            }
+
+            runChunks();
+
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (--mPending == 0) {
+                mDoneCondition.notify_one();
+            }
+        }
+    }
+};
+
+}
+
+#endif
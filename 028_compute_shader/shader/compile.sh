@@ -1,4 +1,30 @@
-!/bin/bash
+#!/bin/bash
 
-glslc 018_shader_base.vert -o vert.spv
-glslc 018_shader_base.frag -o frag.spv
+glslc shader_compute.vert -o vert.spv
+glslc shader_compute.frag -o frag.spv
+glslc shader_compute.comp -o comp.spv
+glslc -DHALF_PRECISION shader_compute.comp -o comp_f16.spv
+glslc radix_count.comp -o radix_count.spv
+glslc radix_scatter.comp -o radix_scatter.spv
+glslc --target-env=vulkan1.1 -DUSE_SUBGROUPS radix_scatter.comp -o radix_scatter_subgroup.spv
+
+# 粒子相互作用: 空间哈希 + boids, O(n^2) 的 N-body
+for kernel in grid_count grid_scatter boids nbody; do
+    glslc $kernel.comp -o $kernel.spv
+    glslc -DHALF_PRECISION $kernel.comp -o ${kernel}_f16.spv
+done
+glslc grid_scan.comp -o grid_scan.spv
+
+# 发射器: alive / dead list, indirect dispatch 和 draw
+for kernel in emitter_simulate emitter_emit; do
+    glslc $kernel.comp -o $kernel.spv
+    glslc -DHALF_PRECISION $kernel.comp -o ${kernel}_f16.spv
+done
+glslc emitter_args.comp -o emitter_args.spv
+glslc -DEMIT_ARGS emitter_args.comp -o emitter_emit_args.spv
+
+# ops::ComputePrimitives: scan, reduce, compaction
+for kernel in scan_reduce scan_blocks; do
+    glslc $kernel.comp -o $kernel.spv
+    glslc --target-env=vulkan1.1 -DUSE_SUBGROUPS $kernel.comp -o ${kernel}_subgroup.spv
+done
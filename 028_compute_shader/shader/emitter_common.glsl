@@ -0,0 +1,52 @@
+// 发射器的声明, 粒子 buffer 中的每一个位置 (slot) 要么活着, 要么在 dead list 中:
+//   alive list 和粒子 buffer 一起轮换, 第 k 步从 alive list (k - 1) 读取活着的 slot, 把这一步还活着的追加到 alive list k
+//   dead list 是一个栈, 死掉的 slot 压栈, 发射的时候从栈顶取
+// 所有的计数都在 gpu 上用原子操作维护, dispatch 和 draw 的数量通过 indirect 参数传递, cpu 从不回读
+// 依赖 particle_common.glsl 中的 PARTICLE_COUNT, 需要在它之后包含 (emitter_args.comp 自己声明)
+
+// 和 VkDrawIndexedIndirectCommand 的布局相同, graphics 直接把它当作 indirect 参数, 后面的 slot 当作 index buffer
+struct AliveHeader {
+    uint indexCount;
+    uint instanceCount;
+    uint firstIndex;
+    int vertexOffset;
+    uint firstInstance;
+    uint padding0;
+    uint padding1;
+    uint padding2;
+};
+
+layout(std430, binding = 10) buffer AliveListIn {
+    AliveHeader aliveInHeader;
+    uint aliveIn[ ];
+};
+
+layout(std430, binding = 11) buffer AliveListOut {
+    AliveHeader aliveOutHeader;
+    uint aliveOut[ ];
+};
+
+// simulateDispatch 和 emitDispatch 是两个 VkDispatchIndirectCommand
+layout(std430, binding = 12) buffer DeadList {
+    uint deadCount;
+    uint emitCount;
+    uint emitBase;
+    uint simulateDispatchX;
+    uint simulateDispatchY;
+    uint simulateDispatchZ;
+    uint emitDispatchX;
+    uint emitDispatchY;
+    uint emitDispatchZ;
+    uint padding0;
+    uint padding1;
+    uint padding2;
+    uint deadList[ ];
+};
+
+// 每个 slot 剩余的寿命, 和 ubo.deltaTime 的单位相同
+layout(std430, binding = 13) buffer ParticleLife {
+    float particleLife[ ];
+};
+
+// 每一步最多发射的粒子数量, 平均寿命大约是 120 步, 稳定之后大约一半的 slot 是活的
+const uint EMIT_PER_STEP = PARTICLE_COUNT / 240 + 1;
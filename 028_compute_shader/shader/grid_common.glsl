@@ -0,0 +1,39 @@
+// 均匀网格空间哈希的声明, 网格覆盖 [-1, 1] x [-1, 1], 每一步用 counting sort 重新建立:
+//   grid_count   每个粒子算出自己的格子, 用 atomicAdd 得到格子中的计数和自己在格子中的序号
+//   grid_scan    对格子的计数做 exclusive scan, 得到每个格子在排序后数组中的起始位置
+//   grid_scatter 按 起始位置 + 序号 把粒子复制到按格子排好序的数组中
+// 之后邻居查询只需要遍历周围 3x3 个格子中连续存放的粒子
+
+// 每个方向上的格子数量, 格子边长 2 / GRID_SIZE 就是相互作用的半径, GRID_SIZE * GRID_SIZE 必须是 256 的整数倍
+layout (constant_id = 3) const uint GRID_SIZE = 64;
+
+// grid_count 之后是每个格子的粒子数量, grid_scan 之后是每个格子的起始位置
+layout(std430, binding = 5) buffer GridCells {
+   uint gridCells[ ];
+};
+
+layout(std430, binding = 6) buffer ParticleCells {
+   uint particleCells[ ];
+};
+
+layout(std430, binding = 7) buffer ParticleRanks {
+   uint particleRanks[ ];
+};
+
+layout(std430, binding = 8) buffer SortedPositions {
+   vec2 sortedPositions[ ];
+};
+
+layout(std430, binding = 9) buffer SortedVelocities {
+   vec2 sortedVelocities[ ];
+};
+
+ivec2 gridCoord(vec2 position)
+{
+    return clamp(ivec2((position + 1.0) * 0.5 * float(GRID_SIZE)), ivec2(0), ivec2(GRID_SIZE - 1));
+}
+
+uint gridCellIndex(ivec2 coord)
+{
+    return uint(coord.y) * GRID_SIZE + uint(coord.x);
+}
@@ -0,0 +1,56 @@
+// 粒子模拟 kernel 共用的声明, 必须在 #version 之后第一个包含 (里面有 #extension)
+// 粒子按 SoA 存放, 每一步读上一步的 position / velocity, 写这一步的 position / velocity
+// 定义 HALF_PRECISION 编译出 *_f16.spv, velocity 用 16 位浮点存储, 计算仍然是 32 位
+#ifdef HALF_PRECISION
+#extension GL_EXT_shader_16bit_storage : require
+#define VELOCITY_TYPE f16vec2
+#else
+#define VELOCITY_TYPE vec2
+#endif
+
+layout (binding = 0) uniform ParameterUBO {
+    float deltaTime;
+    uint step;      // 第几步模拟, 用作发射器随机数的种子
+} ubo;
+
+layout(std430, binding = 1) readonly buffer PositionSSBOIn {
+   vec2 positionsIn[ ];
+};
+
+layout(std430, binding = 2) readonly buffer VelocitySSBOIn {
+   VELOCITY_TYPE velocitiesIn[ ];
+};
+
+layout(std430, binding = 3) writeonly buffer PositionSSBOOut {
+   vec2 positionsOut[ ];
+};
+
+layout(std430, binding = 4) writeonly buffer VelocitySSBOOut {
+   VELOCITY_TYPE velocitiesOut[ ];
+};
+
+// workgroup 大小, 粒子数量和功能开关都由 pipeline 创建时的 VkSpecializationInfo 决定
+layout (local_size_x_id = 0, local_size_y = 1, local_size_z = 1) in;
+layout (constant_id = 1) const uint PARTICLE_COUNT = 8192;
+layout (constant_id = 2) const bool BOUNCE_AT_BORDER = true;
+
+vec2 loadVelocity(uint index)
+{
+    return vec2(velocitiesIn[index]);
+}
+
+// 越过窗口边界的时候速度反向, 然后写到这一步的输出中
+void storeParticle(uint index, vec2 position, vec2 velocity)
+{
+    if (BOUNCE_AT_BORDER) {
+        if ((position.x <= -1.0) || (position.x >= 1.0)) {
+            velocity.x = -velocity.x;
+        }
+        if ((position.y <= -1.0) || (position.y >= 1.0)) {
+            velocity.y = -velocity.y;
+        }
+    }
+
+    positionsOut[index] = position;
+    velocitiesOut[index] = VELOCITY_TYPE(velocity);
+}
@@ -0,0 +1,79 @@
+// ops::ComputePrimitives 的 kernel 共用的声明, 必须在 #version 之后第一个包含 (里面有 #extension)
+// 每个 workgroup 256 个线程, 每个线程连续处理 4 个元素, 一个 block 是 1024 个元素
+// 任意长度的输入按 block 分层: 第 0 层是调用者的数据, 第 k + 1 层是第 k 层每个 block 的和, 存在 scratch 中
+// 定义 USE_SUBGROUPS 编译出 *_subgroup.spv, workgroup 内的 scan 用 subgroup 指令
+#ifdef USE_SUBGROUPS
+#extension GL_KHR_shader_subgroup_arithmetic : require
+#endif
+
+layout (local_size_x = 256, local_size_y = 1, local_size_z = 1) in;
+
+// 第 0 层的操作, 每种操作一个 pipeline; 第 0 层以上总是对 scratch 做 exclusive scan
+const uint OPERATION_EXCLUSIVE_SCAN = 0;
+const uint OPERATION_INCLUSIVE_SCAN = 1;
+const uint OPERATION_REDUCE = 2;
+const uint OPERATION_COMPACT = 3;
+layout (constant_id = 0) const uint OPERATION = OPERATION_EXCLUSIVE_SCAN;
+
+// flags
+const uint CARRY_IN = 1;        // scan: 每个 block 加上 scratch[blockOffset + block] (上一层 scan 的结果)
+const uint WRITE_OUTPUT = 2;    // reduce: 每个 block 的和写到 output[block], 而不是 scratch
+
+layout (push_constant) uniform PrimitiveParameters {
+    uint count;         // 这一层的元素数量
+    uint level;         // 0 表示读写调用者的 buffer
+    uint sourceOffset;  // level > 0 时这一层的元素在 scratch 中的起始位置
+    uint blockOffset;   // 这一层每个 block 的和在 scratch 中的起始位置
+    uint flags;
+} params;
+
+layout (std430, binding = 0) readonly buffer InputData {
+    uint inputData[ ];
+};
+
+// compact 的条件, 非 0 的元素被保留
+layout (std430, binding = 1) readonly buffer FlagData {
+    uint flagData[ ];
+};
+
+layout (std430, binding = 2) buffer OutputData {
+    uint outputData[ ];
+};
+
+layout (std430, binding = 3) buffer Scratch {
+    uint scratch[ ];
+};
+
+// compact 保留下来的元素数量
+layout (std430, binding = 4) buffer Counter {
+    uint compactCount;
+};
+
+#include "workgroup_scan.glsl"
+
+const uint ITEMS_PER_THREAD = 4;
+const uint BLOCK_SIZE = 256 * ITEMS_PER_THREAD;
+
+// 这一层第 index 个元素参与求和的值, compact 的第 0 层是 0 / 1
+uint loadElement(uint index)
+{
+    if (params.level > 0) {
+        return scratch[params.sourceOffset + index];
+    }
+    if (OPERATION == OPERATION_COMPACT) {
+        return flagData[index] != 0 ? 1 : 0;
+    }
+    return inputData[index];
+}
+
+// 当前线程负责的 4 个元素, 越界的是 0
+uvec4 loadThreadElements(uint base)
+{
+    uvec4 values = uvec4(0);
+    for (uint i = 0; i < ITEMS_PER_THREAD; ++i) {
+        if (base + i < params.count) {
+            values[i] = loadElement(base + i);
+        }
+    }
+    return values;
+}
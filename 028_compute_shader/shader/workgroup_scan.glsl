@@ -0,0 +1,75 @@
+// 256 个线程的 workgroup 内的 exclusive scan, grid_scan 和 scan_common.glsl 共用
+// 定义 USE_SUBGROUPS 的时候用 subgroup 指令 (包含本文件的 shader 需要启用 GL_KHR_shader_subgroup_arithmetic),
+// 否则在共享内存中做 Hillis-Steele scan
+
+shared uint sScratch[257];
+
+// total 返回所有线程的和, 所有线程都必须调用
+uint workgroupExclusiveScan(uint value, out uint total)
+{
+    uint tid = gl_LocalInvocationID.x;
+#ifdef USE_SUBGROUPS
+    uint subgroupPrefix = subgroupExclusiveAdd(value);
+    // workgroup 大小是 subgroup 大小的整数倍, 每个 subgroup 都是满的
+    if (gl_SubgroupInvocationID == gl_SubgroupSize - 1) {
+        sScratch[gl_SubgroupID] = subgroupPrefix + value;
+    }
+    barrier();
+    if (tid == 0) {
+        uint sum = 0;
+        for (uint i = 0; i < gl_NumSubgroups; ++i) {
+            uint subgroupTotal = sScratch[i];
+            sScratch[i] = sum;
+            sum += subgroupTotal;
+        }
+        sScratch[256] = sum;
+    }
+    barrier();
+    uint result = sScratch[gl_SubgroupID] + subgroupPrefix;
+    total = sScratch[256];
+    barrier();
+    return result;
+#else
+    sScratch[tid] = value;
+    barrier();
+    for (uint offset = 1; offset < 256; offset <<= 1) {
+        uint addend = tid >= offset ? sScratch[tid - offset] : 0;
+        barrier();
+        sScratch[tid] += addend;
+        barrier();
+    }
+    uint inclusive = sScratch[tid];
+    total = sScratch[255];
+    barrier();
+    return inclusive - value;
+#endif
+}
+
+#ifdef SCAN_BUFFER
+// 单个 workgroup 对 SCAN_BUFFER[0, size) 做 exclusive scan, 每次处理 256 * 4 个元素,
+// 前面所有段的总和通过 carry 带到下一段. SCAN_BUFFER 是包含本文件之前声明的 buffer 数组
+void workgroupScanBuffer(uint size)
+{
+    uint tid = gl_LocalInvocationID.x;
+    uint carry = 0;
+    for (uint base = 0; base < size; base += 256 * 4) {
+        uint index = base + tid * 4;
+        uvec4 values = uvec4(0);
+        for (uint i = 0; i < 4; ++i) {
+            if (index + i < size) {
+                values[i] = SCAN_BUFFER[index + i];
+            }
+        }
+
+        uint chunkTotal;
+        uint prefix = carry + workgroupExclusiveScan(values.x + values.y + values.z + values.w, chunkTotal);
+        for (uint i = 0; i < 4; ++i) {
+            if (index + i < size) {
+                SCAN_BUFFER[index + i] = prefix;
+            }
+            prefix += values[i];
+        }
+        carry += chunkTotal;
+    }
+}
+#endif
@@ -23,10 +23,65 @@ if is_mode("debug") then
     add_ldflags("-g")
 end
 
+-- 用 glslc 编译 target 的 values("glsl.shaders") 中列出的 shader, 每一项是 "源文件:输出[:glslc 参数]",
+-- 源文件和输出都在 shader 目录下, 列表和 shader/compile.sh 保持一致.
+-- 源文件, shader 目录中的 .glsl 或者参数有变化, 以及 .spv 不存在的时候才重新编译,
+-- 保证 main.cpp 读取的 .spv 和当前的 descriptor layout / specialization constant 一致
+rule("glsl.shaders")
+    before_build(function (target)
+        import("lib.detect.find_tool")
+        import("core.project.depend")
+        local glslc = find_tool("glslc")
+        if not glslc then
+            raise("glslc not found, install shaderc or the vulkan sdk to compile the shaders")
+        end
+        local shaderdir = path.join(target:scriptdir(), "shader")
+        local includes = os.files(path.join(shaderdir, "*.glsl"))
+        for _, shader in ipairs(table.wrap(target:values("glsl.shaders"))) do
+            local parts = shader:split(":", {plain = true})
+            local source = path.join(shaderdir, parts[1])
+            local output = path.join(shaderdir, parts[2])
+            local args = table.join(parts[3] and parts[3]:split(" ", {plain = true}) or {}, {source, "-o", output})
+            depend.on_changed(function ()
+                cprint("${color.build.object}compiling.glsl %s", parts[2])
+                os.vrunv(glslc.program, args)
+            end, {dependfile = target:dependfile(output), files = table.join(source, includes),
+                values = args, changed = not os.isfile(output)})
+        end
+    end)
+rule_end()
+
 target("multisampling")
     set_kind("binary")
     add_files("main.cpp")
     add_includedirs("./thrity_part")
+    add_includedirs("./ops")
+    add_rules("glsl.shaders")
+    add_values("glsl.shaders", "shader_compute.vert:vert.spv", "shader_compute.frag:frag.spv", "shader_compute.comp:comp.spv")
+    -- velocity 使用 16 位浮点存储的变体
+    add_values("glsl.shaders", "shader_compute.comp:comp_f16.spv:-DHALF_PRECISION")
+    -- ops::RadixSort
+    add_values("glsl.shaders", "radix_count.comp:radix_count.spv",
+        "radix_scatter.comp:radix_scatter.spv",
+        "radix_scatter.comp:radix_scatter_subgroup.spv:--target-env=vulkan1.1 -DUSE_SUBGROUPS")
+    -- 粒子相互作用: 空间哈希 + boids, O(n^2) 的 N-body
+    add_values("glsl.shaders", "grid_count.comp:grid_count.spv", "grid_count.comp:grid_count_f16.spv:-DHALF_PRECISION",
+        "grid_scatter.comp:grid_scatter.spv", "grid_scatter.comp:grid_scatter_f16.spv:-DHALF_PRECISION",
+        "boids.comp:boids.spv", "boids.comp:boids_f16.spv:-DHALF_PRECISION",
+        "nbody.comp:nbody.spv", "nbody.comp:nbody_f16.spv:-DHALF_PRECISION",
+        "grid_scan.comp:grid_scan.spv")
+    -- 发射器: alive / dead list, indirect dispatch 和 draw
+    add_values("glsl.shaders", "emitter_simulate.comp:emitter_simulate.spv",
+        "emitter_simulate.comp:emitter_simulate_f16.spv:-DHALF_PRECISION",
+        "emitter_emit.comp:emitter_emit.spv", "emitter_emit.comp:emitter_emit_f16.spv:-DHALF_PRECISION",
+        "emitter_args.comp:emitter_args.spv", "emitter_args.comp:emitter_emit_args.spv:-DEMIT_ARGS")
+    -- ops::ComputePrimitives: scan, reduce, compaction
+    add_values("glsl.shaders", "scan_reduce.comp:scan_reduce.spv",
+        "scan_reduce.comp:scan_reduce_subgroup.spv:--target-env=vulkan1.1 -DUSE_SUBGROUPS",
+        "scan_blocks.comp:scan_blocks.spv",
+        "scan_blocks.comp:scan_blocks_subgroup.spv:--target-env=vulkan1.1 -DUSE_SUBGROUPS")
+    -- cpu 的粒子积分要和 gpu 逐位一致, 不允许编译器把乘加合并成 fma
+    add_cxflags("-ffp-contract=off")
     add_packages("spdlog::spdlog")
     add_packages("SDL2")
 
@@ -30,8 +30,14 @@
 #include <optional>
 #include <chrono>
 #include <unordered_map>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <exception>
 // using std::hash function
 #include <functional>
+#include <algorithm>
+#include <limits>
 
 // for log print
 #include <spdlog/spdlog.h>
@@ -49,6 +55,21 @@
 
 #include "Verterx.h"
 #include "Shape.h"
+#include "PipelineCache.h"
+#include "FrameTimeline.h"
+#include "VkHandles.h"
+#include "PipelineVariants.h"
+#include "Specialization.h"
+#include "Options.h"
+#include "FrameStats.h"
+#include "PresentPolicy.h"
+#include "TripleBuffer.h"
+#include "SpscQueue.h"
+#include "ClusteredLights.h"
+#include "ShadowCascades.h"
+#include "MaterialPacker.h"
+#include "RenderGraph.h"
+#include "BarrierBatcher.h"
 
 // 对于需要在 std::unordered_map 中使用的类，还需要提供一个 std::hash 的类特化函数用于在 std::unordered_map 中计算 hash 值
 namespace std {
@@ -79,8 +100,62 @@ const uint32_t HEIGHT = 900;
 // https://skfb.ly/VAKF
 const std::string MODEL_PATH = "./models/house.obj";
 const std::string MTL_PATH   = "./models/house.mtl";
+// mtl 中的贴图路径是导出时的绝对路径, 找不到的时候按文件名在这个目录中查找
+const std::string TEXTURE_DIR = "./textures/";
+
+// pipeline cache 保存的位置, 第二次启动的时候驱动可以跳过 shader 的编译
+const std::string PIPELINE_CACHE_PATH = "./pipeline_cache.bin";
+
+// fragment shader 功能开关对应的位, 见 PipelineVariantKey::mFeatureFlags
+const uint32_t FEATURE_TEXTURE = 1u << 0;
+const uint32_t FEATURE_LIGHTING = 1u << 1;
+// G-buffer 变体: 使用 gbuffer.frag, 输出到 deferred render pass 的 subpass 0
+const uint32_t FEATURE_DEFERRED = 1u << 2;
+
+// G-buffer 的格式, 和 shader/gbuffer_common.glsl 保持一致: albedo, 八面体编码的法线, roughness / metal
+// 都是必须支持作为 color attachment 的格式, 每个像素 10 字节
+constexpr std::array<VkFormat, 3> GBUFFER_FORMATS = {
+    VK_FORMAT_R8G8B8A8_UNORM,
+    VK_FORMAT_R16G16_SFLOAT,
+    VK_FORMAT_R8G8_UNORM
+};
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+// 投影矩阵的视角, 近平面和远平面, cluster 的深度切片和 shadow cascade 也按照这个范围划分
+const float CAMERA_FOV_Y_DEGREES = 45.0f;
+const float CAMERA_NEAR = 0.1f;
+const float CAMERA_FAR = 100.0f;
+// 方向光 (太阳) 的 cascaded shadow map: 每一层的分辨率, 计算阴影的最远距离
+const uint32_t SHADOW_MAP_SIZE = 2048;
+const float SHADOW_DISTANCE = 30.0f;
+const glm::vec3 SUN_DIRECTION = glm::vec3(-0.4f, -1.0f, -0.3f);
+const glm::vec4 SUN_COLOR_INTENSITY = glm::vec4(1.0f, 0.95f, 0.85f, 1.5f);
+// 每按一次 J 键太阳绕 y 轴旋转的角度, 所有 cascade 都会失效
+const float SUN_ROTATE_DEGREES = 15.0f;
+// shadow benchmark 在开启和关闭缓存时各统计这么多帧
+const uint32_t SHADOW_BENCHMARK_FRAMES = 300;
+// 每一帧的 timestamp: 整帧的开始和结束, shadow pass 的开始和结束
+const uint32_t TIMESTAMPS_PER_FRAME = 4;
+// 光源 buffer 按这个数量分配, 运行时的光源数量不超过它
+const uint32_t MAX_LIGHTS = 16384;
+// light_cull.comp 的 local_size_x, 每个线程负责一个 cluster
+const uint32_t LIGHT_CULL_WORKGROUP_SIZE = 128;
+// 光源 benchmark 依次测试的数量, 每一种先跑几帧预热, 然后统计
+const std::array<uint32_t, 5> LIGHT_BENCHMARK_COUNTS = {1, 10, 100, 1000, 10000};
+const uint32_t LIGHT_BENCHMARK_WARMUP_FRAMES = 60;
+const uint32_t LIGHT_BENCHMARK_FRAMES = 240;
+
+// 每一帧的资源按照这个上限创建, 实际使用的帧数 mFramesInFlight 在启动时配置或者根据测量结果选择
+const int MAX_FRAMES_IN_FLIGHT = 3;
+// 自动选择 frames in flight 之前需要测量的帧数
+const uint32_t FRAME_STATS_WARMUP_FRAMES = 240;
+// 每隔多少帧打印一次帧时间和延迟的统计
+const uint32_t FRAME_STATS_LOG_INTERVAL = 600;
+// 输入和相机的模拟在单独的线程中以固定的步长更新, 和渲染的帧率无关
+const double UPDATE_RATE_HZ = 120.0;
+const std::chrono::nanoseconds UPDATE_TICK = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::duration<double>(1.0 / UPDATE_RATE_HZ));
+// 最近一次移动或者缩放窗口之后多长时间之内的帧算作窗口交互期间的帧
+const std::chrono::milliseconds WINDOW_INTERACTION_WINDOW = std::chrono::milliseconds(250);
 
 const std::vector<const char *> validationLayers = {
     "VK_LAYER_KHRONOS_validation", // debug, logging and validate
@@ -98,6 +173,18 @@ const std::vector<const char*> deviceExtensions = {
 #endif /* BUG_FIXES */
 };
 
+// VK_KHR_dynamic_rendering 以及它依赖的扩展, 设备全部支持的时候就不再创建 VkRenderPass 和 VkFramebuffer
+const std::vector<const char*> dynamicRenderingExtensions = {
+    VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME,
+    VK_KHR_DEPTH_STENCIL_RESOLVE_EXTENSION_NAME,
+    VK_KHR_CREATE_RENDERPASS_2_EXTENSION_NAME,
+};
+
+// VK_KHR_synchronization2: 设备支持的时候 render graph 用 vkCmdPipelineBarrier2KHR 录制 barrier, 否则退回 vkCmdPipelineBarrier
+const std::vector<const char*> synchronization2Extensions = {
+    VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME,
+};
+
 const std::vector<const char*> instanceExtensions = {
 #ifdef BUG_FIXES
     VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
@@ -152,6 +239,35 @@ struct QueueFamilyIndices
 };
 
 
+// 控制相机的按键, 主线程采样之后交给 update 线程
+enum InputKey : uint32_t {
+    INPUT_FORWARD  = 1u << 0,
+    INPUT_LEFT     = 1u << 1,
+    INPUT_BACKWARD = 1u << 2,
+    INPUT_RIGHT    = 1u << 3,
+    INPUT_UP       = 1u << 4,
+    INPUT_DOWN     = 1u << 5,
+};
+
+// 主线程的 glfw 回调产生的事件, 通过 SpscQueue 交给渲染线程处理
+enum class WindowEventType : uint32_t {
+    Resize,
+    Key,
+};
+
+struct WindowEvent {
+    WindowEventType mType = WindowEventType::Resize;
+    int mKey = 0;
+};
+
+// update 线程每一个 tick 发布的场景状态, 同时保留上一个 tick 的值, 渲染的时候在两者之间插值
+struct SimulationState {
+    glm::vec3 mPrevCameraPos = glm::vec3(0.0f, 0.0f, 3.0f);
+    glm::vec3 mCameraPos = glm::vec3(0.0f, 0.0f, 3.0f);
+    uint64_t mTick = 0;
+    std::chrono::steady_clock::time_point mTickTime{};
+};
+
 struct SwapChainSupportDetails {
     VkSurfaceCapabilitiesKHR mCapabilities;
     std::vector<VkSurfaceFormatKHR> mFormats;
@@ -161,6 +277,20 @@ struct SwapChainSupportDetails {
 class HelloTriangleApplication
 {
 public:
+    void setOptions(const ops::Options& options) {
+        mOptions = options;
+        mPresentPolicy = mOptions.mPresentPolicy;
+        mDeferred = mOptions.mDeferred;
+        mShadowCacheEnabled = mOptions.mShadowCache;
+        if (mOptions.mFramesInFlight != 0) {
+            mFramesInFlight = std::clamp(mOptions.mFramesInFlight, 1u, static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT));
+            mFramesInFlightSelected = true;
+        }
+        spdlog::info("{} frames in flight {}, swapchain images {}", __func__,
+            mFramesInFlightSelected ? std::to_string(mFramesInFlight) : "auto",
+            mOptions.mSwapchainImages != 0 ? std::to_string(mOptions.mSwapchainImages) : "auto");
+    }
+
     void run()
     {
         initWindow();
@@ -188,20 +318,60 @@ private:
     VkExtent2D mSwapChainExtent;
 
     // image view
-    std::vector<VkImageView> mSwapChainImageViews;
+    // 依赖交换链的资源都用 ops 中的 RAII 句柄管理, 替换或者析构的时候交给 mFrameTimeline 延迟销毁
+    std::vector<ops::ImageView> mSwapChainImageViews;
 
     // render pass
-    VkRenderPass mRenderPass;
+    VkRenderPass mRenderPass = VK_NULL_HANDLE;
+    // 设备支持 VK_KHR_dynamic_rendering 的时候直接用 image view 开始渲染, 不再需要 render pass 和 framebuffer
+    bool mUseDynamicRendering = false;
+    PFN_vkCmdBeginRenderingKHR mCmdBeginRendering = nullptr;
+    PFN_vkCmdEndRenderingKHR mCmdEndRendering = nullptr;
+    bool mUseSynchronization2 = false;
+    PFN_vkCmdPipelineBarrier2KHR mCmdPipelineBarrier2 = nullptr;
+    // deferred shading: subpass 0 写 G-buffer, subpass 1 通过 input attachment 读取并计算光照
+    // G-buffer 和深度只在 render pass 内部使用, 用 TRANSIENT + LAZILY_ALLOCATED 创建, tile based gpu 上不会写回内存
+    bool mDeferred = false;
+    std::array<ops::Image, GBUFFER_FORMATS.size()> mGBufferImages;
+    std::array<ops::DeviceMemory, GBUFFER_FORMATS.size()> mGBufferImagesMemory;
+    std::array<ops::ImageView, GBUFFER_FORMATS.size()> mGBufferImageViews;
+    // input attachment 的 descriptor 随交换链一起重建, 旧的 pool 交给 mFrameTimeline 延迟销毁
+    ops::DescriptorPool mGBufferDescriptorPool;
+    VkDescriptorSet mGBufferDescriptorSet = VK_NULL_HANDLE;
+    VkDescriptorSetLayout mGBufferSetLayout = VK_NULL_HANDLE;
+    // set 0 和 mPipelineLayout 相同, set 1 是 G-buffer
+    VkPipelineLayout mDeferredPipelineLayout = VK_NULL_HANDLE;
+    VkShaderModule mGBufferFragShaderModule = VK_NULL_HANDLE;
+    VkShaderModule mDeferredVertShaderModule = VK_NULL_HANDLE;
+    VkShaderModule mDeferredFragShaderModule = VK_NULL_HANDLE;
+    // [0] 不计算光照, [1] 计算光照, 对应 L 键
+    std::array<VkPipeline, 2> mDeferredLightingPipelines{};
     // descriptor set layout
     VkDescriptorSetLayout mDescriptorSetLayout;
     // Pipeline layout
     VkPipelineLayout mPipelineLayout;
 
     // graphic pipeline
+    // 默认变体, 其他变体还在编译的时候用它来绘制
     VkPipeline mGraphicsPipeline;
+    VkShaderModule mVertShaderModule;
+    VkShaderModule mFragShaderModule;
+    // 按照状态 hash 管理所有的 pipeline 变体, 在工作线程上编译
+    ops::PipelineVariantManager mPipelineVariants;
+    // 运行时可以切换的 pipeline 状态, B 键切换混合, C 键切换背面剔除
+    VkBool32 mBlendEnable = VK_FALSE;
+    VkCullModeFlags mCullMode = VK_CULL_MODE_BACK_BIT;
+    // fragment shader 的功能开关, T 键切换是否采样纹理, L 键切换是否计算光照
+    uint32_t mFeatureFlags = FEATURE_TEXTURE | FEATURE_LIGHTING;
+    // 持久化到磁盘上的 pipeline cache
+    ops::PipelineCache mPipelineCache;
+
+    // 所有提交共用的 timeline semaphore, 以及每一个 frame 最后一次提交 signal 的值
+    ops::FrameTimeline mFrameTimeline;
+    std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> mFrameTimelineValues{};
 
     // Framebuffers
-    std::vector<VkFramebuffer> mSwapChainFramebuffers;
+    std::vector<ops::Framebuffer> mSwapChainFramebuffers;
 
     // command pools
     VkCommandPool mCommandPool;
@@ -214,11 +384,11 @@ private:
     std::vector<uint32_t> mIndices;
     // 需要根据形状去解析
     std::vector<ops::Shape_Mesh> mMeshes;
-    VkBuffer mVertexBuffer;
-    VkDeviceMemory mVertexBufferMemory;
+    ops::Buffer mVertexBuffer;
+    ops::DeviceMemory mVertexBufferMemory;
     // index buffer
-    VkBuffer mIndexBuffer;
-    VkDeviceMemory mIndexBufferMemory;
+    ops::Buffer mIndexBuffer;
+    ops::DeviceMemory mIndexBufferMemory;
 
     // uniform buffer UniformBufferObject
     // Todo: 这个需要改名字
@@ -232,42 +402,168 @@ private:
     std::vector<VkDeviceMemory> mUBOIndexBuffersMemory;
     std::vector<void*> mUBOIndexBuffersMapped;
 
+    // clustered forward lighting, 每一帧一份, 和 mDescriptorSets 一一对应
+    //   lighting uniform 和光源数组由 cpu 每帧写入
+    //   cluster buffer 由 light_cull.comp 写, fragment shader 读: [每个 cluster 的光源数量 | 光源下标]
+    //   stats buffer 是 host visible 的, 帧完成之后读取 light_cull.comp 的统计
+    std::vector<VkBuffer> mLightingUniformBuffers;
+    std::vector<VkDeviceMemory> mLightingUniformBuffersMemory;
+    std::vector<void*> mLightingUniformBuffersMapped;
+    std::vector<VkBuffer> mLightBuffers;
+    std::vector<VkDeviceMemory> mLightBuffersMemory;
+    std::vector<void*> mLightBuffersMapped;
+    std::vector<VkBuffer> mClusterBuffers;
+    std::vector<VkDeviceMemory> mClusterBuffersMemory;
+    std::vector<VkBuffer> mClusterStatsBuffers;
+    std::vector<VkDeviceMemory> mClusterStatsBuffersMemory;
+    std::vector<void*> mClusterStatsBuffersMapped;
+    // 和 graphics pipeline 共用 mPipelineLayout 和 descriptor set
+    VkPipeline mLightCullPipeline = VK_NULL_HANDLE;
+    VkShaderModule mLightCullShaderModule = VK_NULL_HANDLE;
+    // 场景在世界空间中的包围盒, 光源在其中运动
+    glm::vec3 mSceneBoundsMin = glm::vec3(-1.0f);
+    glm::vec3 mSceneBoundsMax = glm::vec3(1.0f);
+    ops::LightField mLightField;
+    std::chrono::steady_clock::time_point mLightStartTime = std::chrono::steady_clock::now();
+    // 每一帧录制时的光源数量, 读取统计的时候使用
+    std::array<uint32_t, MAX_FRAMES_IN_FLIGHT> mFrameLightCounts{};
+    ops::RollingStat mLightsPerCluster;
+    uint32_t mMaxLightsPerCluster = 0;
+    uint32_t mOverflowClusters = 0;
+    // 光源 benchmark 当前测试的下标, 超出 LIGHT_BENCHMARK_COUNTS 表示没有在测试
+    size_t mLightBenchmarkStage = LIGHT_BENCHMARK_COUNTS.size();
+    uint32_t mLightBenchmarkFrames = 0;
+    ops::RollingStat mLightBenchmarkGpuTime{LIGHT_BENCHMARK_FRAMES};
+
+    // cascaded shadow map, 所有帧共用一份, 只有矩阵变化的 cascade 才会重新渲染 (见 ops::ShadowCascades)
+    // render pass 的外部依赖保证重新渲染之前上一帧的采样已经结束
+    ops::ShadowCascades mShadowCascades;
+    bool mShadowCacheEnabled = true;
+    // 这一帧需要重新渲染的 cascade, 在 updateLighting 中计算, recordShadowPass 中使用
+    uint32_t mShadowRenderMask = 0;
+    glm::vec3 mSunDirection = SUN_DIRECTION;
+    VkFormat mShadowFormat = VK_FORMAT_UNDEFINED;
+    ops::Image mShadowImage;
+    ops::DeviceMemory mShadowImageMemory;
+    // 采样用的数组 view, 以及渲染每一层用的 view 和 framebuffer
+    ops::ImageView mShadowImageView;
+    std::array<ops::ImageView, ops::ShadowCascades::COUNT> mShadowLayerViews;
+    std::array<ops::Framebuffer, ops::ShadowCascades::COUNT> mShadowFramebuffers;
+    ops::Sampler mShadowSampler;
+    // 只有位置的顶点流, shadow pass 不需要读取 ops::Vertex 的其他属性
+    ops::Buffer mShadowPositionBuffer;
+    ops::DeviceMemory mShadowPositionBufferMemory;
+    VkRenderPass mShadowRenderPass = VK_NULL_HANDLE;
+    VkPipelineLayout mShadowPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline mShadowPipeline = VK_NULL_HANDLE;
+    VkShaderModule mShadowVertShaderModule = VK_NULL_HANDLE;
+    // shadow pass 的 gpu 耗时和每一帧渲染的 cascade 数量
+    std::array<uint32_t, MAX_FRAMES_IN_FLIGHT> mFrameShadowCascades{};
+    ops::RollingStat mShadowGpuTime;
+    ops::RollingStat mShadowCascadesRendered;
+    // shadow benchmark: 0 开启缓存, 1 关闭缓存, 2 没有在测试
+    uint32_t mShadowBenchmarkStage = 2;
+    uint32_t mShadowBenchmarkFrames = 0;
+    ops::RollingStat mShadowBenchmarkGpuTime{SHADOW_BENCHMARK_FRAMES};
+    ops::RollingStat mShadowBenchmarkCascades{SHADOW_BENCHMARK_FRAMES};
+
     // descriptor pool
     VkDescriptorPool mDescriptorPool;
     std::vector<VkDescriptorSet> mDescriptorSets;
 
     // synchronization object
-    // use semaphore for gpu sync, and use fence for sync between gpu and cpu
+    // binary semaphore 只用于交换链的 acquire 和 present, cpu 与 gpu 之间的同步使用 mFrameTimeline
     std::vector<VkSemaphore> mImageAvailableSemaphores;
     std::vector<VkSemaphore> mRenderFinishedSemaphores;
-    std::vector<VkFence> mInFlightFences;
 
     // frames in flight
     uint32_t mCurrentFrame = 0;
+    // 实际使用的帧数, 不超过 MAX_FRAMES_IN_FLIGHT
+    uint32_t mFramesInFlight = 2;
+    ops::Options mOptions;
+
+    // 帧时间和延迟的测量
+    ops::FrameStats mFrameStats;
+    // 每一个 frame in flight 占用两个 timestamp, 分别在命令的开始和结束写入
+    VkQueryPool mTimestampQueryPool = VK_NULL_HANDLE;
+    float mTimestampPeriod = 1.0f;
+    std::array<bool, MAX_FRAMES_IN_FLIGHT> mTimestampsWritten{};
+    std::array<std::chrono::high_resolution_clock::time_point, MAX_FRAMES_IN_FLIGHT> mFrameInputTime{};
+    uint64_t mFrameCount = 0;
+    bool mFramesInFlightSelected = false;
+    double mRefreshIntervalMs = 1000.0 / 60.0;
+
+    // present mode 由策略决定, P 键切换策略之后在帧末尾重建交换链
+    ops::PresentPolicy mPresentPolicy = ops::PresentPolicy::TearFree;
+    VkPresentModeKHR mPresentMode = VK_PRESENT_MODE_FIFO_KHR;
+    bool mPresentPolicyChanged = false;
+    // 每一种 present mode 下相邻两次 present 的间隔分布
+    std::map<VkPresentModeKHR, ops::FrameTimeHistogram> mPresentIntervals;
+    std::chrono::high_resolution_clock::time_point mLastPresentTime{};
+    bool mHasLastPresentTime = false;
 
     // for glfw window size changed
     bool mFrameBufferResized = false;
 
+    // 主线程只处理窗口事件, 队列, 交换链和提交都属于渲染线程
+    // glfw 回调中的事件放进 mWindowEvents, 渲染线程在每一帧开始的时候处理
+    ops::SpscQueue<WindowEvent, 256> mWindowEvents;
+    // 渲染线程不能调用 glfwGetFramebufferSize, 由主线程在回调中更新
+    std::atomic<uint32_t> mFramebufferWidth{0};
+    std::atomic<uint32_t> mFramebufferHeight{0};
+    std::thread mRenderThread;
+    std::atomic<bool> mRenderRunning{false};
+    std::exception_ptr mRenderError;
+    // 最近一次窗口交互的时间 (steady_clock 的纳秒数), 用来把帧时间分成空闲和交互两组
+    std::atomic<int64_t> mLastInteractionNs{0};
+    ops::RollingStat mIdleFrameTime;
+    ops::RollingStat mInteractionFrameTime;
+    std::chrono::steady_clock::time_point mLastFrameTime{};
+
     // texture image
     VkImage mTextureImage;
     VkDeviceMemory mTextureImageMemory;
     VkImageView mTextureImageView;
-    VkSampler mTextureSampler;
+    ops::Sampler mTextureSampler;
 
     // 我们要同时使用多个纹理图片
     // 我们需要一个从纹理的名称到其下标的映射
     std::unordered_map<std::string, int> mTexName2IndexMap;
-    std::vector<VkImage> mTextureImages;
-    std::vector<VkDeviceMemory> mTextureImagesMemory;
-    std::vector<VkImageView> mTextureImagesView;
+    // 纹理数组的大小, 通过 specialization constant 传给 fragment shader
+    uint32_t mTextureCount = 0;
+    std::vector<ops::Image> mTextureImages;
+    std::vector<ops::DeviceMemory> mTextureImagesMemory;
+    std::vector<ops::ImageView> mTextureImagesView;
     std::vector<VkDescriptorImageInfo> mTextureImagesInfo;
+    // 每个材质的 roughness / metallic / alpha 等单通道贴图打包成一张 RGBA8 贴图, 下标和 mTextureImages 一致
+    std::vector<ops::Image> mMaterialImages;
+    std::vector<ops::DeviceMemory> mMaterialImagesMemory;
+    std::vector<ops::ImageView> mMaterialImagesView;
+    // uploadTextureImage 创建的 image 先记录在这里, 由 flushTextureUploads 在一个 command buffer 中统一转换和拷贝
+    struct PendingTextureUpload {
+        VkBuffer mStagingBuffer;
+        VkDeviceMemory mStagingMemory;
+        VkImage mImage;
+        uint32_t mWidth;
+        uint32_t mHeight;
+    };
+    std::vector<PendingTextureUpload> mPendingTextureUploads;
     // 我们对于多个纹理，可以使用同一个 sampler?
     // Todo: 能否只使用一个 sampler
 
-    // depth image
-    VkImage mDepthImage;
-    VkDeviceMemory mDepthImageMemory;
-    VkImageView mDepthImageView;
+    // depth image, 由 mFrameGraph 创建
+    VkFormat mDepthFormat = VK_FORMAT_UNDEFINED;
+
+    // 每一帧的 pass 和资源, barrier 和 layout 转换由 compile 的结果生成
+    // shadow pass 不在图中: 缓存的 cascade 不会每一帧都渲染, 同步由 mShadowRenderPass 的 subpass dependency 完成
+    ops::RenderGraph mFrameGraph;
+    ops::RenderGraphResource mSwapChainResource = 0;
+    ops::RenderGraphResource mClusterResource = 0;
+    ops::RenderGraphResource mClusterStatsResource = 0;
+    ops::RenderGraphResource mDepthResource = 0;
+    uint32_t mLightCullPass = 0;
+    // 正在录制的交换链图像, 图中的 pass 通过它找到 image view 和 framebuffer
+    uint32_t mRecordingImageIndex = 0;
 
     // tiny obj instance
     tinyobj::ObjReader mObjReaderInstance;
@@ -275,11 +571,16 @@ private:
     // 按键输入用来控制相机的位置
     const glm::vec3 front = glm::vec3(0.0f, 0.0f, -1.0f);
     const glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
-    glm::vec3 mCameraPos = glm::vec3(0.0f, 0.0f, 3.0f);
-    float mCameraDeltaTime = 0.0f;
-    float mCameraLastRenderTime = 0.0f;
     float mCameraSpeedFactor = 2.0f;
 
+    // 主线程采样的按键状态, update 线程每个 tick 读取一次
+    std::atomic<uint32_t> mInputKeys{0};
+    // update 线程私有的模拟状态, 每个 tick 之后拷贝到 mSimulationBuffer 发布给渲染
+    SimulationState mSimulation;
+    ops::TripleBuffer<SimulationState> mSimulationBuffer;
+    std::thread mUpdateThread;
+    std::atomic<bool> mUpdateRunning{false};
+
     void initWindow()
     {
         glfwInit();
@@ -295,12 +596,102 @@ private:
 
         glfwSetWindowUserPointer(mWindow, this);
         glfwSetFramebufferSizeCallback(mWindow, frameBufferResizedCallback);
+        glfwSetWindowPosCallback(mWindow, windowPosCallback);
+        glfwSetKeyCallback(mWindow, keyCallback);
+
+        int width = 0, height = 0;
+        glfwGetFramebufferSize(mWindow, &width, &height);
+        mFramebufferWidth.store(static_cast<uint32_t>(width), std::memory_order_relaxed);
+        mFramebufferHeight.store(static_cast<uint32_t>(height), std::memory_order_relaxed);
+
+        // 刷新周期用于选择 frames in flight 和估计延迟
+        const GLFWvidmode* videoMode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+        if (videoMode != nullptr && videoMode->refreshRate > 0) {
+            mRefreshIntervalMs = 1000.0 / videoMode->refreshRate;
+        }
+    }
+
+    static void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+        if (action != GLFW_PRESS) {
+            return;
+        }
+        auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+        WindowEvent event{};
+        event.mType = WindowEventType::Key;
+        event.mKey = key;
+        app->pushWindowEvent(event);
     }
 
     static void frameBufferResizedCallback(GLFWwindow* window, int width, int height) {
         spdlog::debug("{}: window changed to [{}x{}]", __func__, width, height);
         auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
-        app->mFrameBufferResized = true;
+        app->mFramebufferWidth.store(static_cast<uint32_t>(width), std::memory_order_relaxed);
+        app->mFramebufferHeight.store(static_cast<uint32_t>(height), std::memory_order_relaxed);
+        app->markWindowInteraction();
+        // 拖动窗口的时候一帧之内会收到多次回调, 渲染线程只设置标记, drawFrame 每一帧最多重建一次交换链
+        WindowEvent event{};
+        event.mType = WindowEventType::Resize;
+        app->pushWindowEvent(event);
+    }
+
+    static void windowPosCallback(GLFWwindow* window, int x, int y) {
+        auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+        app->markWindowInteraction();
+    }
+
+    void pushWindowEvent(const WindowEvent& event) {
+        if (!mWindowEvents.tryPush(event)) {
+            spdlog::warn("{} window event queue is full, drop event {}", __func__, static_cast<uint32_t>(event.mType));
+        }
+    }
+
+    void markWindowInteraction() {
+        mLastInteractionNs.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+
+    // 在渲染线程中处理主线程放进队列的事件
+    void processWindowEvents() {
+        WindowEvent event;
+        while (mWindowEvents.tryPop(event)) {
+            if (event.mType == WindowEventType::Resize) {
+                mFrameBufferResized = true;
+            } else if (event.mType == WindowEventType::Key) {
+                handleKey(event.mKey);
+            }
+        }
+    }
+
+    void handleKey(int key) {
+        if (key == GLFW_KEY_B) {
+            mBlendEnable = mBlendEnable ? VK_FALSE : VK_TRUE;
+            spdlog::info("{}: blend {}", __func__, mBlendEnable ? "on" : "off");
+        } else if (key == GLFW_KEY_T) {
+            mFeatureFlags ^= FEATURE_TEXTURE;
+            spdlog::info("{}: texture {}", __func__, (mFeatureFlags & FEATURE_TEXTURE) ? "on" : "off");
+        } else if (key == GLFW_KEY_L) {
+            mFeatureFlags ^= FEATURE_LIGHTING;
+            spdlog::info("{}: lighting {}", __func__, (mFeatureFlags & FEATURE_LIGHTING) ? "on" : "off");
+            buildFrameGraph();
+        } else if (key == GLFW_KEY_K) {
+            mShadowCacheEnabled = !mShadowCacheEnabled;
+            spdlog::info("{}: shadow cache {}", __func__, mShadowCacheEnabled ? "on" : "off");
+        } else if (key == GLFW_KEY_J) {
+            mSunDirection = glm::vec3(glm::rotate(glm::mat4(1.0f), glm::radians(SUN_ROTATE_DEGREES),
+                glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(mSunDirection, 0.0f));
+            spdlog::info("{}: sun direction ({:.2f}, {:.2f}, {:.2f})", __func__,
+                mSunDirection.x, mSunDirection.y, mSunDirection.z);
+        } else if (key == GLFW_KEY_EQUAL || key == GLFW_KEY_KP_ADD) {
+            setLightCount(std::min(mLightField.count() * 10, MAX_LIGHTS));
+        } else if (key == GLFW_KEY_MINUS || key == GLFW_KEY_KP_SUBTRACT) {
+            setLightCount(std::max(mLightField.count() / 10, 1u));
+        } else if (key == GLFW_KEY_P) {
+            mPresentPolicy = ops::nextPresentPolicy(mPresentPolicy);
+            mPresentPolicyChanged = true;
+            spdlog::info("{}: present policy {}", __func__, ops::presentPolicyName(mPresentPolicy));
+        } else if (key == GLFW_KEY_C) {
+            mCullMode = mCullMode == VK_CULL_MODE_NONE ? VK_CULL_MODE_BACK_BIT : VK_CULL_MODE_NONE;
+            spdlog::info("{}: cull mode {}", __func__, mCullMode);
+        }
     }
 
     void initVulkan()
@@ -310,21 +701,45 @@ private:
         createSurface();
         pickPhysicalDevice();
         createLogicalDevice();
+        mPipelineCache.create(mPhysicalDevice, mDevice, PIPELINE_CACHE_PATH);
+        mFrameTimeline.create(mDevice);
+        mFrameGraph.init(mPhysicalDevice, mDevice, mFrameTimeline, mCmdPipelineBarrier2);
         createSwapChain();
         createImageViews();
-        createRenderPass();
+        mDepthFormat = findDepthFormat();
+        if (!mUseDynamicRendering) {
+            createRenderPass();
+        }
+        // load model obj
+        // 纹理数组的大小需要在创建 descriptor set layout 和 pipeline 之前确定, 所以提前解析模型
+        loadModel();
+        mTextureCount = countDiffuseTextures();
+        computeSceneBounds();
+        mShadowCascades.setSceneBounds(mSceneBoundsMin, mSceneBoundsMax);
+        setLightCount(std::clamp(mOptions.mLightCount, 1u, MAX_LIGHTS));
+        if (mOptions.mBenchmarkLights) {
+            startLightBenchmark();
+        }
+        if (mOptions.mBenchmarkShadows) {
+            startShadowBenchmark();
+        }
         // descriptor
         createDescriptorSetLayout();
         createGraphicPipeline();
         createCommandPool();
         // create depth image and depth image views
-        createDepthResources();
+        buildFrameGraph();
+        if (mDeferred) {
+            createGBufferResources();
+        }
         // move create frame buffers after create depth resources
-        createFrameBuffers();
-        // load model obj
-        loadModel();
+        if (!mUseDynamicRendering) {
+            createFrameBuffers();
+        }
         // generate the texture image
         createTextureImages();
+        createMaterialTextures();
+        flushTextureUploads();
         // Todo: 这里需要重新修改
         //createTextureImage();
         // Todo: 这里需要重新修改
@@ -332,15 +747,21 @@ private:
         // Todo: 这里需要重新的修改
         // creata image sampler
         createTextureSampler();
+        // shadow map 不依赖交换链, 只创建一次
+        createShadowResources();
+        createShadowPipeline();
         // create vertex buffer and map it to gpu mem after create Command pool
         createVertexBuffer();
         createIndexBuffer();
+        createShadowPositionBuffer();
         // create uniform buffer and map it to gpu mem
         createUniformBuffers();
+        createLightingBuffers();
         // descriptor pool
         createDescriptorPool();
         createDescriptorSets();
         createCommandBuffers();
+        createTimestampQueryPool();
         createSyncObjects();
     }
 
@@ -353,28 +774,133 @@ private:
 
     void mainLoop()
     {
-        while (!glfwWindowShouldClose(mWindow))
+        startUpdateThread();
+        startRenderThread();
+        // 主线程只处理窗口事件, 移动窗口或者连续缩放的时候不会再耽误给 gpu 提交,
+        // 渲染线程阻塞在 vkAcquireNextImageKHR 的时候也不会耽误事件处理
+        // 超时保证至少每个 tick 采样一次按键
+        double waitTimeout = std::chrono::duration<double>(UPDATE_TICK).count();
+        while (!glfwWindowShouldClose(mWindow) && mRenderRunning.load(std::memory_order_acquire))
         {
-            glfwPollEvents();
-            drawFrame();
+            glfwWaitEventsTimeout(waitTimeout);
+            // glfw 只允许在主线程查询按键, 这里采样之后由 update 线程使用
+            mInputKeys.store(sampleInput(mWindow), std::memory_order_relaxed);
         }
+        stopRenderThread();
+        stopUpdateThread();
 
         vkDeviceWaitIdle(mDevice);
+        logFrameTimeJitter();
+        if (mRenderError) {
+            std::rethrow_exception(mRenderError);
+        }
+    }
+
+    void startRenderThread() {
+        mRenderRunning.store(true, std::memory_order_release);
+        mRenderThread = std::thread(&HelloTriangleApplication::renderLoop, this);
+    }
+
+    void stopRenderThread() {
+        mRenderRunning.store(false, std::memory_order_release);
+        if (mRenderThread.joinable()) {
+            mRenderThread.join();
+        }
+    }
+
+    // 渲染线程, 出错的时候保存异常并唤醒主线程, 由主线程重新抛出
+    void renderLoop() {
+        try {
+            while (mRenderRunning.load(std::memory_order_acquire)) {
+                processWindowEvents();
+                drawFrame();
+                recordFrameTime();
+            }
+        } catch (...) {
+            mRenderError = std::current_exception();
+            mRenderRunning.store(false, std::memory_order_release);
+            glfwPostEmptyEvent();
+        }
+    }
+
+    // 按照最近是否有窗口交互, 把相邻两帧的间隔分别记录下来
+    void recordFrameTime() {
+        auto now = std::chrono::steady_clock::now();
+        if (mLastFrameTime != std::chrono::steady_clock::time_point{}) {
+            std::chrono::duration<double, std::milli> frameTime = now - mLastFrameTime;
+            std::chrono::steady_clock::time_point lastInteraction{
+                std::chrono::steady_clock::duration(mLastInteractionNs.load(std::memory_order_relaxed))};
+            if (now - lastInteraction < WINDOW_INTERACTION_WINDOW) {
+                mInteractionFrameTime.add(frameTime.count());
+            } else {
+                mIdleFrameTime.add(frameTime.count());
+            }
+        }
+        mLastFrameTime = now;
+    }
+
+    // 抖动用 p99 - p50 表示, 比较窗口交互期间和空闲时的帧时间
+    void logFrameTimeJitter() {
+        spdlog::info("{} idle: {} frames, p50 {:.3f} ms, p99 {:.3f} ms, jitter {:.3f} ms; "
+            "window interaction: {} frames, p50 {:.3f} ms, p99 {:.3f} ms, jitter {:.3f} ms",
+            __func__,
+            mIdleFrameTime.count(), mIdleFrameTime.percentile(0.50), mIdleFrameTime.percentile(0.99),
+            mIdleFrameTime.percentile(0.99) - mIdleFrameTime.percentile(0.50),
+            mInteractionFrameTime.count(), mInteractionFrameTime.percentile(0.50),
+            mInteractionFrameTime.percentile(0.99),
+            mInteractionFrameTime.percentile(0.99) - mInteractionFrameTime.percentile(0.50));
+    }
+
+    void startUpdateThread() {
+        mSimulation.mTickTime = std::chrono::steady_clock::now();
+        mSimulationBuffer.writeBuffer() = mSimulation;
+        mSimulationBuffer.publish();
+        mUpdateRunning.store(true, std::memory_order_release);
+        mUpdateThread = std::thread(&HelloTriangleApplication::updateLoop, this);
+    }
+
+    void stopUpdateThread() {
+        mUpdateRunning.store(false, std::memory_order_release);
+        if (mUpdateThread.joinable()) {
+            mUpdateThread.join();
+        }
+    }
+
+    // 按照固定的步长推进模拟, 每个 tick 的 dt 都相同, 所以结果只取决于输入和 tick 的数量
+    // 落后的时候 sleep_until 会立即返回, 连续执行 tick 追上进度
+    void updateLoop() {
+        auto nextTick = mSimulation.mTickTime;
+        while (mUpdateRunning.load(std::memory_order_acquire)) {
+            nextTick += UPDATE_TICK;
+            std::this_thread::sleep_until(nextTick);
+            stepSimulation(mInputKeys.load(std::memory_order_relaxed), nextTick);
+            mSimulationBuffer.writeBuffer() = mSimulation;
+            mSimulationBuffer.publish();
+        }
     }
 
     void cleanup()
     {
         spdlog::info("{}", __func__);
+        logPresentIntervals();
 
         cleanupSwapChain();
 
         // vertex buffer is not dependent on the swap chain, we need clean it by my self
         // the buffer should be available for use in rendering commands until the end of 
         // program
-        vkDestroyBuffer(mDevice, mVertexBuffer, nullptr);
+        mVertexBuffer.reset();
         // 就像 C++ 中的动态内存分配一样，内存应该在某个时候被释放
         // 一旦缓冲区不再使用，绑定到缓冲区对象的内存可能会被释放，因此让我们在缓冲区被销毁后释放它
-        vkFreeMemory(mDevice, mVertexBufferMemory, nullptr);
+        mVertexBufferMemory.reset();
+        mShadowPositionBuffer.reset();
+        mShadowPositionBufferMemory.reset();
+        mShadowFramebuffers = {};
+        mShadowLayerViews = {};
+        mShadowImageView.reset();
+        mShadowImage.reset();
+        mShadowImageMemory.reset();
+        mShadowSampler.reset();
 
         // 回收 uniform buffer 的内存 rotate matrix and project matrix
         for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
@@ -388,44 +914,66 @@ private:
             vkFreeMemory(mDevice, mUBOIndexBuffersMemory[i], nullptr);
         }
 
+        destroyLightingBuffers();
+
         // destory descriptor pool
         vkDestroyDescriptorPool(mDevice, mDescriptorPool, nullptr);
 
         // destroy sampler
-        vkDestroySampler(mDevice, mTextureSampler, nullptr);
+        mTextureSampler.reset();
         // destroy image view
-        for (auto& vkImageView : mTextureImagesView) {
-            vkDestroyImageView(mDevice, vkImageView, nullptr);
-        }
-
+        mTextureImagesView.clear();
         // clean the texture image
-        for (auto& vkImage : mTextureImages) {
-            vkDestroyImage(mDevice, vkImage, nullptr);
-        }
-
-        for (auto& vkImageMemory : mTextureImagesMemory) {
-            vkFreeMemory(mDevice, vkImageMemory, nullptr);
-        }
+        mTextureImages.clear();
+        mTextureImagesMemory.clear();
+        mMaterialImagesView.clear();
+        mMaterialImages.clear();
+        mMaterialImagesMemory.clear();
 
         // destory descriptor set layout
         vkDestroyDescriptorSetLayout(mDevice, mDescriptorSetLayout, nullptr);
+        vkDestroyDescriptorSetLayout(mDevice, mGBufferSetLayout, nullptr);
 
         // destory index buffer
-        vkDestroyBuffer(mDevice, mIndexBuffer, nullptr);
-        vkFreeMemory(mDevice, mIndexBufferMemory, nullptr);
+        mIndexBuffer.reset();
+        mIndexBufferMemory.reset();
 
         for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
             vkDestroySemaphore(mDevice, mRenderFinishedSemaphores[i], nullptr);
             vkDestroySemaphore(mDevice, mImageAvailableSemaphores[i], nullptr);
-            vkDestroyFence(mDevice, mInFlightFences[i], nullptr);
         }
 
+        // 上面 reset 的句柄都在这里真正销毁, 之后再 reset 的句柄会立即销毁
+        mFrameTimeline.destroy();
         vkDestroyCommandPool(mDevice, mCommandPool, nullptr);
 
-        vkDestroyPipeline(mDevice, mGraphicsPipeline, nullptr);
+        if (mTimestampQueryPool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(mDevice, mTimestampQueryPool, nullptr);
+        }
+
+        // 包括 mGraphicsPipeline 在内的所有变体都由 mPipelineVariants 销毁
+        mPipelineVariants.destroy();
+        vkDestroyPipeline(mDevice, mLightCullPipeline, nullptr);
+        vkDestroyShaderModule(mDevice, mLightCullShaderModule, nullptr);
+        vkDestroyShaderModule(mDevice, mFragShaderModule, nullptr);
+        vkDestroyShaderModule(mDevice, mVertShaderModule, nullptr);
+        for (VkPipeline pipeline : mDeferredLightingPipelines) {
+            vkDestroyPipeline(mDevice, pipeline, nullptr);
+        }
+        vkDestroyShaderModule(mDevice, mGBufferFragShaderModule, nullptr);
+        vkDestroyShaderModule(mDevice, mDeferredVertShaderModule, nullptr);
+        vkDestroyShaderModule(mDevice, mDeferredFragShaderModule, nullptr);
+        vkDestroyPipelineLayout(mDevice, mDeferredPipelineLayout, nullptr);
+        vkDestroyPipeline(mDevice, mShadowPipeline, nullptr);
+        vkDestroyShaderModule(mDevice, mShadowVertShaderModule, nullptr);
+        vkDestroyPipelineLayout(mDevice, mShadowPipelineLayout, nullptr);
+        vkDestroyRenderPass(mDevice, mShadowRenderPass, nullptr);
         vkDestroyPipelineLayout(mDevice, mPipelineLayout, nullptr);
         vkDestroyRenderPass(mDevice, mRenderPass, nullptr);
 
+        // 写回磁盘之后再销毁
+        mPipelineCache.destroy();
+
         vkDestroyDevice(mDevice, nullptr);
 
         if (enableValidationLayers)
@@ -441,8 +989,19 @@ private:
     }
 
     void drawFrame() {
-        vkWaitForFences(mDevice, 1, &mInFlightFences[mCurrentFrame], VK_TRUE, UINT64_MAX);
-        vkResetFences(mDevice, 1, &mInFlightFences[mCurrentFrame]);
+        // 等待上一次使用这个 frame 的提交 signal 的 timeline 值
+        mFrameTimeline.wait(mFrameTimelineValues[mCurrentFrame]);
+        mFrameTimeline.collect();
+        if (mFrameBufferResized || mPresentPolicyChanged) {
+            if (mPresentPolicyChanged) {
+                logPresentIntervals();
+                mPresentPolicyChanged = false;
+            }
+            recreateSwapChain();
+        }
+        // 上一次使用这个 frame 的命令已经执行完了, 可以读取它的 gpu 耗时和 cluster 统计
+        collectGpuTime(mCurrentFrame);
+        collectClusterStats(mCurrentFrame);
 
         uint32_t imageIndex;
         VkResult result = vkAcquireNextImageKHR(
@@ -461,7 +1020,9 @@ private:
             throw std::runtime_error("failed to acquire swap images");
         }
 
-        // update uniform buffer
+        // update uniform buffer, 输入也是在这里读取的, 作为延迟估计的起点
+        auto inputTime = std::chrono::high_resolution_clock::now();
+        mFrameInputTime[mCurrentFrame] = inputTime;
         updateUniformBuffer(mCurrentFrame);
 
         vkResetCommandBuffer(mCommandBuffers[mCurrentFrame], 0);
@@ -478,13 +1039,38 @@ private:
         submitInfo.commandBufferCount = 1;
         submitInfo.pCommandBuffers = &mCommandBuffers[mCurrentFrame];
 
-        VkSemaphore signalSemaphores[] = {mRenderFinishedSemaphores[mCurrentFrame]};
-        submitInfo.signalSemaphoreCount = 1;
+        // 同时 signal timeline 和给 present 使用的 binary semaphore, binary semaphore 的值会被忽略
+        uint64_t graphicsValue = mFrameTimeline.nextValue();
+        VkSemaphore signalSemaphores[] = {mFrameTimeline.semaphore(), mRenderFinishedSemaphores[mCurrentFrame]};
+        uint64_t signalValues[] = {graphicsValue, 0};
+        uint64_t waitValues[] = {0};
+        submitInfo.signalSemaphoreCount = 2;
         submitInfo.pSignalSemaphores = signalSemaphores;
-        if (vkQueueSubmit(mGraphicsQueue, 1, &submitInfo, mInFlightFences[mCurrentFrame]) != VK_SUCCESS) {
+
+        VkTimelineSemaphoreSubmitInfo timelineInfo{};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.waitSemaphoreValueCount = 1;
+        timelineInfo.pWaitSemaphoreValues = waitValues;
+        timelineInfo.signalSemaphoreValueCount = 2;
+        timelineInfo.pSignalSemaphoreValues = signalValues;
+        submitInfo.pNext = &timelineInfo;
+
+        // 在提交之前统计还有多少帧在 gpu 上排队
+        uint32_t queuedFrames = 0;
+        uint64_t completedValue = mFrameTimeline.completedValue();
+        for (uint32_t i = 0; i < mFramesInFlight; ++i) {
+            if (i != mCurrentFrame && mFrameTimelineValues[i] > completedValue) {
+                queuedFrames++;
+            }
+        }
+        if (vkQueueSubmit(mGraphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
             spdlog::error("{} failed to submit draw command buffer", __func__);
             throw std::runtime_error("failed to submit draw command buffer");
         }
+        mFrameTimelineValues[mCurrentFrame] = graphicsValue;
+        std::chrono::duration<double, std::milli> cpuTime = std::chrono::high_resolution_clock::now() - inputTime;
+        mFrameStats.mCpuTime.add(cpuTime.count());
+        mFrameStats.mLatency.add(estimateLatency(cpuTime.count(), queuedFrames));
 
         VkPresentInfoKHR presentInfo{};
         presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -499,16 +1085,136 @@ private:
         presentInfo.pImageIndices = &imageIndex;
 
         result = vkQueuePresentKHR(mPresentQueue, &presentInfo);
-        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || mFrameBufferResized) {
+        recordPresentInterval();
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
             spdlog::debug("{}: recreateSwapChain", __func__);
-            mFrameBufferResized = false;
             recreateSwapChain();
+        } else if (result == VK_SUBOPTIMAL_KHR) {
+            // 还可以继续 present, 和 resize 合并到下一帧开始的时候重建
+            mFrameBufferResized = true;
         } else if (result != VK_SUCCESS) {
             spdlog::error("{}: vkQeueuPresentKHR error", __func__);
             throw std::runtime_error("failed to present swap chain image!");
         }
 
-        mCurrentFrame = (mCurrentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+        mCurrentFrame = (mCurrentFrame + 1) % mFramesInFlight;
+        mFrameCount++;
+        updateFrameStats();
+        updateLightBenchmark();
+        updateShadowBenchmark();
+    }
+
+    void recordPresentInterval() {
+        auto now = std::chrono::high_resolution_clock::now();
+        if (mHasLastPresentTime) {
+            std::chrono::duration<double, std::milli> interval = now - mLastPresentTime;
+            mPresentIntervals[mPresentMode].add(interval.count());
+        }
+        mLastPresentTime = now;
+        mHasLastPresentTime = true;
+    }
+
+    void logPresentIntervals() {
+        for (auto& [mode, histogram] : mPresentIntervals) {
+            spdlog::info("{} {}: {} frames, mean {:.3f} ms, p50 {:.2f} ms, p95 {:.2f} ms, p99 {:.2f} ms, max {:.3f} ms",
+                __func__, ops::presentModeName(mode), histogram.count(), histogram.mean(),
+                histogram.percentile(0.50), histogram.percentile(0.95), histogram.percentile(0.99), histogram.max());
+        }
+    }
+
+    // 输入到画面呈现的延迟估计, 没有 VK_KHR_present_wait 的时候拿不到真实的呈现时间, 所以按照下面几段相加:
+    //   读取输入到提交命令的 cpu 时间
+    //   前面还在 gpu 上排队的帧 * 平均 gpu 耗时
+    //   本帧的 gpu 耗时
+    //   等待扫描输出, 平均半个刷新周期
+    double estimateLatency(double cpuTimeMs, uint32_t queuedFrames) {
+        double gpuTimeMs = mFrameStats.mGpuTime.mean();
+        return cpuTimeMs + queuedFrames * gpuTimeMs + gpuTimeMs + mRefreshIntervalMs * 0.5;
+    }
+
+    void collectGpuTime(uint32_t frame) {
+        if (mTimestampQueryPool == VK_NULL_HANDLE || !mTimestampsWritten[frame]) {
+            return;
+        }
+        uint64_t timestamps[TIMESTAMPS_PER_FRAME] = {};
+        if (vkGetQueryPoolResults(mDevice, mTimestampQueryPool, frame * TIMESTAMPS_PER_FRAME, TIMESTAMPS_PER_FRAME,
+                sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+            double gpuTime = static_cast<double>(timestamps[1] - timestamps[0]) * mTimestampPeriod / 1e6;
+            mFrameStats.mGpuTime.add(gpuTime);
+            double shadowTime = static_cast<double>(timestamps[3] - timestamps[2]) * mTimestampPeriod / 1e6;
+            mShadowGpuTime.add(shadowTime);
+            mShadowCascadesRendered.add(mFrameShadowCascades[frame]);
+            if (mShadowBenchmarkStage < 2) {
+                mShadowBenchmarkGpuTime.add(shadowTime);
+                mShadowBenchmarkCascades.add(mFrameShadowCascades[frame]);
+            }
+            if (mLightBenchmarkStage < LIGHT_BENCHMARK_COUNTS.size() &&
+                    mLightBenchmarkFrames >= LIGHT_BENCHMARK_WARMUP_FRAMES) {
+                mLightBenchmarkGpuTime.add(gpuTime);
+            }
+        }
+        mTimestampsWritten[frame] = false;
+    }
+
+    void updateFrameStats() {
+        if (!mFramesInFlightSelected && mFrameStats.mCpuTime.count() >= FRAME_STATS_WARMUP_FRAMES) {
+            mFramesInFlightSelected = true;
+            applyFramesInFlight(mFrameStats.recommendFramesInFlight(mRefreshIntervalMs, MAX_FRAMES_IN_FLIGHT));
+        }
+        if (mFrameCount % FRAME_STATS_LOG_INTERVAL == 0) {
+            spdlog::info("{} frames in flight {}, swapchain images {}, cpu {:.3f} ms (p95 {:.3f}), "
+                "gpu {:.3f} ms (p95 {:.3f}), input to present ~{:.3f} ms",
+                __func__, mFramesInFlight, mSwapChainImages.size(),
+                mFrameStats.mCpuTime.mean(), mFrameStats.mCpuTime.percentile(0.95),
+                mFrameStats.mGpuTime.mean(), mFrameStats.mGpuTime.percentile(0.95),
+                mFrameStats.mLatency.mean());
+            logClusterStats();
+            logShadowStats();
+            logFrameTimeJitter();
+        }
+    }
+
+    // 切换实际使用的帧数, 每一帧的资源都是按照 MAX_FRAMES_IN_FLIGHT 创建的, 只需要改变轮转的范围
+    // 每个 frame 在复用之前都会等待自己的 timeline 值, 所以不需要等 gpu 空闲
+    void applyFramesInFlight(uint32_t framesInFlight) {
+        spdlog::info("{} cpu {:.3f} ms, gpu {:.3f} ms, refresh {:.3f} ms -> {} frames in flight",
+            __func__, mFrameStats.mCpuTime.mean(), mFrameStats.mGpuTime.mean(), mRefreshIntervalMs, framesInFlight);
+        if (framesInFlight == mFramesInFlight) {
+            return;
+        }
+        mFramesInFlight = framesInFlight;
+        mCurrentFrame = 0;
+        mFrameStats.reset();
+        if (mOptions.mSwapchainImages == 0) {
+            // 交换链的图像数量跟随 frames in flight
+            recreateSwapChain();
+        }
+    }
+
+    void createTimestampQueryPool() {
+        QueueFamilyIndices indices = findQueueFamilies(mPhysicalDevice);
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(mPhysicalDevice, &queueFamilyCount, queueFamilies.data());
+        if (queueFamilies[indices.mGraphicsFamily.value()].timestampValidBits == 0) {
+            spdlog::warn("{} graphics queue does not support timestamps, gpu time is not measured", __func__);
+            return;
+        }
+
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(mPhysicalDevice, &properties);
+        mTimestampPeriod = properties.limits.timestampPeriod;
+
+        VkQueryPoolCreateInfo queryPoolInfo{};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = MAX_FRAMES_IN_FLIGHT * TIMESTAMPS_PER_FRAME;
+
+        if (vkCreateQueryPool(mDevice, &queryPoolInfo, nullptr, &mTimestampQueryPool) != VK_SUCCESS) {
+            spdlog::error("{} failed to create timestamp query pool", __func__);
+            throw std::runtime_error("failed to create timestamp query pool");
+        }
     }
 
     void createInstance()
@@ -524,7 +1230,9 @@ private:
         appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
         appInfo.pEngineName = "No Engine";
         appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-        appInfo.apiVersion = VK_API_VERSION_1_0;
+        // VK_KHR_dynamic_rendering 依赖的 multiview, maintenance2 和 get_physical_device_properties2 在 1.1 中是核心功能
+        // timeline semaphore 需要 1.2
+        appInfo.apiVersion = VK_API_VERSION_1_2;
 
         VkInstanceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -579,7 +1287,12 @@ private:
         VkPhysicalDeviceFeatures deviceFeatures{};
         // 如果要使用各项异性过滤，需要手动的去请求它
         deviceFeatures.samplerAnisotropy = VK_TRUE;
+        // 帧同步使用 vulkan 1.2 的 timeline semaphore
+        VkPhysicalDeviceTimelineSemaphoreFeatures timelineSemaphoreFeatures{};
+        timelineSemaphoreFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+        timelineSemaphoreFeatures.timelineSemaphore = VK_TRUE;
         VkDeviceCreateInfo createInfo{};    // Logical Device Create Info
+        createInfo.pNext = &timelineSemaphoreFeatures;
 
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
         createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
@@ -589,8 +1302,30 @@ private:
 
         // extension
         // 使用交换链需要首先启用 VK_KHR_swapchain 扩展
-        createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-        createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+        std::vector<const char*> enabledExtensions(deviceExtensions.begin(), deviceExtensions.end());
+        VkPhysicalDeviceDynamicRenderingFeaturesKHR dynamicRenderingFeatures{};
+        dynamicRenderingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES_KHR;
+        if (mUseDynamicRendering) {
+            std::set<std::string> enabled(enabledExtensions.begin(), enabledExtensions.end());
+            for (const char* extension : dynamicRenderingExtensions) {
+                if (enabled.insert(extension).second) {
+                    enabledExtensions.push_back(extension);
+                }
+            }
+            dynamicRenderingFeatures.dynamicRendering = VK_TRUE;
+            timelineSemaphoreFeatures.pNext = &dynamicRenderingFeatures;
+        }
+        VkPhysicalDeviceSynchronization2FeaturesKHR synchronization2Features{};
+        synchronization2Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR;
+        if (mUseSynchronization2) {
+            enabledExtensions.insert(enabledExtensions.end(),
+                synchronization2Extensions.begin(), synchronization2Extensions.end());
+            synchronization2Features.synchronization2 = VK_TRUE;
+            synchronization2Features.pNext = createInfo.pNext;
+            createInfo.pNext = &synchronization2Features;
+        }
+        createInfo.enabledExtensionCount = static_cast<uint32_t>(enabledExtensions.size());
+        createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
         if (enableValidationLayers) {
             createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
@@ -606,19 +1341,41 @@ private:
 
         vkGetDeviceQueue(mDevice, indices.mGraphicsFamily.value(), 0, &mGraphicsQueue);
         vkGetDeviceQueue(mDevice, indices.mPresentFamily.value(), 0, &mPresentQueue);
+
+        if (mUseDynamicRendering) {
+            mCmdBeginRendering = reinterpret_cast<PFN_vkCmdBeginRenderingKHR>(
+                vkGetDeviceProcAddr(mDevice, "vkCmdBeginRenderingKHR"));
+            mCmdEndRendering = reinterpret_cast<PFN_vkCmdEndRenderingKHR>(
+                vkGetDeviceProcAddr(mDevice, "vkCmdEndRenderingKHR"));
+            if (mCmdBeginRendering == nullptr || mCmdEndRendering == nullptr) {
+                spdlog::error("{} failed to load vkCmdBeginRenderingKHR", __func__);
+                throw std::runtime_error("failed to load vkCmdBeginRenderingKHR");
+            }
+        }
+        if (mUseSynchronization2) {
+            mCmdPipelineBarrier2 = reinterpret_cast<PFN_vkCmdPipelineBarrier2KHR>(
+                vkGetDeviceProcAddr(mDevice, "vkCmdPipelineBarrier2KHR"));
+            if (mCmdPipelineBarrier2 == nullptr) {
+                spdlog::warn("{} failed to load vkCmdPipelineBarrier2KHR, using vkCmdPipelineBarrier", __func__);
+            }
+        }
     }
 
-    void createSwapChain() {
+    void createSwapChain(VkSwapchainKHR oldSwapChain = VK_NULL_HANDLE) {
         SwapChainSupportDetails swapChainSupport = querySwapChainSupport(mPhysicalDevice);
         VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.mFormats);
         // 呈现模式，它决定了如何将画面送往屏幕
-        VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.mPresentModes);
+        VkPresentModeKHR presentMode = ops::choosePresentMode(mPresentPolicy, swapChainSupport.mPresentModes);
+        spdlog::info("{} present policy {} -> {}", __func__,
+            ops::presentPolicyName(mPresentPolicy), ops::presentModeName(presentMode));
         VkExtent2D extent = chooseSwapExtent(swapChainSupport.mCapabilities);
 
         // 我们必须决定交换链中需要多少图像。 实现过程中会指定其运行所需的最小数量
         // 但是，如果仅仅坚持这一最小值，就意味着我们有时可能需要等待驱动程序完成内部操作，
         // 然后才能获取另一张图像进行渲染。 因此，我们建议至少比最小值多请求一个图像
-        uint32_t imageCount = swapChainSupport.mCapabilities.minImageCount + 1;
+        // 可以通过 --swapchain-images 指定, 否则跟随 frames in flight, 每一帧都能拿到一张空闲的图像
+        uint32_t imageCount = mOptions.mSwapchainImages != 0 ? mOptions.mSwapchainImages : mFramesInFlight + 1;
+        imageCount = std::max(imageCount, swapChainSupport.mCapabilities.minImageCount);
         if (swapChainSupport.mCapabilities.maxImageCount > 0 &&
             imageCount > swapChainSupport.mCapabilities.maxImageCount) {
             // 我们还应该确保在执行此操作时，图像数量不超过最大值，其中 0 是一个特殊值，表示没有最大值。
@@ -670,7 +1427,8 @@ private:
         createInfo.presentMode = presentMode;
         createInfo.clipped = VK_TRUE;
 
-        createInfo.oldSwapchain = VK_NULL_HANDLE;
+        // 重建的时候传入旧的交换链, 驱动可以复用它的资源, 已经 acquire 的旧图像也可以继续 present
+        createInfo.oldSwapchain = oldSwapChain;
 
         if (vkCreateSwapchainKHR(mDevice, &createInfo, nullptr, &mSwapChain) != VK_SUCCESS) {
             spdlog::error("{} failed to create swap chain", __func__);
@@ -683,36 +1441,62 @@ private:
 
         mSwapChainImageFormat = surfaceFormat.format;
         mSwapChainExtent = extent;
+        mPresentMode = presentMode;
+        // 重建交换链期间的停顿不计入帧间隔
+        mHasLastPresentTime = false;
     }
 
+    // 不再调用 vkDeviceWaitIdle, 已经提交的帧继续使用旧的资源, 新的资源创建好之后下一帧就可以开始使用
     void recreateSwapChain() {
-        //我们首先调用 vkDeviceWaitIdle，因为就像上一章一样，我们不应该触碰可能仍在使用的资源。
-        //显然，我们必须重新创建交换链本身。 图像视图需要重新创建，因为它们直接基于交换链图像。
-        //最后，帧缓冲区直接依赖于交换链图像，因此也必须重新创建。
-        vkDeviceWaitIdle(mDevice);
-
-        cleanupSwapChain();
+        mFrameBufferResized = false;
+        // 窗口最小化的时候 framebuffer 的大小为 0, 不能创建交换链, 等到窗口恢复
+        // 渲染线程不能调用 glfwWaitEvents, 等待主线程在回调中更新 framebuffer 的大小
+        while (mFramebufferWidth.load(std::memory_order_relaxed) == 0 ||
+            mFramebufferHeight.load(std::memory_order_relaxed) == 0) {
+            if (!mRenderRunning.load(std::memory_order_acquire)) {
+                mFrameBufferResized = true;
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
 
-        createSwapChain();
+        VkSwapchainKHR oldSwapChain = mSwapChain;
+        retireSwapChain();
+        createSwapChain(oldSwapChain);
         createImageViews();
-        createDepthResources();
-        createFrameBuffers();
+        buildFrameGraph();
+        if (mDeferred) {
+            createGBufferResources();
+        }
+        // dynamic rendering 在录制命令的时候直接使用 image view, 没有需要重建的 framebuffer
+        if (!mUseDynamicRendering) {
+            createFrameBuffers();
+        }
+    }
+
+    // 把依赖交换链的资源交给 mFrameTimeline, 在最后一次提交执行完之后再销毁
+    void retireSwapChain() {
+        uint64_t retireValue = mFrameTimeline.lastValue();
+        mSwapChainFramebuffers.clear();
+        mSwapChainImageViews.clear();
+        mFrameGraph.releaseTransients();
+        destroyGBufferResources();
+
+        // present 不会 signal timeline, 没有办法直接知道旧图像的 present 什么时候结束,
+        // 所以交换链本身再多等 MAX_FRAMES_IN_FLIGHT 次提交, 那时旧图像的 present 肯定已经被处理了
+        VkSwapchainKHR swapChain = mSwapChain;
+        mFrameTimeline.deferDestroy(retireValue + MAX_FRAMES_IN_FLIGHT, [this, swapChain]() {
+            vkDestroySwapchainKHR(mDevice, swapChain, nullptr);
+        });
     }
 
     void cleanupSwapChain() {
         spdlog::debug("{}", __func__);
 
-        vkDestroyImageView(mDevice, mDepthImageView, nullptr);
-        vkDestroyImage(mDevice, mDepthImage, nullptr);
-        vkFreeMemory(mDevice, mDepthImageMemory, nullptr);
-
-        for (int i = 0; i < mSwapChainFramebuffers.size(); i++) {
-            vkDestroyFramebuffer(mDevice, mSwapChainFramebuffers[i], nullptr);
-        }
-
-        for (int i = 0; i < mSwapChainImageViews.size(); i++) {
-            vkDestroyImageView(mDevice, mSwapChainImageViews[i], nullptr);
-        }
+        mFrameGraph.releaseTransients();
+        destroyGBufferResources();
+        mSwapChainFramebuffers.clear();
+        mSwapChainImageViews.clear();
 
         vkDestroySwapchainKHR(mDevice, mSwapChain, nullptr);
     }
@@ -776,6 +1560,19 @@ private:
             spdlog::error("{} can not find a gpu device can do graphic work", __func__);
             throw std::runtime_error("failed to find a suitable GPU!");
         }
+
+#ifndef FORCE_LEGACY_RENDER_PASS
+        mUseDynamicRendering = checkDeviceExtensionSupport(mPhysicalDevice, dynamicRenderingExtensions);
+#endif /* FORCE_LEGACY_RENDER_PASS */
+        // input attachment 只能在同一个 render pass 的 subpass 之间传递
+        if (mDeferred) {
+            mUseDynamicRendering = false;
+        }
+        spdlog::info("{} {} shading", __func__, mDeferred ? "deferred" : "forward");
+        spdlog::info("{} using {}", __func__, mUseDynamicRendering ? "dynamic rendering" : "render pass and framebuffers");
+        mUseSynchronization2 = checkDeviceExtensionSupport(mPhysicalDevice, synchronization2Extensions);
+        spdlog::info("{} recording barriers with {}", __func__,
+            mUseSynchronization2 ? "vkCmdPipelineBarrier2KHR" : "vkCmdPipelineBarrier");
     }
 
     uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
@@ -830,10 +1627,27 @@ private:
         // 检查显卡的各项异性过滤的支持
         VkPhysicalDeviceFeatures supportedFeatures{};
         vkGetPhysicalDeviceFeatures(pDevice, &supportedFeatures);
-        return indices.isComplete() && extensionsSupported && swapChainAdequate && supportedFeatures.samplerAnisotropy;
+        return indices.isComplete() && extensionsSupported && swapChainAdequate && supportedFeatures.samplerAnisotropy &&
+            supportsTimelineSemaphore(pDevice);
     }
 
-    bool checkDeviceExtensionSupport(VkPhysicalDevice pDevice) {
+    bool supportsTimelineSemaphore(VkPhysicalDevice pDevice) {
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(pDevice, &properties);
+        if (properties.apiVersion < VK_API_VERSION_1_2) {
+            return false;
+        }
+        VkPhysicalDeviceTimelineSemaphoreFeatures timelineSemaphoreFeatures{};
+        timelineSemaphoreFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+        VkPhysicalDeviceFeatures2 features2{};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &timelineSemaphoreFeatures;
+        vkGetPhysicalDeviceFeatures2(pDevice, &features2);
+        return timelineSemaphoreFeatures.timelineSemaphore == VK_TRUE;
+    }
+
+    bool checkDeviceExtensionSupport(VkPhysicalDevice pDevice,
+        const std::vector<const char*>& extensions = deviceExtensions) {
         uint32_t extensionCount;
         vkEnumerateDeviceExtensionProperties(pDevice, nullptr, &extensionCount, nullptr);
         
@@ -846,7 +1660,7 @@ private:
         }
 #endif
 
-        std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+        std::set<std::string> requiredExtensions(extensions.begin(), extensions.end());
 
         for (const auto& extension : availableExtensions) {
             spdlog::trace("{}: device support extension {}", __func__, extension.extensionName);
@@ -1016,18 +1830,6 @@ private:
         return availableFormats[0];
     }
 
-    VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes) {
-        for (const auto& availablePresentMode : availablePresentModes) {
-            // 不会在交换链满的时候，去阻塞应用程序，队列中的图像会直接被替换为程序新提交的图像
-            if  (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
-                spdlog::trace("{} choose {}", __func__, "VK_PRESENT_MODE_MAILBOX_KHR");
-                return availablePresentMode;
-            }
-        }
-        spdlog::trace("{} use {} for default", __func__, "VK_PRESENT_MODE_FIFO_KHR");
-        return VK_PRESENT_MODE_FIFO_KHR;
-    }
-
     /**
      * 设置交换范围，它是交换链中的图像的分辨率，它几乎总是和我们要显示的窗口大小相同
     */
@@ -1040,9 +1842,10 @@ private:
             );
             return capabilities.currentExtent;
         } else {
-            int width, height;
-            glfwGetFramebufferSize(mWindow, &width, &height);
-            spdlog::info("{} glfwGetFrameBufferSize [{}x{}]", __func__, width, height);
+            // 在渲染线程中调用, 使用主线程记录的 framebuffer 大小
+            uint32_t width = mFramebufferWidth.load(std::memory_order_relaxed);
+            uint32_t height = mFramebufferHeight.load(std::memory_order_relaxed);
+            spdlog::info("{} framebuffer size [{}x{}]", __func__, width, height);
 
             VkExtent2D actualExtent = {
                 static_cast<uint32_t>(width),
@@ -1065,18 +1868,24 @@ private:
     }
 
     void createImageViews() {
-        mSwapChainImageViews.resize(mSwapChainImages.size());
+        mSwapChainImageViews.clear();
+        mSwapChainImageViews.reserve(mSwapChainImages.size());
         for(int i = 0; i < mSwapChainImages.size(); ++i) {
             // move most of the same part to function createImageView
-            mSwapChainImageViews[i] = createImageView(
+            mSwapChainImageViews.emplace_back(mFrameTimeline, createImageView(
                 mSwapChainImages[i],
                 mSwapChainImageFormat,
                 VK_IMAGE_ASPECT_COLOR_BIT
-            );
+            ));
         }
     }
 
     void createRenderPass() {
+        if (mDeferred) {
+            createDeferredRenderPass();
+            return;
+        }
+
         VkAttachmentDescription colorAttachment{};
         // attachment 的格式，例如 VK_FORMAT_B8G8R8A8_SRGB
         colorAttachment.format = mSwapChainImageFormat;
@@ -1097,7 +1906,7 @@ private:
 
         // depth attachment
         VkAttachmentDescription depthAttachment{};
-        depthAttachment.format = findDepthFormat();
+        depthAttachment.format = mDepthFormat;
         depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
         depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
         depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
@@ -1152,26 +1961,290 @@ private:
         }
     }
 
+    // attachment: 0 交换链图像, 1 深度, 2 ~ 4 G-buffer
+    // subpass 0 把几何体写入 G-buffer 和深度, subpass 1 把它们作为 input attachment 读取, 画一个全屏三角形计算光照
+    // G-buffer 和深度的 storeOp 都是 DONT_CARE, 配合 BY_REGION 的依赖, tile based gpu 可以把两个 subpass 合并在片上完成
+    void createDeferredRenderPass() {
+        std::array<VkAttachmentDescription, 2 + GBUFFER_FORMATS.size()> attachments{};
+        attachments[0].format = mSwapChainImageFormat;
+        attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
+        attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+        attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        attachments[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+        // 光照 subpass 用深度重建位置, 之后就不再需要
+        attachments[1].format = mDepthFormat;
+        attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
+        attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        attachments[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+        // G-buffer 的每个像素都会被几何体覆盖或者在光照 subpass 中被丢弃, 不需要清除
+        for (size_t i = 0; i < GBUFFER_FORMATS.size(); ++i) {
+            VkAttachmentDescription& attachment = attachments[2 + i];
+            attachment.format = GBUFFER_FORMATS[i];
+            attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+            attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+            attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+            attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            attachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        }
+
+        std::array<VkAttachmentReference, GBUFFER_FORMATS.size()> gbufferOutputRefs{};
+        // 顺序和 deferred_lighting.frag 中的 input_attachment_index 一致: albedo, normal, material, depth
+        std::array<VkAttachmentReference, GBUFFER_FORMATS.size() + 1> gbufferInputRefs{};
+        for (uint32_t i = 0; i < GBUFFER_FORMATS.size(); ++i) {
+            gbufferOutputRefs[i] = {2 + i, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+            gbufferInputRefs[i] = {2 + i, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+        }
+        gbufferInputRefs[GBUFFER_FORMATS.size()] = {1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL};
+        VkAttachmentReference depthAttachmentRef{1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+        VkAttachmentReference colorAttachmentRef{0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+
+        std::array<VkSubpassDescription, 2> subpasses{};
+        subpasses[0].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpasses[0].colorAttachmentCount = static_cast<uint32_t>(gbufferOutputRefs.size());
+        subpasses[0].pColorAttachments = gbufferOutputRefs.data();
+        subpasses[0].pDepthStencilAttachment = &depthAttachmentRef;
+        subpasses[1].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpasses[1].inputAttachmentCount = static_cast<uint32_t>(gbufferInputRefs.size());
+        subpasses[1].pInputAttachments = gbufferInputRefs.data();
+        subpasses[1].colorAttachmentCount = 1;
+        subpasses[1].pColorAttachments = &colorAttachmentRef;
+
+        std::array<VkSubpassDependency, 2> dependencies{};
+        // 上一帧的光照 subpass 还在读取 G-buffer 和深度的时候不能覆盖它们
+        dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[0].dstSubpass = 0;
+        dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+            VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        dependencies[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+            VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        // 每个像素只读取自己的 G-buffer, BY_REGION 让驱动不需要等整个 subpass 0 结束
+        dependencies[1].srcSubpass = 0;
+        dependencies[1].dstSubpass = 1;
+        dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+            VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        dependencies[1].dstAccessMask = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
+        dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+        VkRenderPassCreateInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+        renderPassInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+        renderPassInfo.pAttachments = attachments.data();
+        renderPassInfo.subpassCount = static_cast<uint32_t>(subpasses.size());
+        renderPassInfo.pSubpasses = subpasses.data();
+        renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+        renderPassInfo.pDependencies = dependencies.data();
+
+        if (vkCreateRenderPass(mDevice, &renderPassInfo, nullptr, &mRenderPass) != VK_SUCCESS) {
+            spdlog::error("{} failed to create deferred render pass", __func__);
+            throw std::runtime_error("failed to create deferred render pass");
+        }
+    }
+
+    // 有 LAZILY_ALLOCATED 的内存类型时 (通常是 tile based gpu), transient attachment 可能完全不占用显存
+    // memoryTypeBits 是 image 的 VkMemoryRequirements::memoryTypeBits, 其中没有 lazily allocated 的类型时退回 DEVICE_LOCAL
+    VkMemoryPropertyFlags transientAttachmentMemoryProperties(uint32_t memoryTypeBits = ~0u) {
+        const VkMemoryPropertyFlags lazy = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+        VkPhysicalDeviceMemoryProperties memProperties;
+        vkGetPhysicalDeviceMemoryProperties(mPhysicalDevice, &memProperties);
+        for (uint32_t i = 0; i < memProperties.memoryTypeCount; ++i) {
+            if ((memoryTypeBits & (1u << i)) && (memProperties.memoryTypes[i].propertyFlags & lazy) == lazy) {
+                return lazy;
+            }
+        }
+        return VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    }
+
+    // 和深度一样依赖交换链的大小, 在 buildFrameGraph 之后创建
+    void createGBufferResources() {
+        VkMemoryPropertyFlags memoryProperties = transientAttachmentMemoryProperties();
+        for (size_t i = 0; i < GBUFFER_FORMATS.size(); ++i) {
+            VkImage image;
+            VkDeviceMemory imageMemory;
+            createImage(mSwapChainExtent.width, mSwapChainExtent.height,
+                GBUFFER_FORMATS[i],
+                VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT |
+                    VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
+                memoryProperties,
+                image,
+                imageMemory
+            );
+            mGBufferImages[i] = ops::Image(mFrameTimeline, image);
+            mGBufferImagesMemory[i] = ops::DeviceMemory(mFrameTimeline, imageMemory);
+            mGBufferImageViews[i] = ops::ImageView(mFrameTimeline,
+                createImageView(image, GBUFFER_FORMATS[i], VK_IMAGE_ASPECT_COLOR_BIT));
+        }
+        spdlog::info("{} {}x{} G-buffer, lazily allocated memory {}", __func__, mSwapChainExtent.width,
+            mSwapChainExtent.height,
+            (memoryProperties & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) ? "requested" : "not available");
+
+        VkDescriptorPoolSize poolSize{};
+        poolSize.type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+        poolSize.descriptorCount = static_cast<uint32_t>(GBUFFER_FORMATS.size() + 1);
+
+        VkDescriptorPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.poolSizeCount = 1;
+        poolInfo.pPoolSizes = &poolSize;
+        poolInfo.maxSets = 1;
+
+        VkDescriptorPool pool;
+        if (vkCreateDescriptorPool(mDevice, &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+            spdlog::error("{} failed to create G-buffer descriptor pool", __func__);
+            throw std::runtime_error("failed to create G-buffer descriptor pool");
+        }
+        mGBufferDescriptorPool = ops::DescriptorPool(mFrameTimeline, pool);
+
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = pool;
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &mGBufferSetLayout;
+        if (vkAllocateDescriptorSets(mDevice, &allocInfo, &mGBufferDescriptorSet) != VK_SUCCESS) {
+            spdlog::error("{} failed to allocate G-buffer descriptor set", __func__);
+            throw std::runtime_error("failed to allocate G-buffer descriptor set");
+        }
+
+        std::array<VkDescriptorImageInfo, GBUFFER_FORMATS.size() + 1> imageInfos{};
+        for (size_t i = 0; i < GBUFFER_FORMATS.size(); ++i) {
+            imageInfos[i] = {VK_NULL_HANDLE, mGBufferImageViews[i].get(), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+        }
+        imageInfos[GBUFFER_FORMATS.size()] = {VK_NULL_HANDLE, mFrameGraph.imageView(mDepthResource),
+            VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL};
+
+        VkWriteDescriptorSet descriptorWrite{};
+        descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite.dstSet = mGBufferDescriptorSet;
+        descriptorWrite.dstBinding = 0;
+        descriptorWrite.dstArrayElement = 0;
+        descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+        descriptorWrite.descriptorCount = static_cast<uint32_t>(imageInfos.size());
+        descriptorWrite.pImageInfo = imageInfos.data();
+        vkUpdateDescriptorSets(mDevice, 1, &descriptorWrite, 0, nullptr);
+    }
+
+    void destroyGBufferResources() {
+        for (size_t i = 0; i < GBUFFER_FORMATS.size(); ++i) {
+            mGBufferImageViews[i].reset();
+            mGBufferImages[i].reset();
+            mGBufferImagesMemory[i].reset();
+        }
+        // 销毁 pool 的时候它分配的 set 一起释放
+        mGBufferDescriptorPool.reset();
+        mGBufferDescriptorSet = VK_NULL_HANDLE;
+    }
+
     void createGraphicPipeline() {
         auto vertShaderCode = readFile("shader/vert.spv");
         auto fragShaderCode = readFile("shader/frag.spv");
 
-        VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
-        VkShaderModule fragShaderModule = createShaderModule(fragShaderCode);
+        // 变体会在工作线程上陆续编译, shader module 需要一直保留到 cleanup
+        mVertShaderModule = createShaderModule(vertShaderCode);
+        mFragShaderModule = createShaderModule(fragShaderCode);
+
+        // Pipeline layout
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        // 我们创建了一个 descriptorsetlayout, 绑定了一个 ubo, 在创建 pipeline 的时候，需要进行设置
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &mDescriptorSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 0;
+        pipelineLayoutInfo.pPushConstantRanges = nullptr;
+
+        if (vkCreatePipelineLayout(mDevice, &pipelineLayoutInfo, nullptr, &mPipelineLayout)
+            != VK_SUCCESS) {
+            spdlog::error("{} failed to create pipeline layout", __func__);
+            throw std::runtime_error("failed to create pipeline layout");
+        }
+
+        createLightCullPipeline();
+        if (mDeferred) {
+            mGBufferFragShaderModule = createShaderModule(readFile("shader/gbuffer.spv"));
+            createDeferredLightingPipelines();
+        }
+
+        mPipelineVariants.init(mDevice, [this](const ops::PipelineVariantKey& key) {
+            return createGraphicPipelineVariant(key);
+        });
+
+        // 默认的变体同步编译, 其他变体编译期间用它来绘制
+        mGraphicsPipeline = mPipelineVariants.getBlocking(currentPipelineVariantKey());
+        if (mGraphicsPipeline == VK_NULL_HANDLE) {
+            spdlog::error("{} failed to create graphics pipeline", __func__);
+            throw std::runtime_error("failed to create graphics pipeline");
+        }
+
+        // 运行时可以切换到的变体提前在后台编译
+        std::vector<ops::PipelineVariantKey> warmupKeys;
+        for (VkBool32 blendEnable : {VK_FALSE, VK_TRUE}) {
+            for (VkCullModeFlags cullMode : {VK_CULL_MODE_BACK_BIT, VK_CULL_MODE_NONE}) {
+                ops::PipelineVariantKey key = currentPipelineVariantKey();
+                key.mBlendEnable = blendEnable;
+                key.mCullMode = cullMode;
+                warmupKeys.push_back(key);
+            }
+        }
+        mPipelineVariants.request(warmupKeys);
+    }
+
+    ops::PipelineVariantKey currentPipelineVariantKey() {
+        ops::PipelineVariantKey key{};
+        key.mSamples = VK_SAMPLE_COUNT_1_BIT;
+        key.mDepthFormat = mDepthFormat;
+        key.mBlendEnable = mBlendEnable;
+        key.mCullMode = mCullMode;
+        key.mFeatureFlags = mFeatureFlags;
+        // G-buffer 变体不计算光照, 光照开关只影响 mDeferredLightingPipelines 的选择
+        if (mDeferred) {
+            key.mFeatureFlags = (mFeatureFlags & ~FEATURE_LIGHTING) | FEATURE_DEFERRED;
+        }
+        return key;
+    }
 
+    // 会在 PipelineVariantManager 的工作线程上并发调用, 出错的时候返回 VK_NULL_HANDLE
+    VkPipeline createGraphicPipelineVariant(const ops::PipelineVariantKey& key) {
         // Vertex Shader setting
         VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
         vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
         vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-        vertShaderStageInfo.module = vertShaderModule;
+        vertShaderStageInfo.module = mVertShaderModule;
         vertShaderStageInfo.pName = "main";
 
         // Fragment Shader setting
         VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
         fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
         fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-        fragShaderStageInfo.module = fragShaderModule;
+        fragShaderStageInfo.module = mFragShaderModule;
         fragShaderStageInfo.pName = "main";
+        bool deferred = key.mFeatureFlags & FEATURE_DEFERRED;
+        if (deferred) {
+            fragShaderStageInfo.module = mGBufferFragShaderModule;
+        }
+        // 对应 fragment shader 中的 constant_id, 纹理数组大小和功能开关在这里确定, 不需要重新编译 shader
+        ops::SpecializationConstants fragConstants;
+        fragConstants.set<uint32_t>(0, mTextureCount);
+        fragConstants.set<VkBool32>(1, (key.mFeatureFlags & FEATURE_TEXTURE) ? VK_TRUE : VK_FALSE);
+        fragConstants.set<VkBool32>(2, (key.mFeatureFlags & FEATURE_LIGHTING) ? VK_TRUE : VK_FALSE);
+        fragShaderStageInfo.pSpecializationInfo = fragConstants.info();
 
         VkPipelineShaderStageCreateInfo shaderStages[] = {
             vertShaderStageInfo, 
@@ -1216,7 +2289,7 @@ private:
         rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
         // 线宽
         rasterizer.lineWidth = 1.0f;
-        rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+        rasterizer.cullMode = key.mCullMode;
         // 逆时针方向
         rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
         // 是否开启深度偏移，对片段的深度值应用一个偏移值
@@ -1231,7 +2304,7 @@ private:
         VkPipelineMultisampleStateCreateInfo multisampling{};
         multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
         multisampling.sampleShadingEnable = VK_FALSE;
-        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+        multisampling.rasterizationSamples = key.mSamples;
         //multisampling.minSampleShading = 1.0f;
         //multisampling.pSampleMask = nullptr;
         //multisampling.alphaToCoverageEnable = VK_FALSE;
@@ -1243,13 +2316,13 @@ private:
             VK_COLOR_COMPONENT_G_BIT |
             VK_COLOR_COMPONENT_B_BIT |
             VK_COLOR_COMPONENT_A_BIT;
-        colorBlendAttachment.blendEnable = VK_FALSE;
-        //colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-        //colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;    // Optional
-        //colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;    // Optional
-        //colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE; // Optional
-        //colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;    // Optional
-        //colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;    // Optional
+        colorBlendAttachment.blendEnable = key.mBlendEnable;
+        colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+        colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+        colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+        colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+        colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
 
         // color blending
         VkPipelineColorBlendStateCreateInfo colorBlending{};
@@ -1258,6 +2331,16 @@ private:
         colorBlending.logicOp = VK_LOGIC_OP_COPY;
         colorBlending.attachmentCount = 1;
         colorBlending.pAttachments = &colorBlendAttachment;
+        // G-buffer 中保存的是表面的属性, 混合没有意义
+        std::array<VkPipelineColorBlendAttachmentState, GBUFFER_FORMATS.size()> gbufferBlendAttachments{};
+        if (deferred) {
+            for (auto& attachment : gbufferBlendAttachments) {
+                attachment = colorBlendAttachment;
+                attachment.blendEnable = VK_FALSE;
+            }
+            colorBlending.attachmentCount = static_cast<uint32_t>(gbufferBlendAttachments.size());
+            colorBlending.pAttachments = gbufferBlendAttachments.data();
+        }
         colorBlending.blendConstants[0] = 0.0f;
         colorBlending.blendConstants[1] = 0.0f;
         colorBlending.blendConstants[2] = 0.0f;
@@ -1292,21 +2375,6 @@ private:
         depthStencil.front = {};
         depthStencil.back = {};
 
-        // Pipeline layout
-        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-        // 我们创建了一个 descriptorsetlayout, 绑定了一个 ubo, 在创建 pipeline 的时候，需要进行设置
-        pipelineLayoutInfo.setLayoutCount = 1;
-        pipelineLayoutInfo.pSetLayouts = &mDescriptorSetLayout;
-        pipelineLayoutInfo.pushConstantRangeCount = 0;
-        pipelineLayoutInfo.pPushConstantRanges = nullptr;
-
-        if (vkCreatePipelineLayout(mDevice, &pipelineLayoutInfo, nullptr, &mPipelineLayout)
-            != VK_SUCCESS) {
-            spdlog::error("{} failed to create pipeline layout", __func__);
-            throw std::runtime_error("failed to create pipeline layout");
-        }
-
         // create graphic pipeline
         VkGraphicsPipelineCreateInfo pipelineInfo{};
         pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
@@ -1325,28 +2393,156 @@ private:
         pipelineInfo.layout = mPipelineLayout;
         pipelineInfo.renderPass = mRenderPass;
         pipelineInfo.subpass = 0;
+        // dynamic rendering 下 pipeline 不和 render pass 绑定, 只需要声明 attachment 的格式
+        VkPipelineRenderingCreateInfoKHR renderingInfo{};
+        renderingInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR;
+        renderingInfo.colorAttachmentCount = 1;
+        renderingInfo.pColorAttachmentFormats = &mSwapChainImageFormat;
+        renderingInfo.depthAttachmentFormat = key.mDepthFormat;
+        renderingInfo.stencilAttachmentFormat = VK_FORMAT_UNDEFINED;
+        if (mUseDynamicRendering) {
+            pipelineInfo.renderPass = VK_NULL_HANDLE;
+            pipelineInfo.pNext = &renderingInfo;
+        }
         pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
         pipelineInfo.basePipelineIndex = -1;
         pipelineInfo.pDepthStencilState = &depthStencil;
 
-        if (vkCreateGraphicsPipelines(mDevice, VK_NULL_HANDLE, 1, &pipelineInfo,
-            nullptr, &mGraphicsPipeline) != VK_SUCCESS) {
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        auto pipelineStartTime = std::chrono::high_resolution_clock::now();
+        if (vkCreateGraphicsPipelines(mDevice, mPipelineCache.handle(), 1, &pipelineInfo,
+            nullptr, &pipeline) != VK_SUCCESS) {
             spdlog::error("{} failed to create graphics pipeline", __func__);
-            throw std::runtime_error("failed to create graphics pipeline");
+            return VK_NULL_HANDLE;
         }
+        std::chrono::duration<double, std::milli> pipelineTime =
+            std::chrono::high_resolution_clock::now() - pipelineStartTime;
+        spdlog::info("{} graphics pipeline created in {:.3f} ms ({} pipeline cache)",
+            __func__, pipelineTime.count(), mPipelineCache.isWarm() ? "warm" : "cold");
 
-        // destroy the shader module, we do not need to keep it
-        vkDestroyShaderModule(mDevice, fragShaderModule, nullptr);
-        vkDestroyShaderModule(mDevice, vertShaderModule, nullptr);
+        return pipeline;
+    }
+
+
+    // 光照 subpass 的 pipeline: 全屏三角形, 没有顶点输入和深度测试
+    void createDeferredLightingPipelines() {
+        std::array<VkDescriptorSetLayout, 2> setLayouts = {mDescriptorSetLayout, mGBufferSetLayout};
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = static_cast<uint32_t>(setLayouts.size());
+        pipelineLayoutInfo.pSetLayouts = setLayouts.data();
+
+        if (vkCreatePipelineLayout(mDevice, &pipelineLayoutInfo, nullptr, &mDeferredPipelineLayout) != VK_SUCCESS) {
+            spdlog::error("{} failed to create deferred pipeline layout", __func__);
+            throw std::runtime_error("failed to create deferred pipeline layout");
+        }
+
+        mDeferredVertShaderModule = createShaderModule(readFile("shader/deferred_lighting_vert.spv"));
+        mDeferredFragShaderModule = createShaderModule(readFile("shader/deferred_lighting_frag.spv"));
+
+        std::array<VkPipelineShaderStageCreateInfo, 2> shaderStages{};
+        shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+        shaderStages[0].module = mDeferredVertShaderModule;
+        shaderStages[0].pName = "main";
+        shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+        shaderStages[1].module = mDeferredFragShaderModule;
+        shaderStages[1].pName = "main";
+
+        VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+        vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+        VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+        inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+        inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+        VkPipelineViewportStateCreateInfo viewportState{};
+        viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+        viewportState.viewportCount = 1;
+        viewportState.scissorCount = 1;
+
+        VkPipelineRasterizationStateCreateInfo rasterizer{};
+        rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+        rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+        rasterizer.lineWidth = 1.0f;
+        rasterizer.cullMode = VK_CULL_MODE_NONE;
+        rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+        VkPipelineMultisampleStateCreateInfo multisampling{};
+        multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+        VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+        colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
+            VK_COLOR_COMPONENT_G_BIT |
+            VK_COLOR_COMPONENT_B_BIT |
+            VK_COLOR_COMPONENT_A_BIT;
+        colorBlendAttachment.blendEnable = VK_FALSE;
+
+        VkPipelineColorBlendStateCreateInfo colorBlending{};
+        colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+        colorBlending.attachmentCount = 1;
+        colorBlending.pAttachments = &colorBlendAttachment;
+
+        std::array<VkDynamicState, 2> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+        VkPipelineDynamicStateCreateInfo dynamicState{};
+        dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+        dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+        dynamicState.pDynamicStates = dynamicStates.data();
+
+        VkGraphicsPipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+        pipelineInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
+        pipelineInfo.pStages = shaderStages.data();
+        pipelineInfo.pVertexInputState = &vertexInputInfo;
+        pipelineInfo.pInputAssemblyState = &inputAssembly;
+        pipelineInfo.pViewportState = &viewportState;
+        pipelineInfo.pRasterizationState = &rasterizer;
+        pipelineInfo.pMultisampleState = &multisampling;
+        pipelineInfo.pColorBlendState = &colorBlending;
+        pipelineInfo.pDynamicState = &dynamicState;
+        pipelineInfo.layout = mDeferredPipelineLayout;
+        pipelineInfo.renderPass = mRenderPass;
+        pipelineInfo.subpass = 1;
+        pipelineInfo.basePipelineIndex = -1;
+
+        for (uint32_t lit = 0; lit < mDeferredLightingPipelines.size(); ++lit) {
+            ops::SpecializationConstants fragConstants;
+            fragConstants.set<VkBool32>(0, lit ? VK_TRUE : VK_FALSE);
+            shaderStages[1].pSpecializationInfo = fragConstants.info();
+            if (vkCreateGraphicsPipelines(mDevice, mPipelineCache.handle(), 1, &pipelineInfo, nullptr,
+                    &mDeferredLightingPipelines[lit]) != VK_SUCCESS) {
+                spdlog::error("{} failed to create deferred lighting pipeline", __func__);
+                throw std::runtime_error("failed to create deferred lighting pipeline");
+            }
+        }
+    }
+
+    // 第二个 subpass: 每个像素读取自己的 G-buffer, 只计算一次光照
+    void recordDeferredLighting(VkCommandBuffer commandBuffer) {
+        vkCmdNextSubpass(commandBuffer, VK_SUBPASS_CONTENTS_INLINE);
+        bool lit = mFeatureFlags & FEATURE_LIGHTING;
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mDeferredLightingPipelines[lit ? 1 : 0]);
+        std::array<VkDescriptorSet, 2> descriptorSets = {mDescriptorSets[mCurrentFrame], mGBufferDescriptorSet};
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mDeferredPipelineLayout,
+            0, static_cast<uint32_t>(descriptorSets.size()), descriptorSets.data(), 0, nullptr);
+        vkCmdDraw(commandBuffer, 3, 1, 0, 0);
     }
 
     void createFrameBuffers() {
-        mSwapChainFramebuffers.resize(mSwapChainImageViews.size());
+        mSwapChainFramebuffers.clear();
+        mSwapChainFramebuffers.reserve(mSwapChainImageViews.size());
         for (unsigned int i = 0; i < mSwapChainImageViews.size(); ++i) {
-            std::array<VkImageView, 2> attachments = {
-                mSwapChainImageViews[i],
-                mDepthImageView
+            std::vector<VkImageView> attachments = {
+                mSwapChainImageViews[i].get(),
+                mFrameGraph.imageView(mDepthResource)
             };
+            if (mDeferred) {
+                for (const ops::ImageView& view : mGBufferImageViews) {
+                    attachments.push_back(view.get());
+                }
+            }
 
             VkFramebufferCreateInfo framebufferInfo{};
             framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
@@ -1357,12 +2553,13 @@ private:
             framebufferInfo.height = mSwapChainExtent.height;
             framebufferInfo.layers = 1;
 
-            if (vkCreateFramebuffer(mDevice, &framebufferInfo, nullptr,
-                &mSwapChainFramebuffers[i]) != VK_SUCCESS) {
+            VkFramebuffer framebuffer;
+            if (vkCreateFramebuffer(mDevice, &framebufferInfo, nullptr, &framebuffer) != VK_SUCCESS) {
                 spdlog::error("{} failed to create framebuffer for imageView "
                     "with index {}", __func__, i);
                 throw std::runtime_error("failed to create framebuffer");
             }
+            mSwapChainFramebuffers.emplace_back(mFrameTimeline, framebuffer);
         }
     }
 
@@ -1370,18 +2567,13 @@ private:
         // resize the sync objects size
         mImageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
         mRenderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        mInFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
 
         VkSemaphoreCreateInfo semaphoreInfo{};
         semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-        VkFenceCreateInfo fenceInfo{};
-        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
         for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
             if (vkCreateSemaphore(mDevice, &semaphoreInfo, nullptr, &mImageAvailableSemaphores[i]) != VK_SUCCESS ||
-                vkCreateSemaphore(mDevice, &semaphoreInfo, nullptr, &mRenderFinishedSemaphores[i]) != VK_SUCCESS ||
-                vkCreateFence(mDevice, &fenceInfo, nullptr, &mInFlightFences[i]) != VK_SUCCESS
+                vkCreateSemaphore(mDevice, &semaphoreInfo, nullptr, &mRenderFinishedSemaphores[i]) != VK_SUCCESS
             ) {
                 spdlog::error("{}:{} failed to create synchronization objects", __func__, i);
                 throw std::runtime_error("failed to create synchronization objects!");
@@ -1459,7 +2651,8 @@ private:
         vkBindBufferMemory(mDevice, buffer, bufferMemory, 0);
     }
 
-    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+    // 不等待拷贝完成, 返回的 timeline 值被 signal 之后才能销毁 srcBuffer
+    uint64_t copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
         VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
         VkBufferCopy copyRegion{};
@@ -1468,7 +2661,31 @@ private:
         copyRegion.size = size;
         vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
 
-        endSingleTimeCommands(commandBuffer);
+        // cpu 不再等待拷贝完成, 由 barrier 保证之后提交的命令能看到拷贝的结果
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            0,
+            1, &barrier,
+            0, nullptr,
+            0, nullptr
+        );
+
+        return submitSingleTimeCommands(commandBuffer);
+    }
+
+    // 在 timeline 到达 value 之后销毁 staging buffer
+    void destroyStagingBufferAfter(uint64_t value, VkBuffer buffer, VkDeviceMemory memory) {
+        mFrameTimeline.deferDestroy(value, [this, buffer, memory]() {
+            vkDestroyBuffer(mDevice, buffer, nullptr);
+            vkFreeMemory(mDevice, memory, nullptr);
+        });
     }
 
     void createVertexBuffer() {
@@ -1487,16 +2704,19 @@ private:
         memcpy(data, mVertices.data(), static_cast<size_t>(bufferSize));
         vkUnmapMemory(mDevice, stagingBufferMemory);
 
+        VkBuffer vertexBuffer;
+        VkDeviceMemory vertexBufferMemory;
         createBuffer(bufferSize,
             VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-            mVertexBuffer,
-            mVertexBufferMemory
+            vertexBuffer,
+            vertexBufferMemory
         );
+        mVertexBuffer = ops::Buffer(mFrameTimeline, vertexBuffer);
+        mVertexBufferMemory = ops::DeviceMemory(mFrameTimeline, vertexBufferMemory);
 
-        copyBuffer(stagingBuffer, mVertexBuffer, bufferSize);
-        vkDestroyBuffer(mDevice, stagingBuffer, nullptr);
-        vkFreeMemory(mDevice, stagingBufferMemory, nullptr);
+        uint64_t copyValue = copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
+        destroyStagingBufferAfter(copyValue, stagingBuffer, stagingBufferMemory);
     }
 
     void  createIndexBuffer() {
@@ -1516,12 +2736,15 @@ private:
         memcpy(data, mIndices.data(), static_cast<size_t>(bufferSize));
         vkUnmapMemory(mDevice, stagingBufferMemory);
 
+        VkBuffer indexBuffer;
+        VkDeviceMemory indexBufferMemory;
         createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mIndexBuffer, mIndexBufferMemory);
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
+        mIndexBuffer = ops::Buffer(mFrameTimeline, indexBuffer);
+        mIndexBufferMemory = ops::DeviceMemory(mFrameTimeline, indexBufferMemory);
 
-        copyBuffer(stagingBuffer, mIndexBuffer, bufferSize);
-        vkDestroyBuffer(mDevice, stagingBuffer, nullptr);
-        vkFreeMemory(mDevice, stagingBufferMemory, nullptr);
+        uint64_t copyValue = copyBuffer(stagingBuffer, indexBuffer, bufferSize);
+        destroyStagingBufferAfter(copyValue, stagingBuffer, stagingBufferMemory);
     }
 
     void createUniformBuffers() {
@@ -1561,15 +2784,533 @@ private:
         }
     }
 
+    // light_cull.comp 的 pipeline, 和 graphics pipeline 共用 pipeline layout
+    void createLightCullPipeline() {
+        mLightCullShaderModule = createShaderModule(readFile("shader/light_cull.spv"));
+
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.layout = mPipelineLayout;
+        pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineInfo.stage.module = mLightCullShaderModule;
+        pipelineInfo.stage.pName = "main";
+
+        if (vkCreateComputePipelines(mDevice, mPipelineCache.handle(), 1, &pipelineInfo, nullptr,
+                &mLightCullPipeline) != VK_SUCCESS) {
+            spdlog::error("{} failed to create light cull pipeline", __func__);
+            throw std::runtime_error("failed to create light cull pipeline");
+        }
+    }
+
+    // 每个线程处理一个 cluster, 结果在 fragment shader 中读取, 前后的 barrier 由 mFrameGraph 生成
+    // 每一帧都有自己的 cluster buffer, 不会和前一帧还在执行的 fragment shader 冲突
+    void recordLightCulling(VkCommandBuffer commandBuffer) {
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mLightCullPipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, mPipelineLayout,
+            0, 1, &mDescriptorSets[mCurrentFrame], 0, nullptr);
+        vkCmdDispatch(commandBuffer,
+            (ops::ClusterGrid::COUNT + LIGHT_CULL_WORKGROUP_SIZE - 1) / LIGHT_CULL_WORKGROUP_SIZE, 1, 1);
+    }
+
+    void createLightingBuffers() {
+        mLightingUniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        mLightingUniformBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        mLightingUniformBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+        mLightBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        mLightBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        mLightBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+        mClusterBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        mClusterBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        mClusterStatsBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        mClusterStatsBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+        mClusterStatsBuffersMapped.resize(MAX_FRAMES_IN_FLIGHT);
+
+        VkDeviceSize lightsSize = MAX_LIGHTS * sizeof(ops::GpuLight);
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            createBuffer(sizeof(ops::LightingUniform), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                mLightingUniformBuffers[i], mLightingUniformBuffersMemory[i]
+            );
+            vkMapMemory(mDevice, mLightingUniformBuffersMemory[i], 0, sizeof(ops::LightingUniform), 0,
+                &mLightingUniformBuffersMapped[i]);
+
+            // 光源每一帧都会移动, 直接写在 host visible 的内存中, light_cull.comp 中每个光源每个 workgroup 只读一次
+            createBuffer(lightsSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                mLightBuffers[i], mLightBuffersMemory[i]
+            );
+            vkMapMemory(mDevice, mLightBuffersMemory[i], 0, lightsSize, 0, &mLightBuffersMapped[i]);
+
+            createBuffer(ops::ClusterGrid::countsSize() + ops::ClusterGrid::indicesSize(),
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                mClusterBuffers[i], mClusterBuffersMemory[i]
+            );
+
+            createBuffer(sizeof(ops::ClusterStats), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                mClusterStatsBuffers[i], mClusterStatsBuffersMemory[i]
+            );
+            vkMapMemory(mDevice, mClusterStatsBuffersMemory[i], 0, sizeof(ops::ClusterStats), 0,
+                &mClusterStatsBuffersMapped[i]);
+        }
+    }
+
+    void destroyLightingBuffers() {
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+            vkDestroyBuffer(mDevice, mLightingUniformBuffers[i], nullptr);
+            vkFreeMemory(mDevice, mLightingUniformBuffersMemory[i], nullptr);
+            vkDestroyBuffer(mDevice, mLightBuffers[i], nullptr);
+            vkFreeMemory(mDevice, mLightBuffersMemory[i], nullptr);
+            vkDestroyBuffer(mDevice, mClusterBuffers[i], nullptr);
+            vkFreeMemory(mDevice, mClusterBuffersMemory[i], nullptr);
+            vkDestroyBuffer(mDevice, mClusterStatsBuffers[i], nullptr);
+            vkFreeMemory(mDevice, mClusterStatsBuffersMemory[i], nullptr);
+        }
+    }
+
+    // 模型在世界空间中的包围盒, 没有加载到模型的时候保留默认的 [-1, 1]
+    void computeSceneBounds() {
+        if (mVertices.empty()) {
+            return;
+        }
+        glm::mat4 model = modelMatrix();
+        mSceneBoundsMin = glm::vec3(std::numeric_limits<float>::max());
+        mSceneBoundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+        for (const ops::Vertex& vertex : mVertices) {
+            glm::vec3 position = glm::vec3(model * glm::vec4(vertex.mPos, 1.0f));
+            mSceneBoundsMin = glm::min(mSceneBoundsMin, position);
+            mSceneBoundsMax = glm::max(mSceneBoundsMax, position);
+        }
+    }
+
+    // 只在渲染线程 (或者启动的时候) 调用, 光源 buffer 按 MAX_LIGHTS 分配, 不需要重新创建
+    void setLightCount(uint32_t count) {
+        mLightField.generate(count, mSceneBoundsMin, mSceneBoundsMax);
+        mLightsPerCluster.reset();
+        mMaxLightsPerCluster = 0;
+        mOverflowClusters = 0;
+        spdlog::info("{} {} dynamic lights", __func__, count);
+    }
+
+    // 读取上一次使用这个 frame 的 light_cull.comp 的统计
+    void collectClusterStats(uint32_t frame) {
+        if (mFrameLightCounts[frame] == 0) {
+            return;
+        }
+        ops::ClusterStats stats;
+        memcpy(&stats, mClusterStatsBuffersMapped[frame], sizeof(stats));
+        if (mFrameLightCounts[frame] == mLightField.count()) {
+            // 每个有光源的 cluster 平均被多少个光源影响, 也就是被照亮的像素平均需要计算的光源数量
+            mLightsPerCluster.add(stats.mOccupiedClusters == 0 ? 0.0 :
+                static_cast<double>(stats.mLightReferences) / stats.mOccupiedClusters);
+            mMaxLightsPerCluster = std::max(mMaxLightsPerCluster, stats.mMaxLightsPerCluster);
+            mOverflowClusters = std::max(mOverflowClusters, stats.mOverflowClusters);
+        }
+        mFrameLightCounts[frame] = 0;
+    }
+
+    void logClusterStats() {
+        spdlog::info("{} {} lights, {:.1f} lights per occupied cluster, max {} (shaded {}), {} clusters truncated",
+            __func__, mLightField.count(), mLightsPerCluster.mean(), mMaxLightsPerCluster,
+            std::min(mMaxLightsPerCluster, ops::ClusterGrid::MAX_LIGHTS_PER_CLUSTER), mOverflowClusters);
+    }
+
+    // 依次使用 LIGHT_BENCHMARK_COUNTS 中的光源数量, 比较 gpu 耗时和每个 cluster 中的光源数量:
+    // 光源总数增加 10000 倍, 每个像素计算的光源数量受 MAX_LIGHTS_PER_CLUSTER 限制, gpu 耗时也应该有上限
+    void startLightBenchmark() {
+        mLightBenchmarkStage = 0;
+        mLightBenchmarkFrames = 0;
+        mLightBenchmarkGpuTime.reset();
+        setLightCount(LIGHT_BENCHMARK_COUNTS[0]);
+    }
+
+    void updateLightBenchmark() {
+        if (mLightBenchmarkStage >= LIGHT_BENCHMARK_COUNTS.size()) {
+            return;
+        }
+        if (++mLightBenchmarkFrames < LIGHT_BENCHMARK_WARMUP_FRAMES + LIGHT_BENCHMARK_FRAMES) {
+            return;
+        }
+        spdlog::info("{} {:5} lights: gpu {:.3f} ms (p95 {:.3f}), {:.1f} lights per occupied cluster, "
+            "max {} (shaded {}), {} clusters truncated",
+            __func__, mLightField.count(), mLightBenchmarkGpuTime.mean(), mLightBenchmarkGpuTime.percentile(0.95),
+            mLightsPerCluster.mean(), mMaxLightsPerCluster,
+            std::min(mMaxLightsPerCluster, ops::ClusterGrid::MAX_LIGHTS_PER_CLUSTER), mOverflowClusters);
+
+        mLightBenchmarkFrames = 0;
+        mLightBenchmarkGpuTime.reset();
+        if (++mLightBenchmarkStage < LIGHT_BENCHMARK_COUNTS.size()) {
+            setLightCount(LIGHT_BENCHMARK_COUNTS[mLightBenchmarkStage]);
+        } else {
+            setLightCount(std::clamp(mOptions.mLightCount, 1u, MAX_LIGHTS));
+        }
+    }
+
+    // shadow map 数组, 采样用的 view, 每一层的 framebuffer, 以及比较采样器
+    void createShadowResources() {
+        // 采样的时候使用硬件的比较和双线性过滤
+        mShadowFormat = findSupportedFormat(
+            {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D16_UNORM},
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+                VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT
+        );
+        createShadowRenderPass();
+
+        VkImage image;
+        VkDeviceMemory imageMemory;
+        createImage(SHADOW_MAP_SIZE, SHADOW_MAP_SIZE,
+            mShadowFormat,
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            image,
+            imageMemory,
+            ops::ShadowCascades::COUNT
+        );
+        mShadowImage = ops::Image(mFrameTimeline, image);
+        mShadowImageMemory = ops::DeviceMemory(mFrameTimeline, imageMemory);
+        mShadowImageView = ops::ImageView(mFrameTimeline, createImageView(image, mShadowFormat,
+            VK_IMAGE_ASPECT_DEPTH_BIT, VK_IMAGE_VIEW_TYPE_2D_ARRAY, 0, ops::ShadowCascades::COUNT));
+
+        for (uint32_t cascade = 0; cascade < ops::ShadowCascades::COUNT; ++cascade) {
+            mShadowLayerViews[cascade] = ops::ImageView(mFrameTimeline, createImageView(image, mShadowFormat,
+                VK_IMAGE_ASPECT_DEPTH_BIT, VK_IMAGE_VIEW_TYPE_2D, cascade, 1));
+
+            VkFramebufferCreateInfo framebufferInfo{};
+            framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+            framebufferInfo.renderPass = mShadowRenderPass;
+            framebufferInfo.attachmentCount = 1;
+            framebufferInfo.pAttachments = mShadowLayerViews[cascade].address();
+            framebufferInfo.width = SHADOW_MAP_SIZE;
+            framebufferInfo.height = SHADOW_MAP_SIZE;
+            framebufferInfo.layers = 1;
+
+            VkFramebuffer framebuffer;
+            if (vkCreateFramebuffer(mDevice, &framebufferInfo, nullptr, &framebuffer) != VK_SUCCESS) {
+                spdlog::error("{} failed to create framebuffer for shadow cascade {}", __func__, cascade);
+                throw std::runtime_error("failed to create shadow framebuffer");
+            }
+            mShadowFramebuffers[cascade] = ops::Framebuffer(mFrameTimeline, framebuffer);
+        }
+
+        // 超出 shadow map 范围的地方比较结果为 1, 当作没有遮挡
+        VkSamplerCreateInfo samplerInfo{};
+        samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        samplerInfo.magFilter = VK_FILTER_LINEAR;
+        samplerInfo.minFilter = VK_FILTER_LINEAR;
+        samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+        samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+        samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+        samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+        samplerInfo.compareEnable = VK_TRUE;
+        samplerInfo.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+        samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        samplerInfo.maxLod = 0.0f;
+
+        VkSampler sampler;
+        if (vkCreateSampler(mDevice, &samplerInfo, nullptr, &sampler) != VK_SUCCESS) {
+            spdlog::error("{} failed to create shadow sampler", __func__);
+            throw std::runtime_error("failed to create shadow sampler");
+        }
+        mShadowSampler = ops::Sampler(mFrameTimeline, sampler);
+        spdlog::info("{} {} cascades of {}x{}, format {}", __func__, ops::ShadowCascades::COUNT,
+            SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, static_cast<int>(mShadowFormat));
+    }
+
+    // 每个 cascade 单独开始一次 render pass, 整层清除之后重新渲染, 不需要保留之前的内容
+    void createShadowRenderPass() {
+        VkAttachmentDescription depthAttachment{};
+        depthAttachment.format = mShadowFormat;
+        depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+        depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+        depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+        VkAttachmentReference depthAttachmentRef{0, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+
+        VkSubpassDescription subpass{};
+        subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+        std::array<VkSubpassDependency, 2> dependencies{};
+        // 之前的帧还在 fragment shader 中采样这一层的时候不能覆盖 (write after read, 只需要执行依赖)
+        dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[0].dstSubpass = 0;
+        dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        dependencies[0].srcAccessMask = 0;
+        dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+            VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        // 渲染的结果在这一帧和之后的帧的 fragment shader 中采样
+        dependencies[1].srcSubpass = 0;
+        dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+        dependencies[1].srcStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+            VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+        dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+        VkRenderPassCreateInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+        renderPassInfo.attachmentCount = 1;
+        renderPassInfo.pAttachments = &depthAttachment;
+        renderPassInfo.subpassCount = 1;
+        renderPassInfo.pSubpasses = &subpass;
+        renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+        renderPassInfo.pDependencies = dependencies.data();
+
+        if (vkCreateRenderPass(mDevice, &renderPassInfo, nullptr, &mShadowRenderPass) != VK_SUCCESS) {
+            spdlog::error("{} failed to create shadow render pass", __func__);
+            throw std::runtime_error("failed to create shadow render pass");
+        }
+    }
+
+    // 只有深度的 pipeline: 只读取位置, 没有 fragment shader, 用 depth bias 减少 shadow acne
+    void createShadowPipeline() {
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = sizeof(glm::mat4);
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+        if (vkCreatePipelineLayout(mDevice, &pipelineLayoutInfo, nullptr, &mShadowPipelineLayout) != VK_SUCCESS) {
+            spdlog::error("{} failed to create shadow pipeline layout", __func__);
+            throw std::runtime_error("failed to create shadow pipeline layout");
+        }
+
+        mShadowVertShaderModule = createShaderModule(readFile("shader/shadow.spv"));
+        VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
+        vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+        vertShaderStageInfo.module = mShadowVertShaderModule;
+        vertShaderStageInfo.pName = "main";
+
+        // 紧密排列的 vec3, 见 createShadowPositionBuffer
+        VkVertexInputBindingDescription bindingDescription{};
+        bindingDescription.binding = 0;
+        bindingDescription.stride = sizeof(glm::vec3);
+        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        VkVertexInputAttributeDescription attributeDescription{};
+        attributeDescription.location = 0;
+        attributeDescription.binding = 0;
+        attributeDescription.format = VK_FORMAT_R32G32B32_SFLOAT;
+        attributeDescription.offset = 0;
+
+        VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+        vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+        vertexInputInfo.vertexBindingDescriptionCount = 1;
+        vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+        vertexInputInfo.vertexAttributeDescriptionCount = 1;
+        vertexInputInfo.pVertexAttributeDescriptions = &attributeDescription;
+
+        VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+        inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+        inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+        VkPipelineViewportStateCreateInfo viewportState{};
+        viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+        viewportState.viewportCount = 1;
+        viewportState.scissorCount = 1;
+
+        // 模型有很多单面的墙, 两面都要投射阴影
+        VkPipelineRasterizationStateCreateInfo rasterizer{};
+        rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+        rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+        rasterizer.lineWidth = 1.0f;
+        rasterizer.cullMode = VK_CULL_MODE_NONE;
+        rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+        rasterizer.depthBiasEnable = VK_TRUE;
+        rasterizer.depthBiasConstantFactor = 1.25f;
+        rasterizer.depthBiasSlopeFactor = 1.75f;
+
+        VkPipelineMultisampleStateCreateInfo multisampling{};
+        multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+        VkPipelineDepthStencilStateCreateInfo depthStencil{};
+        depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+        depthStencil.depthTestEnable = VK_TRUE;
+        depthStencil.depthWriteEnable = VK_TRUE;
+        depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+
+        VkPipelineColorBlendStateCreateInfo colorBlending{};
+        colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+        colorBlending.attachmentCount = 0;
+
+        std::array<VkDynamicState, 2> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+        VkPipelineDynamicStateCreateInfo dynamicState{};
+        dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+        dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+        dynamicState.pDynamicStates = dynamicStates.data();
+
+        VkGraphicsPipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+        pipelineInfo.stageCount = 1;
+        pipelineInfo.pStages = &vertShaderStageInfo;
+        pipelineInfo.pVertexInputState = &vertexInputInfo;
+        pipelineInfo.pInputAssemblyState = &inputAssembly;
+        pipelineInfo.pViewportState = &viewportState;
+        pipelineInfo.pRasterizationState = &rasterizer;
+        pipelineInfo.pMultisampleState = &multisampling;
+        pipelineInfo.pDepthStencilState = &depthStencil;
+        pipelineInfo.pColorBlendState = &colorBlending;
+        pipelineInfo.pDynamicState = &dynamicState;
+        pipelineInfo.layout = mShadowPipelineLayout;
+        pipelineInfo.renderPass = mShadowRenderPass;
+        pipelineInfo.subpass = 0;
+        pipelineInfo.basePipelineIndex = -1;
+
+        if (vkCreateGraphicsPipelines(mDevice, mPipelineCache.handle(), 1, &pipelineInfo, nullptr,
+                &mShadowPipeline) != VK_SUCCESS) {
+            spdlog::error("{} failed to create shadow pipeline", __func__);
+            throw std::runtime_error("failed to create shadow pipeline");
+        }
+    }
+
+    // 从 mVertices 中取出位置, 和 mIndexBuffer 一起使用
+    void createShadowPositionBuffer() {
+        std::vector<glm::vec3> positions;
+        positions.reserve(mVertices.size());
+        for (const ops::Vertex& vertex : mVertices) {
+            positions.push_back(vertex.mPos);
+        }
+        VkDeviceSize bufferSize = sizeof(positions[0]) * positions.size();
+
+        VkBuffer stagingBuffer;
+        VkDeviceMemory stagingBufferMemory;
+        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            stagingBuffer,
+            stagingBufferMemory
+        );
+
+        void* data;
+        vkMapMemory(mDevice, stagingBufferMemory, 0, bufferSize, 0, &data);
+        memcpy(data, positions.data(), static_cast<size_t>(bufferSize));
+        vkUnmapMemory(mDevice, stagingBufferMemory);
+
+        VkBuffer positionBuffer;
+        VkDeviceMemory positionBufferMemory;
+        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, positionBuffer, positionBufferMemory);
+        mShadowPositionBuffer = ops::Buffer(mFrameTimeline, positionBuffer);
+        mShadowPositionBufferMemory = ops::DeviceMemory(mFrameTimeline, positionBufferMemory);
+
+        uint64_t copyValue = copyBuffer(stagingBuffer, positionBuffer, bufferSize);
+        destroyStagingBufferAfter(copyValue, stagingBuffer, stagingBufferMemory);
+    }
+
+    // 只渲染 mShadowRenderMask 中的 cascade, 其他 cascade 保留之前的内容
+    void recordShadowPass(VkCommandBuffer commandBuffer) {
+        if (mTimestampQueryPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, mTimestampQueryPool,
+                mCurrentFrame * TIMESTAMPS_PER_FRAME + 2);
+        }
+
+        uint32_t rendered = 0;
+        glm::mat4 model = modelMatrix();
+        for (uint32_t cascade = 0; cascade < ops::ShadowCascades::COUNT; ++cascade) {
+            if (!(mShadowRenderMask & (1u << cascade))) {
+                continue;
+            }
+            VkClearValue clearValue{};
+            clearValue.depthStencil = {1.0f, 0};
+            VkRenderPassBeginInfo renderPassInfo{};
+            renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+            renderPassInfo.renderPass = mShadowRenderPass;
+            renderPassInfo.framebuffer = mShadowFramebuffers[cascade].get();
+            renderPassInfo.renderArea.offset = {0, 0};
+            renderPassInfo.renderArea.extent = {SHADOW_MAP_SIZE, SHADOW_MAP_SIZE};
+            renderPassInfo.clearValueCount = 1;
+            renderPassInfo.pClearValues = &clearValue;
+            vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mShadowPipeline);
+            VkViewport viewport{0.0f, 0.0f, static_cast<float>(SHADOW_MAP_SIZE), static_cast<float>(SHADOW_MAP_SIZE),
+                0.0f, 1.0f};
+            vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+            VkRect2D scissor{{0, 0}, {SHADOW_MAP_SIZE, SHADOW_MAP_SIZE}};
+            vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+            glm::mat4 lightModelViewProj = mShadowCascades.viewProj(cascade) * model;
+            vkCmdPushConstants(commandBuffer, mShadowPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT,
+                0, sizeof(lightModelViewProj), &lightModelViewProj);
+            VkBuffer vertexBuffers[] = {mShadowPositionBuffer.get()};
+            VkDeviceSize offsets[] = {0};
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+            for (auto& mesh : mMeshes) {
+                vkCmdBindIndexBuffer(commandBuffer, mIndexBuffer.get(), mesh.mOffset * sizeof(uint32_t),
+                    VK_INDEX_TYPE_UINT32);
+                vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(mesh.mIndices.size()), 1, 0, 0, 0);
+            }
+
+            vkCmdEndRenderPass(commandBuffer);
+            rendered++;
+        }
+        mFrameShadowCascades[mCurrentFrame] = rendered;
+
+        if (mTimestampQueryPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, mTimestampQueryPool,
+                mCurrentFrame * TIMESTAMPS_PER_FRAME + 3);
+        }
+    }
+
+    void logShadowStats() {
+        spdlog::info("{} shadow pass {:.3f} ms (p95 {:.3f}), {:.2f} cascades rendered per frame, cache {}",
+            __func__, mShadowGpuTime.mean(), mShadowGpuTime.percentile(0.95), mShadowCascadesRendered.mean(),
+            mShadowCacheEnabled ? "on" : "off");
+        mShadowGpuTime.reset();
+        mShadowCascadesRendered.reset();
+    }
+
+    // 相机不动的时候比较开启和关闭缓存的 shadow pass 耗时, 结束之后恢复启动参数中的设置
+    void startShadowBenchmark() {
+        mShadowBenchmarkStage = 0;
+        mShadowBenchmarkFrames = 0;
+        mShadowBenchmarkGpuTime.reset();
+        mShadowBenchmarkCascades.reset();
+        mShadowCacheEnabled = true;
+    }
+
+    void updateShadowBenchmark() {
+        if (mShadowBenchmarkStage >= 2 || ++mShadowBenchmarkFrames < SHADOW_BENCHMARK_FRAMES) {
+            return;
+        }
+        spdlog::info("{} cache {}: shadow pass {:.3f} ms (p95 {:.3f}), {:.2f} cascades rendered per frame",
+            __func__, mShadowCacheEnabled ? "on" : "off", mShadowBenchmarkGpuTime.mean(),
+            mShadowBenchmarkGpuTime.percentile(0.95), mShadowBenchmarkCascades.mean());
+
+        mShadowBenchmarkFrames = 0;
+        mShadowBenchmarkGpuTime.reset();
+        mShadowBenchmarkCascades.reset();
+        mShadowBenchmarkStage++;
+        mShadowCacheEnabled = mShadowBenchmarkStage == 2 ? mOptions.mShadowCache : false;
+    }
+
     void createDescriptorPool() {
-        std::array<VkDescriptorPoolSize, 2> poolSizes{};
+        std::array<VkDescriptorPoolSize, 3> poolSizes{};
         poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
         // Todo: 这里存在一些问题，我们在创建 Descriptor Pool 的时候，需要告知 vulkan 我们需要多少个 descriptor set
-        // 这里我们创建了两个 Uniform buffer object
-        poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * 2);
+        // 这里我们创建了三个 Uniform buffer object (变换矩阵, 纹理下标, 光照参数)
+        poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * 3);
         // 我们还创建了 3 个 texture
         poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        poolSizes[1].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * mTextureImages.size());
+        // 每个 texture 还有一张打包的材质贴图, 以及 shadow map
+        poolSizes[1].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT *
+            (mTextureImages.size() + mMaterialImages.size() + 1));
+        // 光源, cluster 的光源数量和下标, 统计
+        poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        poolSizes[2].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * 4);
 
         VkDescriptorPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -1617,13 +3358,31 @@ private:
             int imagesNums = mTextureImages.size();
             imagesInfo.resize(imagesNums);
             for (int i = 0; i < imagesNums; i++) {
-                imagesInfo[i].imageView = mTextureImagesView[i];
+                imagesInfo[i].imageView = mTextureImagesView[i].get();
                 // Todo: 所有的 texture 是否可以共用一个 sampler
-                imagesInfo[i].sampler = mTextureSampler;
+                imagesInfo[i].sampler = mTextureSampler.get();
                 imagesInfo[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
             }
 
-            std::array<VkWriteDescriptorSet, 3> descriptorWrites{};
+            // clustered lighting: 3 是 uniform, 4 ~ 7 是 storage buffer
+            VkDescriptorBufferInfo lightingBufferInfo{mLightingUniformBuffers[i], 0, sizeof(ops::LightingUniform)};
+            std::array<VkDescriptorBufferInfo, 4> storageBufferInfos = {{
+                {mLightBuffers[i], 0, MAX_LIGHTS * sizeof(ops::GpuLight)},
+                {mClusterBuffers[i], 0, ops::ClusterGrid::countsSize()},
+                {mClusterBuffers[i], ops::ClusterGrid::countsSize(), ops::ClusterGrid::indicesSize()},
+                {mClusterStatsBuffers[i], 0, sizeof(ops::ClusterStats)},
+            }};
+
+            std::vector<VkDescriptorImageInfo> materialImagesInfo(mMaterialImagesView.size());
+            for (size_t material = 0; material < mMaterialImagesView.size(); ++material) {
+                materialImagesInfo[material] = {mTextureSampler.get(), mMaterialImagesView[material].get(),
+                    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+            }
+
+            VkDescriptorImageInfo shadowMapInfo{mShadowSampler.get(), mShadowImageView.get(),
+                VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL};
+
+            std::array<VkWriteDescriptorSet, 10> descriptorWrites{};
             // ubo for rotate matrix and project matrix
             descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
             descriptorWrites[0].dstSet = mDescriptorSets[i];
@@ -1652,6 +3411,38 @@ private:
             descriptorWrites[2].pBufferInfo = &uboIndexBufferInfo;
             descriptorWrites[2].pImageInfo = nullptr;
             descriptorWrites[2].pTexelBufferView = nullptr;
+            // lighting uniform
+            descriptorWrites[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[3].dstSet = mDescriptorSets[i];
+            descriptorWrites[3].dstBinding = 3;
+            descriptorWrites[3].dstArrayElement = 0;
+            descriptorWrites[3].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            descriptorWrites[3].descriptorCount = 1;
+            descriptorWrites[3].pBufferInfo = &lightingBufferInfo;
+            for (uint32_t storage = 0; storage < storageBufferInfos.size(); ++storage) {
+                VkWriteDescriptorSet& write = descriptorWrites[4 + storage];
+                write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                write.dstSet = mDescriptorSets[i];
+                write.dstBinding = 4 + storage;
+                write.dstArrayElement = 0;
+                write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                write.descriptorCount = 1;
+                write.pBufferInfo = &storageBufferInfos[storage];
+            }
+            descriptorWrites[8].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[8].dstSet = mDescriptorSets[i];
+            descriptorWrites[8].dstBinding = 8;
+            descriptorWrites[8].dstArrayElement = 0;
+            descriptorWrites[8].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            descriptorWrites[8].descriptorCount = 1;
+            descriptorWrites[8].pImageInfo = &shadowMapInfo;
+            descriptorWrites[9].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrites[9].dstSet = mDescriptorSets[i];
+            descriptorWrites[9].dstBinding = 9;
+            descriptorWrites[9].dstArrayElement = 0;
+            descriptorWrites[9].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            descriptorWrites[9].descriptorCount = static_cast<uint32_t>(materialImagesInfo.size());
+            descriptorWrites[9].pImageInfo = materialImagesInfo.data();
 
             vkUpdateDescriptorSets(mDevice,
                 static_cast<uint32_t>(descriptorWrites.size()), 
@@ -1661,23 +3452,24 @@ private:
     }
 
     void updateUniformBuffer(uint32_t currentImage) {
-        static auto startTime = std::chrono::high_resolution_clock::now();
-
-        // 更新 camera 位置
-        processInput(mWindow);
+        // 取 update 线程最近发布的状态, 按照距离这个 tick 过去的时间在上一个 tick 和这个 tick 之间插值
+        const SimulationState& state = mSimulationBuffer.read();
+        std::chrono::duration<float> sinceTick = std::chrono::steady_clock::now() - state.mTickTime;
+        float alpha = std::clamp(sinceTick.count() * static_cast<float>(UPDATE_RATE_HZ), 0.0f, 1.0f);
+        glm::vec3 cameraPos = glm::mix(state.mPrevCameraPos, state.mCameraPos, alpha);
 
         UniformBufferObject ubo{};
-        ubo.mModel = glm::rotate(glm::mat4(1.0f), glm::radians(70.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        ubo.mModel = modelMatrix();
         //ubo.mModel = glm::rotate(ubo.mModel, timeDiff * glm::radians(22.0f), glm::vec3(0.0f, 0.0f, 1.0f));
         ubo.mView = glm::lookAt(
-            mCameraPos, // eyes
-            mCameraPos + front, // center
+            cameraPos, // eyes
+            cameraPos + front, // center
             up  // up
         );
-        ubo.mProj = glm::perspective(glm::radians(45.0f),
+        ubo.mProj = glm::perspective(glm::radians(CAMERA_FOV_Y_DEGREES),
             mSwapChainExtent.width / static_cast<float>(mSwapChainExtent.height),
-            0.1f,
-            100.0f
+            CAMERA_NEAR,
+            CAMERA_FAR
         );
         // GLM最初是为OpenGL设计的，其中剪辑坐标的Y坐标是倒置的。
         // 补偿这一问题的最简单方法是翻转投影矩阵中 Y 轴缩放因子的符号。
@@ -1686,6 +3478,52 @@ private:
 
         // 将更新之后的 ubo 写入到映射的内存中
         memcpy(mUniformBuffersMapped[currentImage], &ubo, sizeof(ubo));
+
+        updateLighting(currentImage, cameraPos, ubo.mView, ubo.mProj);
+    }
+
+    // 模型只绕 y 轴旋转一个固定的角度
+    static glm::mat4 modelMatrix() {
+        return glm::rotate(glm::mat4(1.0f), glm::radians(70.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    }
+
+    // 写入这一帧的光照参数和光源的位置, 光源的运动按照墙上时间计算, 和帧率无关
+    void updateLighting(uint32_t currentImage, const glm::vec3& cameraPos, const glm::mat4& view,
+            const glm::mat4& proj) {
+        uint32_t lightCount = mLightField.count();
+        std::chrono::duration<float> time = std::chrono::steady_clock::now() - mLightStartTime;
+        mLightField.animate(time.count(), static_cast<ops::GpuLight*>(mLightBuffersMapped[currentImage]));
+        mFrameLightCounts[currentImage] = lightCount;
+
+        uint32_t width = std::max(mSwapChainExtent.width, 1u);
+        uint32_t height = std::max(mSwapChainExtent.height, 1u);
+        glm::vec2 sliceScaleBias = ops::ClusterGrid::sliceScaleBias(CAMERA_NEAR, CAMERA_FAR);
+        ops::LightingUniform lighting{};
+        lighting.mView = view;
+        lighting.mInverseProj = glm::inverse(proj);
+        lighting.mInverseView = glm::inverse(view);
+
+        // cascade 的矩阵和这一帧 shadow pass 使用的一致, 没有重新渲染的 cascade 的矩阵和缓存的内容一致
+        mShadowRenderMask = mShadowCascades.update(view, glm::radians(CAMERA_FOV_Y_DEGREES),
+            static_cast<float>(width) / static_cast<float>(height), CAMERA_NEAR, std::min(SHADOW_DISTANCE, CAMERA_FAR),
+            mSunDirection, SHADOW_MAP_SIZE, mShadowCacheEnabled);
+        for (uint32_t cascade = 0; cascade < ops::ShadowCascades::COUNT; ++cascade) {
+            lighting.mCascadeViewProj[cascade] = mShadowCascades.viewProj(cascade);
+        }
+        lighting.mCascadeSplits = mShadowCascades.splitDepths();
+        lighting.mCascadeTexelSizes = mShadowCascades.texelSizes();
+        lighting.mSunDirection = glm::vec4(glm::normalize(mSunDirection), 1.0f);
+        lighting.mSunColorIntensity = SUN_COLOR_INTENSITY;
+        lighting.mCameraPosition = glm::vec4(cameraPos, 1.0f);
+        lighting.mGridLightCount = glm::uvec4(ops::ClusterGrid::X, ops::ClusterGrid::Y, ops::ClusterGrid::Z, lightCount);
+        lighting.mDepthParams = glm::vec4(CAMERA_NEAR, CAMERA_FAR, sliceScaleBias.x, sliceScaleBias.y);
+        // tile 向上取整, 最后一列和最后一行的 tile 可能超出屏幕
+        lighting.mScreenParams = glm::vec4(
+            static_cast<float>((width + ops::ClusterGrid::X - 1) / ops::ClusterGrid::X),
+            static_cast<float>((height + ops::ClusterGrid::Y - 1) / ops::ClusterGrid::Y),
+            static_cast<float>(width),
+            static_cast<float>(height));
+        memcpy(mLightingUniformBuffersMapped[currentImage], &lighting, sizeof(lighting));
     }
 
     void updateTextureIndex(uint32_t currentImage ,uint32_t textureIndex) {
@@ -1706,10 +3544,10 @@ private:
         uboLayoutBinding.pImmutableSamplers = nullptr; //optional
 
         // sampler layout binding
-        // 对应 fragment shader 中的 layout(binding = 1) uniform sampler2D texSampler[3];
+        // 对应 fragment shader 中的 layout(binding = 1) uniform sampler2D texSampler[TEXTURE_COUNT];
         VkDescriptorSetLayoutBinding samplerLayoutBinding{};
         samplerLayoutBinding.binding = 1;
-        samplerLayoutBinding.descriptorCount = 3;   // 现在需要存储三个纹理，这里设置为 3
+        samplerLayoutBinding.descriptorCount = mTextureCount;   // 和 shader 中的 specialization constant 保持一致
         samplerLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
         samplerLayoutBinding.pImmutableSamplers = nullptr;
         samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
@@ -1721,10 +3559,39 @@ private:
         samplerIndexLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
         samplerIndexLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
-        std::array<VkDescriptorSetLayoutBinding, 3> bindings = {
+        // clustered lighting: light_cull.comp 和 fragment shader 都会用到
+        //   3: LightingUniform, 4: 光源, 5: cluster 的光源数量, 6: cluster 的光源下标, 7: 统计 (只有 compute)
+        std::array<VkDescriptorSetLayoutBinding, 5> lightingBindings{};
+        for (uint32_t i = 0; i < lightingBindings.size(); ++i) {
+            lightingBindings[i].binding = 3 + i;
+            lightingBindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            lightingBindings[i].descriptorCount = 1;
+            lightingBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT |
+                (i == 4 ? 0 : VK_SHADER_STAGE_FRAGMENT_BIT);
+        }
+
+        // 8: cascaded shadow map
+        VkDescriptorSetLayoutBinding shadowMapBinding{};
+        shadowMapBinding.binding = 8;
+        shadowMapBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        shadowMapBinding.descriptorCount = 1;
+        shadowMapBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+        // 9: 打包的材质贴图 (ORM + alpha), 和 binding 1 的纹理数组一一对应
+        VkDescriptorSetLayoutBinding materialLayoutBinding = samplerLayoutBinding;
+        materialLayoutBinding.binding = 9;
+
+        std::array<VkDescriptorSetLayoutBinding, 10> bindings = {
             uboLayoutBinding,
             samplerLayoutBinding,
-            samplerIndexLayoutBinding
+            samplerIndexLayoutBinding,
+            lightingBindings[0],
+            lightingBindings[1],
+            lightingBindings[2],
+            lightingBindings[3],
+            lightingBindings[4],
+            shadowMapBinding,
+            materialLayoutBinding
         };
         // 所有的描述符的绑定，都需要组合到一个 VkDescriptorSetLayout 对象上面
         VkDescriptorSetLayoutCreateInfo layoutInfo{};
@@ -1736,6 +3603,35 @@ private:
             spdlog::error("{}: failed to create descriptor set layout!", __func__);
             throw std::runtime_error("failed to create descriptor set layout!");
         }
+
+        if (mDeferred) {
+            createGBufferSetLayout();
+        }
+    }
+
+    // deferred 光照 subpass 的 set 1: G-buffer 和深度, 顺序和 deferred_lighting.frag 一致
+    void createGBufferSetLayout() {
+        VkDescriptorSetLayoutBinding inputBinding{};
+        inputBinding.binding = 0;
+        inputBinding.descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+        inputBinding.descriptorCount = 1;
+        inputBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+        std::array<VkDescriptorSetLayoutBinding, GBUFFER_FORMATS.size() + 1> bindings{};
+        for (uint32_t i = 0; i < bindings.size(); ++i) {
+            bindings[i] = inputBinding;
+            bindings[i].binding = i;
+        }
+
+        VkDescriptorSetLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+        layoutInfo.pBindings = bindings.data();
+
+        if (vkCreateDescriptorSetLayout(mDevice, &layoutInfo, nullptr, &mGBufferSetLayout) != VK_SUCCESS) {
+            spdlog::error("{}: failed to create G-buffer descriptor set layout!", __func__);
+            throw std::runtime_error("failed to create G-buffer descriptor set layout!");
+        }
     }
 
     void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
@@ -1747,27 +3643,132 @@ private:
             throw std::runtime_error("failed to begin recording command buffer");
         }
 
-        VkRenderPassBeginInfo renderPassInfo{};
-        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        renderPassInfo.renderPass = mRenderPass;
-        renderPassInfo.framebuffer = mSwapChainFramebuffers[imageIndex];
-        renderPassInfo.renderArea.offset = {0, 0};
-        renderPassInfo.renderArea.extent = mSwapChainExtent;
+        if (mTimestampQueryPool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(commandBuffer, mTimestampQueryPool, mCurrentFrame * TIMESTAMPS_PER_FRAME,
+                TIMESTAMPS_PER_FRAME);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, mTimestampQueryPool,
+                mCurrentFrame * TIMESTAMPS_PER_FRAME);
+        }
 
-        std::array<VkClearValue, 2> clearValues{};
-#ifndef USE_SELF_DEFINED_CLEAR_COLOR
-        clearValues[0].color = {{0.0f, 0.0f, 0.0f, 1.0f}};
-#else
-        clearValues[0].color = {{0.102f, 0.102f, 0.102f, 1.0f}};
-#endif /* USE_SELF_DEFINED_CLEAR_COLOR */
-        clearValues[1].depthStencil = {1.0f, 0};
+        recordShadowPass(commandBuffer);
 
-        renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
-        renderPassInfo.pClearValues = clearValues.data();
+        // 光源分配到 cluster 必须在 render pass 之外完成, 由图中的 light-cull pass 录制
+        mRecordingImageIndex = imageIndex;
+        mFrameGraph.bindImage(mSwapChainResource, mSwapChainImages[imageIndex]);
+        if (mFrameGraph.isCulled(mLightCullPass)) {
+            // 没有执行 light culling, 这一帧没有可以读取的 cluster 统计
+            mFrameLightCounts[mCurrentFrame] = 0;
+        }
+        mFrameGraph.execute(commandBuffer);
 
-        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        if (mTimestampQueryPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, mTimestampQueryPool,
+                mCurrentFrame * TIMESTAMPS_PER_FRAME + 1);
+            mTimestampsWritten[mCurrentFrame] = true;
+        }
+
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+            spdlog::error("{} failed to record command buffer", __func__);
+            throw std::runtime_error("failed to record command buffer");
+        }
+    }
+
+    // 交换链大小或者 FEATURE_LIGHTING 变化的时候重新声明每一帧的 pass 和资源
+    // 声明的顺序就是执行的顺序; depth 的生命周期不随光照开关变化, 重新编译时复用已经创建的 image,
+    // framebuffer 和 G-buffer 的 descriptor 中的 view 仍然有效
+    void buildFrameGraph() {
+        mFrameGraph.reset();
+
+        // 交换链图像在 acquire 的 semaphore 上等待 COLOR_ATTACHMENT_OUTPUT, 之前的内容不需要保留
+        mSwapChainResource = mFrameGraph.importImage("swapchain", VK_IMAGE_ASPECT_COLOR_BIT,
+            {VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, VK_ACCESS_2_NONE_KHR, VK_IMAGE_LAYOUT_UNDEFINED},
+            {VK_PIPELINE_STAGE_2_NONE_KHR, VK_ACCESS_2_NONE_KHR, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR},
+            true);
+        // cluster buffer 每一帧一份, 上一次使用它的提交已经在 drawFrame 开始时等待完成
+        mClusterResource = mFrameGraph.importBuffer("clusters", {}, {}, false);
+        // 统计在帧完成之后由 cpu 读取
+        mClusterStatsResource = mFrameGraph.importBuffer("cluster-stats", {},
+            {VK_PIPELINE_STAGE_2_HOST_BIT_KHR, VK_ACCESS_2_HOST_READ_BIT_KHR}, false);
+
+        // deferred shading 中深度只在 render pass 内部被光照 subpass 读取, 和 G-buffer 一样是 transient 的
+        ops::TransientImageDesc depthDesc{};
+        depthDesc.mFormat = mDepthFormat;
+        depthDesc.mExtent = mSwapChainExtent;
+        depthDesc.mUsage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+        depthDesc.mAspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+        if (hasStencilComponent(mDepthFormat)) {
+            depthDesc.mAspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+        }
+        if (mDeferred) {
+            depthDesc.mUsage |= VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+            depthDesc.mMemoryProperties = transientAttachmentMemoryProperties();
+        }
+        mDepthResource = mFrameGraph.createImage("depth", depthDesc);
+
+        uint32_t clearPass = mFrameGraph.addPass("cluster-stats-clear", [this](VkCommandBuffer commandBuffer) {
+            vkCmdFillBuffer(commandBuffer, mClusterStatsBuffers[mCurrentFrame], 0, sizeof(ops::ClusterStats), 0);
+        });
+        mFrameGraph.write(clearPass, mClusterStatsResource,
+            {VK_PIPELINE_STAGE_2_TRANSFER_BIT_KHR, VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR,
+                VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_MAX_ENUM, true});
+
+        mLightCullPass = mFrameGraph.addPass("light-cull", [this](VkCommandBuffer commandBuffer) {
+            recordLightCulling(commandBuffer);
+        });
+        mFrameGraph.write(mLightCullPass, mClusterStatsResource,
+            {VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_READ_BIT_KHR | VK_ACCESS_2_SHADER_WRITE_BIT_KHR});
+        mFrameGraph.write(mLightCullPass, mClusterResource,
+            {VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_WRITE_BIT_KHR,
+                VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_MAX_ENUM, true});
+
+        uint32_t mainPass = mFrameGraph.addPass(mDeferred ? "deferred" : "forward", [this](VkCommandBuffer commandBuffer) {
+            recordMainPass(commandBuffer, mRecordingImageIndex);
+        });
+        // 关闭光照之后没有 pass 读取 cluster, light culling 和统计的清零都会被剔除
+        if (mFeatureFlags & FEATURE_LIGHTING) {
+            mFrameGraph.read(mainPass, mClusterResource,
+                {VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_READ_BIT_KHR});
+        }
+        VkPipelineStageFlags2KHR depthStages = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT_KHR |
+            VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT_KHR;
+        VkAccessFlags2KHR depthAccess = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT_KHR |
+            VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT_KHR;
+        if (mUseDynamicRendering) {
+            // 没有 render pass 帮我们做 layout 转换, 由图生成 barrier
+            mFrameGraph.write(mainPass, mSwapChainResource,
+                {VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR,
+                    VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_MAX_ENUM, true});
+            mFrameGraph.write(mainPass, mDepthResource,
+                {depthStages, depthAccess, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_MAX_ENUM, true});
+        } else {
+            // layout 转换和同步由 mRenderPass 完成, 只声明 render pass 结束时的 layout
+            mFrameGraph.write(mainPass, mSwapChainResource,
+                {VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT_KHR,
+                    VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, true});
+            if (mDeferred) {
+                depthStages |= VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT_KHR;
+                depthAccess |= VK_ACCESS_2_INPUT_ATTACHMENT_READ_BIT_KHR;
+            }
+            mFrameGraph.write(mainPass, mDepthResource,
+                {depthStages, depthAccess, VK_IMAGE_LAYOUT_UNDEFINED, mDeferred ?
+                    VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, true});
+        }
+
+        mFrameGraph.compile();
+        mFrameGraph.dump();
+    }
+
+    // forward 或者 deferred 的主 render pass
+    void recordMainPass(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+        if (mUseDynamicRendering) {
+            beginDynamicRendering(commandBuffer, imageIndex);
+        } else {
+            beginRenderPass(commandBuffer, imageIndex);
+        }
 
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, mGraphicsPipeline);
+        // 当前状态对应的变体还没有编译好的时候，先使用默认的 pipeline
+        VkPipeline pipeline = mPipelineVariants.get(currentPipelineVariantKey(), mGraphicsPipeline);
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
 
         VkViewport viewport{};
         viewport.x = 0.0f;
@@ -1794,11 +3795,11 @@ private:
             index.u_samplerIndex = mesh.mMeterial_ID;
             //updateTextureIndex(mCurrentFrame, mesh.mMeterial_ID);
             // vertex buffer
-            VkBuffer vertexBuffers[] = {mVertexBuffer};
+            VkBuffer vertexBuffers[] = {mVertexBuffer.get()};
             VkDeviceSize offsets[] = {0};
             VkDeviceSize indicesOffsets = mesh.mOffset * sizeof(uint32_t);
             vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-            vkCmdBindIndexBuffer(commandBuffer, mIndexBuffer, indicesOffsets, VK_INDEX_TYPE_UINT32);
+            vkCmdBindIndexBuffer(commandBuffer, mIndexBuffer.get(), indicesOffsets, VK_INDEX_TYPE_UINT32);
             vkCmdBindDescriptorSets(commandBuffer,
                 VK_PIPELINE_BIND_POINT_GRAPHICS,
                 mPipelineLayout,
@@ -1816,14 +3817,74 @@ private:
             vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(meshIndices.size()), 1, 0, 0, 0);
         }
 
-        vkCmdEndRenderPass(commandBuffer);
+        if (mDeferred) {
+            recordDeferredLighting(commandBuffer);
+        }
 
-        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
-            spdlog::error("{} failed to record command buffer", __func__);
-            throw std::runtime_error("failed to record command buffer");
+        if (mUseDynamicRendering) {
+            mCmdEndRendering(commandBuffer);
+        } else {
+            vkCmdEndRenderPass(commandBuffer);
         }
     }
 
+    void beginRenderPass(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+        VkRenderPassBeginInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = mRenderPass;
+        renderPassInfo.framebuffer = mSwapChainFramebuffers[imageIndex].get();
+        renderPassInfo.renderArea.offset = {0, 0};
+        renderPassInfo.renderArea.extent = mSwapChainExtent;
+
+        // deferred render pass 的 G-buffer 不清除, 这里的值不会被使用
+        std::array<VkClearValue, 2 + GBUFFER_FORMATS.size()> clearValues{};
+        clearValues[0].color = clearColor();
+        clearValues[1].depthStencil = {1.0f, 0};
+
+        renderPassInfo.clearValueCount = mDeferred ? static_cast<uint32_t>(clearValues.size()) : 2;
+        renderPassInfo.pClearValues = clearValues.data();
+
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    }
+
+    VkClearColorValue clearColor() {
+#ifndef USE_SELF_DEFINED_CLEAR_COLOR
+        return {{0.0f, 0.0f, 0.0f, 1.0f}};
+#else
+        return {{0.102f, 0.102f, 0.102f, 1.0f}};
+#endif /* USE_SELF_DEFINED_CLEAR_COLOR */
+    }
+
+    // 交换链图像和深度的 layout 已经由 mFrameGraph 在 pass 之前转换好
+    void beginDynamicRendering(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+        VkRenderingAttachmentInfoKHR colorAttachment{};
+        colorAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+        colorAttachment.imageView = mSwapChainImageViews[imageIndex].get();
+        colorAttachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+        colorAttachment.clearValue.color = clearColor();
+
+        VkRenderingAttachmentInfoKHR depthAttachment{};
+        depthAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO_KHR;
+        depthAttachment.imageView = mFrameGraph.imageView(mDepthResource);
+        depthAttachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depthAttachment.clearValue.depthStencil = {1.0f, 0};
+
+        VkRenderingInfoKHR renderingInfo{};
+        renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO_KHR;
+        renderingInfo.renderArea.offset = {0, 0};
+        renderingInfo.renderArea.extent = mSwapChainExtent;
+        renderingInfo.layerCount = 1;
+        renderingInfo.colorAttachmentCount = 1;
+        renderingInfo.pColorAttachments = &colorAttachment;
+        renderingInfo.pDepthAttachment = &depthAttachment;
+
+        mCmdBeginRendering(commandBuffer, &renderingInfo);
+    }
+
     // 二进制的 SPIR-V 代码需要转化为 VkShaderModule 对象
     VkShaderModule createShaderModule(const std::vector<char>& code) {
         VkShaderModuleCreateInfo createInfo{};
@@ -1841,6 +3902,21 @@ private:
         return shaderModule;
     }
 
+    // 和 createTextureImages() 的规则一致, 每一个带有漫反射贴图的 material 占用纹理数组中的一个位置
+    uint32_t countDiffuseTextures() {
+        uint32_t count = 0;
+        for (auto& material : mObjReaderInstance.GetMaterials()) {
+            if (!material.diffuse_texname.empty()) {
+                count++;
+            }
+        }
+        if (count == 0) {
+            spdlog::error("{} model {} has no diffuse texture", __func__, MODEL_PATH);
+            throw std::runtime_error("model has no diffuse texture");
+        }
+        return count;
+    }
+
     // Todo: 根据解析的模型中的materials 来创建所有的纹理
     void createTextureImages() {
         const std::vector<tinyobj::material_t>& materials = mObjReaderInstance.GetMaterials();
@@ -1855,16 +3931,100 @@ private:
                 VkDeviceMemory vkImageMemory;
                 VkImageView vkImageView;
                 createTextureImage(diffuseTexName, vkImage, vkImageMemory);
-                mTextureImages.push_back(vkImage);
-                mTextureImagesMemory.push_back(vkImageMemory);
+                mTextureImages.emplace_back(mFrameTimeline, vkImage);
+                mTextureImagesMemory.emplace_back(mFrameTimeline, vkImageMemory);
                 spdlog::debug("{} texture {} with index {}", __func__, diffuseTexName, index);
                 mTexName2IndexMap.insert(std::make_pair<>(diffuseTexName, index++));
                 vkImageView = createTextureImageView(vkImage);
-                mTextureImagesView.push_back(vkImageView);
+                mTextureImagesView.emplace_back(mFrameTimeline, vkImageView);
             }
         }
     }
 
+    // 材质的单通道贴图, 按 ops::PackedMaterial::Channel 排列, 空字符串表示使用默认值
+    // Blender 导出的 mtl 把 roughness 写成 map_Ns, metallic 写成 map_refl (tinyobj 不认识, 在 unknown_parameter 中)
+    std::array<std::string, ops::PackedMaterial::CHANNEL_COUNT> materialChannelPaths(
+            const tinyobj::material_t& material) {
+        std::array<std::string, ops::PackedMaterial::CHANNEL_COUNT> paths;
+        paths[ops::PackedMaterial::OCCLUSION] = material.ambient_texname;
+        paths[ops::PackedMaterial::ROUGHNESS] = !material.roughness_texname.empty() ?
+            material.roughness_texname : material.specular_highlight_texname;
+        paths[ops::PackedMaterial::METALLIC] = !material.metallic_texname.empty() ?
+            material.metallic_texname : material.reflection_texname;
+        if (paths[ops::PackedMaterial::METALLIC].empty()) {
+            auto it = material.unknown_parameter.find("map_refl");
+            if (it != material.unknown_parameter.end()) {
+                std::string value = it->second;
+                value.erase(value.find_last_not_of(" \t\r\n") + 1);
+                paths[ops::PackedMaterial::METALLIC] = value;
+            }
+        }
+        paths[ops::PackedMaterial::ALPHA] = material.alpha_texname;
+        return paths;
+    }
+
+    // 以单通道读取贴图, 路径不存在的时候再到 TEXTURE_DIR 中按文件名查找, 都失败时返回空的图像
+    ops::GrayImage loadGrayImage(const std::string& path) {
+        ops::GrayImage image{};
+        if (path.empty()) {
+            return image;
+        }
+        int width, height, channels;
+        stbi_uc* pixels = stbi_load(path.c_str(), &width, &height, &channels, STBI_grey);
+        std::string resolvedPath = path;
+        if (!pixels) {
+            resolvedPath = TEXTURE_DIR + path.substr(path.find_last_of("/\\") + 1);
+            pixels = stbi_load(resolvedPath.c_str(), &width, &height, &channels, STBI_grey);
+        }
+        if (!pixels) {
+            spdlog::warn("{} failed to load {}, using the default value", __func__, path);
+            return image;
+        }
+        image.mWidth = static_cast<uint32_t>(width);
+        image.mHeight = static_cast<uint32_t>(height);
+        image.mPixels.assign(pixels, pixels + size_t(width) * height);
+        stbi_image_free(pixels);
+        spdlog::debug("{} {} [{}x{}]", __func__, resolvedPath, width, height);
+        return image;
+    }
+
+    // 和 createTextureImages() 的规则一致, 每个带有漫反射贴图的 material 生成一张打包的材质贴图
+    // shader 中一次采样就可以得到 occlusion / roughness / metallic / alpha, 每个材质只占用一个 descriptor
+    void createMaterialTextures() {
+        for (auto& material : mObjReaderInstance.GetMaterials()) {
+            if (material.diffuse_texname.empty()) {
+                continue;
+            }
+            std::array<std::string, ops::PackedMaterial::CHANNEL_COUNT> paths = materialChannelPaths(material);
+            std::array<ops::GrayImage, ops::PackedMaterial::CHANNEL_COUNT> images;
+            std::array<const ops::GrayImage*, ops::PackedMaterial::CHANNEL_COUNT> sources{};
+            for (uint32_t channel = 0; channel < ops::PackedMaterial::CHANNEL_COUNT; ++channel) {
+                images[channel] = loadGrayImage(paths[channel]);
+                sources[channel] = &images[channel];
+            }
+            ops::PackedMaterial packed = ops::packMaterialChannels(sources);
+
+            VkImage vkImage;
+            VkDeviceMemory vkImageMemory;
+            uploadTextureImage(packed.mPixels.data(), packed.mWidth, packed.mHeight, VK_FORMAT_R8G8B8A8_UNORM,
+                vkImage, vkImageMemory);
+            mMaterialImages.emplace_back(mFrameTimeline, vkImage);
+            mMaterialImagesMemory.emplace_back(mFrameTimeline, vkImageMemory);
+            mMaterialImagesView.emplace_back(mFrameTimeline,
+                createImageView(vkImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_ASPECT_COLOR_BIT));
+
+            // 对比每张贴图单独作为 RGBA8 纹理上传时的大小
+            uint64_t packedSize = uint64_t(packed.mWidth) * packed.mHeight * 4;
+            uint64_t separateSize = 0;
+            for (const ops::GrayImage& image : images) {
+                separateSize += uint64_t(image.mWidth) * image.mHeight * 4;
+            }
+            spdlog::info("{} material {}: {} maps packed into [{}x{}], {} KiB instead of {} KiB", __func__,
+                material.name, packed.mSourceCount, packed.mWidth, packed.mHeight,
+                packedSize / 1024, separateSize / 1024);
+        }
+    }
+
     void createTextureImage(const std::string texturePath, VkImage& vkImage, VkDeviceMemory& vkImageMemory) {
         int texWidth, texHeight, texChannels;
         stbi_uc* pixels = stbi_load(texturePath.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
@@ -1883,6 +4043,17 @@ private:
         spdlog::info("{} load image with [{}x{}x{}], image size is {}",
             __func__, texWidth, texHeight, texChannels, imageSize);
 
+        uploadTextureImage(pixels, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight),
+            VK_FORMAT_R8G8B8A8_SRGB, vkImage, vkImageMemory);
+        stbi_image_free(pixels);
+    }
+
+    // 把 RGBA8 的像素拷贝到 staging buffer 并创建 image, 拷贝命令在 flushTextureUploads 中录制
+    // flushTextureUploads 提交之后 image 处于 SHADER_READ_ONLY_OPTIMAL
+    void uploadTextureImage(const void* pixels, uint32_t texWidth, uint32_t texHeight, VkFormat format,
+            VkImage& vkImage, VkDeviceMemory& vkImageMemory) {
+        VkDeviceSize imageSize = VkDeviceSize(texWidth) * texHeight * 4;
+
         VkBuffer stagingBuffer;
         VkDeviceMemory stagingBufferMemory;
         createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
@@ -1894,44 +4065,55 @@ private:
         memcpy(data, pixels, static_cast<size_t>(imageSize));
         vkUnmapMemory(mDevice, stagingBufferMemory);
 
-        stbi_image_free(pixels);
 #ifndef BUG_FIXES
         createImage(texWidth, texHeight,
-            VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
+            format, VK_IMAGE_TILING_OPTIMAL,
             VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vkImage, vkImageMemory
         );
 #else
         // VUID-VkImageViewCreateInfo-None-02273
         createImage(texWidth, texHeight,
-            VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_LINEAR,
+            format, VK_IMAGE_TILING_LINEAR,
             VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vkImage, vkImageMemory
         );
 #endif /* BUG_FIXES */
-        // 该图像是使用VK_IMAGE_LAYOUT_UNDEFINED布局创建的，因此在转换textureImage时应将其指定为旧布局。
-        // 请记住，我们可以这样做，因为在执行复制操作之前我们不关心其内容
-        // 未定义 → 传输目的地
-        transitionImageLayout(vkImage,
-            VK_FORMAT_R8G8B8A8_SRGB,
-            VK_IMAGE_LAYOUT_UNDEFINED,
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
-        );
-        // 从临时的 buffer 拷贝到 VkImage 中
-        copyBufferToImage(stagingBuffer,
-            vkImage,
-            static_cast<uint32_t>(texWidth),
-            static_cast<uint32_t>(texHeight)
-        );
-        // 传输目的地→着色器读取
-        transitionImageLayout(vkImage,
-            VK_FORMAT_R8G8B8A8_SRGB,
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
-        );
-        // 销毁临时的 buffer
-        vkDestroyBuffer(mDevice, stagingBuffer, nullptr);
-        vkFreeMemory(mDevice, stagingBufferMemory, nullptr);
+        mPendingTextureUploads.push_back({stagingBuffer, stagingBufferMemory, vkImage, texWidth, texHeight});
+    }
+
+    // 所有纹理共用一个 command buffer: 一次 barrier 把所有 image 转换到 TRANSFER_DST, 拷贝,
+    // 再一次 barrier 转换到 SHADER_READ_ONLY. 之前每张纹理需要 3 次提交和等待, 以及 2 次 vkCmdPipelineBarrier
+    void flushTextureUploads() {
+        if (mPendingTextureUploads.empty()) {
+            return;
+        }
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        ops::BarrierBatcher barriers(mCmdPipelineBarrier2);
+        for (const PendingTextureUpload& upload : mPendingTextureUploads) {
+            // 该图像是使用 VK_IMAGE_LAYOUT_UNDEFINED 布局创建的, 在执行复制操作之前我们不关心其内容
+            barriers.addImage(upload.mImage, VK_IMAGE_ASPECT_COLOR_BIT, 1, 1);
+            barriers.transition(upload.mImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        }
+        barriers.flush(commandBuffer);
+
+        for (const PendingTextureUpload& upload : mPendingTextureUploads) {
+            recordCopyBufferToImage(commandBuffer, upload.mStagingBuffer, upload.mImage, upload.mWidth, upload.mHeight);
+        }
+
+        // 传输目的地 → 着色器读取: 由片段着色器去做读取操作
+        for (const PendingTextureUpload& upload : mPendingTextureUploads) {
+            barriers.transition(upload.mImage, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+        }
+        barriers.flush(commandBuffer);
+
+        uint64_t uploadValue = submitSingleTimeCommands(commandBuffer);
+        for (const PendingTextureUpload& upload : mPendingTextureUploads) {
+            destroyStagingBufferAfter(uploadValue, upload.mStagingBuffer, upload.mStagingMemory);
+        }
+        spdlog::info("{} uploaded {} textures with {} barriers in {} pipeline barrier calls", __func__,
+            mPendingTextureUploads.size(), barriers.barrierCount(), barriers.flushCount());
+        mPendingTextureUploads.clear();
     }
 
     VkImageView createTextureImageView(const VkImage& vkImage) {
@@ -1969,23 +4151,26 @@ private:
         samplerInfo.maxLod = 0.0f;
 
         // 采用器不和任何特定的 Image 绑定，它提供了从纹理中提取颜色的接口，它可以用于任何图像
-        if (vkCreateSampler(mDevice, &samplerInfo, nullptr, &mTextureSampler) != VK_SUCCESS) {
+        VkSampler sampler;
+        if (vkCreateSampler(mDevice, &samplerInfo, nullptr, &sampler) != VK_SUCCESS) {
             spdlog::error("{} failed to create texture sampler!", __func__);
             throw std::runtime_error("failed to create texture sampler!");
         }
+        mTextureSampler = ops::Sampler(mFrameTimeline, sampler);
     }
 
-    VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags) {
+    VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags,
+        VkImageViewType viewType = VK_IMAGE_VIEW_TYPE_2D, uint32_t baseArrayLayer = 0, uint32_t layerCount = 1) {
         VkImageViewCreateInfo viewInfo{};
         viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
         viewInfo.image = image;
-        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.viewType = viewType;
         viewInfo.format = format;
         viewInfo.subresourceRange.aspectMask = aspectFlags;
         viewInfo.subresourceRange.baseMipLevel = 0;
         viewInfo.subresourceRange.levelCount = 1;
-        viewInfo.subresourceRange.baseArrayLayer = 0;
-        viewInfo.subresourceRange.layerCount = 1;
+        viewInfo.subresourceRange.baseArrayLayer = baseArrayLayer;
+        viewInfo.subresourceRange.layerCount = layerCount;
         // can left out explicit, the default value is 0(VK_COMPONENT_SWIZZLE_IDENTITY)
         //viewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
         //viewInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
@@ -2004,7 +4189,7 @@ private:
     void createImage(uint32_t width, uint32_t height,
         VkFormat format, VkImageTiling tiling,
         VkImageUsageFlags usage, VkMemoryPropertyFlags properties,
-        VkImage& image, VkDeviceMemory& imageMemory) {
+        VkImage& image, VkDeviceMemory& imageMemory, uint32_t arrayLayers = 1) {
 
         VkImageCreateInfo imageInfo{};
         imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -2024,7 +4209,7 @@ private:
         imageInfo.mipLevels = 1;
 #endif /* BUG_FIXES */
         // 图像的层数
-        imageInfo.arrayLayers = 1;
+        imageInfo.arrayLayers = arrayLayers;
         imageInfo.format = format;
         imageInfo.tiling = tiling;
         imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -2042,6 +4227,14 @@ private:
 
         VkMemoryRequirements memRequirements;
         vkGetImageMemoryRequirements(mDevice, image, &memRequirements);
+        // 不是每个 image 都能放进 lazily allocated 的内存, 这个 image 不支持的时候退回 DEVICE_LOCAL
+        if (properties & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) {
+            VkMemoryPropertyFlags supported = transientAttachmentMemoryProperties(memRequirements.memoryTypeBits);
+            if (!(supported & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT)) {
+                spdlog::info("{} image does not support lazily allocated memory, use device local", __func__);
+                properties = (properties & ~VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+            }
+        }
 
         VkMemoryAllocateInfo allocInfo{};
         allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
@@ -2054,89 +4247,8 @@ private:
         vkBindImageMemory(mDevice, image, imageMemory, 0);
     }
 
-    void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout) {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-        // 同步对图像资源的访问
-        // 在图像的不同的操作之间插入内存屏障
-        VkImageMemoryBarrier barrier{};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.oldLayout = oldLayout;
-        barrier.newLayout = newLayout;
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.image = image;
-#ifndef EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-#else
-        if(newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
-            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-            if (hasStencilComponent(format)) {
-                barrier.subresourceRange.aspectMask | VK_IMAGE_ASPECT_STENCIL_BIT;
-            }
-        } else {
-            barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        }
-#endif /* EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE */
-        barrier.subresourceRange.baseMipLevel = 0;
-        barrier.subresourceRange.levelCount = 1;
-        barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = 1;
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = 0;
-
-        VkPipelineStageFlags sourceStage;
-        VkPipelineStageFlags dstinationStage;
-
-        if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED &&
-                newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-            // 未定义 → 传输目的地：传输不需要等待任何内容的写入
-            barrier.srcAccessMask = 0;
-            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-            sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-            dstinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        } else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL &&
-                newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-            // 传输目的地 → 着色器读取：着色器读取应该等待传输写入，特别是着色器在片段着色器中读取，因为这是我们要使用纹理的地方
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-            sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-            // 由片段着色器去做读取操作
-            dstinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-#ifdef EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE
-        } else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED &&
-                newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
-            barrier.srcAccessMask = 0;
-            barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
-                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-
-            sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-            dstinationStage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-#endif /* EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE */
-        } else {
-            spdlog::error("{} unsupported layout transition!", __func__);
-            throw std::runtime_error("unsupported layout transition!");
-        }
-
-        vkCmdPipelineBarrier(
-            commandBuffer,
-            sourceStage, dstinationStage,
-            0,
-            0,
-            nullptr,
-            0,
-            nullptr,
-            1,
-            &barrier
-        );
-
-        endSingleTimeCommands(commandBuffer);
-    }
-
-    void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
-        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
+    void recordCopyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkImage image,
+            uint32_t width, uint32_t height) {
         VkBufferImageCopy region{};
         region.bufferOffset = 0;
         region.bufferRowLength = 0;
@@ -2162,8 +4274,6 @@ private:
             1,
             &region
         );
-
-        endSingleTimeCommands(commandBuffer);
     }
 
     // recording and executing a command buffer
@@ -2185,17 +4295,40 @@ private:
         return commandBuffer;
     }
     // end a command buffer
+    // 提交之后只等待这一次提交 signal 的 timeline 值, 而不是 vkQueueWaitIdle 等待整个队列
     void endSingleTimeCommands(VkCommandBuffer commandBuffer) {
+        mFrameTimeline.wait(submitSingleTimeCommands(commandBuffer));
+        mFrameTimeline.collect();
+    }
+
+    // 提交之后不等待, command buffer 在 timeline 到达返回的值之后回收
+    uint64_t submitSingleTimeCommands(VkCommandBuffer commandBuffer) {
         vkEndCommandBuffer(commandBuffer);
+
+        VkSemaphore timeline = mFrameTimeline.semaphore();
+        uint64_t signalValue = mFrameTimeline.nextValue();
+        VkTimelineSemaphoreSubmitInfo timelineInfo{};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &signalValue;
+
         VkSubmitInfo submitInfo{};
         submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.pNext = &timelineInfo;
         submitInfo.commandBufferCount = 1;
         submitInfo.pCommandBuffers = &commandBuffer;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &timeline;
 
-        vkQueueSubmit(mGraphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-        vkQueueWaitIdle(mGraphicsQueue);
+        if (vkQueueSubmit(mGraphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+            spdlog::error("{} failed to submit single time commands", __func__);
+            throw std::runtime_error("failed to submit single time commands");
+        }
 
-        vkFreeCommandBuffers(mDevice, mCommandPool, 1, &commandBuffer);
+        mFrameTimeline.deferDestroy(signalValue, [this, commandBuffer]() {
+            vkFreeCommandBuffers(mDevice, mCommandPool, 1, &commandBuffer);
+        });
+        return signalValue;
     }
 
     static std::vector<char> readFile(const std::string& fileName) {
@@ -2216,26 +4349,6 @@ private:
         return buffer;
     }
 
-    void createDepthResources() {
-        VkFormat depthFormat = findDepthFormat();
-        createImage(mSwapChainExtent.width, mSwapChainExtent.height,
-            depthFormat,
-            VK_IMAGE_TILING_OPTIMAL,
-            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-            mDepthImage,
-            mDepthImageMemory
-        );
-        mDepthImageView = createImageView(mDepthImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
-
-#ifdef EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE
-        spdlog::info("{} explicitly transitioning depth image", __func__);
-        transitionImageLayout(mDepthImage, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED,
-            VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
-        );
-#endif /* EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE */
-    }
-
     void loadModel() {
         tinyobj::ObjReaderConfig readerConfig;
         readerConfig.mtl_search_path = "./models/";
@@ -2361,31 +4474,58 @@ private:
         return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
     }
 
-    // glfw 控制输入
-    void processInput(GLFWwindow* window) {
-        float currentRenderTime = glfwGetTime();
-        mCameraDeltaTime = currentRenderTime - mCameraLastRenderTime;
-        mCameraLastRenderTime = currentRenderTime;
-        float cameraSpeed = mCameraDeltaTime * mCameraSpeedFactor;
-
+    // glfw 控制输入, 只在主线程调用
+    uint32_t sampleInput(GLFWwindow* window) {
+        uint32_t keys = 0;
         if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
-            mCameraPos += cameraSpeed * front;
+            keys |= INPUT_FORWARD;
         }
         if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
-            mCameraPos -= glm::normalize(glm::cross(front, up)) * cameraSpeed;
+            keys |= INPUT_LEFT;
         }
         if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
-            mCameraPos -= cameraSpeed * front;
+            keys |= INPUT_BACKWARD;
         }
         if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
-            mCameraPos += glm::normalize(glm::cross(front, up)) * cameraSpeed;
+            keys |= INPUT_RIGHT;
         }
         if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) {
-            mCameraPos += cameraSpeed * up;
+            keys |= INPUT_UP;
         }
         if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) {
-            mCameraPos -= cameraSpeed * up;
+            keys |= INPUT_DOWN;
+        }
+        return keys;
+    }
+
+    // update 线程中推进一个 tick, 相机的移动速度按照固定的 dt 计算
+    void stepSimulation(uint32_t keys, std::chrono::steady_clock::time_point tickTime) {
+        float cameraSpeed = static_cast<float>(1.0 / UPDATE_RATE_HZ) * mCameraSpeedFactor;
+        glm::vec3 cameraPos = mSimulation.mCameraPos;
+
+        if (keys & INPUT_FORWARD) {
+            cameraPos += cameraSpeed * front;
+        }
+        if (keys & INPUT_LEFT) {
+            cameraPos -= glm::normalize(glm::cross(front, up)) * cameraSpeed;
+        }
+        if (keys & INPUT_BACKWARD) {
+            cameraPos -= cameraSpeed * front;
+        }
+        if (keys & INPUT_RIGHT) {
+            cameraPos += glm::normalize(glm::cross(front, up)) * cameraSpeed;
         }
+        if (keys & INPUT_UP) {
+            cameraPos += cameraSpeed * up;
+        }
+        if (keys & INPUT_DOWN) {
+            cameraPos -= cameraSpeed * up;
+        }
+
+        mSimulation.mPrevCameraPos = mSimulation.mCameraPos;
+        mSimulation.mCameraPos = cameraPos;
+        mSimulation.mTick++;
+        mSimulation.mTickTime = tickTime;
     }
 
     static uint32_t calculateMaxMipLevels(uint32_t width, uint32_t height, uint32_t depth) {
@@ -2427,6 +4567,7 @@ int main(int argc, char *argv[])
     spdlog::set_level(spdlog::level::info);
 #endif
     HelloTriangleApplication app;
+    app.setOptions(ops::Options::parse(argc, argv));
     try
     {
         app.run();
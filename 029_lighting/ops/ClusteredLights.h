@@ -0,0 +1,152 @@
+#ifndef _CLUSTERED_LIGHTS_DEMO_H_
+#define _CLUSTERED_LIGHTS_DEMO_H_
+
+#include <glm/glm.hpp>
+#include "ShadowCascades.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace ops {
+
+// clustered forward shading: view frustum 按屏幕 tile 和指数分布的深度切片分成 X * Y * Z 个 cluster (froxel)
+// 每一帧由 light_cull.comp 把光源分到和它的影响范围相交的 cluster 中, fragment shader 只遍历自己所在 cluster 的光源
+// 每个 cluster 最多记录 MAX_LIGHTS_PER_CLUSTER 个光源, 所以不管场景中有多少光源, 每个像素的光照开销都有上限
+// 常量和 shader/clustered_common.glsl 保持一致
+struct ClusterGrid {
+    static constexpr uint32_t X = 16;
+    static constexpr uint32_t Y = 9;
+    static constexpr uint32_t Z = 24;
+    static constexpr uint32_t COUNT = X * Y * Z;
+    static constexpr uint32_t MAX_LIGHTS_PER_CLUSTER = 128;
+
+    // 一帧的 cluster 数据: [每个 cluster 的光源数量 | 每个 cluster MAX_LIGHTS_PER_CLUSTER 个光源下标]
+    // 数量部分的大小是 256 的倍数, 两部分可以作为同一个 buffer 的两个 descriptor, 满足任何设备的 offset 对齐要求
+    static constexpr uint64_t countsSize() { return COUNT * sizeof(uint32_t); }
+    static constexpr uint64_t indicesSize() { return uint64_t(COUNT) * MAX_LIGHTS_PER_CLUSTER * sizeof(uint32_t); }
+    static_assert(COUNT * sizeof(uint32_t) % 256 == 0, "cluster counts must keep the index list aligned");
+
+    // 深度切片 k 覆盖 view 空间深度 [near * (far / near)^(k / Z), near * (far / near)^((k + 1) / Z)]
+    // 所以 slice = log(depth) * scale + bias, 近处的切片薄, 远处的切片厚, 每个 cluster 的形状接近立方体
+    static glm::vec2 sliceScaleBias(float nearPlane, float farPlane) {
+        float logRatio = std::log(farPlane / nearPlane);
+        return glm::vec2(Z / logRatio, -Z * std::log(nearPlane) / logRatio);
+    }
+};
+
+// 光源在 gpu 上的布局 (std430), 和 clustered_common.glsl 中的 Light 一致
+struct GpuLight {
+    glm::vec4 mPositionRadius;      // 世界空间的位置, 影响半径 (半径之外贡献为 0)
+    glm::vec4 mColorIntensity;
+    glm::vec4 mDirectionCosOuter;   // 聚光灯的方向和外锥角的余弦, 点光源的余弦小于 -1
+    glm::vec4 mCosInnerPad;         // x: 聚光灯内锥角的余弦
+};
+static_assert(sizeof(GpuLight) == 64, "GpuLight must match the std430 layout");
+
+// 每一帧的光照参数, 和 clustered_common.glsl 中的 LightingUniform 一致
+struct LightingUniform {
+    glm::mat4 mView;
+    glm::mat4 mInverseProj;
+    glm::vec4 mCameraPosition;
+    glm::uvec4 mGridLightCount;     // cluster 的 X, Y, Z 和光源数量
+    glm::vec4 mDepthParams;         // near, far, slice scale, slice bias
+    glm::vec4 mScreenParams;        // tile 的宽高 (像素), framebuffer 的宽高
+    glm::mat4 mInverseView;         // deferred shading 从深度重建世界空间的位置
+    std::array<glm::mat4, ShadowCascades::COUNT> mCascadeViewProj;
+    glm::vec4 mCascadeSplits;       // 每个 cascade 覆盖到的 view 空间深度
+    glm::vec4 mCascadeTexelSizes;   // 每个 cascade 的 texel 在世界空间中的大小
+    glm::vec4 mSunDirection;        // 方向光的传播方向, w 为 0 时不计算方向光
+    glm::vec4 mSunColorIntensity;
+};
+
+// light_cull.comp 用原子操作累加的统计, 每一帧清零, 帧完成之后由 cpu 读取
+struct ClusterStats {
+    uint32_t mLightReferences = 0;      // 所有 cluster 中光源下标的总数 (截断之前)
+    uint32_t mMaxLightsPerCluster = 0;  // 截断之前单个 cluster 中最多的光源数量
+    uint32_t mOverflowClusters = 0;     // 超过 MAX_LIGHTS_PER_CLUSTER 被截断的 cluster 数量
+    uint32_t mOccupiedClusters = 0;     // 至少有一个光源的 cluster 数量
+};
+
+// 压力测试用的动态光源: 每个光源在场景包围盒内绕自己的中心做圆周运动, 同时上下浮动
+// 一半是点光源, 一半是朝下并且慢慢摆动的聚光灯. 随机数种子固定, 同样的数量每次运行的场景都相同
+class LightField {
+public:
+    // 光源的影响半径是包围盒对角线的 radiusFraction 倍, 和数量无关, 光源越多每个 cluster 中的光源越多
+    void generate(uint32_t count, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+            float radiusFraction = 0.08f) {
+        std::mt19937 rndEngine(1234);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        glm::vec3 extent = boundsMax - boundsMin;
+        float lightRadius = glm::length(extent) * radiusFraction;
+        float orbitScale = std::max(std::min(extent.x, extent.z) * 0.15f, 1e-3f);
+
+        mOrbits.clear();
+        mOrbits.reserve(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            Orbit orbit{};
+            orbit.mCenter = boundsMin + extent * glm::vec3(unit(rndEngine), unit(rndEngine), unit(rndEngine));
+            orbit.mOrbitRadius = orbitScale * (0.2f + unit(rndEngine));
+            orbit.mAngularSpeed = (unit(rndEngine) * 2.0f - 1.0f) * 1.5f;
+            orbit.mPhase = unit(rndEngine) * 6.2831853f;
+            orbit.mBobHeight = extent.y * 0.05f * unit(rndEngine);
+            orbit.mRadius = lightRadius * (0.5f + unit(rndEngine));
+            // 饱和度较高的颜色, 叠加在一起的时候容易看出每个光源的范围
+            glm::vec3 color(unit(rndEngine), unit(rndEngine), unit(rndEngine));
+            orbit.mColor = color / std::max(std::max(color.r, color.g), std::max(color.b, 1e-3f));
+            orbit.mIntensity = 2.0f + 2.0f * unit(rndEngine);
+            orbit.mSpot = (i % 2) == 1;
+            mOrbits.push_back(orbit);
+        }
+    }
+
+    uint32_t count() const { return static_cast<uint32_t>(mOrbits.size()); }
+
+    // 把 time 秒时所有光源的状态写到 lights 中, lights 至少有 count() 个元素
+    void animate(float time, GpuLight* lights) const {
+        // 聚光灯的内外锥角: 20 和 30 度
+        const float cosInner = 0.9397f;
+        const float cosOuter = 0.8660f;
+        for (size_t i = 0; i < mOrbits.size(); ++i) {
+            const Orbit& orbit = mOrbits[i];
+            float angle = orbit.mPhase + orbit.mAngularSpeed * time;
+            glm::vec3 position = orbit.mCenter + glm::vec3(
+                std::cos(angle) * orbit.mOrbitRadius,
+                std::sin(angle * 0.7f) * orbit.mBobHeight,
+                std::sin(angle) * orbit.mOrbitRadius);
+
+            GpuLight& light = lights[i];
+            light.mPositionRadius = glm::vec4(position, orbit.mRadius);
+            light.mColorIntensity = glm::vec4(orbit.mColor, orbit.mIntensity);
+            if (orbit.mSpot) {
+                glm::vec3 direction = glm::normalize(glm::vec3(std::cos(angle) * 0.5f, -1.0f, std::sin(angle) * 0.5f));
+                light.mDirectionCosOuter = glm::vec4(direction, cosOuter);
+                light.mCosInnerPad = glm::vec4(cosInner, 0.0f, 0.0f, 0.0f);
+            } else {
+                light.mDirectionCosOuter = glm::vec4(0.0f, -1.0f, 0.0f, -2.0f);
+                light.mCosInnerPad = glm::vec4(-1.0f, 0.0f, 0.0f, 0.0f);
+            }
+        }
+    }
+
+private:
+    struct Orbit {
+        glm::vec3 mCenter;
+        float mOrbitRadius;
+        float mAngularSpeed;
+        float mPhase;
+        float mBobHeight;
+        float mRadius;
+        glm::vec3 mColor;
+        float mIntensity;
+        bool mSpot;
+    };
+
+    std::vector<Orbit> mOrbits;
+};
+
+}
+
+#endif
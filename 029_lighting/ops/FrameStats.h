@@ -0,0 +1,140 @@
+#ifndef _FRAME_STATS_DEMO_H_
+#define _FRAME_STATS_DEMO_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace ops {
+
+// 固定窗口的滑动统计, 只保留最近的 capacity 个样本
+class RollingStat {
+public:
+    explicit RollingStat(size_t capacity = 240) : mCapacity(capacity) {
+        mSamples.reserve(capacity);
+    }
+
+    void add(double value) {
+        if (mSamples.size() < mCapacity) {
+            mSamples.push_back(value);
+        } else {
+            mSamples[mNext] = value;
+        }
+        mNext = (mNext + 1) % mCapacity;
+    }
+
+    void reset() {
+        mSamples.clear();
+        mNext = 0;
+    }
+
+    size_t count() const { return mSamples.size(); }
+    bool full() const { return mSamples.size() == mCapacity; }
+
+    double mean() const {
+        if (mSamples.empty()) {
+            return 0.0;
+        }
+        double sum = 0.0;
+        for (double sample : mSamples) {
+            sum += sample;
+        }
+        return sum / mSamples.size();
+    }
+
+    // percentile 取值 [0, 1]
+    double percentile(double p) const {
+        if (mSamples.empty()) {
+            return 0.0;
+        }
+        std::vector<double> sorted = mSamples;
+        size_t index = static_cast<size_t>(p * (sorted.size() - 1));
+        std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+        return sorted[index];
+    }
+
+private:
+    size_t mCapacity;
+    size_t mNext = 0;
+    std::vector<double> mSamples;
+};
+
+// 帧间隔的直方图, 不限制样本数量, 用于比较不同 present mode 下完整的帧时间分布
+class FrameTimeHistogram {
+public:
+    static constexpr double BUCKET_MS = 0.25;
+    static constexpr size_t BUCKET_COUNT = 400;     // 0 ~ 100 ms, 超出的样本记在最后一个桶里
+
+    FrameTimeHistogram() : mBuckets(BUCKET_COUNT, 0) {}
+
+    void add(double frameTimeMs) {
+        size_t bucket = static_cast<size_t>(std::max(frameTimeMs, 0.0) / BUCKET_MS);
+        mBuckets[std::min(bucket, BUCKET_COUNT - 1)]++;
+        mCount++;
+        mSum += frameTimeMs;
+        mMax = std::max(mMax, frameTimeMs);
+    }
+
+    uint64_t count() const { return mCount; }
+    double mean() const { return mCount == 0 ? 0.0 : mSum / mCount; }
+    double max() const { return mMax; }
+
+    // 返回所在桶的上边界, 精度为 BUCKET_MS
+    double percentile(double p) const {
+        if (mCount == 0) {
+            return 0.0;
+        }
+        uint64_t target = static_cast<uint64_t>(p * (mCount - 1)) + 1;
+        uint64_t accumulated = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            accumulated += mBuckets[i];
+            if (accumulated >= target) {
+                return (i + 1) * BUCKET_MS;
+            }
+        }
+        return mMax;
+    }
+
+private:
+    std::vector<uint64_t> mBuckets;
+    uint64_t mCount = 0;
+    double mSum = 0.0;
+    double mMax = 0.0;
+};
+
+// 每一帧的 cpu 耗时, gpu 耗时和输入到呈现的延迟估计, 单位都是 ms
+struct FrameStats {
+    RollingStat mCpuTime;
+    RollingStat mGpuTime;
+    RollingStat mLatency;
+
+    void reset() {
+        mCpuTime.reset();
+        mGpuTime.reset();
+        mLatency.reset();
+    }
+
+    // 根据测量的 cpu 和 gpu 耗时推荐 frames in flight:
+    //   cpu + gpu 在一个刷新周期之内就能完成, 串行执行也不会掉帧, 用 1 帧换取最低的延迟
+    //   耗时比较平稳的时候, 2 帧已经可以让 cpu 和 gpu 并行起来
+    //   耗时抖动很大的时候, 用第 3 帧吸收尖峰, 以延迟换吞吐量
+    uint32_t recommendFramesInFlight(double refreshIntervalMs, uint32_t maxFramesInFlight) const {
+        double cpu = mCpuTime.mean();
+        double gpu = mGpuTime.mean();
+        uint32_t frames = 2;
+        if (cpu + gpu < refreshIntervalMs * 0.9) {
+            frames = 1;
+        } else {
+            double busiest = std::max(cpu, gpu);
+            double busiestP95 = std::max(mCpuTime.percentile(0.95), mGpuTime.percentile(0.95));
+            if (busiestP95 > busiest * 1.5) {
+                frames = 3;
+            }
+        }
+        return std::min(frames, maxFramesInFlight);
+    }
+};
+
+}
+
+#endif
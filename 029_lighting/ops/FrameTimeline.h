@@ -0,0 +1,124 @@
+#ifndef _FRAME_TIMELINE_DEMO_H_
+#define _FRAME_TIMELINE_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <stdexcept>
+
+namespace ops {
+
+// 基于 timeline semaphore (vulkan 1.2) 的同步, 取代每一帧的 VkFence
+// 每一次提交都 signal 一个单调递增的值, cpu 通过等待某个值来确认之前的提交已经执行完
+// 同一个值也用来驱动上传完成的确认, compute 和 graphics 之间的依赖以及资源的延迟销毁
+class FrameTimeline {
+public:
+    void create(VkDevice device) {
+        mDevice = device;
+        mNextValue = 1;
+
+        VkSemaphoreTypeCreateInfo typeInfo{};
+        typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        typeInfo.initialValue = 0;
+
+        VkSemaphoreCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        createInfo.pNext = &typeInfo;
+
+        if (vkCreateSemaphore(mDevice, &createInfo, nullptr, &mSemaphore) != VK_SUCCESS) {
+            spdlog::error("{} failed to create timeline semaphore!", __func__);
+            throw std::runtime_error("failed to create timeline semaphore!");
+        }
+    }
+
+    // 调用之前需要保证 gpu 已经空闲, 剩下的延迟销毁会全部执行
+    void destroy() {
+        collect(UINT64_MAX);
+        if (mSemaphore != VK_NULL_HANDLE) {
+            vkDestroySemaphore(mDevice, mSemaphore, nullptr);
+            mSemaphore = VK_NULL_HANDLE;
+        }
+    }
+
+    VkDevice device() const { return mDevice; }
+    VkSemaphore semaphore() const { return mSemaphore; }
+
+    // 为下一次提交分配要 signal 的值, 必须按照分配的顺序提交到队列
+    uint64_t nextValue() { return mNextValue++; }
+
+    // 最近一次分配出去的值, 等待它就等于等待目前为止所有的提交
+    uint64_t lastValue() const { return mNextValue - 1; }
+
+    uint64_t completedValue() {
+        uint64_t value = 0;
+        vkGetSemaphoreCounterValue(mDevice, mSemaphore, &value);
+        return value;
+    }
+
+    bool isComplete(uint64_t value) {
+        return completedValue() >= value;
+    }
+
+    void wait(uint64_t value) {
+        if (value == 0) {
+            return;
+        }
+        VkSemaphoreWaitInfo waitInfo{};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &mSemaphore;
+        waitInfo.pValues = &value;
+        if (vkWaitSemaphores(mDevice, &waitInfo, UINT64_MAX) != VK_SUCCESS) {
+            spdlog::error("{} failed to wait timeline value {}!", __func__, value);
+            throw std::runtime_error("failed to wait timeline semaphore!");
+        }
+    }
+
+    // 等到 value 被 signal 之后再执行 destroyer, 用来销毁 gpu 可能还在使用的资源
+    // value 可以大于 lastValue(), 表示等到之后的提交完成再销毁
+    // destroy() 之后 gpu 已经空闲, 直接执行
+    void deferDestroy(uint64_t value, std::function<void()> destroyer) {
+        if (mSemaphore == VK_NULL_HANDLE) {
+            destroyer();
+            return;
+        }
+        auto it = std::upper_bound(mDeferred.begin(), mDeferred.end(), value,
+            [](uint64_t v, const Deferred& deferred) { return v < deferred.mValue; });
+        mDeferred.insert(it, {value, std::move(destroyer)});
+    }
+
+    // 每一帧调用一次, 执行已经完成的延迟销毁
+    void collect() {
+        if (mDeferred.empty()) {
+            return;
+        }
+        collect(completedValue());
+    }
+
+private:
+    struct Deferred {
+        uint64_t mValue;
+        std::function<void()> mDestroyer;
+    };
+
+    VkDevice mDevice = VK_NULL_HANDLE;
+    VkSemaphore mSemaphore = VK_NULL_HANDLE;
+    uint64_t mNextValue = 1;
+    // 按照值递增的顺序排列
+    std::deque<Deferred> mDeferred;
+
+    void collect(uint64_t completed) {
+        while (!mDeferred.empty() && mDeferred.front().mValue <= completed) {
+            mDeferred.front().mDestroyer();
+            mDeferred.pop_front();
+        }
+    }
+};
+
+}
+
+#endif
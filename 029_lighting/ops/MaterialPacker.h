@@ -0,0 +1,83 @@
+#ifndef _MATERIAL_PACKER_DEMO_H_
+#define _MATERIAL_PACKER_DEMO_H_
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace ops {
+
+// 单通道的 8 bit 灰度图, 像素按行紧密排列
+struct GrayImage {
+    uint32_t mWidth = 0;
+    uint32_t mHeight = 0;
+    std::vector<uint8_t> mPixels;
+
+    bool empty() const { return mPixels.empty(); }
+};
+
+// 打包之后的 RGBA8 材质贴图, 每个通道对应一张单通道贴图 (ORM + alpha, 和 glTF 的 occlusionRoughnessMetallic 一致):
+//   R: ambient occlusion, G: roughness, B: metallic, A: alpha (alpha test)
+// 数据是线性的, 需要使用 UNORM 格式上传, 不能使用 SRGB
+struct PackedMaterial {
+    enum Channel : uint32_t {
+        OCCLUSION = 0,
+        ROUGHNESS = 1,
+        METALLIC = 2,
+        ALPHA = 3,
+        CHANNEL_COUNT = 4,
+    };
+
+    uint32_t mWidth = 1;
+    uint32_t mHeight = 1;
+    std::vector<uint8_t> mPixels;
+    // 实际来自贴图的通道数量, 其余通道使用默认值
+    uint32_t mSourceCount = 0;
+};
+
+// 没有对应贴图时的默认值, roughness 和 metallic 与 shader/gbuffer_common.glsl 中的 MATERIAL_ROUGHNESS / MATERIAL_METAL 一致
+constexpr std::array<uint8_t, PackedMaterial::CHANNEL_COUNT> PACKED_MATERIAL_DEFAULTS = {255, 128, 0, 255};
+
+// 把一个材质的单通道贴图合并成一张 RGBA8 贴图, sources 按 PackedMaterial::Channel 排列, 空的贴图使用默认值
+// 尺寸不同的贴图按最近邻缩放到其中最大的尺寸; 所有通道都没有贴图时输出 1x1 的默认值
+inline PackedMaterial packMaterialChannels(const std::array<const GrayImage*, PackedMaterial::CHANNEL_COUNT>& sources) {
+    PackedMaterial packed{};
+    packed.mWidth = 0;
+    packed.mHeight = 0;
+    for (const GrayImage* source : sources) {
+        if (source && !source->empty()) {
+            packed.mWidth = std::max(packed.mWidth, source->mWidth);
+            packed.mHeight = std::max(packed.mHeight, source->mHeight);
+            packed.mSourceCount++;
+        }
+    }
+    packed.mWidth = std::max(packed.mWidth, 1u);
+    packed.mHeight = std::max(packed.mHeight, 1u);
+    packed.mPixels.resize(size_t(packed.mWidth) * packed.mHeight * PackedMaterial::CHANNEL_COUNT);
+
+    for (uint32_t channel = 0; channel < PackedMaterial::CHANNEL_COUNT; ++channel) {
+        const GrayImage* source = sources[channel];
+        uint8_t* out = packed.mPixels.data() + channel;
+        if (!source || source->empty()) {
+            for (size_t i = 0; i < size_t(packed.mWidth) * packed.mHeight; ++i) {
+                out[i * PackedMaterial::CHANNEL_COUNT] = PACKED_MATERIAL_DEFAULTS[channel];
+            }
+            continue;
+        }
+        bool sameSize = source->mWidth == packed.mWidth && source->mHeight == packed.mHeight;
+        for (uint32_t y = 0; y < packed.mHeight; ++y) {
+            uint32_t sourceY = sameSize ? y : uint32_t(uint64_t(y) * source->mHeight / packed.mHeight);
+            const uint8_t* row = source->mPixels.data() + size_t(sourceY) * source->mWidth;
+            for (uint32_t x = 0; x < packed.mWidth; ++x) {
+                uint32_t sourceX = sameSize ? x : uint32_t(uint64_t(x) * source->mWidth / packed.mWidth);
+                out[(size_t(y) * packed.mWidth + x) * PackedMaterial::CHANNEL_COUNT] = row[sourceX];
+            }
+        }
+    }
+    return packed;
+}
+
+}
+
+#endif
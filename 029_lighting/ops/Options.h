@@ -0,0 +1,78 @@
+#ifndef _OPTIONS_DEMO_H_
+#define _OPTIONS_DEMO_H_
+
+#include <spdlog/spdlog.h>
+#include "PresentPolicy.h"
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+namespace ops {
+
+// 启动参数, 0 表示由程序根据测量的结果自动选择
+//   --frames-in-flight N|auto   同时在录制和执行的帧数, 1 延迟最低, 3 吞吐量最高
+//   --swapchain-images N|auto   交换链中图像的数量, auto 为 frames in flight + 1
+//   --low-latency               等价于 --frames-in-flight 1 --swapchain-images auto
+//   --throughput                等价于 --frames-in-flight 3 --swapchain-images auto
+//   --present-policy NAME       low-latency, power-saving, tear-free 或者 uncapped, 运行时按 P 键切换
+//   --lights N                  动态光源的数量, 运行时按 +/- 键乘或除以 10
+//   --benchmark-lights          依次测量 1 ~ 10000 个光源时的 gpu 耗时和每个 cluster 中的光源数量
+//   --deferred                  先写 G-buffer 再在第二个 subpass 中计算光照, 需要使用 render pass
+//   --shadow-cache on|off       cascade 没有变化的时候是否复用上一次的 shadow map, 运行时按 K 键切换
+//   --benchmark-shadows         分别在开启和关闭缓存时测量 shadow pass 的 gpu 耗时
+struct Options {
+    uint32_t mFramesInFlight = 0;
+    uint32_t mSwapchainImages = 0;
+    PresentPolicy mPresentPolicy = PresentPolicy::TearFree;
+    uint32_t mLightCount = 256;
+    bool mBenchmarkLights = false;
+    bool mDeferred = false;
+    bool mShadowCache = true;
+    bool mBenchmarkShadows = false;
+
+    static Options parse(int argc, char *argv[]) {
+        Options options{};
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--frames-in-flight" && i + 1 < argc) {
+                options.mFramesInFlight = parseCount(argv[++i]);
+            } else if (arg == "--swapchain-images" && i + 1 < argc) {
+                options.mSwapchainImages = parseCount(argv[++i]);
+            } else if (arg == "--present-policy" && i + 1 < argc) {
+                std::string name = argv[++i];
+                if (!parsePresentPolicy(name, options.mPresentPolicy)) {
+                    spdlog::warn("{} unknown present policy {}", __func__, name);
+                }
+            } else if (arg == "--low-latency") {
+                options.mFramesInFlight = 1;
+            } else if (arg == "--throughput") {
+                options.mFramesInFlight = 3;
+            } else if (arg == "--lights" && i + 1 < argc) {
+                options.mLightCount = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            } else if (arg == "--benchmark-lights") {
+                options.mBenchmarkLights = true;
+            } else if (arg == "--deferred") {
+                options.mDeferred = true;
+            } else if (arg == "--shadow-cache" && i + 1 < argc) {
+                options.mShadowCache = std::string(argv[++i]) != "off";
+            } else if (arg == "--benchmark-shadows") {
+                options.mBenchmarkShadows = true;
+            } else {
+                spdlog::warn("{} unknown argument {}", __func__, arg);
+            }
+        }
+        return options;
+    }
+
+private:
+    static uint32_t parseCount(const std::string& value) {
+        if (value == "auto") {
+            return 0;
+        }
+        return static_cast<uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+    }
+};
+
+}
+
+#endif
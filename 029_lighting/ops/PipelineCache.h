@@ -0,0 +1,199 @@
+#ifndef _PIPELINE_CACHE_DEMO_H_
+#define _PIPELINE_CACHE_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include <spdlog/spdlog.h>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+namespace ops {
+
+// 磁盘上的 pipeline cache 文件格式: PipelineCacheFileHeader + vkGetPipelineCacheData() 返回的数据
+// vulkan 自带的 VkPipelineCacheHeaderVersionOne 中没有 driverVersion, 驱动升级之后旧的 cache 虽然 uuid
+// 可能不变, 但是内容已经没有意义了, 所以我们自己再包一层头部
+struct PipelineCacheFileHeader {
+    uint32_t mMagic;
+    uint32_t mVersion;
+    uint32_t mVendorID;
+    uint32_t mDeviceID;
+    uint32_t mDriverVersion;
+    uint32_t mDataSize;
+    uint64_t mDataHash;
+    uint8_t  mPipelineCacheUUID[VK_UUID_SIZE];
+};
+
+class PipelineCache {
+public:
+    static constexpr uint32_t MAGIC = 0x43504b56;   // "VKPC"
+    static constexpr uint32_t VERSION = 1;
+
+    void create(VkPhysicalDevice physicalDevice, VkDevice device, const std::string& path) {
+        mDevice = device;
+        mPath = path;
+        vkGetPhysicalDeviceProperties(physicalDevice, &mProperties);
+
+        std::vector<char> initialData = loadFromFile();
+        mWarm = !initialData.empty();
+
+        VkPipelineCacheCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+        createInfo.initialDataSize = initialData.size();
+        createInfo.pInitialData = initialData.empty() ? nullptr : initialData.data();
+
+        if (vkCreatePipelineCache(mDevice, &createInfo, nullptr, &mPipelineCache) != VK_SUCCESS) {
+            // 驱动仍然可能拒绝一份通过了校验的数据，这时退化为一个空的 cache
+            spdlog::warn("{} driver rejected cache data from {}, start cold", __func__, mPath);
+            createInfo.initialDataSize = 0;
+            createInfo.pInitialData = nullptr;
+            mWarm = false;
+            if (vkCreatePipelineCache(mDevice, &createInfo, nullptr, &mPipelineCache) != VK_SUCCESS) {
+                spdlog::error("{} failed to create pipeline cache!", __func__);
+                throw std::runtime_error("failed to create pipeline cache!");
+            }
+        }
+        spdlog::info("{} pipeline cache {} ({} bytes loaded)", __func__, mWarm ? "warm" : "cold", initialData.size());
+    }
+
+    // 退出前调用，把 cache 的内容写回磁盘，然后销毁 VkPipelineCache
+    void destroy() {
+        if (mPipelineCache == VK_NULL_HANDLE) {
+            return;
+        }
+        save();
+        vkDestroyPipelineCache(mDevice, mPipelineCache, nullptr);
+        mPipelineCache = VK_NULL_HANDLE;
+    }
+
+    void save() {
+        size_t dataSize = 0;
+        if (vkGetPipelineCacheData(mDevice, mPipelineCache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0) {
+            spdlog::warn("{} no pipeline cache data to save", __func__);
+            return;
+        }
+        std::vector<char> data(dataSize);
+        if (vkGetPipelineCacheData(mDevice, mPipelineCache, &dataSize, data.data()) != VK_SUCCESS) {
+            spdlog::warn("{} failed to get pipeline cache data", __func__);
+            return;
+        }
+        data.resize(dataSize);
+
+        PipelineCacheFileHeader header{};
+        header.mMagic = MAGIC;
+        header.mVersion = VERSION;
+        header.mVendorID = mProperties.vendorID;
+        header.mDeviceID = mProperties.deviceID;
+        header.mDriverVersion = mProperties.driverVersion;
+        header.mDataSize = static_cast<uint32_t>(data.size());
+        header.mDataHash = hashData(data);
+        memcpy(header.mPipelineCacheUUID, mProperties.pipelineCacheUUID, VK_UUID_SIZE);
+
+        // 先写到一个临时文件里，写完之后再 rename 覆盖，避免进程中途退出留下半个文件
+        std::string tmpPath = mPath + ".tmp";
+        {
+            std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) {
+                spdlog::warn("{} failed to open {}", __func__, tmpPath);
+                return;
+            }
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(data.data(), data.size());
+            file.flush();
+            if (!file.good()) {
+                spdlog::warn("{} failed to write {}", __func__, tmpPath);
+                file.close();
+                std::remove(tmpPath.c_str());
+                return;
+            }
+        }
+        if (std::rename(tmpPath.c_str(), mPath.c_str()) != 0) {
+            spdlog::warn("{} failed to rename {} to {}", __func__, tmpPath, mPath);
+            std::remove(tmpPath.c_str());
+            return;
+        }
+        spdlog::info("{} saved {} bytes to {}", __func__, data.size(), mPath);
+    }
+
+    VkPipelineCache handle() const { return mPipelineCache; }
+    bool isWarm() const { return mWarm; }
+
+private:
+    VkDevice mDevice = VK_NULL_HANDLE;
+    VkPipelineCache mPipelineCache = VK_NULL_HANDLE;
+    VkPhysicalDeviceProperties mProperties{};
+    std::string mPath;
+    bool mWarm = false;
+
+    static uint64_t hashData(const std::vector<char>& data) {
+        // FNV-1a, 只是用来发现被截断或者损坏的文件
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (char c : data) {
+            hash ^= static_cast<uint8_t>(c);
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    std::vector<char> loadFromFile() {
+        std::ifstream file(mPath, std::ios::ate | std::ios::binary);
+        if (!file.is_open()) {
+            spdlog::info("{} no pipeline cache file {}", __func__, mPath);
+            return {};
+        }
+
+        size_t fileSize = static_cast<size_t>(file.tellg());
+        if (fileSize < sizeof(PipelineCacheFileHeader)) {
+            spdlog::warn("{} {} is too small, ignore it", __func__, mPath);
+            return {};
+        }
+        file.seekg(0);
+
+        PipelineCacheFileHeader header{};
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (header.mMagic != MAGIC || header.mVersion != VERSION) {
+            spdlog::warn("{} {} has a unknown header, ignore it", __func__, mPath);
+            return {};
+        }
+        if (header.mVendorID != mProperties.vendorID ||
+            header.mDeviceID != mProperties.deviceID ||
+            header.mDriverVersion != mProperties.driverVersion ||
+            memcmp(header.mPipelineCacheUUID, mProperties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            spdlog::info("{} {} was created by another device or driver, ignore it", __func__, mPath);
+            return {};
+        }
+        if (header.mDataSize != fileSize - sizeof(PipelineCacheFileHeader)) {
+            spdlog::warn("{} {} is truncated, ignore it", __func__, mPath);
+            return {};
+        }
+
+        std::vector<char> data(header.mDataSize);
+        file.read(data.data(), data.size());
+        if (!file.good() || hashData(data) != header.mDataHash) {
+            spdlog::warn("{} {} is corrupted, ignore it", __func__, mPath);
+            return {};
+        }
+
+        // 驱动的数据本身也以 VkPipelineCacheHeaderVersionOne 开头，再检查一遍
+        if (data.size() < sizeof(VkPipelineCacheHeaderVersionOne)) {
+            return {};
+        }
+        VkPipelineCacheHeaderVersionOne vkHeader{};
+        memcpy(&vkHeader, data.data(), sizeof(vkHeader));
+        if (vkHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+            vkHeader.vendorID != mProperties.vendorID ||
+            vkHeader.deviceID != mProperties.deviceID ||
+            memcmp(vkHeader.pipelineCacheUUID, mProperties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            spdlog::warn("{} {} has a mismatched vulkan cache header, ignore it", __func__, mPath);
+            return {};
+        }
+
+        return data;
+    }
+};
+
+}
+
+#endif
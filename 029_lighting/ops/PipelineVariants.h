@@ -0,0 +1,204 @@
+#ifndef _PIPELINE_VARIANTS_DEMO_H_
+#define _PIPELINE_VARIANTS_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include <spdlog/spdlog.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace ops {
+
+// 一个 graphics pipeline 变体由这些状态唯一确定, 以前每一个都需要通过 #define 重新编译程序来切换
+struct PipelineVariantKey {
+    VkSampleCountFlagBits mSamples = VK_SAMPLE_COUNT_1_BIT;
+    VkFormat mDepthFormat = VK_FORMAT_UNDEFINED;
+    VkBool32 mBlendEnable = VK_FALSE;
+    VkCullModeFlags mCullMode = VK_CULL_MODE_BACK_BIT;
+    // shader 中通过 specialization constant 打开或关闭的功能, 每一位的含义由使用者定义
+    uint32_t mFeatureFlags = 0;
+
+    bool operator==(const PipelineVariantKey& other) const {
+        return mSamples == other.mSamples &&
+            mDepthFormat == other.mDepthFormat &&
+            mBlendEnable == other.mBlendEnable &&
+            mCullMode == other.mCullMode &&
+            mFeatureFlags == other.mFeatureFlags;
+    }
+
+    size_t hash() const {
+        size_t seed = 0;
+        auto combine = [&seed](size_t value) {
+            seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+        };
+        combine(std::hash<uint32_t>()(static_cast<uint32_t>(mSamples)));
+        combine(std::hash<uint32_t>()(static_cast<uint32_t>(mDepthFormat)));
+        combine(std::hash<uint32_t>()(mBlendEnable));
+        combine(std::hash<uint32_t>()(mCullMode));
+        combine(std::hash<uint32_t>()(mFeatureFlags));
+        return seed;
+    }
+};
+
+struct PipelineVariantKeyHash {
+    size_t operator()(const PipelineVariantKey& key) const {
+        return key.hash();
+    }
+};
+
+// 在工作线程上并行编译 pipeline 变体, 所有的线程共用同一个 VkPipelineCache
+// 渲染线程通过 get() 取变体, 如果变体还在编译, 就先用 fallback 的 pipeline 绘制
+class PipelineVariantManager {
+public:
+    // builder 会在工作线程上并发调用, 失败的时候返回 VK_NULL_HANDLE, 不要抛异常
+    using Builder = std::function<VkPipeline(const PipelineVariantKey&)>;
+
+    void init(VkDevice device, Builder builder, uint32_t workerCount = 0) {
+        mDevice = device;
+        mBuilder = std::move(builder);
+        mStopping = false;
+        if (workerCount == 0) {
+            uint32_t hardwareThreads = std::thread::hardware_concurrency();
+            workerCount = hardwareThreads > 1 ? std::min(hardwareThreads - 1, 4u) : 1;
+        }
+        for (uint32_t i = 0; i < workerCount; ++i) {
+            mWorkers.emplace_back([this]() { workerLoop(); });
+        }
+        spdlog::info("{} started {} pipeline compile threads", __func__, workerCount);
+    }
+
+    // 把变体加入编译队列, 不阻塞
+    void request(const PipelineVariantKey& key) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        enqueueLocked(key);
+    }
+
+    void request(const std::vector<PipelineVariantKey>& keys) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (auto& key : keys) {
+            enqueueLocked(key);
+        }
+    }
+
+    // 变体已经编译好了就返回它, 否则请求编译并返回 fallback
+    VkPipeline get(const PipelineVariantKey& key, VkPipeline fallback) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        Entry& entry = enqueueLocked(key);
+        VkPipeline pipeline = entry.mPipeline.load(std::memory_order_acquire);
+        return pipeline != VK_NULL_HANDLE ? pipeline : fallback;
+    }
+
+    // 等待变体编译完成, 用于启动时创建 fallback pipeline
+    VkPipeline getBlocking(const PipelineVariantKey& key) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        Entry& entry = enqueueLocked(key);
+        mIdleCondition.wait(lock, [&entry]() { return entry.mDone; });
+        return entry.mPipeline.load(std::memory_order_acquire);
+    }
+
+    void waitIdle() {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mIdleCondition.wait(lock, [this]() { return mPending.empty() && mCompiling == 0; });
+    }
+
+    // 停止工作线程并销毁所有的变体, 调用之前需要保证 gpu 不再使用这些 pipeline
+    void destroy() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+            mPending.clear();
+        }
+        mCondition.notify_all();
+        for (auto& worker : mWorkers) {
+            worker.join();
+        }
+        mWorkers.clear();
+
+        for (auto& [key, entry] : mEntries) {
+            VkPipeline pipeline = entry->mPipeline.load();
+            if (pipeline != VK_NULL_HANDLE) {
+                vkDestroyPipeline(mDevice, pipeline, nullptr);
+            }
+        }
+        mEntries.clear();
+    }
+
+private:
+    struct Entry {
+        std::atomic<VkPipeline> mPipeline{VK_NULL_HANDLE};
+        bool mDone = false;
+    };
+
+    VkDevice mDevice = VK_NULL_HANDLE;
+    Builder mBuilder;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::condition_variable mIdleCondition;
+    std::deque<PipelineVariantKey> mPending;
+    std::unordered_map<PipelineVariantKey, std::unique_ptr<Entry>, PipelineVariantKeyHash> mEntries;
+    std::vector<std::thread> mWorkers;
+    uint32_t mCompiling = 0;
+    bool mStopping = false;
+
+    Entry& enqueueLocked(const PipelineVariantKey& key) {
+        auto it = mEntries.find(key);
+        if (it != mEntries.end()) {
+            return *it->second;
+        }
+        auto result = mEntries.emplace(key, std::make_unique<Entry>());
+        mPending.push_back(key);
+        mCondition.notify_one();
+        return *result.first->second;
+    }
+
+    void workerLoop() {
+        while (true) {
+            PipelineVariantKey key;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this]() { return mStopping || !mPending.empty(); });
+                if (mStopping) {
+                    return;
+                }
+                key = mPending.front();
+                mPending.pop_front();
+                mCompiling++;
+            }
+
+            auto startTime = std::chrono::high_resolution_clock::now();
+            VkPipeline pipeline = mBuilder(key);
+            std::chrono::duration<double, std::milli> compileTime =
+                std::chrono::high_resolution_clock::now() - startTime;
+
+            if (pipeline == VK_NULL_HANDLE) {
+                spdlog::error("{} failed to compile variant {:#x}", __func__, key.hash());
+            } else {
+                spdlog::debug("{} variant {:#x} (samples {}, depth format {}, blend {}, cull {}, features {:#x}) compiled in {:.3f} ms",
+                    __func__, key.hash(), static_cast<uint32_t>(key.mSamples),
+                    static_cast<uint32_t>(key.mDepthFormat), key.mBlendEnable, key.mCullMode, key.mFeatureFlags,
+                    compileTime.count());
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                Entry& entry = *mEntries[key];
+                entry.mPipeline.store(pipeline, std::memory_order_release);
+                entry.mDone = true;
+                mCompiling--;
+            }
+            mIdleCondition.notify_all();
+        }
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef _PRESENT_POLICY_DEMO_H_
+#define _PRESENT_POLICY_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace ops {
+
+// 按照使用场景选择 present mode, 而不是固定的 MAILBOX 优先
+enum class PresentPolicy {
+    LowLatency,     // 尽快显示最新的一帧, 允许撕裂
+    PowerSaving,    // 跟随垂直同步, gpu 只渲染能显示出来的帧
+    TearFree,       // 不撕裂, 有 MAILBOX 的时候用它降低延迟
+    Uncapped,       // 不受刷新率限制, 用于 benchmark
+    Count,
+};
+
+inline const char* presentPolicyName(PresentPolicy policy) {
+    switch (policy) {
+        case PresentPolicy::LowLatency:  return "low-latency";
+        case PresentPolicy::PowerSaving: return "power-saving";
+        case PresentPolicy::TearFree:    return "tear-free";
+        case PresentPolicy::Uncapped:    return "uncapped";
+        default:                         return "unknown";
+    }
+}
+
+inline bool parsePresentPolicy(const std::string& name, PresentPolicy& policy) {
+    for (int i = 0; i < static_cast<int>(PresentPolicy::Count); ++i) {
+        if (name == presentPolicyName(static_cast<PresentPolicy>(i))) {
+            policy = static_cast<PresentPolicy>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline PresentPolicy nextPresentPolicy(PresentPolicy policy) {
+    return static_cast<PresentPolicy>((static_cast<int>(policy) + 1) % static_cast<int>(PresentPolicy::Count));
+}
+
+inline const char* presentModeName(VkPresentModeKHR mode) {
+    switch (mode) {
+        case VK_PRESENT_MODE_IMMEDIATE_KHR:    return "IMMEDIATE";
+        case VK_PRESENT_MODE_MAILBOX_KHR:      return "MAILBOX";
+        case VK_PRESENT_MODE_FIFO_KHR:         return "FIFO";
+        case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+        default:                               return "OTHER";
+    }
+}
+
+// 按照策略的优先级从设备支持的 present mode 中选择, FIFO 是规范保证一定支持的
+inline VkPresentModeKHR choosePresentMode(PresentPolicy policy, const std::vector<VkPresentModeKHR>& availableModes) {
+    std::vector<VkPresentModeKHR> preferred;
+    switch (policy) {
+        case PresentPolicy::LowLatency:
+            preferred = {VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR};
+            break;
+        case PresentPolicy::PowerSaving:
+            preferred = {VK_PRESENT_MODE_FIFO_KHR};
+            break;
+        case PresentPolicy::TearFree:
+            preferred = {VK_PRESENT_MODE_MAILBOX_KHR};
+            break;
+        case PresentPolicy::Uncapped:
+            preferred = {VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR};
+            break;
+        default:
+            break;
+    }
+    for (VkPresentModeKHR mode : preferred) {
+        if (std::find(availableModes.begin(), availableModes.end(), mode) != availableModes.end()) {
+            return mode;
+        }
+    }
+    return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+}
+
+#endif
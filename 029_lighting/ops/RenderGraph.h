@@ -0,0 +1,692 @@
+#ifndef _RENDER_GRAPH_DEMO_H_
+#define _RENDER_GRAPH_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include <spdlog/spdlog.h>
+#include "BarrierBatcher.h"
+#include "FrameTimeline.h"
+#include "VkHandles.h"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ops {
+
+using RenderGraphResource = uint32_t;
+
+// pass 对资源的一次访问, stage 和 access 使用 synchronization2 的定义
+// 只能使用和 vulkan 1.0 数值相同的位 (NONE 除外), 设备不支持 VK_KHR_synchronization2 时直接截断成 vkCmdPipelineBarrier 的参数
+struct ResourceAccess {
+    VkPipelineStageFlags2KHR mStages = VK_PIPELINE_STAGE_2_NONE_KHR;
+    VkAccessFlags2KHR mAccess = VK_ACCESS_2_NONE_KHR;
+    // pass 执行时 image 需要处于的 layout; UNDEFINED 表示这是 pass 中 VkRenderPass 的 attachment,
+    // layout 转换和同步都由 render pass 的 initialLayout 和 EXTERNAL subpass dependency 完成, 图中只更新状态
+    VkImageLayout mLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    // pass 结束时 image 所处的 layout, MAX_ENUM 表示和 mLayout 相同, 只有 VkRenderPass 的 finalLayout 才需要设置
+    VkImageLayout mFinalLayout = VK_IMAGE_LAYOUT_MAX_ENUM;
+    // 不需要之前的内容 (清除或者完全覆盖), 转换时 oldLayout 使用 UNDEFINED, 之前写这个资源的 pass 也可能因此被剔除
+    bool mDiscard = false;
+
+    VkImageLayout finalLayout() const { return mFinalLayout == VK_IMAGE_LAYOUT_MAX_ENUM ? mLayout : mFinalLayout; }
+};
+
+// 由 render graph 创建的 image, 只在一帧之内有意义, 生命周期不重叠的 image 共用同一段内存
+struct TransientImageDesc {
+    VkFormat mFormat = VK_FORMAT_UNDEFINED;
+    VkExtent2D mExtent{};
+    VkImageUsageFlags mUsage = 0;
+    VkImageAspectFlags mAspect = VK_IMAGE_ASPECT_COLOR_BIT;
+    // 包含 LAZILY_ALLOCATED 的 image 单独分配, 不参与别名, 它们的内存本来就只在 tile 上
+    VkMemoryPropertyFlags mMemoryProperties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+    bool operator==(const TransientImageDesc& other) const {
+        return mFormat == other.mFormat && mExtent.width == other.mExtent.width &&
+            mExtent.height == other.mExtent.height && mUsage == other.mUsage && mAspect == other.mAspect &&
+            mMemoryProperties == other.mMemoryProperties;
+    }
+};
+
+// 帧图: pass 声明自己读写哪些资源, compile() 按声明的顺序
+//   1. 从输出资源反向剔除结果没有被使用的 pass
+//   2. 用 BarrierState 模拟每个资源的访问历史, 每个 pass 之前最多生成一次 barrier: 所有 buffer 和不需要转换 layout 的 image
+//      合并成一个全局的 memory barrier, 需要转换 layout 的 image 各自一个 image barrier, 连续的读之间不插入 barrier
+//   3. 按 pass 的下标计算 transient image 的生命周期, 不重叠的 image 放在同一个 VkDeviceMemory 的同一段上
+// 图的结构只在声明变化的时候重新 compile, 每一帧只需要绑定导入的 image 然后 execute()
+// 同一个队列上的 barrier 对之前提交的所有命令生效, 所以 transient image 在多个 frame in flight 之间共用一份,
+// 第一次使用之前的 barrier 等待上一帧 (以及和它共用内存的 image) 的最后一次使用
+class RenderGraph {
+public:
+    using RecordFunction = std::function<void(VkCommandBuffer)>;
+
+    // barrier2 为 nullptr 时使用 vkCmdPipelineBarrier
+    void init(VkPhysicalDevice physicalDevice, VkDevice device, FrameTimeline& timeline,
+            PFN_vkCmdPipelineBarrier2KHR barrier2) {
+        mPhysicalDevice = physicalDevice;
+        mDevice = device;
+        mTimeline = &timeline;
+        mCmdPipelineBarrier2 = barrier2;
+    }
+
+    // 清除所有的 pass 和资源声明; 已经创建的 transient image 保留, 下一次 compile 的声明和生命周期都相同时直接复用
+    void reset() {
+        mResources.clear();
+        mPasses.clear();
+        mFinalBarriers = BarrierBatch{};
+        mCompiled = false;
+    }
+
+    // 图之外的资源: initial 是进入这一帧时最后一次访问, final 是这一帧结束后需要的状态
+    // output 为 true 时这个资源是图的结果, 写它的 pass 不会被剔除
+    RenderGraphResource importImage(const std::string& name, VkImageAspectFlags aspect,
+            const ResourceAccess& initial, const ResourceAccess& final, bool output) {
+        Resource resource{};
+        resource.mName = name;
+        resource.mImage = true;
+        resource.mAspect = aspect;
+        resource.mInitial = initial;
+        resource.mFinal = final;
+        resource.mOutput = output;
+        mResources.push_back(resource);
+        return static_cast<RenderGraphResource>(mResources.size() - 1);
+    }
+
+    // buffer 只需要 memory barrier, 所以不需要绑定句柄
+    RenderGraphResource importBuffer(const std::string& name, const ResourceAccess& initial,
+            const ResourceAccess& final, bool output) {
+        Resource resource{};
+        resource.mName = name;
+        resource.mInitial = initial;
+        resource.mFinal = final;
+        resource.mOutput = output;
+        mResources.push_back(resource);
+        return static_cast<RenderGraphResource>(mResources.size() - 1);
+    }
+
+    // 第一次访问必须是 mDiscard 的写
+    RenderGraphResource createImage(const std::string& name, const TransientImageDesc& desc) {
+        Resource resource{};
+        resource.mName = name;
+        resource.mImage = true;
+        resource.mTransient = true;
+        resource.mAspect = desc.mAspect;
+        resource.mDesc = desc;
+        mResources.push_back(resource);
+        return static_cast<RenderGraphResource>(mResources.size() - 1);
+    }
+
+    // sideEffect 为 true 的 pass 不会被剔除 (例如结果由 cpu 读取)
+    uint32_t addPass(const std::string& name, RecordFunction record, bool sideEffect = false) {
+        Pass pass{};
+        pass.mName = name;
+        pass.mRecord = std::move(record);
+        pass.mSideEffect = sideEffect;
+        mPasses.push_back(std::move(pass));
+        return static_cast<uint32_t>(mPasses.size() - 1);
+    }
+
+    void read(uint32_t pass, RenderGraphResource resource, const ResourceAccess& access) {
+        mPasses[pass].mUsages.push_back({resource, access, false});
+    }
+
+    // 没有 mDiscard 的写同时也依赖之前的内容
+    void write(uint32_t pass, RenderGraphResource resource, const ResourceAccess& access) {
+        mPasses[pass].mUsages.push_back({resource, access, true});
+    }
+
+    void compile() {
+        cullPasses();
+        computeLifetimes();
+        realizeTransients();
+        buildBarriers();
+        mCompiled = true;
+    }
+
+    // 导入的 image 每一帧可能不同 (交换链图像)
+    void bindImage(RenderGraphResource resource, VkImage image) {
+        mResources[resource].mBoundImage = image;
+    }
+
+    VkImage image(RenderGraphResource resource) const {
+        const Resource& r = mResources[resource];
+        return r.mPhysical >= 0 ? mPhysicalImages[r.mPhysical].mImage.get() : r.mBoundImage;
+    }
+
+    VkImageView imageView(RenderGraphResource resource) const {
+        const Resource& r = mResources[resource];
+        return r.mPhysical >= 0 ? mPhysicalImages[r.mPhysical].mView.get() : VK_NULL_HANDLE;
+    }
+
+    bool isCulled(uint32_t pass) const { return mPasses[pass].mCulled; }
+    bool compiled() const { return mCompiled; }
+
+    void execute(VkCommandBuffer commandBuffer) const {
+        for (const Pass& pass : mPasses) {
+            if (pass.mCulled) {
+                continue;
+            }
+            recordBatch(commandBuffer, pass.mBarriers);
+            pass.mRecord(commandBuffer);
+        }
+        recordBatch(commandBuffer, mFinalBarriers);
+    }
+
+    // 交换链重建之前调用, 已经提交的帧仍然可以使用旧的 image, 由 FrameTimeline 延迟销毁
+    void releaseTransients() {
+        mPhysicalImages.clear();
+        mMemoryBlocks.clear();
+        mRealizedSignature.clear();
+        for (Resource& resource : mResources) {
+            resource.mPhysical = -1;
+        }
+        mCompiled = false;
+    }
+
+    // 用 debug 级别打印编译的结果 (LOG_DEBUG): 每个 pass 之前的 barrier, 被剔除的 pass, transient image 的位置和别名节省的内存
+    void dump() const {
+        uint32_t culled = 0;
+        for (const Pass& pass : mPasses) {
+            culled += pass.mCulled ? 1 : 0;
+        }
+        spdlog::debug("{} {} passes ({} culled), {} resources, {} barrier batches", __func__,
+            mPasses.size(), culled, mResources.size(), barrierBatchCount());
+        for (size_t i = 0; i < mPasses.size(); ++i) {
+            const Pass& pass = mPasses[i];
+            spdlog::debug("{}   pass {} {}{}", __func__, i, pass.mName, pass.mCulled ? " [culled]" : "");
+            if (!pass.mCulled) {
+                dumpBatch(pass.mBarriers);
+            }
+        }
+        if (!mFinalBarriers.empty()) {
+            spdlog::debug("{}   end of frame", __func__);
+            dumpBatch(mFinalBarriers);
+        }
+
+        VkDeviceSize requested = 0;
+        VkDeviceSize allocated = 0;
+        for (const PhysicalImage& physical : mPhysicalImages) {
+            requested += physical.mSize;
+        }
+        for (const MemoryBlock& block : mMemoryBlocks) {
+            allocated += block.mSize;
+        }
+        for (const Resource& resource : mResources) {
+            if (resource.mPhysical < 0) {
+                continue;
+            }
+            const PhysicalImage& physical = mPhysicalImages[resource.mPhysical];
+            spdlog::debug("{}   transient {} [{}x{}] {} KiB at memory {} + {} KiB, passes {} ~ {}", __func__,
+                resource.mName, resource.mDesc.mExtent.width, resource.mDesc.mExtent.height, physical.mSize / 1024,
+                physical.mBlock, physical.mOffset / 1024, resource.mFirstPass, resource.mLastPass);
+        }
+        spdlog::debug("{} transient memory {} KiB in {} allocations, {} KiB without aliasing, {} KiB saved", __func__,
+            allocated / 1024, mMemoryBlocks.size(), requested / 1024, (requested - std::min(requested, allocated)) / 1024);
+    }
+
+private:
+    struct Resource {
+        std::string mName;
+        bool mImage = false;
+        bool mTransient = false;
+        bool mOutput = false;
+        VkImageAspectFlags mAspect = 0;
+        ResourceAccess mInitial;
+        ResourceAccess mFinal;
+        TransientImageDesc mDesc;
+        VkImage mBoundImage = VK_NULL_HANDLE;
+        // 在没有被剔除的 pass 中第一次和最后一次使用的下标, 没有使用时 mFirstPass > mLastPass
+        uint32_t mFirstPass = UINT32_MAX;
+        uint32_t mLastPass = 0;
+        int32_t mPhysical = -1;
+    };
+
+    struct Usage {
+        RenderGraphResource mResource;
+        ResourceAccess mAccess;
+        bool mWrite;
+    };
+
+    // image 在 compile 时还没有绑定 (交换链图像每一帧不同), 先记录资源, execute 时再换成 VkImage
+    struct ImageBarrier {
+        RenderGraphResource mResource;
+        BarrierDependency mDependency;
+    };
+
+    struct BarrierBatch {
+        // 合并之后的全局 memory barrier
+        BarrierDependency mMemory;
+        std::vector<ImageBarrier> mImageBarriers;
+
+        bool hasMemoryBarrier() const { return mMemory.mSrcStages != VK_PIPELINE_STAGE_2_NONE_KHR; }
+        bool empty() const { return !hasMemoryBarrier() && mImageBarriers.empty(); }
+    };
+
+    struct Pass {
+        std::string mName;
+        RecordFunction mRecord;
+        bool mSideEffect = false;
+        bool mCulled = false;
+        std::vector<Usage> mUsages;
+        BarrierBatch mBarriers;
+    };
+
+    struct PhysicalImage {
+        Image mImage;
+        ImageView mView;
+        uint32_t mBlock = 0;
+        VkDeviceSize mOffset = 0;
+        VkDeviceSize mSize = 0;
+    };
+
+    struct MemoryBlock {
+        DeviceMemory mMemory;
+        uint32_t mMemoryType = 0;
+        VkDeviceSize mSize = 0;
+        bool mDedicated = false;
+    };
+
+    // 复用 transient image 的条件: 同样的 image 按同样的顺序声明, 生命周期也相同
+    struct TransientSignature {
+        TransientImageDesc mDesc;
+        uint32_t mFirstPass;
+        uint32_t mLastPass;
+
+        bool operator==(const TransientSignature& other) const {
+            return mDesc == other.mDesc && mFirstPass == other.mFirstPass && mLastPass == other.mLastPass;
+        }
+    };
+
+    void cullPasses() {
+        std::vector<bool> needed(mResources.size(), false);
+        for (size_t i = 0; i < mResources.size(); ++i) {
+            needed[i] = mResources[i].mOutput;
+        }
+        for (size_t i = mPasses.size(); i-- > 0;) {
+            Pass& pass = mPasses[i];
+            bool keep = pass.mSideEffect;
+            for (const Usage& usage : pass.mUsages) {
+                keep = keep || (usage.mWrite && needed[usage.mResource]);
+            }
+            pass.mCulled = !keep;
+            if (!keep) {
+                continue;
+            }
+            // 先处理覆盖, 再处理依赖之前内容的访问
+            for (const Usage& usage : pass.mUsages) {
+                if (usage.mWrite && usage.mAccess.mDiscard) {
+                    needed[usage.mResource] = false;
+                }
+            }
+            for (const Usage& usage : pass.mUsages) {
+                if (!usage.mWrite || !usage.mAccess.mDiscard) {
+                    needed[usage.mResource] = true;
+                }
+            }
+        }
+    }
+
+    void computeLifetimes() {
+        for (Resource& resource : mResources) {
+            resource.mFirstPass = UINT32_MAX;
+            resource.mLastPass = 0;
+        }
+        for (uint32_t i = 0; i < mPasses.size(); ++i) {
+            if (mPasses[i].mCulled) {
+                continue;
+            }
+            for (const Usage& usage : mPasses[i].mUsages) {
+                Resource& resource = mResources[usage.mResource];
+                resource.mFirstPass = std::min(resource.mFirstPass, i);
+                resource.mLastPass = std::max(resource.mLastPass, i);
+            }
+        }
+    }
+
+    bool used(const Resource& resource) const { return resource.mFirstPass <= resource.mLastPass; }
+
+    static bool lifetimesOverlap(const Resource& a, const Resource& b) {
+        return a.mFirstPass <= b.mLastPass && b.mFirstPass <= a.mLastPass;
+    }
+
+    void realizeTransients() {
+        std::vector<TransientSignature> signature;
+        std::vector<RenderGraphResource> transients;
+        for (RenderGraphResource i = 0; i < mResources.size(); ++i) {
+            const Resource& resource = mResources[i];
+            if (resource.mTransient && used(resource)) {
+                signature.push_back({resource.mDesc, resource.mFirstPass, resource.mLastPass});
+                transients.push_back(i);
+            }
+        }
+        if (!signature.empty() && signature == mRealizedSignature) {
+            for (size_t i = 0; i < transients.size(); ++i) {
+                mResources[transients[i]].mPhysical = static_cast<int32_t>(i);
+            }
+            return;
+        }
+        mPhysicalImages.clear();
+        mMemoryBlocks.clear();
+        mRealizedSignature = signature;
+
+        VkPhysicalDeviceMemoryProperties memoryProperties;
+        vkGetPhysicalDeviceMemoryProperties(mPhysicalDevice, &memoryProperties);
+        std::vector<VkMemoryRequirements> requirements(transients.size());
+        std::vector<uint32_t> memoryTypes(transients.size());
+        mPhysicalImages.resize(transients.size());
+        for (size_t i = 0; i < transients.size(); ++i) {
+            Resource& resource = mResources[transients[i]];
+            resource.mPhysical = static_cast<int32_t>(i);
+            mPhysicalImages[i].mImage = Image(*mTimeline, createVkImage(resource));
+            vkGetImageMemoryRequirements(mDevice, mPhysicalImages[i].mImage.get(), &requirements[i]);
+            memoryTypes[i] = findMemoryType(memoryProperties, requirements[i].memoryTypeBits,
+                resource.mDesc.mMemoryProperties, resource.mName);
+            mPhysicalImages[i].mSize = requirements[i].size;
+        }
+
+        // 从大到小放置, 每个 image 放在同一种内存中第一个和生命周期重叠的 image 都不冲突的位置
+        std::vector<size_t> order(transients.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&requirements](size_t a, size_t b) {
+            return requirements[a].size > requirements[b].size;
+        });
+        std::vector<size_t> placed;
+        for (size_t index : order) {
+            PhysicalImage& physical = mPhysicalImages[index];
+            bool lazy = (memoryProperties.memoryTypes[memoryTypes[index]].propertyFlags &
+                VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) != 0;
+            int32_t blockIndex = -1;
+            for (size_t b = 0; b < mMemoryBlocks.size() && !lazy; ++b) {
+                if (!mMemoryBlocks[b].mDedicated && mMemoryBlocks[b].mMemoryType == memoryTypes[index]) {
+                    blockIndex = static_cast<int32_t>(b);
+                }
+            }
+            if (blockIndex < 0) {
+                MemoryBlock block{};
+                block.mMemoryType = memoryTypes[index];
+                block.mDedicated = lazy;
+                mMemoryBlocks.push_back(std::move(block));
+                blockIndex = static_cast<int32_t>(mMemoryBlocks.size() - 1);
+            }
+            physical.mBlock = static_cast<uint32_t>(blockIndex);
+            physical.mOffset = findOffset(placed, index, transients, requirements[index]);
+            MemoryBlock& block = mMemoryBlocks[blockIndex];
+            block.mSize = std::max(block.mSize, physical.mOffset + physical.mSize);
+            placed.push_back(index);
+        }
+
+        for (MemoryBlock& block : mMemoryBlocks) {
+            VkMemoryAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+            allocInfo.allocationSize = block.mSize;
+            allocInfo.memoryTypeIndex = block.mMemoryType;
+            VkDeviceMemory memory;
+            if (vkAllocateMemory(mDevice, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+                spdlog::error("{} failed to allocate {} bytes of transient memory", __func__, block.mSize);
+                throw std::runtime_error("failed to allocate transient memory");
+            }
+            block.mMemory = DeviceMemory(*mTimeline, memory);
+        }
+        for (size_t i = 0; i < transients.size(); ++i) {
+            const Resource& resource = mResources[transients[i]];
+            PhysicalImage& physical = mPhysicalImages[i];
+            vkBindImageMemory(mDevice, physical.mImage.get(), mMemoryBlocks[physical.mBlock].mMemory.get(),
+                physical.mOffset);
+            physical.mView = ImageView(*mTimeline, createVkImageView(physical.mImage.get(), resource));
+        }
+    }
+
+    // 和同一块内存中生命周期重叠的 image 都不相交的最低偏移, 候选位置是 0 和每个已放置的 image 的末尾
+    VkDeviceSize findOffset(const std::vector<size_t>& placed, size_t index,
+            const std::vector<RenderGraphResource>& transients, const VkMemoryRequirements& requirement) const {
+        const PhysicalImage& physical = mPhysicalImages[index];
+        std::vector<VkDeviceSize> candidates = {0};
+        for (size_t other : placed) {
+            if (mPhysicalImages[other].mBlock == physical.mBlock) {
+                candidates.push_back(mPhysicalImages[other].mOffset + mPhysicalImages[other].mSize);
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+        for (VkDeviceSize candidate : candidates) {
+            VkDeviceSize offset = (candidate + requirement.alignment - 1) / requirement.alignment * requirement.alignment;
+            bool fits = true;
+            for (size_t other : placed) {
+                const PhysicalImage& o = mPhysicalImages[other];
+                if (o.mBlock != physical.mBlock ||
+                    !lifetimesOverlap(mResources[transients[index]], mResources[transients[other]])) {
+                    continue;
+                }
+                if (offset < o.mOffset + o.mSize && o.mOffset < offset + physical.mSize) {
+                    fits = false;
+                    break;
+                }
+            }
+            if (fits) {
+                return offset;
+            }
+        }
+        return 0;
+    }
+
+    VkImage createVkImage(const Resource& resource) const {
+        VkImageCreateInfo imageInfo{};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.extent = {resource.mDesc.mExtent.width, resource.mDesc.mExtent.height, 1};
+        imageInfo.mipLevels = 1;
+        imageInfo.arrayLayers = 1;
+        imageInfo.format = resource.mDesc.mFormat;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        imageInfo.usage = resource.mDesc.mUsage;
+        imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        VkImage image;
+        if (vkCreateImage(mDevice, &imageInfo, nullptr, &image) != VK_SUCCESS) {
+            spdlog::error("{} failed to create transient image {}", __func__, resource.mName);
+            throw std::runtime_error("failed to create transient image");
+        }
+        return image;
+    }
+
+    VkImageView createVkImageView(VkImage image, const Resource& resource) const {
+        VkImageViewCreateInfo viewInfo{};
+        viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        viewInfo.image = image;
+        viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        viewInfo.format = resource.mDesc.mFormat;
+        // depth/stencil 的 view 只包含 depth, input attachment 的 view 只能有一个 aspect, barrier 仍然覆盖所有 aspect
+        VkImageAspectFlags aspect = resource.mAspect;
+        if (aspect & VK_IMAGE_ASPECT_DEPTH_BIT) {
+            aspect &= ~VK_IMAGE_ASPECT_STENCIL_BIT;
+        }
+        viewInfo.subresourceRange = {aspect, 0, 1, 0, 1};
+        VkImageView view;
+        if (vkCreateImageView(mDevice, &viewInfo, nullptr, &view) != VK_SUCCESS) {
+            spdlog::error("{} failed to create transient image view {}", __func__, resource.mName);
+            throw std::runtime_error("failed to create transient image view");
+        }
+        return view;
+    }
+
+    // 要求 lazily allocated 但是 image 的 typeBits 中没有这种内存的时候, 退回 DEVICE_LOCAL
+    static uint32_t findMemoryType(const VkPhysicalDeviceMemoryProperties& memoryProperties, uint32_t typeBits,
+            VkMemoryPropertyFlags properties, const std::string& name) {
+        for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i) {
+            if ((typeBits & (1u << i)) && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+                return i;
+            }
+        }
+        if (properties & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) {
+            spdlog::info("{} transient image {} does not support lazily allocated memory, use device local",
+                __func__, name);
+            return findMemoryType(memoryProperties, typeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, name);
+        }
+        spdlog::error("{} no memory type for transient image {}", __func__, name);
+        throw std::runtime_error("failed to find memory type for transient image");
+    }
+
+    static BarrierAccess barrierAccess(const ResourceAccess& access) {
+        return {access.mStages, access.mAccess};
+    }
+
+    void buildBarriers() {
+        std::vector<BarrierState> states(mResources.size());
+        for (RenderGraphResource i = 0; i < mResources.size(); ++i) {
+            const Resource& resource = mResources[i];
+            BarrierState& state = states[i];
+            if (!resource.mTransient) {
+                state = BarrierState::initial(resource.mInitial.finalLayout(), barrierAccess(resource.mInitial));
+                continue;
+            }
+            // 上一帧中这段内存的最后一次使用: 自己以及和自己的内存重叠的 transient image
+            for (RenderGraphResource j = 0; j < mResources.size(); ++j) {
+                if (aliases(i, j)) {
+                    const ResourceAccess& last = lastAccess(j);
+                    state.mWriteStages |= last.mStages;
+                    state.mWriteAccess |= last.mAccess & BarrierState::WRITE_ACCESS;
+                }
+            }
+        }
+
+        for (Pass& pass : mPasses) {
+            pass.mBarriers = BarrierBatch{};
+            if (pass.mCulled) {
+                continue;
+            }
+            for (const Usage& usage : pass.mUsages) {
+                access(pass.mBarriers, states[usage.mResource], usage.mResource, usage.mAccess, usage.mWrite);
+            }
+        }
+
+        mFinalBarriers = BarrierBatch{};
+        for (RenderGraphResource i = 0; i < mResources.size(); ++i) {
+            const Resource& resource = mResources[i];
+            if (!resource.mTransient && used(resource)) {
+                access(mFinalBarriers, states[i], i, resource.mFinal, BarrierState::isWrite(barrierAccess(resource.mFinal)));
+            }
+        }
+    }
+
+    bool aliases(RenderGraphResource a, RenderGraphResource b) const {
+        const Resource& ra = mResources[a];
+        const Resource& rb = mResources[b];
+        if (ra.mPhysical < 0 || rb.mPhysical < 0) {
+            return false;
+        }
+        const PhysicalImage& pa = mPhysicalImages[ra.mPhysical];
+        const PhysicalImage& pb = mPhysicalImages[rb.mPhysical];
+        return pa.mBlock == pb.mBlock && pa.mOffset < pb.mOffset + pb.mSize && pb.mOffset < pa.mOffset + pa.mSize;
+    }
+
+    const ResourceAccess& lastAccess(RenderGraphResource resource) const {
+        const Pass& pass = mPasses[mResources[resource].mLastPass];
+        const ResourceAccess* last = nullptr;
+        for (const Usage& usage : pass.mUsages) {
+            if (usage.mResource == resource) {
+                last = &usage.mAccess;
+            }
+        }
+        return *last;
+    }
+
+    // 把一次访问加入 batch, 并更新资源的状态
+    // 需要转换 layout 的 image 各自一个 image barrier, 其它的依赖合并到全局的 memory barrier
+    void access(BarrierBatch& batch, BarrierState& state, RenderGraphResource resource, const ResourceAccess& access,
+            bool write) const {
+        const Resource& r = mResources[resource];
+        if (r.mImage && access.mLayout == VK_IMAGE_LAYOUT_UNDEFINED) {
+            state.synchronized(barrierAccess(access), write);
+        } else {
+            // 覆盖 transient image 时这段内存之前可能属于别的 image, 总是从 UNDEFINED 转换
+            if (r.mImage && r.mTransient && access.mDiscard) {
+                state.mLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            }
+            VkImageLayout layout = r.mImage ? access.mLayout : VK_IMAGE_LAYOUT_UNDEFINED;
+            bool transition = layout != state.mLayout;
+            BarrierDependency dependency{};
+            if (state.resolve(layout, barrierAccess(access), write, access.mDiscard, dependency)) {
+                if (transition) {
+                    batch.mImageBarriers.push_back({resource, dependency});
+                } else {
+                    batch.mMemory.mSrcStages |= dependency.mSrcStages;
+                    batch.mMemory.mSrcAccess |= dependency.mSrcAccess;
+                    batch.mMemory.mDstStages |= dependency.mDstStages;
+                    batch.mMemory.mDstAccess |= dependency.mDstAccess;
+                }
+            }
+        }
+        if (access.finalLayout() != VK_IMAGE_LAYOUT_UNDEFINED) {
+            state.mLayout = access.finalLayout();
+        }
+    }
+
+    void recordBatch(VkCommandBuffer commandBuffer, const BarrierBatch& batch) const {
+        if (batch.empty()) {
+            return;
+        }
+        std::vector<ImageDependency> images(batch.mImageBarriers.size());
+        for (size_t i = 0; i < batch.mImageBarriers.size(); ++i) {
+            const ImageBarrier& b = batch.mImageBarriers[i];
+            images[i] = {image(b.mResource), {mResources[b.mResource].mAspect, 0, 1, 0, 1}, b.mDependency};
+        }
+        recordBarriers(commandBuffer, mCmdPipelineBarrier2, batch.mMemory, images, {});
+    }
+
+    size_t barrierBatchCount() const {
+        size_t count = mFinalBarriers.empty() ? 0 : 1;
+        for (const Pass& pass : mPasses) {
+            count += (!pass.mCulled && !pass.mBarriers.empty()) ? 1 : 0;
+        }
+        return count;
+    }
+
+    void dumpBatch(const BarrierBatch& batch) const {
+        if (batch.hasMemoryBarrier()) {
+            const BarrierDependency& m = batch.mMemory;
+            spdlog::debug("{}     memory  stages {:#x} -> {:#x}, access {:#x} -> {:#x}", __func__,
+                m.mSrcStages, m.mDstStages, m.mSrcAccess, m.mDstAccess);
+        }
+        for (const ImageBarrier& b : batch.mImageBarriers) {
+            const BarrierDependency& d = b.mDependency;
+            spdlog::debug("{}     image {} {} -> {}, stages {:#x} -> {:#x}, access {:#x} -> {:#x}", __func__,
+                mResources[b.mResource].mName, layoutName(d.mOldLayout), layoutName(d.mNewLayout),
+                d.mSrcStages, d.mDstStages, d.mSrcAccess, d.mDstAccess);
+        }
+    }
+
+    static std::string layoutName(VkImageLayout layout) {
+        switch (layout) {
+        case VK_IMAGE_LAYOUT_UNDEFINED: return "UNDEFINED";
+        case VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL: return "COLOR_ATTACHMENT";
+        case VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL: return "DEPTH_STENCIL_ATTACHMENT";
+        case VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL: return "DEPTH_STENCIL_READ_ONLY";
+        case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL: return "SHADER_READ_ONLY";
+        case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL: return "TRANSFER_SRC";
+        case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL: return "TRANSFER_DST";
+        case VK_IMAGE_LAYOUT_PRESENT_SRC_KHR: return "PRESENT_SRC";
+        default: return std::to_string(static_cast<int>(layout));
+        }
+    }
+
+    VkPhysicalDevice mPhysicalDevice = VK_NULL_HANDLE;
+    VkDevice mDevice = VK_NULL_HANDLE;
+    FrameTimeline* mTimeline = nullptr;
+    PFN_vkCmdPipelineBarrier2KHR mCmdPipelineBarrier2 = nullptr;
+
+    std::vector<Resource> mResources;
+    std::vector<Pass> mPasses;
+    BarrierBatch mFinalBarriers;
+    bool mCompiled = false;
+
+    std::vector<PhysicalImage> mPhysicalImages;
+    std::vector<MemoryBlock> mMemoryBlocks;
+    std::vector<TransientSignature> mRealizedSignature;
+};
+
+}
+
+#endif
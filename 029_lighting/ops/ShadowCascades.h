@@ -0,0 +1,116 @@
+#ifndef _SHADOW_CASCADES_DEMO_H_
+#define _SHADOW_CASCADES_DEMO_H_
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace ops {
+
+// 方向光的 cascaded shadow map: 相机的 view frustum 按深度切成 COUNT 段, 每一段使用 shadow map 数组中的一层
+// 每一层的投影范围是这一段 frustum 的包围球, 半径只和 fov / aspect / 切分深度有关, 相机旋转的时候不变;
+// 球心在光源空间中对齐到 texel, 相机平移不到一个 texel 的时候矩阵也不变. 矩阵不变并且这一层只有静态的几何体时,
+// 上一次渲染的结果可以直接使用, 只有光源方向或者 cascade 的范围变化时才重新渲染
+// 常量和 shader/clustered_common.glsl 保持一致
+class ShadowCascades {
+public:
+    static constexpr uint32_t COUNT = 4;
+    // 对数切分和均匀切分的混合比例, 越大近处的 cascade 越小
+    static constexpr float SPLIT_LAMBDA = 0.75f;
+
+    // 光源空间的深度范围覆盖整个场景, 场景之外没有投射阴影的物体
+    void setSceneBounds(const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+        mBoundsMin = boundsMin;
+        mBoundsMax = boundsMax;
+        invalidate();
+    }
+
+    void invalidate() { mValidMask = 0; }
+
+    // 计算这一帧每个 cascade 的矩阵, 返回需要重新渲染的 cascade 的位掩码
+    // dynamicCasterMask 中的 cascade 包含运动的物体, 每一帧都要重新渲染; cacheEnabled 为 false 时全部重新渲染
+    uint32_t update(const glm::mat4& view, float fovY, float aspect, float nearPlane, float shadowDistance,
+            const glm::vec3& lightDirection, uint32_t resolution, bool cacheEnabled, uint32_t dynamicCasterMask = 0) {
+        glm::mat4 inverseView = glm::inverse(view);
+        glm::vec3 direction = glm::normalize(lightDirection);
+        glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        glm::mat4 lightRotation = glm::lookAt(glm::vec3(0.0f), direction, up);
+
+        // 场景包围盒在光源空间中的深度范围, view 空间朝 -z 看
+        float minZ = std::numeric_limits<float>::max();
+        float maxZ = std::numeric_limits<float>::lowest();
+        for (uint32_t corner = 0; corner < 8; ++corner) {
+            glm::vec3 position((corner & 1) ? mBoundsMax.x : mBoundsMin.x,
+                (corner & 2) ? mBoundsMax.y : mBoundsMin.y,
+                (corner & 4) ? mBoundsMax.z : mBoundsMin.z);
+            float z = (lightRotation * glm::vec4(position, 1.0f)).z;
+            minZ = std::min(minZ, z);
+            maxZ = std::max(maxZ, z);
+        }
+        float depthPadding = (maxZ - minZ) * 0.01f + 1e-3f;
+
+        float tanHalfFovY = std::tan(fovY * 0.5f);
+        float tanHalfFovX = tanHalfFovY * aspect;
+        float sliceNear = nearPlane;
+        uint32_t renderMask = 0;
+        for (uint32_t i = 0; i < COUNT; ++i) {
+            float ratio = static_cast<float>(i + 1) / COUNT;
+            float logSplit = nearPlane * std::pow(shadowDistance / nearPlane, ratio);
+            float uniformSplit = nearPlane + (shadowDistance - nearPlane) * ratio;
+            float sliceFar = SPLIT_LAMBDA * logSplit + (1.0f - SPLIT_LAMBDA) * uniformSplit;
+
+            // 包围球的球心在 view 空间的 z 轴上, 在 view 空间中计算, 半径不受相机姿态的浮点误差影响
+            float centerDepth = (sliceNear + sliceFar) * 0.5f;
+            float farCornerSq = sliceFar * sliceFar * (tanHalfFovX * tanHalfFovX + tanHalfFovY * tanHalfFovY);
+            float nearCornerSq = sliceNear * sliceNear * (tanHalfFovX * tanHalfFovX + tanHalfFovY * tanHalfFovY);
+            float radius = std::sqrt(std::max(farCornerSq + (sliceFar - centerDepth) * (sliceFar - centerDepth),
+                nearCornerSq + (centerDepth - sliceNear) * (centerDepth - sliceNear)));
+
+            glm::vec3 center = glm::vec3(inverseView * glm::vec4(0.0f, 0.0f, -centerDepth, 1.0f));
+            glm::vec3 lightCenter = glm::vec3(lightRotation * glm::vec4(center, 1.0f));
+            float texelSize = 2.0f * radius / static_cast<float>(resolution);
+            lightCenter.x = std::floor(lightCenter.x / texelSize) * texelSize;
+            lightCenter.y = std::floor(lightCenter.y / texelSize) * texelSize;
+
+            glm::mat4 projection = glm::ortho(lightCenter.x - radius, lightCenter.x + radius,
+                lightCenter.y - radius, lightCenter.y + radius,
+                -maxZ - depthPadding, -minZ + depthPadding);
+            glm::mat4 viewProj = projection * lightRotation;
+
+            uint32_t bit = 1u << i;
+            if (!cacheEnabled || !(mValidMask & bit) || (dynamicCasterMask & bit) || viewProj != mViewProj[i]) {
+                renderMask |= bit;
+            }
+            mViewProj[i] = viewProj;
+            mSplitDepths[i] = sliceFar;
+            mTexelSizes[i] = texelSize;
+            sliceNear = sliceFar;
+        }
+        mValidMask = (1u << COUNT) - 1;
+        return renderMask;
+    }
+
+    const glm::mat4& viewProj(uint32_t cascade) const { return mViewProj[cascade]; }
+    // 每个 cascade 覆盖到的 view 空间深度 (正数)
+    glm::vec4 splitDepths() const { return glm::vec4(mSplitDepths[0], mSplitDepths[1], mSplitDepths[2], mSplitDepths[3]); }
+    // 每个 texel 在世界空间中的大小, shader 中用来计算 normal offset
+    glm::vec4 texelSizes() const { return glm::vec4(mTexelSizes[0], mTexelSizes[1], mTexelSizes[2], mTexelSizes[3]); }
+
+private:
+    static_assert(COUNT == 4, "split depths and texel sizes are packed into a vec4");
+
+    glm::vec3 mBoundsMin = glm::vec3(-1.0f);
+    glm::vec3 mBoundsMax = glm::vec3(1.0f);
+    std::array<glm::mat4, COUNT> mViewProj{};
+    std::array<float, COUNT> mSplitDepths{};
+    std::array<float, COUNT> mTexelSizes{};
+    uint32_t mValidMask = 0;
+};
+
+}
+
+#endif
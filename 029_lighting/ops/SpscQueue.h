@@ -0,0 +1,47 @@
+#ifndef _SPSC_QUEUE_DEMO_H_
+#define _SPSC_QUEUE_DEMO_H_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+namespace ops {
+
+// 单生产者单消费者的无锁环形队列, 容量固定, 满了之后 tryPush 返回 false
+// 生产者只写 mTail, 消费者只写 mHead, 两个下标分开放在不同的 cache line 上
+template <typename T, size_t Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+    // 只能由生产者线程调用
+    bool tryPush(const T& value) {
+        size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mHead.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        mItems[tail & (Capacity - 1)] = value;
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 只能由消费者线程调用
+    bool tryPop(T& value) {
+        size_t head = mHead.load(std::memory_order_relaxed);
+        if (head == mTail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = mItems[head & (Capacity - 1)];
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::array<T, Capacity> mItems{};
+    alignas(64) std::atomic<size_t> mHead{0};
+    alignas(64) std::atomic<size_t> mTail{0};
+};
+
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _TRIPLE_BUFFER_DEMO_H_
+#define _TRIPLE_BUFFER_DEMO_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace ops {
+
+// 单写单读的无锁三缓冲, 写线程和读线程各持有一个缓冲, 中间的缓冲通过一次原子交换传递
+// 读线程总是拿到最近一次 publish 的完整数据, 两边都不会被对方阻塞, 中间没有读到的旧数据会被直接覆盖
+template <typename T>
+class TripleBuffer {
+public:
+    // 只能由写线程调用, 写完之后调用 publish
+    T& writeBuffer() { return mBuffers[mWriteIndex].mValue; }
+
+    void publish() {
+        uint8_t previous = mMiddle.exchange(mWriteIndex | DIRTY_BIT, std::memory_order_acq_rel);
+        mWriteIndex = previous & INDEX_MASK;
+    }
+
+    // 只能由读线程调用, 有新数据的时候换到读缓冲, 返回的引用在下一次 read 之前有效
+    const T& read() {
+        if (mMiddle.load(std::memory_order_relaxed) & DIRTY_BIT) {
+            uint8_t previous = mMiddle.exchange(mReadIndex, std::memory_order_acq_rel);
+            mReadIndex = previous & INDEX_MASK;
+        }
+        return mBuffers[mReadIndex].mValue;
+    }
+
+private:
+    static constexpr uint8_t INDEX_MASK = 0x3;
+    static constexpr uint8_t DIRTY_BIT = 0x4;
+
+    // 每个缓冲独占 cache line, 避免读写线程之间的伪共享
+    struct alignas(64) Slot {
+        T mValue{};
+    };
+
+    std::array<Slot, 3> mBuffers{};
+    alignas(64) std::atomic<uint8_t> mMiddle{1};
+    uint8_t mWriteIndex = 0;
+    uint8_t mReadIndex = 2;
+};
+
+}
+
+#endif
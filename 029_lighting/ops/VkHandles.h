@@ -0,0 +1,74 @@
+#ifndef _VK_HANDLES_DEMO_H_
+#define _VK_HANDLES_DEMO_H_
+
+#include <vulkan/vulkan_core.h>
+#include "FrameTimeline.h"
+#include <utility>
+
+namespace ops {
+
+// 只能移动的 vulkan 句柄, 析构或者 reset 的时候不会立即销毁, 而是交给 FrameTimeline,
+// 等到目前为止所有的提交都执行完之后再销毁, 运行时替换资源不需要 vkDeviceWaitIdle
+// Destroy 是 vkDestroyBuffer 这样的函数, 用非类型模板参数区分, 32 位平台上所有非分发句柄都是 uint64_t
+template <typename T, auto Destroy>
+class UniqueHandle {
+public:
+    UniqueHandle() = default;
+
+    UniqueHandle(FrameTimeline& timeline, T handle) : mTimeline(&timeline), mHandle(handle) {}
+
+    ~UniqueHandle() { reset(); }
+
+    UniqueHandle(const UniqueHandle&) = delete;
+    UniqueHandle& operator=(const UniqueHandle&) = delete;
+
+    UniqueHandle(UniqueHandle&& other) noexcept
+        : mTimeline(other.mTimeline), mHandle(std::exchange(other.mHandle, VK_NULL_HANDLE)) {}
+
+    UniqueHandle& operator=(UniqueHandle&& other) noexcept {
+        if (this != &other) {
+            reset();
+            mTimeline = other.mTimeline;
+            mHandle = std::exchange(other.mHandle, VK_NULL_HANDLE);
+        }
+        return *this;
+    }
+
+    T get() const { return mHandle; }
+    const T* address() const { return &mHandle; }
+    explicit operator bool() const { return mHandle != VK_NULL_HANDLE; }
+
+    // 把当前的句柄放进延迟销毁队列, 对应最近一次分配的 timeline 值
+    void reset() {
+        if (mHandle == VK_NULL_HANDLE) {
+            return;
+        }
+        VkDevice device = mTimeline->device();
+        T handle = std::exchange(mHandle, VK_NULL_HANDLE);
+        mTimeline->deferDestroy(mTimeline->lastValue(), [device, handle]() {
+            Destroy(device, handle, nullptr);
+        });
+    }
+
+    // 放弃所有权, 由调用者负责销毁
+    T release() {
+        return std::exchange(mHandle, VK_NULL_HANDLE);
+    }
+
+private:
+    FrameTimeline* mTimeline = nullptr;
+    T mHandle = VK_NULL_HANDLE;
+};
+
+using Buffer = UniqueHandle<VkBuffer, vkDestroyBuffer>;
+using DeviceMemory = UniqueHandle<VkDeviceMemory, vkFreeMemory>;
+using Image = UniqueHandle<VkImage, vkDestroyImage>;
+using ImageView = UniqueHandle<VkImageView, vkDestroyImageView>;
+using Sampler = UniqueHandle<VkSampler, vkDestroySampler>;
+using Framebuffer = UniqueHandle<VkFramebuffer, vkDestroyFramebuffer>;
+using Pipeline = UniqueHandle<VkPipeline, vkDestroyPipeline>;
+using DescriptorPool = UniqueHandle<VkDescriptorPool, vkDestroyDescriptorPool>;
+
+}
+
+#endif
@@ -1,19 +1,45 @@
 #version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "clustered_common.glsl"
+#include "gbuffer_common.glsl"
 
 layout(location = 0) in vec3 fragColor;
 layout(location = 1) in vec2 fragTexCoord;
 layout(location = 2) in vec3 fragNormals;
 layout(location = 3) flat in int fragMaterialID;
+layout(location = 4) in vec3 fragWorldPosition;
 
 layout(location = 0) out vec4 outColor;
 
+// 纹理数组的大小和功能开关由 pipeline 创建时的 VkSpecializationInfo 决定
+layout(constant_id = 0) const uint TEXTURE_COUNT = 3;
+layout(constant_id = 1) const bool USE_TEXTURE = true;
+// 关闭的时候直接输出纹理颜色, 和没有光照的时候一样
+layout(constant_id = 2) const bool USE_LIGHTING = true;
+
 // 纹理数组？
-layout(binding = 1) uniform sampler2D texSampler[3];
+layout(binding = 1) uniform sampler2D texSampler[TEXTURE_COUNT];
+// 每个纹理对应的材质贴图, 见 gbuffer_common.glsl
+layout(binding = 9) uniform sampler2D materialSampler[TEXTURE_COUNT];
 // 选择哪一个纹理？
 layout(binding = 2) uniform UBOIndex {
     int u_samplerIndex;
 } selectSampler;
 
 void main() {
-    outColor = texture(texSampler[fragMaterialID], fragTexCoord, 1.0);
-}
\ No newline at end of file
+    vec4 baseColor = USE_TEXTURE ? texture(texSampler[fragMaterialID], fragTexCoord, 1.0) : vec4(fragColor, 1.0);
+    vec4 material = USE_TEXTURE ? texture(materialSampler[fragMaterialID], fragTexCoord, 1.0) :
+        vec4(1.0, MATERIAL_ROUGHNESS, MATERIAL_METAL, 1.0);
+    if (material.a < ALPHA_CUTOFF) {
+        discard;
+    }
+    if (!USE_LIGHTING) {
+        outColor = baseColor;
+        return;
+    }
+
+    vec3 color = shadeClustered(gl_FragCoord.xy, fragWorldPosition, fragNormals, baseColor.rgb,
+        material.g, material.b, material.r);
+    outColor = vec4(color, baseColor.a);
+}
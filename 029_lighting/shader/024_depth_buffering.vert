@@ -16,11 +16,16 @@ layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
 layout(location = 2) out vec3 fragNormals;
 layout(location = 3) flat out int fragMaterialID;
+// 光照在世界空间中计算
+layout(location = 4) out vec3 fragWorldPosition;
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 1.0);
+    vec4 worldPosition = ubo.model * vec4(inPosition, 1.0);
+    gl_Position = ubo.proj * ubo.view * worldPosition;
     fragColor = inColor;
     fragTexCoord = inTexCoord;
-    fragNormals = inNormals;
+    // model 矩阵只有旋转, 不需要逆转置
+    fragNormals = mat3(ubo.model) * inNormals;
     fragMaterialID = inMaterialID;
+    fragWorldPosition = worldPosition.xyz;
 }
\ No newline at end of file
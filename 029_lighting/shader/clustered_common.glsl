@@ -0,0 +1,180 @@
+// clustered forward shading 中 light_cull.comp 和 fragment shader 共用的声明, 和 ops/ClusteredLights.h 保持一致
+// 包含之前定义 CLUSTER_CULL 表示由 compute shader 写 cluster 数据, 否则只读
+
+const uint CLUSTER_X = 16;
+const uint CLUSTER_Y = 9;
+const uint CLUSTER_Z = 24;
+const uint CLUSTER_COUNT = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+const uint MAX_LIGHTS_PER_CLUSTER = 128;
+// 和 ops/ShadowCascades.h 中的 COUNT 一致
+const uint SHADOW_CASCADE_COUNT = 4;
+
+struct Light {
+    vec4 positionRadius;        // 世界空间的位置, 影响半径
+    vec4 colorIntensity;
+    vec4 directionCosOuter;     // 聚光灯的方向和外锥角的余弦, 点光源的余弦小于 -1
+    vec4 cosInnerPad;
+};
+
+layout(binding = 3) uniform LightingUniform {
+    mat4 view;
+    mat4 inverseProj;
+    vec4 cameraPosition;
+    uvec4 gridLightCount;       // cluster 的 X, Y, Z 和光源数量
+    vec4 depthParams;           // near, far, slice scale, slice bias
+    vec4 screenParams;          // tile 的宽高 (像素), framebuffer 的宽高
+    mat4 inverseView;           // deferred shading 从深度重建世界空间的位置
+    mat4 cascadeViewProj[SHADOW_CASCADE_COUNT];
+    vec4 cascadeSplits;         // 每个 cascade 覆盖到的 view 空间深度
+    vec4 cascadeTexelSizes;     // 每个 cascade 的 texel 在世界空间中的大小
+    vec4 sunDirection;          // 方向光的传播方向, w 为 0 时不计算方向光
+    vec4 sunColorIntensity;
+} lighting;
+
+layout(std430, binding = 4) readonly buffer Lights {
+    Light lights[];
+};
+
+#ifdef CLUSTER_CULL
+layout(std430, binding = 5) writeonly buffer ClusterLightCounts {
+    uint clusterLightCounts[];
+};
+
+layout(std430, binding = 6) writeonly buffer ClusterLightIndices {
+    uint clusterLightIndices[];
+};
+#else
+layout(std430, binding = 5) readonly buffer ClusterLightCounts {
+    uint clusterLightCounts[];
+};
+
+layout(std430, binding = 6) readonly buffer ClusterLightIndices {
+    uint clusterLightIndices[];
+};
+#endif
+
+// 片段所在的 cluster, viewDepth 是 view 空间中到相机平面的距离 (正数)
+uint clusterIndex(vec2 fragCoord, float viewDepth)
+{
+    uvec2 tile = min(uvec2(fragCoord / lighting.screenParams.xy), uvec2(CLUSTER_X - 1, CLUSTER_Y - 1));
+    float slice = log(max(viewDepth, lighting.depthParams.x)) * lighting.depthParams.z + lighting.depthParams.w;
+    uint z = uint(clamp(slice, 0.0, float(CLUSTER_Z - 1)));
+    return tile.x + CLUSTER_X * (tile.y + CLUSTER_Y * z);
+}
+
+#ifndef CLUSTER_CULL
+const float PI = 3.14159265;
+
+// metallic / roughness 的 PBR: Lambert 漫反射 + GGX 法线分布, height-correlated Smith 可见性, Schlick Fresnel
+// 乘以 π 之后光源的强度表示垂直照射时的辐照度, 纯漫反射表面的亮度和之前的 Lambert 着色一致
+vec3 surfaceBrdf(vec3 normal, vec3 viewDir, vec3 lightDir, float nDotL, vec3 diffuse, vec3 f0, float alpha)
+{
+    vec3 halfDir = normalize(lightDir + viewDir);
+    float nDotV = max(dot(normal, viewDir), 1e-4);
+    float nDotH = max(dot(normal, halfDir), 0.0);
+    float vDotH = max(dot(viewDir, halfDir), 0.0);
+    float alphaSq = alpha * alpha;
+
+    float d = nDotH * nDotH * (alphaSq - 1.0) + 1.0;
+    float distribution = alphaSq / (PI * d * d);
+    float visibility = 0.5 / max(nDotL * sqrt(nDotV * nDotV * (1.0 - alphaSq) + alphaSq) +
+        nDotV * sqrt(nDotL * nDotL * (1.0 - alphaSq) + alphaSq), 1e-5);
+    vec3 fresnel = f0 + (1.0 - f0) * pow(1.0 - vDotH, 5.0);
+    return diffuse + PI * distribution * visibility * fresnel;
+}
+
+// 衰减在影响半径处平滑地降到 0, 所以 cluster 之外的光源可以安全地忽略
+vec3 evaluateLight(Light light, vec3 position, vec3 normal, vec3 viewDir, vec3 diffuse, vec3 f0, float alpha)
+{
+    vec3 toLight = light.positionRadius.xyz - position;
+    float distanceSq = dot(toLight, toLight);
+    float radiusSq = light.positionRadius.w * light.positionRadius.w;
+    if (distanceSq >= radiusSq) {
+        return vec3(0.0);
+    }
+    vec3 lightDir = toLight * inversesqrt(max(distanceSq, 1e-8));
+
+    float ratio = distanceSq / radiusSq;
+    float window = clamp(1.0 - ratio * ratio, 0.0, 1.0);
+    float attenuation = window * window / (1.0 + 16.0 * ratio);
+    if (light.directionCosOuter.w >= -1.0) {
+        float cosAngle = dot(-lightDir, light.directionCosOuter.xyz);
+        attenuation *= smoothstep(light.directionCosOuter.w, light.cosInnerPad.x, cosAngle);
+    }
+
+    float nDotL = max(dot(normal, lightDir), 0.0);
+    if (nDotL <= 0.0) {
+        return vec3(0.0);
+    }
+    return light.colorIntensity.rgb * (light.colorIntensity.w * attenuation * nDotL) *
+        surfaceBrdf(normal, viewDir, lightDir, nDotL, diffuse, f0, alpha);
+}
+
+// 没有被任何光源照到的地方保留一点环境光
+const float AMBIENT = 0.08;
+
+// cascaded shadow map, 每一层对应一个 cascade, 超出范围的地方 (border) 当作没有遮挡
+layout(binding = 8) uniform sampler2DArrayShadow shadowMap;
+
+// 按 view 空间深度选择 cascade, 3x3 PCF, 每次采样硬件再做一次 2x2 的比较和双线性过滤
+float sunShadow(vec3 position, vec3 normal, float viewDepth)
+{
+    uint cascade = 0;
+    while (cascade < SHADOW_CASCADE_COUNT && viewDepth > lighting.cascadeSplits[cascade]) {
+        ++cascade;
+    }
+    if (cascade == SHADOW_CASCADE_COUNT) {
+        return 1.0;
+    }
+    // 沿法线偏移一个多 texel, 避免表面自己遮挡自己 (shadow acne)
+    vec3 offsetPosition = position + normal * lighting.cascadeTexelSizes[cascade] * 1.5;
+    vec4 shadowCoord = lighting.cascadeViewProj[cascade] * vec4(offsetPosition, 1.0);
+    vec2 uv = shadowCoord.xy * 0.5 + 0.5;
+    vec2 texel = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+    float lit = 0.0;
+    for (int y = -1; y <= 1; ++y) {
+        for (int x = -1; x <= 1; ++x) {
+            lit += texture(shadowMap, vec4(uv + vec2(x, y) * texel, float(cascade), shadowCoord.z));
+        }
+    }
+    return lit / 9.0;
+}
+
+// forward 和 deferred 两条路径共用的着色: 遍历 fragCoord 所在 cluster 的光源
+// metal 越大漫反射越少, 高光越接近 albedo 的颜色; occlusion 只影响环境光
+vec3 shadeClustered(vec2 fragCoord, vec3 position, vec3 normal, vec3 albedo, float roughness, float metal,
+    float occlusion)
+{
+    vec3 viewDir = normalize(lighting.cameraPosition.xyz - position);
+    normal = dot(normal, normal) > 0.0 ? normalize(normal) : vec3(0.0, 1.0, 0.0);
+    // 双面的几何体从背面看的时候翻转法线
+    if (dot(normal, viewDir) < 0.0) {
+        normal = -normal;
+    }
+    vec3 diffuse = albedo * (1.0 - metal);
+    // 非金属的反射率约为 4%
+    vec3 f0 = mix(vec3(0.04), albedo, metal);
+    // 感知上线性的 roughness 平方之后作为 GGX 的 alpha, 太小时高光会小于一个像素
+    float alpha = max(roughness * roughness, 0.002);
+
+    float viewDepth = -(lighting.view * vec4(position, 1.0)).z;
+    uint cluster = clusterIndex(fragCoord, viewDepth);
+    uint lightCount = clusterLightCounts[cluster];
+
+    vec3 color = albedo * (AMBIENT * occlusion);
+    if (lighting.sunDirection.w > 0.0) {
+        vec3 sunDir = -lighting.sunDirection.xyz;
+        float nDotL = max(dot(normal, sunDir), 0.0);
+        if (nDotL > 0.0) {
+            float shadow = sunShadow(position, normal, viewDepth);
+            color += lighting.sunColorIntensity.rgb * (lighting.sunColorIntensity.w * nDotL * shadow) *
+                surfaceBrdf(normal, viewDir, sunDir, nDotL, diffuse, f0, alpha);
+        }
+    }
+    for (uint i = 0; i < lightCount; ++i) {
+        uint lightIndex = clusterLightIndices[cluster * MAX_LIGHTS_PER_CLUSTER + i];
+        color += evaluateLight(lights[lightIndex], position, normal, viewDir, diffuse, f0, alpha);
+    }
+    return color;
+}
+#endif
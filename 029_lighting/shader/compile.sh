@@ -1,4 +1,9 @@
-!/bin/bash
+#!/bin/bash
 
-glslc 018_shader_base.vert -o vert.spv
-glslc 018_shader_base.frag -o frag.spv
+glslc 024_depth_buffering.vert -o vert.spv
+glslc 024_depth_buffering.frag -o frag.spv
+glslc light_cull.comp -o light_cull.spv
+glslc gbuffer.frag -o gbuffer.spv
+glslc deferred_lighting.vert -o deferred_lighting_vert.spv
+glslc deferred_lighting.frag -o deferred_lighting_frag.spv
+glslc shadow.vert -o shadow.spv
@@ -0,0 +1,40 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "clustered_common.glsl"
+#include "gbuffer_common.glsl"
+
+// deferred shading 的第二个 subpass: 每个像素只计算一次光照, 开销只和像素数量以及 cluster 中的光源数量有关
+// subpassLoad 只能读取当前像素, tile based gpu 上 G-buffer 一直留在片上内存中
+layout(input_attachment_index = 0, set = 1, binding = 0) uniform subpassInput gAlbedo;
+layout(input_attachment_index = 1, set = 1, binding = 1) uniform subpassInput gNormal;
+layout(input_attachment_index = 2, set = 1, binding = 2) uniform subpassInput gMaterial;
+layout(input_attachment_index = 3, set = 1, binding = 3) uniform subpassInput gDepth;
+
+layout(location = 0) out vec4 outColor;
+
+// 关闭的时候直接输出 albedo, 和 forward 路径的 USE_LIGHTING 一致
+layout(constant_id = 0) const bool USE_LIGHTING = true;
+
+void main() {
+    float depth = subpassLoad(gDepth).r;
+    // 没有几何体的像素保留 render pass 清除的颜色
+    if (depth >= 1.0) {
+        discard;
+    }
+    vec4 albedo = subpassLoad(gAlbedo);
+    if (!USE_LIGHTING) {
+        outColor = vec4(albedo.rgb, 1.0);
+        return;
+    }
+
+    // 投影矩阵已经翻转了 y, framebuffer 坐标直接对应 NDC
+    vec2 ndc = gl_FragCoord.xy / lighting.screenParams.zw * 2.0 - 1.0;
+    vec4 viewPosition = lighting.inverseProj * vec4(ndc, depth, 1.0);
+    vec3 worldPosition = (lighting.inverseView * vec4(viewPosition.xyz / viewPosition.w, 1.0)).xyz;
+
+    vec3 normal = octDecode(subpassLoad(gNormal).xy);
+    vec2 material = subpassLoad(gMaterial).xy;
+    vec3 color = shadeClustered(gl_FragCoord.xy, worldPosition, normal, albedo.rgb, material.x, material.y, albedo.a);
+    outColor = vec4(color, 1.0);
+}
@@ -0,0 +1,7 @@
+#version 450
+
+// 不需要顶点 buffer, 三个顶点组成一个覆盖整个屏幕的三角形
+void main() {
+    vec2 uv = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+    gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);
+}
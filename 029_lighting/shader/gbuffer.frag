@@ -0,0 +1,35 @@
+#version 450
+#extension GL_GOOGLE_include_directive : require
+
+#include "gbuffer_common.glsl"
+
+// deferred shading 的第一个 subpass: 只写 G-buffer, 不计算光照, 开销只和三角形数量有关
+layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragTexCoord;
+layout(location = 2) in vec3 fragNormals;
+layout(location = 3) flat in int fragMaterialID;
+layout(location = 4) in vec3 fragWorldPosition;
+
+layout(location = 0) out vec4 outAlbedo;
+layout(location = 1) out vec2 outNormal;
+layout(location = 2) out vec2 outMaterial;
+
+layout(constant_id = 0) const uint TEXTURE_COUNT = 3;
+layout(constant_id = 1) const bool USE_TEXTURE = true;
+
+layout(binding = 1) uniform sampler2D texSampler[TEXTURE_COUNT];
+layout(binding = 9) uniform sampler2D materialSampler[TEXTURE_COUNT];
+
+void main() {
+    vec4 material = USE_TEXTURE ? texture(materialSampler[fragMaterialID], fragTexCoord, 1.0) :
+        vec4(1.0, MATERIAL_ROUGHNESS, MATERIAL_METAL, 1.0);
+    if (material.a < ALPHA_CUTOFF) {
+        discard;
+    }
+    vec3 albedo = USE_TEXTURE ? texture(texSampler[fragMaterialID], fragTexCoord, 1.0).rgb : fragColor;
+    outAlbedo = vec4(albedo, material.r);
+    // 法线在光照 subpass 中再根据视线方向翻转
+    vec3 normal = dot(fragNormals, fragNormals) > 0.0 ? normalize(fragNormals) : vec3(0.0, 1.0, 0.0);
+    outNormal = octEncode(normal);
+    outMaterial = material.gb;
+}
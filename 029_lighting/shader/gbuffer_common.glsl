@@ -0,0 +1,29 @@
+// deferred shading 的 G-buffer 布局, 和 main.cpp 中的 GBUFFER_FORMATS 保持一致
+//   0: albedo, a 是 ambient occlusion (R8G8B8A8_UNORM)
+//   1: 世界空间法线的八面体编码 (R16G16_SFLOAT)
+//   2: roughness, metal (R8G8_UNORM)
+// 深度不单独存储, 光照 subpass 直接读取 depth attachment, 用 inverseProj 重建位置
+
+// 材质参数来自打包的材质贴图 (binding 9, 见 ops/MaterialPacker.h): r occlusion, g roughness, b metallic, a alpha
+// 关闭纹理时使用下面的默认值, 和 ops::PACKED_MATERIAL_DEFAULTS 一致
+const float MATERIAL_ROUGHNESS = 0.5;
+const float MATERIAL_METAL = 0.0;
+// alpha 小于这个值的片段被丢弃 (alpha test), 不需要排序和混合
+const float ALPHA_CUTOFF = 0.5;
+
+// 单位向量投影到八面体 |x| + |y| + |z| = 1 上, 再把下半部分折叠到上面, 两个分量就可以表示整个球面
+vec2 octEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 folded = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return n.z >= 0.0 ? n.xy : folded;
+}
+
+vec3 octDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
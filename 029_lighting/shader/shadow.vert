@@ -0,0 +1,12 @@
+#version 450
+
+// shadow map 只需要深度, 顶点只读取位置流, 没有 fragment shader
+layout(push_constant) uniform ShadowPushConstants {
+    mat4 lightModelViewProj;
+} push;
+
+layout(location = 0) in vec3 inPosition;
+
+void main() {
+    gl_Position = push.lightModelViewProj * vec4(inPosition, 1.0);
+}
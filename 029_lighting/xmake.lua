@@ -6,7 +6,8 @@ set_toolchains("gcc")
 -- global definations
 add_defines("USE_SELF_DEFINED_CLEAR_COLOR")
 add_defines("BUG_FIXES")
-add_defines("EXPLICITLY_TRANSITIONNG_DEPTH_IMAGE")
+-- 即使设备支持 VK_KHR_dynamic_rendering 也使用 VkRenderPass 和 VkFramebuffer
+-- add_defines("FORCE_LEGACY_RENDER_PASS")
 -- add_defines("VERTEX_DEDUPLICATION")
 
 -- debug log print
@@ -23,12 +24,49 @@ if is_mode("debug") then
     add_ldflags("-g")
 end
 
+-- 用 glslc 编译 target 的 values("glsl.shaders") 中列出的 shader, 每一项是 "源文件:输出[:glslc 参数]",
+-- 源文件和输出都在 shader 目录下, 列表和 shader/compile.sh 保持一致.
+-- 源文件, shader 目录中的 .glsl 或者参数有变化, 以及 .spv 不存在的时候才重新编译,
+-- 保证 main.cpp 读取的 .spv 和当前的 descriptor layout / specialization constant 一致
+rule("glsl.shaders")
+    before_build(function (target)
+        import("lib.detect.find_tool")
+        import("core.project.depend")
+        local glslc = find_tool("glslc")
+        if not glslc then
+            raise("glslc not found, install shaderc or the vulkan sdk to compile the shaders")
+        end
+        local shaderdir = path.join(target:scriptdir(), "shader")
+        local includes = os.files(path.join(shaderdir, "*.glsl"))
+        for _, shader in ipairs(table.wrap(target:values("glsl.shaders"))) do
+            local parts = shader:split(":", {plain = true})
+            local source = path.join(shaderdir, parts[1])
+            local output = path.join(shaderdir, parts[2])
+            local args = table.join(parts[3] and parts[3]:split(" ", {plain = true}) or {}, {source, "-o", output})
+            depend.on_changed(function ()
+                cprint("${color.build.object}compiling.glsl %s", parts[2])
+                os.vrunv(glslc.program, args)
+            end, {dependfile = target:dependfile(output), files = table.join(source, includes),
+                values = args, changed = not os.isfile(output)})
+        end
+    end)
+rule_end()
+
 -- target 1
 target("lighting")
     set_kind("binary")
     add_files("main.cpp")
     add_includedirs("./thrity_part")
     add_includedirs("./ops")
+    add_rules("glsl.shaders")
+    add_values("glsl.shaders", "024_depth_buffering.vert:vert.spv", "024_depth_buffering.frag:frag.spv")
+    -- 分块光源剔除
+    add_values("glsl.shaders", "light_cull.comp:light_cull.spv")
+    -- 延迟着色: g-buffer 和全屏光照
+    add_values("glsl.shaders", "gbuffer.frag:gbuffer.spv",
+        "deferred_lighting.vert:deferred_lighting_vert.spv", "deferred_lighting.frag:deferred_lighting_frag.spv")
+    -- 级联阴影的深度 pass
+    add_values("glsl.shaders", "shadow.vert:shadow.spv")
     add_packages("spdlog::spdlog")
 
     add_links("glfw", "glad", "pthread", "vulkan")